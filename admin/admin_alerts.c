@@ -4,6 +4,15 @@
  * This program is the (health) status check alert system of Noise Warning Program. 
  * It receives a message from a publisher if unhealthy status detected.
  * It alerts an administrator to check the health status of the program.
+ *
+ * With NOISE_ANOMALY=1 it also receives the readings of every room (NOISE_ANOMALY_TOPICS, default handong/+/+)
+ * and alerts when a room is much louder or quieter than usual for that hour of the week (common/anomaly.h).
+ * What it learned is saved to NOISE_ANOMALY_CHECKPOINT (default anomaly.ckpt) every
+ * NOISE_ANOMALY_CHECKPOINT_SEC seconds (default 300) and loaded again on start. The checkpoint is a scheduler
+ * event of the main thread, which writes a copy of the table; the network loop then runs in a thread of its own.
+ *
+ * The sequence numbers of the alerts (and of the readings with NOISE_ANOMALY=1) are tracked per room
+ * (common/seq_track.h), so a lost alert is counted; 'kill -USR1 <pid>' prints the counts.
 */
 
 #include <mosquitto.h>
@@ -11,12 +20,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
-#define MQTT_HOST 	"127.0.0.1" 
-#define MQTT_PORT	1883
-#define MAX_TOKEN	7
+#include "anomaly.h"
+#include "config.h"
+#include "packet.h"
+#include "ready.h"
+#include "seq_track.h"
+#include "tls.h"
+#include "transport.h"
+#include "vclock.h"
+#include "worker_pool.h"
 
-char *const topic = "admin/alerts"; //alert topic
+char *const topic = "admin/alerts/#"; //alert topic, with the room appended for compact packets
+
+struct worker_pool *pool = NULL;	//message handlers (NOISE_WORKERS > 0)
+struct transport *transport = NULL;	//MQTT, or shared memory for co-located components (NOISE_SHM)
+struct seq_table seqs;				//delivery of the alerts and readings per room (SIGUSR1 prints it)
+
+struct anomaly_table *anomalies = NULL;	//per-room baselines (NOISE_ANOMALY=1)
+pthread_mutex_t anomaly_lock = PTHREAD_MUTEX_INITIALIZER;	//the workers of the pool share the table
+char anomaly_topics[256] = "handong/+/+";
+const char *checkpoint_file = NULL;
+long checkpoint_sec = 300;
+struct anomaly_table checkpoint_copy;	//the table as it is written to the checkpoint
+struct scheduler *sched = NULL;
+volatile sig_atomic_t stopping = 0;		//SIGTERM or SIGINT: save a last checkpoint and leave (NOISE_ANOMALY=1)
 
 /*
  * This function reconnects to a new broker when the previous broker is disconnected.
@@ -27,7 +59,7 @@ void reconnect(struct mosquitto *mosq) {
         printf("Try to reconnect to broker...\n");
 
         // reconnect to a new broker
-        int rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+        int rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 
         // if connection failed, wait for a second and reconnect to a broker
         if (rc != MOSQ_ERR_SUCCESS) {
@@ -57,7 +89,18 @@ void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
 		mosquitto_disconnect(mosq);
 	}
 
-	rc = mosquitto_subscribe(mosq, NULL, topic, 1);
+	rc = transport_subscribe(transport, topic, 1);
+
+	//readings of the rooms for the anomaly detector
+	if(anomalies != NULL){
+		char copy[256];
+		char *save = NULL;
+
+		snprintf(copy, sizeof(copy), "%s", anomaly_topics);
+		for(char *t = strtok_r(copy, ",", &save); t != NULL && rc == MOSQ_ERR_SUCCESS; t = strtok_r(NULL, ",", &save)){
+			rc = transport_subscribe(transport, t, 1);
+		}
+	}
 	if(rc != MOSQ_ERR_SUCCESS){
 		fprintf(stderr, "Error subscribing: %s\n", mosquitto_strerror(rc));
 		reconnect(mosq);
@@ -91,31 +134,138 @@ void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, con
 }
 
 
+/*
+ * This function checks a reading of a room against the room's baseline and prints an alert
+ * when the room becomes louder or quieter than usual, and when it is back to normal.
+ * The packet is 'institution,location,room,timestamp,noise_level,avg_decibel,health_status,seq[,epoch]',
+ * or the compact packet of the room topic (see common/packet.h).
+*/
+void handle_reading(char *topic, char *payload, int payloadlen)
+{
+	char *tokens[PACKET_FIELDS];
+	char room[PACKET_ROOM_LEN];
+	char key[ANOMALY_KEY_LEN + 1];	//a key cut at ANOMALY_KEY_LEN is still too long
+	unsigned long rejected;
+	struct anomaly_event event;
+	int index, kind;
+
+	index = packet_parse(topic, payload, payloadlen, tokens, room);
+	if(index < 6){
+		return;
+	}
+	seq_table_observe(&seqs, "readings", tokens, index);
+	snprintf(key, sizeof(key), "%s/%s/%s", tokens[0], tokens[1], tokens[2]);
+
+	pthread_mutex_lock(&anomaly_lock);
+	kind = anomaly_update(anomalies, key, tokens[3], atof(tokens[5]), &event);
+	rejected = anomalies->rejected;
+	pthread_mutex_unlock(&anomaly_lock);
+
+	//rooms do not share a baseline through a cut name; the first one and every 1000th are reported
+	if(kind < 0 && strlen(key) >= ANOMALY_KEY_LEN){
+		if(rejected % 1000 == 1){
+			fprintf(stderr, "Ignoring rooms with a name of %d characters or more (%lu readings, e.g. %s...)\n",
+			        ANOMALY_KEY_LEN, rejected, key);
+		}
+		return;
+	}
+
+	if(kind == ANOMALY_LOUD || kind == ANOMALY_QUIET){
+		printf("[%s] noise anomaly: %s dB is %s than usual (%.1f +- %.1f dB %s, z=%+.1f)\n", key, tokens[5],
+		       kind == ANOMALY_LOUD ? "louder" : "quieter", event.mean, event.dev,
+		       event.seasonal ? "at this hour" : "today", event.z);
+	}
+	else if(kind == ANOMALY_CLEAR){
+		printf("[%s] noise back to normal: %s dB\n", key, tokens[5]);
+	}
+}
+
+/*
+ * This function saves what was learned now and then, so that a restart does not start from scratch.
+ * It is a scheduler event of the main thread: the table is copied under the lock (a memcpy) and the copy
+ * is written after it, so the message handlers never wait for the disk.
+*/
+void on_checkpoint(void *ctx)
+{
+	int rc;
+
+	pthread_mutex_lock(&anomaly_lock);
+	rc = anomaly_snapshot(&checkpoint_copy, anomalies);
+	pthread_mutex_unlock(&anomaly_lock);
+
+	if(rc != 0){
+		fprintf(stderr, "Error: Out of memory, checkpoint skipped.\n");
+	}
+	else{
+		anomaly_save(&checkpoint_copy, checkpoint_file);
+	}
+	sched_after(sched, checkpoint_sec * 1000000, on_checkpoint, ctx);
+}
+
+void on_signal(int sig)
+{
+	stopping = 1;
+}
+
 /*
  * This function deals with the process after a message (for alerts) has been received.
- * Callback called when the client receives a message.
+ * It runs on the network thread, or on a worker thread of the pool when NOISE_WORKERS > 0.
  * 
  * After receiving a message from a publisher, it separates each piece of information by using delimeter (,).
  * It puts each piece into tokens array in order.
+ * It records the sequence number, and skips an alert it has seen already.
  * It prints an alert message.
 */
-void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+void handle_message(void *obj, char *topic, char *payload, int payloadlen)
 {
-    char *tokens[MAX_TOKEN];
-	int index = 0;
+    char *tokens[PACKET_FIELDS];
+	char room[PACKET_ROOM_LEN];
+	int index;
 
-	//each piece extracted with the delimeter
-	char *token = strtok((char *)msg->payload, ",");
-	while (token != NULL & index < MAX_TOKEN){
-		tokens[index] = token;
-		index++;
-		token = strtok(NULL, ",");
+	//a reading of a room (not an admin topic), for the anomaly detector
+	if(anomalies != NULL && strncmp(topic, "admin/", 6) != 0){
+		handle_reading(topic, payload, payloadlen);
+		return;
+	}
+
+	//each piece extracted with the delimeter (the room comes from the topic for a compact packet)
+	index = packet_parse(topic, payload, payloadlen, tokens, room);
+	if(index < 3){
+		return;
+	}
+	if(seq_table_observe(&seqs, "alerts", tokens, index) == SEQ_DUPLICATE){
+		//the same alert again (a QoS 1 retry), it was printed already
+		return;
 	}
 
 	//print out an alert message to notify an administrator to check the health status of the program
 	printf("[%s/%s/%s] health check required\n", tokens[0], tokens[1], tokens[2]);
 }
 
+/*
+ * This function takes an alert from the broker or from the shared-memory ring.
+ * With a worker pool, the alert is queued by room and handled on a worker thread.
+*/
+void dispatch_message(void *obj, char *topic, char *payload, int payloadlen)
+{
+	if(pool != NULL){
+		int keylen;
+		const char *key = packet_room(topic, payload, payloadlen, &keylen);
+		wp_submit(pool, key, keylen, topic, payload, payloadlen);
+	} else {
+		handle_message(obj, topic, payload, payloadlen);
+	}
+}
+
+/*
+ * Callback called when the client receives a message.
+*/
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	ready_first_message();
+	dispatch_message(mosq, msg->topic, msg->payload, msg->payloadlen);
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -126,6 +276,12 @@ int main(int argc, char *argv[])
 	struct mosquitto *mosq;
 	int rc;
 
+	/* Sequence tracking: only the report thread takes SIGUSR1, so this comes before the other threads start */
+	seq_table_init(&seqs, "admin_alerts");
+	if(seq_table_report_on_signal(&seqs, SIGUSR1) != 0){
+		fprintf(stderr, "Error: Cannot start the sequence report.\n");
+	}
+
 	/* Required before calling other mosquitto functions */
 	mosquitto_lib_init();
 
@@ -145,11 +301,59 @@ int main(int argc, char *argv[])
 	mosquitto_subscribe_callback_set(mosq, on_subscribe);
 	mosquitto_message_callback_set(mosq, on_message);
 
+	/* Hand messages to a pool of worker threads if NOISE_WORKERS is set */
+	if(config_long("NOISE_WORKERS", 0) > 0){
+		pool = wp_create_configured(handle_message, mosq);
+		if(pool == NULL){
+			mosquitto_destroy(mosq);
+			return 1;
+		}
+	}
+
+	/* Learn the usual noise of every room and alert on deviations if NOISE_ANOMALY is set */
+	if(config_long("NOISE_ANOMALY", 0) != 0){
+		struct anomaly_options opts;
+
+		anomaly_options_from_config(&opts);
+		snprintf(anomaly_topics, sizeof(anomaly_topics), "%s", config_str("NOISE_ANOMALY_TOPICS", "handong/+/+"));
+		checkpoint_file = config_str("NOISE_ANOMALY_CHECKPOINT", "anomaly.ckpt");
+		checkpoint_sec = config_long("NOISE_ANOMALY_CHECKPOINT_SEC", 300);
+		if(checkpoint_sec < 1){
+			checkpoint_sec = 1;
+		}
+
+		anomalies = malloc(sizeof(struct anomaly_table));
+		sched = sched_create();
+		if(anomalies == NULL || sched == NULL || anomaly_table_init(anomalies, &opts) != 0 ||
+		   anomaly_table_init(&checkpoint_copy, &opts) != 0){
+			fprintf(stderr, "Error: Out of memory.\n");
+			mosquitto_destroy(mosq);
+			return 1;
+		}
+		rc = anomaly_load(anomalies, checkpoint_file);
+		if(rc >= 0){
+			printf("Loaded the baselines of %d rooms from %s\n", rc, checkpoint_file);
+		}
+	}
+
+	/* Alerts of co-located publishers can come through shared memory (NOISE_SHM) */
+	transport = transport_create(mosq, dispatch_message, mosq);
+	if(transport == NULL){
+		mosquitto_destroy(mosq);
+		return 1;
+	}
+
+	/* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+	if(tls_configure(mosq) != MOSQ_ERR_SUCCESS){
+		mosquitto_destroy(mosq);
+		return 1;
+	}
+
 	/* Connect to test.mosquitto.org on port 1883, with a keepalive of 60 seconds.
 	 * This call makes the socket connection only, it does not complete the MQTT
 	 * CONNECT/CONNACK flow, you should use mosquitto_loop_start() or
 	 * mosquitto_loop_forever() for processing net traffic. */
-	rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+	rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 	if(rc != MOSQ_ERR_SUCCESS){
 		mosquitto_destroy(mosq);
 		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
@@ -161,9 +365,43 @@ int main(int argc, char *argv[])
 	 *
 	 * This call will continue forever, carrying automatic reconnections if
 	 * necessary, until the user calls mosquitto_disconnect().
+	 *
+	 * With NOISE_ANOMALY=1 the loop runs in a background thread instead,
+	 * and the main thread writes the checkpoints. SIGTERM or SIGINT stops it
+	 * within a second, and what was learned is saved once more before leaving.
 	 */
-	mosquitto_loop_forever(mosq, -1, 1);
+	if(anomalies == NULL){
+		mosquitto_loop_forever(mosq, -1, 1);
+	}
+	else{
+		rc = mosquitto_loop_start(mosq);
+		if(rc != MOSQ_ERR_SUCCESS){
+			mosquitto_destroy(mosq);
+			fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+		signal(SIGINT, on_signal);
+		signal(SIGTERM, on_signal);
+		sched_after(sched, checkpoint_sec * 1000000, on_checkpoint, NULL);
+		while(!stopping){
+			sched_run(sched, vclock_now_usec() + 1000000);
+		}
+		mosquitto_disconnect(mosq);
+		mosquitto_loop_stop(mosq, false);
+	}
 
+	transport_destroy(transport);
+	wp_destroy(pool);
+	if(anomalies != NULL){
+		//the handlers have stopped, so the table is saved as it is
+		if(anomaly_save(anomalies, checkpoint_file) == 0){
+			printf("Saved the baselines of %d rooms to %s\n", anomalies->count, checkpoint_file);
+		}
+		anomaly_table_free(anomalies);
+		anomaly_table_free(&checkpoint_copy);
+		free(anomalies);
+		sched_destroy(sched);
+	}
 	mosquitto_lib_cleanup();
 	return 0;
 }
@@ -3,6 +3,18 @@
  *
  * This program is the log record of Noise Warning Program.
  * It receives log messages from publishers and subscribers of the program about their actions.
+ *
+ * The sequence numbers of the logged packets are tracked per room and per stream (common/seq_track.h):
+ * "pub-readings" and "pub-alerts" for the logs of the publishers, "sub-readings@<subscriber>" for those of every
+ * subscriber (from 'admin/logs/sub/<subscriber>', see sub/nth_313_sub.c), so two subscribers of a room are not duplicates.
+ * A gap in a log stream is a lost log; 'kill -USR1 <pid>' prints the counts.
+ *
+ * With NOISE_LOG_STORE=<dir> the logs are also kept on disk, with an index and rollups per room (common/log_store.h).
+ * The index is checkpointed, so a restart loads it and replays only the logs after the checkpoint
+ * before it subscribes again.
+ *
+ * With NOISE_TAIL_SOCKET=<path> operators can follow the logs live, filtered by room, level, health, time or
+ * source, with admin_tail on that Unix socket (common/tail_server.h). Slow viewers lose logs, admin_logs does not wait.
  */
 
 #include <mosquitto.h>
@@ -10,13 +22,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+
+#include "config.h"
+#include "log_store.h"
+#include "packet.h"
+#include "ready.h"
+#include "seq_track.h"
+#include "tail_server.h"
+#include "tls.h"
+#include "transport.h"
 
-#define MQTT_HOST "127.0.0.1"
-#define MQTT_PORT 1883
 #define MAX_TOKEN 7
 
 // log topics (distinguish between publish messages from subscriber and publisher in a location)
-char *const topics[] = {"admin/logs/sub", "admin/logs/pub", "admin/logs/broker"};
+// logs of compact packets have the room appended to the topic, e.g. admin/logs/pub/handong/NTH/313
+// subscribers append their id first, e.g. admin/logs/sub/host-1234 or admin/logs/sub/host-1234/handong/NTH/313
+char *const topics[] = {"admin/logs/sub/#", "admin/logs/pub/#", "admin/logs/broker"};
+
+// MQTT, or shared memory for co-located components (NOISE_SHM)
+struct transport *transport = NULL;
+
+// delivery of the logs per room and stream (SIGUSR1 prints it)
+struct seq_table seqs;
+
+// the logs on disk (NOISE_LOG_STORE), NULL if they are only printed
+struct log_store *store = NULL;
+
+// live tail clients (NOISE_TAIL_SOCKET), NULL without
+struct tail_server *tail = NULL;
 
 /*
  * This function reconnects to a new broker when the previous broker is disconnected.
@@ -27,7 +61,7 @@ void reconnect(struct mosquitto *mosq)
 	while (1)
 	{
 		// reconnect to new broker
-		int rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+		int rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 
 		// break the while loop if reconnected to a broker
 		if (rc == MOSQ_ERR_SUCCESS)
@@ -63,11 +97,15 @@ void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
 	}
 
 	// if unable to subscribe, try to reconnect to broker
-	rc = mosquitto_subscribe_multiple(mosq, NULL, 3, topics, 1, 0, NULL);
-	if (rc != MOSQ_ERR_SUCCESS)
+	for (int i = 0; i < 3; i++)
 	{
-		fprintf(stderr, "Error subscribing: %s\n", mosquitto_strerror(rc));
-		mosquitto_disconnect(mosq);
+		rc = transport_subscribe(transport, topics[i], 1);
+		if (rc != MOSQ_ERR_SUCCESS)
+		{
+			fprintf(stderr, "Error subscribing: %s\n", mosquitto_strerror(rc));
+			mosquitto_disconnect(mosq);
+			return;
+		}
 	}
 }
 
@@ -99,42 +137,91 @@ void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, con
 	}
 }
 
+/*
+ * This function writes the sequence stream of a subscriber log to 'stream': "sub-readings@<subscriber>"
+ * for 'admin/logs/sub/<subscriber>[/<room topic>]', or "sub-readings" for a subscriber that does not send its id
+ * ('admin/logs/sub[/<room topic>]').
+ */
+void sub_stream(const char *topic, char *stream, int size)
+{
+	const char *rest = topic + 14, *end;
+	int levels = 0;
+
+	for (const char *p = rest; *p != '\0'; p++)
+	{
+		levels += *p == '/';
+	}
+	if (levels != 1 && levels != 4)
+	{
+		snprintf(stream, size, "sub-readings");
+		return;
+	}
+	end = strchr(rest + 1, '/');
+	snprintf(stream, size, "sub-readings@%.*s", end != NULL ? (int)(end - rest - 1) : (int)strlen(rest + 1), rest + 1);
+}
+
 /*
  * This function deals with the process after a message (for logs) has been received.
- * Callback called when the client receives a message.
+ * It is called for messages from the broker and from the shared-memory ring.
  *
  * After receiving a publish message from either publisher or subscriber, it separates each piece of information by using delimeter (,).
  * It puts each piece into tokens array in order.
+ * It records the sequence number in the stream of the log: who logged it (pub/sub) and what (alert/reading).
  * It prints a log message.
  */
-void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+void handle_message(void *obj, char *topic, char *payload, int payloadlen)
 {
-	char *tokens[MAX_TOKEN];
-	int index = 0;
-
-	// each piece extracted with the delimeter
-	char *token = strtok((char *)msg->payload, ",");
+	char *tokens[PACKET_FIELDS];
+	char room[PACKET_ROOM_LEN];
+	char line[PACKET_LOG_LINE];
+	char *save = NULL;
+	int index;
 
 	// case 1. broker recovery
-	if (strcmp(token, "broker") == 0)
+	if (strncmp(payload, "broker,", 7) == 0)
 	{
-		token = strtok(NULL, ",");
-
 		// print out the log message
-		printf("[%s] %s\n", msg->topic, token);
+		printf("[%s] %s\n", topic, strtok_r(payload + 7, ",", &save));
 	}
-	// case 2. publish/subscribe
+	// case 2. publish/subscribe (the room comes from the topic for a compact packet)
 	else
 	{
-		while (token != NULL & index < MAX_TOKEN)
+		index = packet_parse(topic, payload, payloadlen, tokens, room);
+		if (index < MAX_TOKEN)
+		{
+			return;
+		}
+
+		// the publisher numbers its alerts (noise level -1) apart from its readings; a subscriber only logs readings,
+		// and every subscriber of a room logs the same numbers
+		char stream[32];
+		enum log_stream kind = LOG_SUB_READINGS;
+		if (strncmp(topic, "admin/logs/pub", 14) == 0)
 		{
-			tokens[index] = token;
-			index++;
-			token = strtok(NULL, ",");
+			kind = strcmp(tokens[4], "-1") == 0 ? LOG_PUB_ALERTS : LOG_PUB_READINGS;
+			snprintf(stream, sizeof(stream), "%s", kind == LOG_PUB_ALERTS ? "pub-alerts" : "pub-readings");
+		}
+		else
+		{
+			sub_stream(topic, stream, sizeof(stream));
+		}
+		seq_table_observe(&seqs, stream, tokens, index);
+
+		// keep it on disk
+		if (store != NULL)
+		{
+			log_store_append(store, kind, tokens, index);
+		}
+
+		// the live tail clients whose filter matches (formatted for them only if one does)
+		if (tail != NULL)
+		{
+			tail_server_publish(tail, topic, tokens, index);
 		}
 
 		// print out the log message
-		printf("[%s] location: %s_%s_%s, decibel: %s, noise_level: %s, health_status: %s, time: %s\n", msg->topic, tokens[0], tokens[1], tokens[2], tokens[5], tokens[4], tokens[6], tokens[3]);
+		packet_log_line(line, sizeof(line), topic, tokens);
+		fputs(line, stdout);
 	}
 
 	/*
@@ -144,6 +231,15 @@ void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_messag
 	*/
 }
 
+/*
+ * Callback called when the client receives a message.
+ */
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	ready_first_message();
+	handle_message(mosq, msg->topic, msg->payload, msg->payloadlen);
+}
+
 int main(int argc, char *argv[])
 {
 	printf("----------------------\n");
@@ -152,6 +248,38 @@ int main(int argc, char *argv[])
 	struct mosquitto *mosq;
 	int rc;
 
+	/* Sequence tracking: only the report thread takes SIGUSR1, so this comes before the other threads start */
+	seq_table_init(&seqs, "admin_logs");
+	if (seq_table_report_on_signal(&seqs, SIGUSR1) != 0)
+	{
+		fprintf(stderr, "Error: Cannot start the sequence report.\n");
+	}
+
+	/* The logs on disk: load the last checkpoint of the index and replay the logs after it, before subscribing */
+	const char *store_dir = config_str("NOISE_LOG_STORE", NULL);
+	if (store_dir != NULL)
+	{
+		static struct log_store log_store;
+		static const char *const origins[] = {"checkpoint", "previous checkpoint", "segments", "new store"};
+
+		if (log_store_open(&log_store, store_dir) != 0)
+		{
+			fprintf(stderr, "Error: Cannot open the log store %s.\n", store_dir);
+			return 1;
+		}
+		store = &log_store;
+		fprintf(stderr, "log store %s: %llu logs, loaded from the %s, %llu replayed, in %.1f ms\n", store_dir,
+				(unsigned long long)log_store_records(store), origins[store->stats.origin],
+				(unsigned long long)store->stats.replayed, store->stats.open_ms);
+	}
+
+	/* Live tail of the logs for admin_tail clients */
+	const char *tail_socket = config_str("NOISE_TAIL_SOCKET", NULL);
+	if (tail_socket != NULL && (tail = tail_server_start(tail_socket)) == NULL)
+	{
+		return 1;
+	}
+
 	/* Required before calling other mosquitto functions */
 	mosquitto_lib_init();
 
@@ -173,11 +301,26 @@ int main(int argc, char *argv[])
 	mosquitto_message_callback_set(mosq, on_message);
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
 
+	/* Logs of co-located components can come through shared memory (NOISE_SHM) */
+	transport = transport_create(mosq, handle_message, mosq);
+	if (transport == NULL)
+	{
+		mosquitto_destroy(mosq);
+		return 1;
+	}
+
+	/* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+	if (tls_configure(mosq) != MOSQ_ERR_SUCCESS)
+	{
+		mosquitto_destroy(mosq);
+		return 1;
+	}
+
 	/* Connect to test.mosquitto.org on port 1883, with a keepalive of 60 seconds.
 	 * This call makes the socket connection only, it does not complete the MQTT
 	 * CONNECT/CONNACK flow, you should use mosquitto_loop_start() or
 	 * mosquitto_loop_forever() for processing net traffic. */
-	rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+	rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 	if (rc != MOSQ_ERR_SUCCESS)
 	{
 		mosquitto_destroy(mosq);
@@ -193,6 +336,15 @@ int main(int argc, char *argv[])
 	 */
 	mosquitto_loop_forever(mosq, -1, 1);
 
+	transport_destroy(transport);
+	if (tail != NULL)
+	{
+		tail_server_stop(tail);
+	}
+	if (store != NULL)
+	{
+		log_store_close(store, 1);
+	}
 	mosquitto_lib_cleanup();
 	return 0;
 }
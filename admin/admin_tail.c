@@ -0,0 +1,79 @@
+/*
+ * This program follows the logs of admin_logs live, filtered (see common/tail_server.h).
+ *
+ * It connects to the tail socket of admin_logs (NOISE_TAIL_SOCKET), sends the filter given on the
+ * command line and prints the matching logs until it is stopped. Any number of them can run next to
+ * admin_logs without another subscription to the broker.
+ *
+ *      usage: admin_tail [room=<prefix>] [level>=<n>] [health=<0|1>] [from=<yymmddhhmmss>] [to=<yymmddhhmmss>] [source=<pub|sub>]
+ *      e.g.   NOISE_TAIL_SOCKET=/tmp/noise_tail.sock admin_tail room=handong/NTH 'level>=2'
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "tail_server.h"
+
+int main(int argc, char *argv[])
+{
+	const char *path = config_str("NOISE_TAIL_SOCKET", "/tmp/noise_tail.sock");
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct tail_filter filter;
+	char request[TAIL_REQUEST_MAX], error[TAIL_REQUEST_MAX + 32], buffer[65536];
+	int fd, len = 0;
+	ssize_t n;
+
+	// the filter is one line of the arguments, checked here first for a clear message
+	request[0] = '\0';
+	for (int i = 1; i < argc && len < (int)sizeof(request); i++)
+	{
+		len += snprintf(request + len, sizeof(request) - len, "%s%s", i > 1 ? " " : "", argv[i]);
+	}
+	if (len >= (int)sizeof(request) - 1 || tail_filter_parse(&filter, request, error, sizeof(error)) != 0)
+	{
+		fprintf(stderr, "Error: %s\n", len >= (int)sizeof(request) - 1 ? "filter too long" : error);
+		fprintf(stderr, "usage: %s [room=<prefix>] [level>=<n>] [health=<0|1>] [from=<yymmddhhmmss>] [to=<yymmddhhmmss>] [source=<pub|sub>]\n", argv[0]);
+		return 1;
+	}
+	strcat(request, "\n");
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "Error: Cannot connect to %s (is admin_logs running with NOISE_TAIL_SOCKET?)\n", path);
+		return 1;
+	}
+	if (write(fd, request, strlen(request)) < 0)
+	{
+		perror("write");
+		return 1;
+	}
+
+	// "ok" or "error ..." first, then the logs
+	int first = 1;
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		char *p = buffer;
+		if (first && strncmp(buffer, "error", 5) == 0)
+		{
+			fprintf(stderr, "%.*s", (int)n, buffer);
+			return 1;
+		}
+		if (first && n >= 3 && strncmp(buffer, "ok\n", 3) == 0)
+		{
+			p += 3;
+			n -= 3;
+		}
+		first = 0;
+		fwrite(p, 1, n, stdout);
+		fflush(stdout);
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * This program measures the anomaly detector of admin_alerts (common/anomaly.c) at scale.
+ *
+ * Every room (100k by default) reports once per simulated second, in a shuffled order, with its own usual
+ * level (35 .. 77 dB) and 2 dB of noise. After 'warm' seconds of learning, 'seconds' more are timed;
+ * in the middle of them one room in 'every' gets 15 dB louder for 20 seconds. The program prints the
+ * time per reading (parsing the timestamp, hash lookup, scoring and learning), how many rooms one core
+ * keeps up with at one reading per second, the detected and false anomalies, and the time to checkpoint
+ * the table and load it again. admin_alerts only holds its lock for the snapshot; the save is done from the copy.
+ *
+ *      usage: bench_anomaly [-r rooms] [-w warm_seconds] [-s seconds] [-e every] [-f checkpoint_file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "anomaly.h"
+#include "vclock.h"
+
+#define EVENT_START     10          // seconds into the timed part
+#define EVENT_LENGTH    20
+#define EVENT_DB        15.0
+
+uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+
+/*
+ * This function returns a normal random number with mean 0 and deviation 'sd'
+ * (sum of four uniforms, like sim/noise_sim.c).
+*/
+double noise(double sd) {
+    uint64_t r = next_random();
+    double sum = (r & 0xffff) + ((r >> 16) & 0xffff) + ((r >> 32) & 0xffff) + (r >> 48);
+
+    return (sum / 65536.0 - 2.0) * sd * 1.7320508;
+}
+
+
+double usual_level(long room) {
+    return 35 + (room % 7) * 7;
+}
+
+
+int main(int argc, char *argv[]) {
+    long rooms = 100000, warm = 120, seconds = 60, every = 100;
+    const char *file = "/tmp/bench_anomaly.ckpt";
+    struct anomaly_options opts;
+    struct anomaly_table table, loaded, copy;
+    struct anomaly_event event;
+    char timestamp[13];
+    long detected = 0, false_alarms = 0, cleared = 0, updates = 0, timed_ns = 0;
+    struct stat st;
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:w:s:e:f:")) != -1) {
+        switch(opt) {
+            case 'r': rooms = atol(optarg); break;
+            case 'w': warm = atol(optarg); break;
+            case 's': seconds = atol(optarg); break;
+            case 'e': every = atol(optarg); break;
+            case 'f': file = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r rooms] [-w warm_seconds] [-s seconds] [-e every] [-f checkpoint_file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(rooms <= 0 || warm < 2 || seconds < EVENT_START + EVENT_LENGTH || every <= 0) {
+        fprintf(stderr, "Error: need rooms > 0, warm >= 2, seconds >= %d\n", EVENT_START + EVENT_LENGTH);
+        return 1;
+    }
+
+    // the defaults, except that the baselines are trusted after half of the warm up
+    anomaly_options_from_config(&opts);
+    opts.warmup = warm / 2;
+
+    long *order = malloc(rooms * sizeof(long));
+    char (*keys)[ANOMALY_KEY_LEN] = malloc(rooms * ANOMALY_KEY_LEN);
+    if(order == NULL || keys == NULL || anomaly_table_init(&table, &opts) != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    for(long i=0; i<rooms; i++) {
+        snprintf(keys[i], ANOMALY_KEY_LEN, "handong%ld/L%ld/R%ld", i / 10000, i / 100 % 100, i % 100);
+        order[i] = i;
+    }
+    for(long i=rooms-1; i>0; i--) {
+        long j = next_random() % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    time_t start = vclock_parse_usec("261019100000") / 1000000;
+    for(long t=0; t<warm+seconds; t++) {
+        long timed = t - warm;
+        int in_event = timed >= EVENT_START && timed < EVENT_START + EVENT_LENGTH;
+
+        vclock_timestamp(start + t, timestamp);
+        long begin = now_ns();
+        for(long n=0; n<rooms; n++) {
+            long i = order[n];
+            int injected = i % every == 0;
+            double db = usual_level(i) + noise(2.0) + (in_event && injected ? EVENT_DB : 0);
+            int kind = anomaly_update(&table, keys[i], timestamp, db, &event);
+
+            if(timed < 0)
+                continue;
+            if(kind == ANOMALY_LOUD && injected)
+                detected++;
+            else if(kind == ANOMALY_LOUD || kind == ANOMALY_QUIET)
+                false_alarms++;
+            else if(kind == ANOMALY_CLEAR && injected)
+                cleared++;
+        }
+        if(timed >= 0) {
+            timed_ns += now_ns() - begin;
+            updates += rooms;
+        }
+    }
+
+    double ns = (double)timed_ns / updates;
+    printf("rooms: %ld, readings timed: %ld, table memory: %.1f MB (%zu bytes per room)\n", rooms, updates,
+           ((double)table.capacity * sizeof(struct anomaly_room) + table.nslots * 4.0) / 1e6, sizeof(struct anomaly_room));
+    printf("update: %.0f ns/reading, %.0f readings/s on one core (%.1fx the load of %ld rooms at 1/s)\n",
+           ns, 1e9 / ns, 1e9 / ns / rooms, rooms);
+    printf("anomalies: %ld of %ld injected detected, %ld back to normal, %ld false alarms (%.4f%% of readings)\n",
+           detected, (rooms + every - 1) / every, cleared, false_alarms, 100.0 * false_alarms / updates);
+
+    // the copy is kept from one checkpoint to the next: the first snapshot also allocates it
+    if(anomaly_table_init(&copy, &opts) != 0 || anomaly_snapshot(&copy, &table) != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    long begin = now_ns();
+    anomaly_snapshot(&copy, &table);
+    long snapshot_ns = now_ns() - begin;
+
+    begin = now_ns();
+    if(anomaly_save(&copy, file) != 0)
+        return 1;
+    long save_ns = now_ns() - begin;
+    stat(file, &st);
+
+    begin = now_ns();
+    if(anomaly_table_init(&loaded, &opts) != 0 || anomaly_load(&loaded, file) != table.count) {
+        fprintf(stderr, "Error: cannot load %s\n", file);
+        return 1;
+    }
+    long load_ns = now_ns() - begin;
+    int same = memcmp(anomaly_lookup(&loaded, keys[rooms - 1]), anomaly_lookup(&table, keys[rooms - 1]), sizeof(struct anomaly_room)) == 0;
+    printf("checkpoint: %.1f MB, snapshot %.1f ms, save %.0f ms, load %.0f ms, %s\n", st.st_size / 1e6,
+           snapshot_ns / 1e6, save_ns / 1e6, load_ns / 1e6, same ? "restored" : "MISMATCH");
+
+    unlink(file);
+    anomaly_table_free(&table);
+    anomaly_table_free(&loaded);
+    anomaly_table_free(&copy);
+    free(keys);
+    free(order);
+    return same ? 0 : 1;
+}
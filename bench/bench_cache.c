@@ -0,0 +1,127 @@
+/*
+ * This program measures the query latency of the state cache table (common/state_table.c).
+ *
+ * It fills the table with 'institutions' x 'locations' x 'rooms' rooms (100k by default), applies a
+ * round of updates, and then times the queries of the state cache, including writing the answer:
+ *      point   "point handong0/L0/R0"      one room
+ *      prefix  "prefix handong0/L0"        one location
+ *      prefix  "prefix handong0"           one institution
+ *      level   "level 3"                   every room at level 3 (about 2% of the rooms)
+ *
+ *      usage: bench_cache [-i institutions] [-l locations] [-r rooms] [-q queries]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "state_table.h"
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+
+int random_level(void) {
+    int r = random() % 100;
+
+    return r < 60 ? 0 : r < 85 ? 1 : r < 97 ? 2 : r < 99 ? 3 : -1;
+}
+
+
+/*
+ * This function runs 'count' queries made by 'make_query' and prints the mean and p99 latency in microseconds.
+*/
+void time_queries(const char *name, struct state_table *table, long count, char *buffer, int size,
+                  void (*make_query)(char *query, int ninst, int nloc, int nroom), int ninst, int nloc, int nroom) {
+    long *samples = malloc(count * sizeof(long));
+    long total = 0, rooms = 0;
+    char query[64];
+
+    for(long i=0; i<count; i++) {
+        make_query(query, ninst, nloc, nroom);
+        long start = now_ns();
+        int len = state_answer(table, query, buffer, size);
+        samples[i] = now_ns() - start;
+        total += samples[i];
+        if(len > 0)
+            rooms += atol(buffer);
+    }
+    qsort(samples, count, sizeof(long), compare_long);
+    printf("%-8s %10.2f %10.2f %12.1f\n", name, total / 1000.0 / count, samples[(long)(0.99 * (count - 1))] / 1000.0, (double)rooms / count);
+    free(samples);
+}
+
+void point_query(char *q, int ni, int nl, int nr) { sprintf(q, "point handong%ld/L%ld/R%ld", random() % ni, random() % nl, random() % nr); }
+void location_query(char *q, int ni, int nl, int nr) { sprintf(q, "prefix handong%ld/L%ld", random() % ni, random() % nl); }
+void institution_query(char *q, int ni, int nl, int nr) { sprintf(q, "prefix handong%ld", random() % ni); }
+void level_query(char *q, int ni, int nl, int nr) { sprintf(q, "level 3"); }
+
+
+int main(int argc, char *argv[]) {
+    int ninst = 10, nloc = 100, nroom = 100;
+    long queries = 10000;
+    int size = 16 << 20;
+    struct state_table table;
+    char key[64];
+    int changed, opt;
+
+    while((opt = getopt(argc, argv, "i:l:r:q:")) != -1) {
+        switch(opt) {
+            case 'i': ninst = atoi(optarg); break;
+            case 'l': nloc = atoi(optarg); break;
+            case 'r': nroom = atoi(optarg); break;
+            case 'q': queries = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-i institutions] [-l locations] [-r rooms] [-q queries]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    char *buffer = malloc(size);
+    if(buffer == NULL || state_table_init(&table) != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    long total = (long)ninst * nloc * nroom;
+    long start = now_ns();
+    for(int i=0; i<ninst; i++)
+        for(int l=0; l<nloc; l++)
+            for(int r=0; r<nroom; r++) {
+                snprintf(key, sizeof(key), "handong%d/L%d/R%d", i, l, r);
+                state_update(&table, key, "261019120000", random_level(), 40.0f, 1, 1, &changed);
+            }
+    long fill = now_ns() - start;
+
+    // one more reading for every room, in random order, with a new level for some
+    start = now_ns();
+    for(long n=0; n<total; n++) {
+        snprintf(key, sizeof(key), "handong%ld/L%ld/R%ld", random() % ninst, random() % nloc, random() % nroom);
+        state_update(&table, key, "261019120010", random_level(), 42.0f, 1, 2, &changed);
+    }
+    long update = now_ns() - start;
+
+    printf("rooms: %ld, table memory: %.1f MB\n", total, (table.capacity * sizeof(struct state_entry) + table.nslots * 4.0) / 1e6);
+    printf("insert: %.0f ns/room, update: %.0f ns/reading (including key formatting)\n\n", (double)fill / total, (double)update / total);
+    printf("query      mean_us     p99_us  rooms/answer\n");
+    time_queries("point", &table, queries, buffer, size, point_query, ninst, nloc, nroom);
+    time_queries("location", &table, queries, buffer, size, location_query, ninst, nloc, nroom);
+    time_queries("inst", &table, queries / 10, buffer, size, institution_query, ninst, nloc, nroom);
+    time_queries("level>=3", &table, queries / 10, buffer, size, level_query, ninst, nloc, nroom);
+
+    state_table_free(&table);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * This program measures the broker with the two ways of logging the readings (make bench-capture):
+ *      echo    the publisher sends every reading to its room topic and a copy to 'admin/logs/pub', the
+ *              subscriber republishes every reading it receives to 'admin/logs/sub', and a log client
+ *              (like admin_logs) receives both copies: three publishes into the broker per reading.
+ *      plugin  the publisher only sends the readings (NOISE_LOG_ECHO=0); the log capture plugin of the broker
+ *              (plugin/noise_log_plugin.c, plugin_opt_shm) writes them into the ring '-s', where the log client
+ *              reads them. The subscriber still republishes what it receives, which the broker cannot log.
+ * The publisher keeps at most WINDOW readings in flight, so the rate is what the broker sustains.
+ * A run reports:
+ *      msgs_per_sec    readings per second, from the first publish until the subscriber and the log client
+ *                      have everything
+ *      logs            log messages the log client received (2 per reading: from the publisher or the ring,
+ *                      and from the subscriber)
+ *      broker_cpu_us   CPU time of the broker per reading, with -b (from /proc, in clock ticks)
+ *      publishes_in/out  PUBLISH packets the broker received and sent per reading, from
+ *                      $SYS/broker/publish/messages/received|sent (the broker needs a short sys_interval)
+ * The result is printed as a JSON object to stdout. bench/run_capture_bench.sh runs both modes, each on
+ * a private broker.
+ *
+ *      usage: bench_capture -m echo|plugin [-s ring] [-b broker_pid] [-n messages] [-q qos] [-w sys_wait_ms]
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "config.h"
+#include "packet.h"
+#include "shm_ring.h"
+
+#define ROOM_TOPIC      "handong/BENCH/313"
+#define WINDOW          1000        // readings published but not received yet
+
+_Atomic int connected = 0;
+_Atomic int subscribed = 0;
+_Atomic long received = 0;          // readings at the subscriber
+_Atomic long logs = 0;              // log messages at the log client
+_Atomic long sys_in = -1;           // $SYS/broker/publish/messages/received
+_Atomic long sys_out = -1;
+_Atomic int stop = 0;
+
+pid_t broker_pid = 0;
+int echo = 1;
+int qos = 1;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * This function returns the user + system CPU time of the broker in microseconds, or 0 without -b.
+*/
+long broker_cpu_us(void) {
+    char path[64];
+    unsigned long utime = 0, stime = 0;
+    FILE *fp;
+
+    if(broker_pid <= 0)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)broker_pid);
+    if((fp = fopen(path, "r")) == NULL)
+        return 0;
+    // fields 14 and 15; the command name (field 2) has no spaces for mosquitto
+    if(fscanf(fp, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(fp);
+    return (long)((utime + stime) * 1000000.0 / sysconf(_SC_CLK_TCK));
+}
+
+
+void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    if(reason_code == 0)
+        atomic_store(&connected, 1);
+}
+
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+    atomic_store(&subscribed, 1);
+}
+
+
+/*
+ * The subscriber: it republishes the reading to its log topic, like nth_313_sub.
+*/
+void on_reading(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    mosquitto_publish(mosq, NULL, "admin/logs/sub", msg->payloadlen, msg->payload, qos, false);
+    atomic_fetch_add(&received, 1);
+}
+
+
+/*
+ * The log client (the logs of the publisher with echo, those of the subscriber in both modes), and the $SYS counters.
+*/
+void on_log(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    if(strcmp(msg->topic, "$SYS/broker/publish/messages/received") == 0)
+        atomic_store(&sys_in, atol(msg->payload));
+    else if(strcmp(msg->topic, "$SYS/broker/publish/messages/sent") == 0)
+        atomic_store(&sys_out, atol(msg->payload));
+    else
+        atomic_fetch_add(&logs, 1);
+}
+
+
+/*
+ * The log client of the plugin mode: it reads the ring the plugin writes to, like admin_logs with NOISE_SHM.
+*/
+void *ring_reader(void *arg)
+{
+    struct shm_ring *ring = arg;
+    struct shm_cursor cursor;
+    char *buffer = malloc(shm_ring_max_message(ring) + 2);
+    char *topic, *payload;
+    int len;
+
+    shm_cursor_init(ring, &cursor);
+    while(!atomic_load(&stop)) {
+        if(!shm_ring_read(ring, &cursor, buffer, &topic, &payload, &len)) {
+            shm_ring_wait(ring, &cursor, 0, 100);
+            continue;
+        }
+        if(strncmp(topic, "admin/logs/pub", 14) == 0)
+            atomic_fetch_add(&logs, 1);
+    }
+    if(cursor.lost > 0)
+        fprintf(stderr, "Warning: %lu log messages lost in the ring\n", cursor.lost);
+    free(buffer);
+    return NULL;
+}
+
+
+struct mosquitto *connect_client(void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *))
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+
+    if(mosq == NULL)
+        return NULL;
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    if(on_message != NULL)
+        mosquitto_message_callback_set(mosq, on_message);
+    mosquitto_max_inflight_messages_set(mosq, WINDOW);
+
+    atomic_store(&connected, 0);
+    if(mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60) != MOSQ_ERR_SUCCESS ||
+       mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+    for(int i=0; i<500 && !atomic_load(&connected); i++)
+        usleep(10000);
+    return mosq;
+}
+
+
+int subscribe(struct mosquitto *mosq, const char *topic)
+{
+    atomic_store(&subscribed, 0);
+    mosquitto_subscribe(mosq, NULL, topic, qos);
+    for(int i=0; i<500 && !atomic_load(&subscribed); i++)
+        usleep(10000);
+    return atomic_load(&subscribed) ? 0 : -1;
+}
+
+
+void close_client(struct mosquitto *mosq)
+{
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+}
+
+
+/*
+ * This function waits for the next $SYS update and returns the PUBLISH packets the broker received and sent so far.
+*/
+void sys_publishes(struct mosquitto *sys, int wait_ms, long *in, long *out)
+{
+    atomic_store(&sys_in, -1);
+    atomic_store(&sys_out, -1);
+    // a new subscription gets the retained values at once; then wait for the next interval
+    mosquitto_unsubscribe(sys, NULL, "$SYS/broker/publish/messages/+");
+    usleep(wait_ms * 1000);
+    mosquitto_subscribe(sys, NULL, "$SYS/broker/publish/messages/+", 0);
+    for(int i=0; i<300 && (atomic_load(&sys_in) < 0 || atomic_load(&sys_out) < 0); i++)
+        usleep(10000);
+    *in = atomic_load(&sys_in);
+    *out = atomic_load(&sys_out);
+}
+
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -m echo|plugin [-s ring] [-b broker_pid] [-n messages] [-q qos] [-w sys_wait_ms]\n", prog);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct mosquitto *pub, *sub, *log;
+    struct shm_ring *ring = NULL;
+    struct packet_writer writer;
+    pthread_t reader;
+    char packet[PACKET_MAX];
+    const char *mode = NULL, *ring_name = "/noise_capture_bench";
+    long messages = 100000, in0, out0, in1, out1;
+    int wait_ms = 1500, opt;
+
+    while((opt = getopt(argc, argv, "m:s:b:n:q:w:")) != -1) {
+        switch(opt) {
+            case 'm': mode = optarg; break;
+            case 's': ring_name = optarg; break;
+            case 'b': broker_pid = atoi(optarg); break;
+            case 'n': messages = atol(optarg); break;
+            case 'q': qos = atoi(optarg); break;
+            case 'w': wait_ms = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(mode == NULL || (strcmp(mode, "echo") != 0 && strcmp(mode, "plugin") != 0) || messages < 1 || qos < 0 || qos > 2 || wait_ms < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    echo = strcmp(mode, "echo") == 0;
+    long expected_logs = 2 * messages;
+
+    mosquitto_lib_init();
+    if((log = connect_client(on_log)) == NULL || (sub = connect_client(on_reading)) == NULL || (pub = connect_client(NULL)) == NULL) {
+        fprintf(stderr, "Error: cannot connect to %s:%d\n", config_mqtt_host(), config_mqtt_port());
+        return 1;
+    }
+    if(subscribe(sub, ROOM_TOPIC) != 0 || subscribe(log, echo ? "admin/logs/#" : "admin/logs/sub") != 0) {
+        fprintf(stderr, "Error: subscription failed\n");
+        return 1;
+    }
+    if(!echo) {
+        // the plugin created the ring when the broker started; this only attaches to it
+        if((ring = shm_ring_open(ring_name, 65536, 256)) == NULL)
+            return 1;
+        pthread_create(&reader, NULL, ring_reader, ring);
+    }
+
+    packet_writer_init(&writer, "handong", "BENCH", "313");
+    packet_writer_set_epoch(&writer, time(NULL));
+    sys_publishes(log, wait_ms, &in0, &out0);
+    long cpu = broker_cpu_us(), start = now_ns();
+
+    for(long i=0; i<messages; i++) {
+        int len = packet_format(&writer, packet, time(NULL), 1, 55.5f + i % 10, 1, i + 1);
+
+        while(i - atomic_load(&received) >= WINDOW)
+            usleep(100);
+        mosquitto_publish(pub, NULL, ROOM_TOPIC, len, packet, qos, false);
+        if(echo)
+            mosquitto_publish(pub, NULL, "admin/logs/pub", len, packet, qos, false);
+    }
+    for(int i=0; i<1000 && (atomic_load(&received) < messages || atomic_load(&logs) < expected_logs); i++)
+        usleep(10000);
+
+    double seconds = (now_ns() - start) / 1e9;
+    double cpu_us = (double)(broker_cpu_us() - cpu) / messages;
+    long got = atomic_load(&received), got_logs = atomic_load(&logs);
+    sys_publishes(log, wait_ms, &in1, &out1);
+
+    atomic_store(&stop, 1);
+    if(ring != NULL) {
+        pthread_join(reader, NULL);
+        shm_ring_close(ring);
+    }
+    close_client(pub);
+    close_client(sub);
+    close_client(log);
+    mosquitto_lib_cleanup();
+
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", mode);
+    printf("  \"messages\": %ld,\n", messages);
+    printf("  \"qos\": %d,\n", qos);
+    printf("  \"received\": %ld,\n", got);
+    printf("  \"logs\": %ld,\n", got_logs);
+    printf("  \"expected_logs\": %ld,\n", expected_logs);
+    printf("  \"msgs_per_sec\": %.1f,\n", seconds > 0 ? got / seconds : 0.0);
+    printf("  \"broker_cpu_us\": %.2f,\n", cpu_us);
+    printf("  \"publishes_in\": %.2f,\n", in0 >= 0 && in1 >= 0 ? (double)(in1 - in0) / messages : 0.0);
+    printf("  \"publishes_out\": %.2f\n", out0 >= 0 && out1 >= 0 ? (double)(out1 - out0) / messages : 0.0);
+    printf("}\n");
+    return got == messages && got_logs >= expected_logs ? 0 : 1;
+}
@@ -0,0 +1,930 @@
+/*
+ * This program emulates the occupants of a building: tens of thousands of MQTT subscribers of the room
+ * topics (handong/+/+) in one process, to size the broker for them (make bench-fanout).
+ *
+ * The subscribers do not use libmosquitto (one thread per client does not scale to 100k clients).
+ * 'threads' event loops own a share of the connections each, with one epoll set per loop, and speak
+ * just enough MQTT 3.1.1 themselves: CONNECT/CONNACK, SUBSCRIBE/SUBACK, PUBLISH (QoS 0 and 1, with PUBACK),
+ * PINGREQ/PINGRESP and DISCONNECT. A publisher thread sends noise packets of 'rooms' rooms at 'rate' per second
+ * to 'handong/LOAD/<n>', with the send time in nanoseconds as last field (like bench/noise_bench.c), so every
+ * reading fans out to every subscriber.
+ *
+ * Scenarios:
+ *      ramp    'connections' subscribers join at 'connect_rate' per second while the publisher runs,
+ *              and the run goes on for 'seconds' after the last one joined
+ *      steady  all subscribers join first (not measured), then the publisher runs for 'seconds'
+ *      churn   like steady, but 'churn_rate' random subscribers per second disconnect and join again
+ * At most 'inflight' handshakes per loop are in progress at once, so the listen backlog of the broker is not flooded.
+ *
+ * The report (a JSON object on stdout) has:
+ *      fanout          deliveries per second, and deliveries against the subscribers there were at each publish
+ *      latency_us      delivery latency of every reading to every subscriber (publisher -> broker -> subscriber)
+ *      per_connection  spread over the subscribers of their received readings, mean and max latency
+ *      connect         handshake times (TCP connect to CONNACK, to SUBACK), failures, refusals, drops by the broker
+ *      churn           time for a churned subscriber to be subscribed again
+ *      timeline        subscribed connections, deliveries and connects in every second
+ * The latency includes the time a reading waits in this process, so 'threads' must keep up with the fan-out.
+ *
+ * One local address has about 28k ephemeral ports. For a broker on the loopback interface the connections
+ * are spread over 'sources' local addresses (127.0.1.1, 127.0.1.2, ...), one per 20000 connections by default.
+ * The open file limit has to allow the connections (ulimit -n); bench/run_fanout_bench.sh starts a private broker for it.
+ *
+ *      usage: bench_fanout [-s ramp|steady|churn] [-c connections] [-T threads] [-r connect_rate] [-d seconds]
+ *                          [-m rate] [-n rooms] [-q qos] [-k churn_rate] [-i inflight] [-K keepalive] [-S sources] [-t topic]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "packet.h"
+
+#define IN_BUF          256         // receive buffer of a subscriber; larger packets are skipped
+#define HIST_BUCKETS    1216        // log-linear latency buckets, 32 per power of two (about 3%)
+#define MAX_TIMELINE    3600
+#define MAX_EVENTS      1024
+#define PORTS_PER_SOURCE 20000
+
+#define MQTT_CONNECT    0x10
+#define MQTT_CONNACK    0x20
+#define MQTT_PUBLISH    0x30
+#define MQTT_PUBACK     0x40
+#define MQTT_SUBSCRIBE  0x82
+#define MQTT_SUBACK     0x90
+#define MQTT_PINGREQ    0xc0
+#define MQTT_PINGRESP   0xd0
+#define MQTT_DISCONNECT 0xe0
+
+enum scenario { RAMP, STEADY, CHURN };
+
+enum conn_state {
+    IDLE,                   // not connected
+    CONNECTING,             // TCP connect in progress
+    WAIT_CONNACK,
+    WAIT_SUBACK,
+    SUBSCRIBED
+};
+
+struct histogram {
+    unsigned long count;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+struct conn {
+    int fd;
+    int state;
+    int in_len;
+    int skip;                   // bytes of an oversized packet still to drop
+    int rejoin;                 // reconnecting after churn
+    int next_idle;              // free list of the loop
+    long started_ns;            // of the current connection attempt
+    long last_sent_ns;          // for the keepalive
+    unsigned long received;
+    unsigned long latency_sum_us;
+    unsigned long latency_max_us;
+    uint8_t in[IN_BUF];
+};
+
+struct loop {
+    pthread_t thread;
+    int id;
+    int epfd;
+    struct conn *conns;
+    int count;
+    int idle;                   // first free connection, -1 if none
+    int active;                 // connections not idle
+    int handshakes;             // connections not subscribed yet
+    unsigned int random;
+    struct histogram latency, connack, suback, resubscribe;
+    unsigned long oversized, send_errors;
+    _Atomic unsigned long deliveries, attempts, connects, failures, refused, dropped, churned;
+};
+
+// options
+enum scenario scenario = RAMP;
+int connections = 10000;
+int threads = 2;
+double connect_rate = 2000;
+double seconds = 30;
+double rate = 10;
+int rooms = 100;
+int qos = 0;
+double churn_rate = 100;
+int inflight = 256;
+int keepalive = 60;
+int sources = 0;
+char topic_filter[64] = "handong/+/+";
+
+struct sockaddr_in broker;
+struct loop *loops = NULL;
+
+_Atomic int stop = 0;              // of the event loops
+_Atomic int stop_publisher = 0;
+_Atomic int measuring = 0;          // the publisher runs
+_Atomic long subscribed = 0;
+_Atomic unsigned long published = 0;
+_Atomic unsigned long expected = 0; // subscribers at every publish
+long start_ns = 0;                  // of the measurement
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * Latency histogram: values below 64 us have a bucket each, above that every power of two has 32 buckets.
+*/
+int hist_index(unsigned long us) {
+    if(us < 64)
+        return us;
+    int e = 63 - __builtin_clzl(us);
+    int index = 64 + (e - 6) * 32 + (int)((us >> (e - 5)) - 32);
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+
+unsigned long hist_value(int index) {
+    if(index < 64)
+        return index;
+    int e = (index - 64) / 32 + 6;
+    return (unsigned long)(32 + (index - 64) % 32) << (e - 5);
+}
+
+
+void hist_add(struct histogram *h, unsigned long us) {
+    h->buckets[hist_index(us)]++;
+    h->count++;
+    if(us > h->max)
+        h->max = us;
+}
+
+
+void hist_merge(struct histogram *sum, const struct histogram *h) {
+    for(int i=0; i<HIST_BUCKETS; i++)
+        sum->buckets[i] += h->buckets[i];
+    sum->count += h->count;
+    if(h->max > sum->max)
+        sum->max = h->max;
+}
+
+
+unsigned long hist_quantile(const struct histogram *h, double q) {
+    unsigned long rank = (unsigned long)(q * h->count), seen = 0;
+
+    for(int i=0; i<HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen > rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+
+void print_hist(const char *name, const struct histogram *h, const char *end) {
+    printf("\"%s\": { \"count\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu }%s",
+           name, h->count, hist_quantile(h, 0.5), hist_quantile(h, 0.9), hist_quantile(h, 0.99),
+           hist_quantile(h, 0.999), h->max, end);
+}
+
+
+/*
+ * The MQTT codec. Every function writes one packet into 'p' and returns its length.
+*/
+int mqtt_remaining(uint8_t *p, int len) {
+    int n = 0;
+
+    do {
+        p[n] = len % 128;
+        len /= 128;
+        if(len > 0)
+            p[n] |= 0x80;
+        n++;
+    } while(len > 0);
+    return n;
+}
+
+
+int mqtt_string(uint8_t *p, const char *s, int len) {
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    memcpy(p + 2, s, len);
+    return len + 2;
+}
+
+
+int mqtt_connect(uint8_t *p, const char *client_id, int keepalive) {
+    int idlen = strlen(client_id);
+    int n = 0;
+
+    p[n++] = MQTT_CONNECT;
+    n += mqtt_remaining(p + n, 10 + 2 + idlen);
+    n += mqtt_string(p + n, "MQTT", 4);
+    p[n++] = 4;                 // protocol level 3.1.1
+    p[n++] = 0x02;              // clean session
+    p[n++] = keepalive >> 8;
+    p[n++] = keepalive & 0xff;
+    n += mqtt_string(p + n, client_id, idlen);
+    return n;
+}
+
+
+int mqtt_subscribe(uint8_t *p, int packet_id, const char *filter, int qos) {
+    int len = strlen(filter);
+    int n = 0;
+
+    p[n++] = MQTT_SUBSCRIBE;
+    n += mqtt_remaining(p + n, 2 + 2 + len + 1);
+    p[n++] = packet_id >> 8;
+    p[n++] = packet_id & 0xff;
+    n += mqtt_string(p + n, filter, len);
+    p[n++] = qos;
+    return n;
+}
+
+
+int mqtt_publish(uint8_t *p, int packet_id, const char *topic, const char *payload, int payloadlen, int qos) {
+    int len = strlen(topic);
+    int n = 0;
+
+    p[n++] = MQTT_PUBLISH | (qos << 1);
+    n += mqtt_remaining(p + n, 2 + len + (qos > 0 ? 2 : 0) + payloadlen);
+    n += mqtt_string(p + n, topic, len);
+    if(qos > 0) {
+        p[n++] = packet_id >> 8;
+        p[n++] = packet_id & 0xff;
+    }
+    memcpy(p + n, payload, payloadlen);
+    return n + payloadlen;
+}
+
+
+int mqtt_ack(uint8_t *p, int type, int packet_id) {
+    p[0] = type;
+    p[1] = 2;
+    p[2] = packet_id >> 8;
+    p[3] = packet_id & 0xff;
+    return 4;
+}
+
+
+int mqtt_empty(uint8_t *p, int type) {
+    p[0] = type;
+    p[1] = 0;
+    return 2;
+}
+
+
+/*
+ * This function finds the packet at the start of 'buf'. It returns the length of its fixed header and stores
+ * the length of the rest in 'remaining', or returns 0 if the header is incomplete and -1 if it is malformed.
+*/
+int mqtt_header(const uint8_t *buf, int len, int *remaining) {
+    int value = 0;
+
+    for(int i=1; i<=4; i++) {
+        if(i >= len)
+            return 0;
+        value |= (buf[i] & 0x7f) << (7 * (i - 1));
+        if((buf[i] & 0x80) == 0) {
+            *remaining = value;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * This function returns the send time at the end of a probe packet, or 0.
+*/
+long payload_send_ns(const uint8_t *payload, int len) {
+    long value = 0, scale = 1;
+
+    for(int i=len - 1; i>=0 && payload[i] != ','; i--) {
+        if(payload[i] < '0' || payload[i] > '9' || scale > 100000000000000000L)
+            return 0;
+        value += (payload[i] - '0') * scale;
+        scale *= 10;
+    }
+    return value;
+}
+
+
+/*
+ * Subscriber connections, on the thread of their loop.
+*/
+int conn_send(struct loop *l, struct conn *c, const uint8_t *p, int len) {
+    // control packets are tiny: a full socket buffer means the broker stopped reading
+    if(send(c->fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) {
+        l->send_errors++;
+        return -1;
+    }
+    c->last_sent_ns = now_ns();
+    return 0;
+}
+
+
+void conn_close(struct loop *l, struct conn *c) {
+    if(c->state == SUBSCRIBED)
+        atomic_fetch_sub(&subscribed, 1);
+    else if(c->state != IDLE)
+        l->handshakes--;
+    if(c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->state = IDLE;
+    c->in_len = c->skip = 0;
+    c->next_idle = l->idle;
+    l->idle = c - l->conns;
+    l->active--;
+}
+
+
+/*
+ * This function starts a non-blocking TCP connection, from one of the source addresses.
+*/
+int conn_start(struct loop *l, struct conn *c) {
+    int index = c - l->conns;
+    struct epoll_event ev;
+
+    atomic_fetch_add(&l->attempts, 1);
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(sources > 0) {
+        struct sockaddr_in local = { .sin_family = AF_INET };
+        local.sin_addr.s_addr = htonl(0x7f000101 + (l->id + index * threads) % sources);
+        // the port is chosen at connect(), per source address
+        setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        if(bind(c->fd, (struct sockaddr *)&local, sizeof(local)) != 0)
+            goto fail;
+    }
+    c->started_ns = now_ns();
+    if(connect(c->fd, (struct sockaddr *)&broker, sizeof(broker)) != 0 && errno != EINPROGRESS)
+        goto fail;
+
+    ev.events = EPOLLOUT;
+    ev.data.u32 = index;
+    if(epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+        goto fail;
+    c->state = CONNECTING;
+    l->handshakes++;
+    return 0;
+
+fail:
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+
+/*
+ * This function sends CONNECT once the TCP connection is established.
+*/
+void conn_connected(struct loop *l, struct conn *c) {
+    uint8_t packet[64];
+    char client_id[32];
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    struct epoll_event ev;
+
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    snprintf(client_id, sizeof(client_id), "fanout-%d-%d-%d", (int)getpid(), l->id, (int)(c - l->conns));
+    ev.events = EPOLLIN;
+    ev.data.u32 = c - l->conns;
+    if(err != 0 || epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0 ||
+       conn_send(l, c, packet, mqtt_connect(packet, client_id, keepalive)) != 0) {
+        atomic_fetch_add(&l->failures, 1);
+        conn_close(l, c);
+        return;
+    }
+    c->state = WAIT_CONNACK;
+}
+
+
+/*
+ * This function handles one packet from the broker. It returns -1 if the connection has to be closed.
+*/
+int conn_packet(struct loop *l, struct conn *c, const uint8_t *p, int header, int remaining) {
+    const uint8_t *body = p + header;
+    uint8_t reply[64];
+    long now = now_ns();
+
+    switch(p[0] & 0xf0) {
+        case MQTT_CONNACK:
+            if(remaining < 2 || body[1] != 0) {
+                atomic_fetch_add(&l->refused, 1);
+                return -1;
+            }
+            hist_add(&l->connack, (now - c->started_ns) / 1000);
+            c->state = WAIT_SUBACK;
+            return conn_send(l, c, reply, mqtt_subscribe(reply, 1, topic_filter, qos));
+
+        case MQTT_SUBACK:
+            if(remaining < 3 || body[2] == 0x80) {
+                atomic_fetch_add(&l->refused, 1);
+                return -1;
+            }
+            hist_add(c->rejoin ? &l->resubscribe : &l->suback, (now - c->started_ns) / 1000);
+            c->state = SUBSCRIBED;
+            c->rejoin = 0;
+            l->handshakes--;
+            atomic_fetch_add(&l->connects, 1);
+            atomic_fetch_add(&subscribed, 1);
+            return 0;
+
+        case MQTT_PUBLISH: {
+            int pqos = (p[0] >> 1) & 3;
+            if(remaining < 2)
+                return -1;
+            int offset = 2 + (body[0] << 8 | body[1]);
+            int packet_id = 0;
+            if(pqos > 0) {
+                if(remaining < offset + 2)
+                    return -1;
+                packet_id = body[offset] << 8 | body[offset + 1];
+                offset += 2;
+            }
+            if(offset > remaining)
+                return -1;
+
+            long sent = payload_send_ns(body + offset, remaining - offset);
+            if(sent > 0 && sent <= now) {
+                unsigned long us = (now - sent) / 1000;
+                hist_add(&l->latency, us);
+                c->received++;
+                c->latency_sum_us += us;
+                if(us > c->latency_max_us)
+                    c->latency_max_us = us;
+                atomic_fetch_add_explicit(&l->deliveries, 1, memory_order_relaxed);
+            }
+            return pqos == 1 ? conn_send(l, c, reply, mqtt_ack(reply, MQTT_PUBACK, packet_id)) : 0;
+        }
+
+        default:                // PINGRESP
+            return 0;
+    }
+}
+
+
+/*
+ * This function reads what the broker sent and handles every complete packet.
+*/
+void conn_read(struct loop *l, struct conn *c) {
+    int n = recv(c->fd, c->in + c->in_len, IN_BUF - c->in_len, 0);
+    int used = 0;
+
+    if(n <= 0) {
+        if(n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        atomic_fetch_add(&l->dropped, 1);
+        conn_close(l, c);
+        return;
+    }
+    c->in_len += n;
+
+    // the rest of a packet too large for the buffer
+    if(c->skip > 0) {
+        used = c->skip < c->in_len ? c->skip : c->in_len;
+        c->skip -= used;
+    }
+
+    while(used < c->in_len) {
+        int remaining, header = mqtt_header(c->in + used, c->in_len - used, &remaining);
+        if(header < 0) {
+            atomic_fetch_add(&l->dropped, 1);
+            conn_close(l, c);
+            return;
+        }
+        if(header == 0)
+            break;
+        if(header + remaining > IN_BUF) {
+            l->oversized++;
+            int have = c->in_len - used;
+            c->skip = header + remaining - have;
+            used = c->in_len;
+            break;
+        }
+        if(header + remaining > c->in_len - used)
+            break;
+        if(conn_packet(l, c, c->in + used, header, remaining) != 0) {
+            conn_close(l, c);
+            return;
+        }
+        used += header + remaining;
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+}
+
+
+/*
+ * This function returns how many connections the loop should have at 'now'.
+*/
+int loop_target(struct loop *l, long now) {
+    if(scenario != RAMP)
+        return l->count;
+    double joined = (now - start_ns) / 1e9 * connect_rate / threads;
+    return joined < l->count ? (int)joined : l->count;
+}
+
+
+/*
+ * This function disconnects random subscribers, at the churn rate since the last call. They join again
+ * like any idle connection.
+*/
+void loop_churn(struct loop *l, long now, long *last, double *owed) {
+    uint8_t packet[4];
+
+    *owed += (now - *last) / 1e9 * churn_rate / threads;
+    *last = now;
+    for(int tries = 0; *owed >= 1 && tries < 64; tries++) {
+        l->random = l->random * 1103515245 + 12345;
+        struct conn *c = &l->conns[(l->random >> 8) % l->count];
+        if(c->state != SUBSCRIBED)
+            continue;
+        conn_send(l, c, packet, mqtt_empty(packet, MQTT_DISCONNECT));
+        conn_close(l, c);
+        c->rejoin = 1;
+        atomic_fetch_add(&l->churned, 1);
+        *owed -= 1;
+    }
+}
+
+
+void *loop_main(void *arg) {
+    struct loop *l = arg;
+    struct epoll_event events[MAX_EVENTS];
+    long last_churn = 0, last_sweep = now_ns();
+    double owed = 0;
+    uint8_t packet[4];
+
+    while(!atomic_load(&stop)) {
+        long now = now_ns();
+
+        // join (or rejoin) while there are free connections, without too many handshakes at once
+        int target = loop_target(l, now);
+        while(l->idle >= 0 && l->active < target && l->handshakes < inflight) {
+            struct conn *c = &l->conns[l->idle];
+            l->idle = c->next_idle;
+            l->active++;
+            if(conn_start(l, c) != 0) {
+                atomic_fetch_add(&l->failures, 1);
+                conn_close(l, c);
+                break;
+            }
+        }
+
+        if(scenario == CHURN && atomic_load(&measuring)) {
+            if(last_churn == 0)
+                last_churn = now;
+            loop_churn(l, now, &last_churn, &owed);
+        }
+
+        // keepalive: a PINGREQ after three quarters of the interval without sending anything
+        if(keepalive > 0 && now - last_sweep >= 1000000000L) {
+            last_sweep = now;
+            for(int i=0; i<l->count; i++) {
+                struct conn *c = &l->conns[i];
+                if(c->state >= WAIT_CONNACK && now - c->last_sent_ns > keepalive * 750000000L &&
+                   conn_send(l, c, packet, mqtt_empty(packet, MQTT_PINGREQ)) != 0)
+                    conn_close(l, c);
+            }
+        }
+
+        int n = epoll_wait(l->epfd, events, MAX_EVENTS, 1);
+        for(int i=0; i<n; i++) {
+            struct conn *c = &l->conns[events[i].data.u32];
+            if(c->state == IDLE)
+                continue;
+            if(c->state == CONNECTING) {
+                conn_connected(l, c);
+                continue;
+            }
+            if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                conn_read(l, c);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * The publisher: blocking socket, paced with absolute deadlines. PUBACKs are read and ignored.
+*/
+int publisher_connect(void) {
+    uint8_t packet[64];
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1, got = 0;
+    char client_id[32];
+
+    if(fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    snprintf(client_id, sizeof(client_id), "fanout-%d-pub", (int)getpid());
+    if(connect(fd, (struct sockaddr *)&broker, sizeof(broker)) != 0 ||
+       send(fd, packet, mqtt_connect(packet, client_id, 0), MSG_NOSIGNAL) < 0)
+        goto fail;
+    while(got < 4) {
+        int n = recv(fd, packet + got, 4 - got, 0);
+        if(n <= 0)
+            goto fail;
+        got += n;
+    }
+    if((packet[0] & 0xf0) != MQTT_CONNACK || packet[3] != 0)
+        goto fail;
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+
+void *publisher_main(void *arg) {
+    int fd = *(int *)arg;
+    struct packet_writer *writers = calloc(rooms, sizeof(struct packet_writer));
+    unsigned long *seqs = calloc(rooms, sizeof(unsigned long));
+    char payload[PACKET_MAX + 24], topic[32], name[12];
+    uint8_t packet[PACKET_MAX + 64], drain[4096];
+    long interval = (long)(1e9 / rate), next = now_ns();
+    struct timespec wake;
+
+    if(writers == NULL || seqs == NULL)
+        return NULL;
+    for(int r=0; r<rooms; r++) {
+        snprintf(name, sizeof(name), "%d", r);
+        packet_writer_init(&writers[r], "handong", "LOAD", name);
+        packet_writer_set_epoch(&writers[r], time(NULL));
+    }
+
+    for(unsigned long i=0; !atomic_load(&stop_publisher); i++) {
+        wake.tv_sec = next / 1000000000L;
+        wake.tv_nsec = next % 1000000000L;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+        next += interval;
+
+        int r = i % rooms;
+        int len = packet_format(&writers[r], payload, time(NULL), 1, 55.5f, 1, ++seqs[r]);
+        len += snprintf(payload + len, sizeof(payload) - len, ",%ld", now_ns());
+        snprintf(topic, sizeof(topic), "handong/LOAD/%d", r);
+        int plen = mqtt_publish(packet, i % 65535 + 1, topic, payload, len, qos);
+
+        // the subscribers there are now are the ones that should get it
+        atomic_fetch_add(&expected, atomic_load(&subscribed));
+        if(send(fd, packet, plen, MSG_NOSIGNAL) != plen)
+            break;
+        atomic_fetch_add(&published, 1);
+        while(recv(fd, drain, sizeof(drain), MSG_DONTWAIT) > 0);
+    }
+    free(writers);
+    free(seqs);
+    return NULL;
+}
+
+
+int compare_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * This function prints min/p50/p99/max of one value over the connections that were subscribed at the end.
+*/
+void print_spread(const char *name, unsigned long *values, long count, const char *end) {
+    qsort(values, count, sizeof(unsigned long), compare_ulong);
+    printf("\"%s\": { \"min\": %lu, \"p50\": %lu, \"p99\": %lu, \"max\": %lu }%s", name,
+           count ? values[0] : 0, count ? values[count / 2] : 0, count ? values[(long)(count * 0.99)] : 0,
+           count ? values[count - 1] : 0, end);
+}
+
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s ramp|steady|churn] [-c connections] [-T threads] [-r connect_rate] [-d seconds]\n"
+                    "       [-m rate] [-n rooms] [-q qos] [-k churn_rate] [-i inflight] [-K keepalive] [-S sources] [-t topic]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    struct rlimit limit;
+    static unsigned long timeline[MAX_TIMELINE][4];
+    int seconds_run = 0, opt;
+
+    while((opt = getopt(argc, argv, "s:c:T:r:d:m:n:q:k:i:K:S:t:")) != -1) {
+        switch(opt) {
+            case 's': scenario = strcmp(optarg, "churn") == 0 ? CHURN : strcmp(optarg, "steady") == 0 ? STEADY : RAMP; break;
+            case 'c': connections = atoi(optarg); break;
+            case 'T': threads = atoi(optarg); break;
+            case 'r': connect_rate = atof(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'm': rate = atof(optarg); break;
+            case 'n': rooms = atoi(optarg); break;
+            case 'q': qos = atoi(optarg); break;
+            case 'k': churn_rate = atof(optarg); break;
+            case 'i': inflight = atoi(optarg); break;
+            case 'K': keepalive = atoi(optarg); break;
+            case 'S': sources = atoi(optarg); break;
+            case 't': snprintf(topic_filter, sizeof(topic_filter), "%s", optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(connections <= 0 || threads <= 0 || threads > connections || connect_rate <= 0 || seconds <= 0 ||
+       rate <= 0 || rooms <= 0 || qos < 0 || qos > 1 || inflight <= 0 || keepalive < 0 || sources < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(getaddrinfo(config_mqtt_host(), NULL, &hints, &ai) != 0) {
+        fprintf(stderr, "Error: cannot resolve %s\n", config_mqtt_host());
+        return 1;
+    }
+    broker = *(struct sockaddr_in *)ai->ai_addr;
+    broker.sin_port = htons(config_mqtt_port());
+    freeaddrinfo(ai);
+    // spread the connections over local addresses, for a broker on the loopback interface
+    if(sources == 0 && (ntohl(broker.sin_addr.s_addr) >> 24) == 127)
+        sources = connections / PORTS_PER_SOURCE + 1;
+    if((ntohl(broker.sin_addr.s_addr) >> 24) != 127)
+        sources = 0;
+
+    // one descriptor per connection
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if(limit.rlim_cur < (rlim_t)connections + threads + 64) {
+        fprintf(stderr, "Error: %d connections need a larger open file limit (ulimit -n, now %lu)\n",
+                connections, (unsigned long)limit.rlim_cur);
+        return 1;
+    }
+
+    loops = calloc(threads, sizeof(struct loop));
+    if(loops == NULL)
+        return 1;
+    for(int t=0; t<threads; t++) {
+        struct loop *l = &loops[t];
+        l->id = t;
+        l->count = connections / threads + (t < connections % threads);
+        l->conns = calloc(l->count, sizeof(struct conn));
+        l->epfd = epoll_create1(0);
+        l->random = 2463534242u + t;
+        if(l->conns == NULL || l->epfd < 0) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            return 1;
+        }
+        for(int i=l->count - 1; i>=0; i--) {
+            l->conns[i].fd = -1;
+            l->conns[i].next_idle = i == l->count - 1 ? -1 : i + 1;
+        }
+        l->idle = 0;
+    }
+
+    int pub_fd = publisher_connect();
+    if(pub_fd < 0) {
+        fprintf(stderr, "Error: cannot connect to the broker %s:%d\n", config_mqtt_host(), config_mqtt_port());
+        return 1;
+    }
+
+    start_ns = now_ns();
+    if(scenario == RAMP)
+        atomic_store(&measuring, 1);
+    for(int t=0; t<threads; t++)
+        pthread_create(&loops[t].thread, NULL, loop_main, &loops[t]);
+
+    // steady and churn: everyone joins before the measurement (at most two minutes)
+    if(scenario != RAMP) {
+        for(int i=0; i<1200 && atomic_load(&subscribed) < connections; i++)
+            usleep(100000);
+        fprintf(stderr, "%ld of %d subscribed after %.1f s\n", atomic_load(&subscribed), connections, (now_ns() - start_ns) / 1e9);
+        start_ns = now_ns();
+        atomic_store(&measuring, 1);
+    }
+
+    pthread_t publisher;
+    pthread_create(&publisher, NULL, publisher_main, &pub_fd);
+
+    // one line of the timeline per second, until 'seconds' after everyone joined
+    double total = seconds + (scenario == RAMP ? connections / connect_rate : 0);
+    unsigned long last[3] = { 0, 0, 0 };
+    while(seconds_run < MAX_TIMELINE && seconds_run < total) {
+        struct timespec wake;
+        long next = start_ns + (seconds_run + 1) * 1000000000L;
+        wake.tv_sec = next / 1000000000L;
+        wake.tv_nsec = next % 1000000000L;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+
+        unsigned long now[3] = { 0, 0, 0 };
+        for(int t=0; t<threads; t++) {
+            now[0] += atomic_load(&loops[t].deliveries);
+            now[1] += atomic_load(&loops[t].connects);
+            now[2] += atomic_load(&loops[t].failures);
+        }
+        timeline[seconds_run][0] = atomic_load(&subscribed);
+        for(int k=0; k<3; k++) {
+            timeline[seconds_run][k + 1] = now[k] - last[k];
+            last[k] = now[k];
+        }
+        seconds_run++;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    atomic_store(&stop_publisher, 1);
+    pthread_join(publisher, NULL);
+    // the readings still on their way
+    usleep(200000);
+    atomic_store(&stop, 1);
+    for(int t=0; t<threads; t++)
+        pthread_join(loops[t].thread, NULL);
+
+    struct histogram *latency = calloc(4, sizeof(struct histogram));
+    unsigned long *received = malloc(connections * sizeof(unsigned long));
+    unsigned long *mean = malloc(connections * sizeof(unsigned long));
+    unsigned long *worst = malloc(connections * sizeof(unsigned long));
+    unsigned long deliveries = 0, attempts = 0, connects = 0, failures = 0, refused = 0, dropped = 0, churned = 0;
+    unsigned long oversized = 0, send_errors = 0;
+    long spread = 0;
+    if(latency == NULL || received == NULL || mean == NULL || worst == NULL)
+        return 1;
+
+    for(int t=0; t<threads; t++) {
+        struct loop *l = &loops[t];
+        hist_merge(&latency[0], &l->latency);
+        hist_merge(&latency[1], &l->connack);
+        hist_merge(&latency[2], &l->suback);
+        hist_merge(&latency[3], &l->resubscribe);
+        deliveries += l->deliveries;
+        attempts += l->attempts;
+        connects += l->connects;
+        failures += l->failures;
+        refused += l->refused;
+        dropped += l->dropped;
+        churned += l->churned;
+        oversized += l->oversized;
+        send_errors += l->send_errors;
+        for(int i=0; i<l->count; i++) {
+            struct conn *c = &l->conns[i];
+            if(c->state != SUBSCRIBED)
+                continue;
+            received[spread] = c->received;
+            mean[spread] = c->received ? c->latency_sum_us / c->received : 0;
+            worst[spread] = c->latency_max_us;
+            spread++;
+        }
+    }
+
+    const char *names[] = { "ramp", "steady", "churn" };
+    unsigned long exp = atomic_load(&expected);
+    printf("{\n");
+    printf("  \"scenario\": \"%s\",\n", names[scenario]);
+    printf("  \"connections\": %d, \"threads\": %d, \"sources\": %d, \"qos\": %d, \"keepalive\": %d,\n",
+           connections, threads, sources, qos, keepalive);
+    printf("  \"seconds\": %.1f,\n", elapsed);
+    printf("  \"publish\": { \"rate\": %.1f, \"rooms\": %d, \"published\": %lu },\n", rate, rooms, atomic_load(&published));
+    printf("  \"fanout\": { \"deliveries\": %lu, \"deliveries_per_sec\": %.1f, \"expected\": %lu, \"delivery_ratio\": %.6f },\n",
+           deliveries, deliveries / elapsed, exp, exp ? (double)deliveries / exp : 0.0);
+    printf("  ");
+    print_hist("latency_us", &latency[0], ",\n");
+    printf("  \"per_connection\": { \"connections\": %ld, ", spread);
+    print_spread("received", received, spread, ", ");
+    print_spread("mean_latency_us", mean, spread, ", ");
+    print_spread("max_latency_us", worst, spread, " },\n");
+    printf("  \"connect\": { \"attempts\": %lu, \"subscribed\": %lu, \"failures\": %lu, \"refused\": %lu, \"dropped\": %lu, "
+           "\"send_errors\": %lu, \"oversized\": %lu,\n    ", attempts, connects, failures, refused, dropped, send_errors, oversized);
+    print_hist("connack_us", &latency[1], ",\n    ");
+    print_hist("suback_us", &latency[2], " },\n");
+    printf("  \"churn\": { \"rate\": %.1f, \"churned\": %lu, ", scenario == CHURN ? churn_rate : 0.0, churned);
+    print_hist("resubscribe_us", &latency[3], " },\n");
+    printf("  \"timeline\": [\n");
+    for(int s=0; s<seconds_run; s++) {
+        printf("    { \"t\": %d, \"subscribed\": %lu, \"deliveries\": %lu, \"connects\": %lu, \"failures\": %lu }%s\n",
+               s + 1, timeline[s][0], timeline[s][1], timeline[s][2], timeline[s][3], s == seconds_run - 1 ? "" : ",");
+    }
+    printf("  ]\n");
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * This program measures the per-message cost of the publish and consume paths and checks that they
+ * do not allocate in steady state (make bench-hotpath).
+ *
+ * It replaces malloc() and friends with a counting allocator (the calls still go to glibc), runs every
+ * path for a warm-up of 'warmup' messages and then for 'messages' more, and reports the time per message
+ * and the heap allocations per message of the second part:
+ *      format      packet with sprintf + strlen, as the publisher used to build it
+ *      packet      packet with common/packet.c (preformatted header, cached timestamp)
+ *      split       consumer parsing of a packet with packet_split
+ *      pool        worker pool: submit on this thread, split on a worker thread, 64 rooms
+ *                  (the queue is filled to its limit once before, so all its buffers exist)
+ *      shm         packet + transport_publish into a shared-memory ring, split on the ring reader thread
+ * The MQTT backend is not measured: libmosquitto copies every published payload to the heap.
+ *
+ * It exits with 1 if a path other than 'format' allocated in steady state, or if packet_format does not write
+ * the decibel exactly like "%f" (random floats, halfway values that round to even, tiny negative values).
+ *
+ *      usage: bench_hotpath [-n messages] [-w warmup]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "packet.h"
+#include "shm_ring.h"
+#include "transport.h"
+#include "vclock.h"
+#include "worker_pool.h"
+
+#define ROOMS           64
+#define POOL_TOTAL      4096        // queue limit of the pool, and so its most buffers
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+_Atomic unsigned long allocations = 0;
+_Atomic long handled = 0;
+_Atomic long checksum = 0;
+_Atomic int hold = 0;
+
+
+// the counting allocator: every allocation of the process, on any thread
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    *ptr = __libc_memalign(align, size);
+    return *ptr == NULL ? 12 : 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_memalign(align, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * The consumer side of every path: what nth_313_sub does with a packet, without the printf.
+*/
+void consume(void *ctx, char *topic, char *payload, int payloadlen) {
+    char *fields[PACKET_FIELDS];
+
+    if(packet_split(payload, payloadlen, fields, PACKET_FIELDS) >= 8)
+        atomic_fetch_add_explicit(&checksum, atoi(fields[4]) + atol(fields[7]), memory_order_relaxed);
+    atomic_fetch_add_explicit(&handled, 1, memory_order_relaxed);
+}
+
+
+struct writer_state {
+    struct packet_writer writers[ROOMS];
+    time_t start;
+};
+
+
+int old_format(struct writer_state *w, char *buffer, long i) {
+    char timestamp[13];
+
+    vclock_timestamp(w->start + i / 1000, timestamp);
+    sprintf(buffer, "%s,%s,R%ld,%s,%d,%f,%d,%lu", "handong", "NTH", i % ROOMS, timestamp, (int)(i % 4), 40.0f + i % 50, 1, (unsigned long)i);
+    return strlen(buffer);
+}
+
+
+int new_format(struct writer_state *w, char *buffer, long i) {
+    return packet_format(&w->writers[i % ROOMS], buffer, w->start + i / 1000, i % 4, 40.0f + i % 50, 1, i);
+}
+
+
+/*
+ * This function checks the decibel field of packet_format against sprintf("%f") for 'count' values of every kind:
+ * random floats, n/128 (halfway between two millionths, which "%f" rounds to even) and small negative values.
+ * It prints the first mismatches and returns their number.
+*/
+long check_decibels(struct writer_state *w, long count) {
+    char packet[PACKET_MAX], expected[64];
+    char *field, *end;
+    uint32_t random = 313;
+    long mismatches = 0;
+    float value;
+
+    for(long i=0; i<count; i++) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        switch(i % 3) {
+            case 0: value = (random / 4294967296.0f) * 300.0f - 100.0f; break;
+            case 1: value = (int32_t)(random % 25600) / 128.0f - 50.0f; break;
+            default: value = -(random % 1000) * 1e-9f; break;
+        }
+
+        packet_format(&w->writers[0], packet, w->start, 0, value, 1, i);
+        field = packet;
+        for(int f=0; f<5; f++)
+            field = strchr(field, ',') + 1;
+        end = strchr(field, ',');
+        *end = '\0';
+        sprintf(expected, "%f", value);
+        if(strcmp(field, expected) != 0 && mismatches++ < 5)
+            fprintf(stderr, "decibel %.9g: packet %s, sprintf %s\n", value, field, expected);
+    }
+    return mismatches;
+}
+
+
+/*
+ * This function runs 'fn' for warmup + count messages and prints the time and allocations
+ * per message of the last 'count'. 'wait' is called at the end of both parts, to let the consumers catch up.
+ * It returns the allocations of the timed part.
+*/
+unsigned long run_path(const char *name, long warmup, long count, void (*fn)(void *ctx, long i), void (*wait)(void *ctx, long total), void *ctx) {
+    unsigned long allocs;
+    long start;
+
+    for(long i=0; i<warmup; i++)
+        fn(ctx, i);
+    if(wait != NULL)
+        wait(ctx, warmup);
+
+    allocs = atomic_load(&allocations);
+    start = now_ns();
+    for(long i=warmup; i<warmup + count; i++)
+        fn(ctx, i);
+    if(wait != NULL)
+        wait(ctx, warmup + count);
+    long elapsed = now_ns() - start;
+    allocs = atomic_load(&allocations) - allocs;
+
+    printf("%-8s %10.1f %12.4f %8lu\n", name, (double)elapsed / count, (double)allocs / count, allocs);
+    return allocs;
+}
+
+
+struct writer_state state;
+char packet[PACKET_MAX + 64];
+struct worker_pool *pool = NULL;
+struct transport *transport = NULL;
+
+
+void format_path(void *ctx, long i) { old_format(&state, packet, i); }
+void packet_path(void *ctx, long i) { new_format(&state, packet, i); }
+
+void split_path(void *ctx, long i) {
+    int len = new_format(&state, packet, i);
+    consume(NULL, NULL, packet, len);
+}
+
+void pool_path(void *ctx, long i) {
+    int len = new_format(&state, packet, i);
+    wp_submit(pool, packet, wp_room_key(packet, len), "handong/NTH/R", packet, len);
+}
+
+void pool_wait(void *ctx, long total) { wp_drain(pool); }
+
+void pool_consume(void *ctx, char *topic, char *payload, int payloadlen) {
+    while(atomic_load(&hold))
+        usleep(100);
+    consume(ctx, topic, payload, payloadlen);
+}
+
+void shm_path(void *ctx, long i) {
+    int len = new_format(&state, packet, i);
+    transport_publish(transport, "bench/hotpath", len, packet, 0, false);
+}
+
+void shm_wait(void *ctx, long total) {
+    struct transport_stats stats;
+
+    // the reader thread needs the CPU on a single core host
+    do {
+        usleep(1000);
+        transport_get_stats(transport, &stats);
+    } while(stats.shm_received + stats.shm_lost < (unsigned long)total);
+}
+
+
+int main(int argc, char *argv[]) {
+    long messages = 1000000, warmup = 100000;
+    char ring[64], room[8];
+    unsigned long steady = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:w:")) != -1) {
+        switch(opt) {
+            case 'n': messages = atol(optarg); break;
+            case 'w': warmup = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n messages] [-w warmup]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(messages <= 0 || warmup <= 0) {
+        fprintf(stderr, "usage: %s [-n messages] [-w warmup]\n", argv[0]);
+        return 1;
+    }
+
+    state.start = vclock_parse_usec("261019100000") / 1000000;
+    for(int r=0; r<ROOMS; r++) {
+        snprintf(room, sizeof(room), "R%d", r);
+        packet_writer_init(&state.writers[r], "handong", "NTH", room);
+    }
+
+    printf("path       ns/msg   allocs/msg   allocs\n");
+    run_path("format", warmup, messages, format_path, NULL, NULL);
+    steady += run_path("packet", warmup, messages, packet_path, NULL, NULL);
+    steady += run_path("split", warmup, messages, split_path, NULL, NULL);
+
+    pool = wp_create(1, 256, POOL_TOTAL, WP_BLOCK, pool_consume, NULL);
+    if(pool == NULL) {
+        fprintf(stderr, "Error: cannot create the worker pool\n");
+        return 1;
+    }
+    // fill the queue once while the worker waits: the pool never needs more buffers than that
+    atomic_store(&hold, 1);
+    for(long i=0; i<POOL_TOTAL; i++)
+        pool_path(NULL, i);
+    atomic_store(&hold, 0);
+    wp_drain(pool);
+    steady += run_path("pool", warmup, messages, pool_path, pool_wait, NULL);
+    wp_destroy(pool);
+
+    snprintf(ring, sizeof(ring), "/noise_hotpath_%d", (int)getpid());
+    transport = transport_create_shm(NULL, ring, "bench/#", consume, NULL);
+    if(transport == NULL || transport_subscribe(transport, "bench/#", 0) != 0) {
+        fprintf(stderr, "Error: cannot open the shared-memory ring %s\n", ring);
+        shm_ring_unlink(ring);
+        return 1;
+    }
+    steady += run_path("shm", warmup, messages, shm_path, shm_wait, NULL);
+    transport_destroy(transport);
+    shm_ring_unlink(ring);
+
+    long mismatches = check_decibels(&state, messages);
+
+    printf("\nsteady state: %s (%lu allocations in %ld messages per path)\n", steady == 0 ? "allocation free" : "FAIL", steady, messages);
+    printf("decibel field like \"%%f\": %s (%ld mismatches in %ld values)\n", mismatches == 0 ? "ok" : "FAIL", mismatches, messages);
+    return steady == 0 && mismatches == 0 ? 0 : 1;
+}
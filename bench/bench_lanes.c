@@ -0,0 +1,304 @@
+/*
+ * This program measures how long alerts wait behind log traffic, with one connection and with
+ * the priority lanes of common/transport.h (make bench-lanes).
+ *
+ * For each mode a sender publishes level 3 alerts at 'alert_rate' per second while a second thread
+ * floods the log topic with 'log_rate' logs per second (0 = as fast as it can), both through one transport:
+ *      shared  alerts and logs share the connection of the sender, like NOISE_LANES=0
+ *      lanes   logs take the bulk lane (NOISE_LANES=1) with 'queue' messages before shedding
+ * A receiver subscribed to the alerts records their latency from the send time in the packet (9th field).
+ * The results (alert p50/p99/max, lost alerts, published and shed logs) are printed as a JSON object.
+ *
+ * It uses the broker of NOISE_MQTT_HOST/NOISE_MQTT_PORT.
+ *
+ *      usage: bench_lanes [-m shared|lanes|both] [-a alert_rate] [-l log_rate] [-d seconds] [-s log_size] [-q queue]
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "packet.h"
+#include "transport.h"
+
+#define ALERT_TOPIC     "bench/alerts/313"
+#define LOG_TOPIC       "bench/logs/pub"
+
+struct result {
+    long alerts_sent;
+    long alerts_received;
+    double p50_ms, p99_ms, max_ms;
+    unsigned long logs_published;
+    unsigned long logs_shed;
+};
+
+// receiver side, on its network thread
+long *latencies = NULL;
+long capacity = 0;
+_Atomic long received = 0;
+_Atomic int subscribed = 0;
+
+// log flood
+struct transport *transport = NULL;
+_Atomic int flooding = 0;
+_Atomic unsigned long logs_sent = 0;
+double log_rate = 0;
+int log_size = 200;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+
+void sleep_until(long ns) {
+    struct timespec wake = { ns / 1000000000L, ns % 1000000000L };
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+}
+
+
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    long now = now_ns();
+    char *field = strrchr(msg->payload, ',');
+    long n = atomic_load(&received);
+
+    if(field == NULL)
+        return;
+    if(n < capacity)
+        latencies[n] = now - strtol(field + 1, NULL, 10);
+    atomic_store(&received, n + 1);
+}
+
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+    atomic_store(&subscribed, 1);
+}
+
+
+/*
+ * This function connects a client to the broker and starts its network thread. It returns NULL if there is no broker.
+*/
+struct mosquitto *connect_broker(void)
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+
+    if(mosq == NULL)
+        return NULL;
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    mosquitto_message_callback_set(mosq, on_message);
+
+    if(mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60) != MOSQ_ERR_SUCCESS ||
+       mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+    return mosq;
+}
+
+
+void close_broker(struct mosquitto *mosq)
+{
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+}
+
+
+/*
+ * This function is the log flood: 'log_size' byte logs at 'log_rate' per second until the round ends.
+*/
+void *flood_main(void *arg)
+{
+    char *log = malloc(log_size);
+    long interval = log_rate > 0 ? (long)(1e9 / log_rate) : 0;
+    long next = now_ns();
+
+    if(log == NULL)
+        return NULL;
+    memset(log, 'x', log_size);
+
+    while(atomic_load(&flooding)) {
+        if(interval > 0) {
+            sleep_until(next);
+            next += interval;
+        }
+        transport_publish(transport, LOG_TOPIC, log_size, log, 1, false);
+        atomic_fetch_add(&logs_sent, 1);
+    }
+    free(log);
+    return NULL;
+}
+
+
+/*
+ * This function runs one mode for 'seconds' and fills 'result'. It returns 0 on success.
+*/
+int run_round(int lanes, double alert_rate, double seconds, int queue, struct result *result)
+{
+    struct mosquitto *receiver, *sender;
+    struct transport_stats stats;
+    struct packet_writer writer;
+    char packet[PACKET_MAX + 24];
+    pthread_t flood;
+    long count = (long)(alert_rate * seconds);
+
+    memset(result, 0, sizeof(*result));
+    capacity = count;
+    latencies = malloc(capacity * sizeof(long));
+    atomic_store(&received, 0);
+    atomic_store(&subscribed, 0);
+    atomic_store(&logs_sent, 0);
+    if(latencies == NULL || (receiver = connect_broker()) == NULL)
+        return -1;
+
+    mosquitto_subscribe(receiver, NULL, "bench/alerts/#", 1);
+    for(int i=0; i<500 && !atomic_load(&subscribed); i++)
+        usleep(10000);
+
+    if(!atomic_load(&subscribed) || (sender = connect_broker()) == NULL) {
+        close_broker(receiver);
+        return -1;
+    }
+    transport = transport_create_shm(sender, NULL, NULL, NULL, NULL);
+    if(transport == NULL || (lanes && transport_open_bulk(transport, "bench/logs/#", 10, queue) != MOSQ_ERR_SUCCESS)) {
+        close_broker(receiver);
+        close_broker(sender);
+        return -1;
+    }
+
+    atomic_store(&flooding, 1);
+    if(pthread_create(&flood, NULL, flood_main, NULL) != 0)
+        return -1;
+    // let the log queue build up before the first alert
+    usleep(500000);
+
+    packet_writer_init(&writer, "handong", "BENCH", "313");
+    long interval = (long)(1e9 / alert_rate), next = now_ns();
+    for(long i=0; i<count; i++) {
+        sleep_until(next);
+        next += interval;
+
+        int len = packet_format(&writer, packet, time(NULL), 3, 95.0f, 1, i + 1);
+        len += snprintf(packet + len, sizeof(packet) - len, ",%ld", now_ns());
+        if(transport_publish(transport, ALERT_TOPIC, len, packet, 1, false) == MOSQ_ERR_SUCCESS)
+            result->alerts_sent++;
+    }
+
+    atomic_store(&flooding, 0);
+    pthread_join(flood, NULL);
+    transport_get_stats(transport, &stats);
+
+    // alerts still queued behind the logs arrive late; wait for them up to 30 sec
+    for(int i=0; i<3000 && atomic_load(&received) < result->alerts_sent; i++)
+        usleep(10000);
+
+    result->alerts_received = atomic_load(&received);
+    long kept = result->alerts_received < capacity ? result->alerts_received : capacity;
+    qsort(latencies, kept, sizeof(long), compare_long);
+    if(kept > 0) {
+        result->p50_ms = latencies[kept / 2] / 1e6;
+        result->p99_ms = latencies[(long)(kept * 0.99)] / 1e6;
+        result->max_ms = latencies[kept - 1] / 1e6;
+    }
+    result->logs_published = lanes ? stats.bulk_published : atomic_load(&logs_sent);
+    result->logs_shed = stats.bulk_shed;
+
+    close_broker(receiver);
+    transport_destroy(transport);
+    close_broker(sender);
+    free(latencies);
+    return 0;
+}
+
+
+void print_round(const char *name, const struct result *r, int last)
+{
+    printf("    \"%s\": {\n", name);
+    printf("      \"alerts_sent\": %ld,\n", r->alerts_sent);
+    printf("      \"alerts_received\": %ld,\n", r->alerts_received);
+    printf("      \"alert_p50_ms\": %.2f,\n", r->p50_ms);
+    printf("      \"alert_p99_ms\": %.2f,\n", r->p99_ms);
+    printf("      \"alert_max_ms\": %.2f,\n", r->max_ms);
+    printf("      \"logs_published\": %lu,\n", r->logs_published);
+    printf("      \"logs_shed\": %lu\n", r->logs_shed);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m shared|lanes|both] [-a alert_rate] [-l log_rate] [-d seconds] [-s log_size] [-q queue]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *mode = "both";
+    double alert_rate = 100, seconds = 10;
+    int queue = 1000, opt;
+    struct result shared, lanes;
+
+    log_rate = 20000;
+    while((opt = getopt(argc, argv, "m:a:l:d:s:q:")) != -1) {
+        switch(opt) {
+            case 'm': mode = optarg; break;
+            case 'a': alert_rate = atof(optarg); break;
+            case 'l': log_rate = atof(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 's': log_size = atoi(optarg); break;
+            case 'q': queue = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    int run_shared = strcmp(mode, "shared") == 0 || strcmp(mode, "both") == 0;
+    int run_lanes = strcmp(mode, "lanes") == 0 || strcmp(mode, "both") == 0;
+    if((!run_shared && !run_lanes) || alert_rate <= 0 || seconds <= 0 || log_rate < 0 || log_size <= 0 || queue <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mosquitto_lib_init();
+    if(run_shared && run_round(0, alert_rate, seconds, queue, &shared) != 0) {
+        fprintf(stderr, "Error: no broker at %s:%d\n", config_mqtt_host(), config_mqtt_port());
+        return 1;
+    }
+    if(run_lanes && run_round(1, alert_rate, seconds, queue, &lanes) != 0) {
+        fprintf(stderr, "Error: no broker at %s:%d\n", config_mqtt_host(), config_mqtt_port());
+        return 1;
+    }
+    mosquitto_lib_cleanup();
+
+    printf("{\n");
+    printf("  \"alerts_per_sec\": %.0f,\n", alert_rate);
+    printf("  \"logs_per_sec\": %.0f,\n", log_rate);
+    printf("  \"log_bytes\": %d,\n", log_size);
+    printf("  \"seconds\": %.1f,\n", seconds);
+    printf("  \"bulk_queue\": %d,\n", queue);
+    printf("  \"modes\": {\n");
+    if(run_shared)
+        print_round("shared", &shared, !run_lanes);
+    if(run_lanes)
+        print_round("lanes", &lanes, 1);
+    printf("  }\n");
+    printf("}\n");
+    return 0;
+}
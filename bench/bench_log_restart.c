@@ -0,0 +1,315 @@
+/*
+ * This program measures how fast admin_logs is back after a restart with a durable log store
+ * (common/log_store.h), and checks the store after torn and damaged files (make bench-logstore).
+ *
+ * Restart: for every volume, a store gets 'volume' logs of 'rooms' rooms, with a checkpoint 'tail' logs
+ * before the end, and is then left without a checkpoint, like after a crash. It is opened again:
+ *      restart_ms      from log_store_open() until the first new log is appended (load the checkpoint,
+ *                      replay the tail)
+ *      rebuild_ms      the same without the checkpoint files (every segment is replayed)
+ *      checkpoint_bytes  size of the checkpoint
+ * The segments are in the page cache for both, so rebuild_ms is the best case of a rebuild.
+ *
+ * Corruption: a small store, with two checkpoints, is damaged in one way per case and opened again.
+ * Every case has to load from the expected source and come back with the same rollups as before:
+ *      torn_checkpoint     index.ckpt cut in half             -> previous checkpoint
+ *      damaged_checkpoint  one byte of index.ckpt changed     -> previous checkpoint
+ *      both_damaged        both checkpoints cut               -> rebuilt from the segments
+ *      torn_record         half a record after the last one   -> checkpoint, the half record cut off
+ *      leftover_tmp        a torn index.ckpt.tmp (crash while writing a checkpoint) -> checkpoint
+ * The program exits with 1 if a case fails.
+ *
+ *      usage: bench_log_restart [-d dir] [-n volume,volume,...] [-r rooms] [-t tail]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "log_store.h"
+
+#define MAX_VOLUMES     16
+
+int rooms = 1000;
+long tail = 10000;
+
+
+double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+/*
+ * This function appends log 'i': one reading of every room per second, some of them alerts.
+*/
+int append_log(struct log_store *store, long i)
+{
+    char location[16], room[16], timestamp[24], level[8], decibel[16], health[4], seq[24];
+    char institution[] = "handong", epoch[] = "1700000000";
+    char *fields[PACKET_FIELDS] = { institution, location, room, timestamp, level, decibel, health, seq, epoch };
+    long second = i / rooms;
+
+    snprintf(location, sizeof(location), "B%d", (int)(i % rooms) / 100);
+    snprintf(room, sizeof(room), "%d", (int)(i % rooms));
+    snprintf(timestamp, sizeof(timestamp), "2306%02ld%02ld%02ld%02ld", 1 + second / 86400 % 28, second / 3600 % 24, second / 60 % 60, second % 60);
+    snprintf(level, sizeof(level), "%d", i % 97 == 0 ? -1 : (int)(i % 4));
+    snprintf(decibel, sizeof(decibel), "%.6f", 30.0 + (i * 7919 % 7000) / 100.0);
+    snprintf(health, sizeof(health), "%d", i % 1013 != 0);
+    snprintf(seq, sizeof(seq), "%ld", second + 1);
+    return log_store_append(store, i % 97 == 0 ? LOG_PUB_ALERTS : LOG_PUB_READINGS, fields, PACKET_FIELDS);
+}
+
+
+/*
+ * This function returns a digest of the rollups of all rooms, to compare a store before and after a restart.
+*/
+unsigned long long digest(struct log_store *store)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    struct log_room rollup;
+    char key[PACKET_ROOM_LEN];
+
+    for(int r=0; r<rooms; r++) {
+        snprintf(key, sizeof(key), "handong/B%d/%d", r / 100, r);
+        if(log_store_room(store, key, &rollup) != 0)
+            continue;
+        unsigned long long values[] = { rollup.head, rollup.count, rollup.unhealthy, rollup.levels[0], rollup.levels[4],
+                                        (unsigned long long)(rollup.decibel_sum * 1000), rollup.first_time, rollup.last_time };
+        for(int i=0; i<(int)(sizeof(values) / sizeof(values[0])); i++)
+            hash = (hash ^ values[i]) * 1099511628211ull;
+    }
+    return hash ^ log_store_records(store);
+}
+
+
+/*
+ * This function makes a store of 'volume' logs in 'dir' and leaves it like a crash: checkpoints after half
+ * of the logs and 'tail' logs before the end, the rest only in the segments. It returns the digest.
+*/
+int make_store(const char *dir, long volume, unsigned long long *sum)
+{
+    struct log_store store;
+    char command[600];
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if(system(command) != 0 || log_store_open(&store, dir) != 0)
+        return -1;
+    for(long i=0; i<volume; i++) {
+        if(append_log(&store, i) != 0)
+            return -1;
+        if(i + 1 == volume / 2 || i + 1 == volume - tail)
+            log_store_checkpoint(&store);
+    }
+    *sum = digest(&store);
+    log_store_close(&store, 0);
+    return 0;
+}
+
+
+/*
+ * This function opens the store and appends one log, like admin_logs starting up. It returns the time in ms.
+*/
+double restart(const char *dir, long next, struct log_store_stats *stats, unsigned long long *sum)
+{
+    struct log_store store;
+    double start = now_ms();
+
+    if(log_store_open(&store, dir) != 0)
+        return -1;
+    double ms = now_ms() - start;
+    *sum = digest(&store);
+    start = now_ms();
+    if(append_log(&store, next) != 0) {
+        log_store_close(&store, 0);
+        return -1;
+    }
+    ms += now_ms() - start;
+    *stats = store.stats;
+    log_store_close(&store, 0);
+    return ms;
+}
+
+
+long file_size(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+
+void cut_file(const char *path, long size)
+{
+    if(truncate(path, size) != 0)
+        perror(path);
+}
+
+
+void change_byte(const char *path, long offset)
+{
+    int fd = open(path, O_RDWR);
+    unsigned char c = 0;
+
+    if(fd >= 0 && pread(fd, &c, 1, offset) == 1) {
+        c ^= 0x5a;
+        if(pwrite(fd, &c, 1, offset) != 1)
+            perror(path);
+    }
+    if(fd >= 0)
+        close(fd);
+}
+
+
+void append_bytes(const char *path, const char *bytes, int len)
+{
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+    if(fd < 0 || write(fd, bytes, len) != len)
+        perror(path);
+    if(fd >= 0)
+        close(fd);
+}
+
+
+/*
+ * This function runs one corruption case. It returns 1 if the store came back from 'expected' with the
+ * same rollups, else 0.
+*/
+int corruption_case(const char *name, const char *dir, long volume, enum log_origin expected, int last)
+{
+    static const char *const origins[] = { "checkpoint", "previous", "segments", "nothing" };
+    char ckpt[320], prev[320], tmp[320], segment[320];
+    struct log_store_stats stats;
+    unsigned long long before, after;
+
+    if(make_store(dir, volume, &before) != 0)
+        return 0;
+    snprintf(ckpt, sizeof(ckpt), "%s/index.ckpt", dir);
+    snprintf(prev, sizeof(prev), "%s/index.ckpt.prev", dir);
+    snprintf(tmp, sizeof(tmp), "%s/index.ckpt.tmp", dir);
+
+    if(strcmp(name, "torn_checkpoint") == 0)
+        cut_file(ckpt, file_size(ckpt) / 2);
+    else if(strcmp(name, "damaged_checkpoint") == 0)
+        change_byte(ckpt, file_size(ckpt) / 3);
+    else if(strcmp(name, "both_damaged") == 0) {
+        cut_file(ckpt, file_size(ckpt) / 2);
+        cut_file(prev, 100);
+    }
+    else if(strcmp(name, "torn_record") == 0) {
+        struct log_store store;
+        // the last segment is the one the next log goes to
+        if(log_store_open(&store, dir) != 0)
+            return 0;
+        snprintf(segment, sizeof(segment), "%s/%08u.seg", dir, store.current);
+        log_store_close(&store, 0);
+        append_bytes(segment, "torn record torn record torn record torn record", LOG_RECORD_SIZE / 2);
+    }
+    else if(strcmp(name, "leftover_tmp") == 0)
+        append_bytes(tmp, "NOLG", 4);
+
+    double ms = restart(dir, volume, &stats, &after);
+    int ok = ms >= 0 && stats.origin == expected && after == before &&
+             (strcmp(name, "torn_record") != 0 || stats.truncated == LOG_RECORD_SIZE / 2);
+
+    printf("    \"%s\": { \"ok\": %s, \"origin\": \"%s\", \"replayed\": %llu, \"truncated_bytes\": %llu, \"restart_ms\": %.2f }%s\n",
+           name, ok ? "true" : "false", ms >= 0 ? origins[stats.origin] : "error", (unsigned long long)stats.replayed,
+           (unsigned long long)stats.truncated, ms, last ? "" : ",");
+    return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+    long volumes[MAX_VOLUMES] = { 100000, 1000000, 4000000 };
+    int nvolumes = 3, opt, failed = 0;
+    const char *base = "/tmp/noise_log_restart";
+    char dir[300], path[320], command[600];
+    char *save = NULL;
+
+    while((opt = getopt(argc, argv, "d:n:r:t:")) != -1) {
+        switch(opt) {
+            case 'd': base = optarg; break;
+            case 'n':
+                nvolumes = 0;
+                for(char *p = strtok_r(optarg, ",", &save); p != NULL && nvolumes < MAX_VOLUMES; p = strtok_r(NULL, ",", &save))
+                    volumes[nvolumes++] = atol(p);
+                break;
+            case 'r': rooms = atoi(optarg); break;
+            case 't': tail = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-d dir] [-n volume,volume,...] [-r rooms] [-t tail]\n", argv[0]);
+                return 1;
+        }
+    }
+    for(int i=0; i<nvolumes; i++) {
+        if(volumes[i] <= tail * 2)
+            nvolumes = 0;
+    }
+    if(nvolumes == 0 || rooms < 1 || rooms > 100000 || tail < 1) {
+        fprintf(stderr, "usage: %s [-d dir] [-n volume,volume,...] [-r rooms] [-t tail], volumes above 2 * tail\n", argv[0]);
+        return 1;
+    }
+    // checkpoints only where the benchmark writes them
+    setenv("NOISE_LOG_CHECKPOINT_SEC", "0", 1);
+    mkdir(base, 0755);
+
+    printf("{\n");
+    printf("  \"rooms\": %d,\n", rooms);
+    printf("  \"tail\": %ld,\n", tail);
+    printf("  \"restart\": [\n");
+    for(int v=0; v<nvolumes; v++) {
+        struct log_store_stats warm, cold;
+        unsigned long long before, after_warm, after_cold;
+
+        snprintf(dir, sizeof(dir), "%s/restart", base);
+        fprintf(stderr, "bench_log_restart: %ld logs\n", volumes[v]);
+        if(make_store(dir, volumes[v], &before) != 0) {
+            fprintf(stderr, "Error: cannot write the store in %s\n", dir);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s/index.ckpt", dir);
+        long checkpoint_bytes = file_size(path);
+
+        double restart_ms = restart(dir, volumes[v], &warm, &after_warm);
+
+        // without the checkpoints: the index is rebuilt from every segment
+        snprintf(command, sizeof(command), "rm -f '%s'/index.ckpt*", dir);
+        if(system(command) != 0)
+            return 1;
+        double rebuild_ms = restart(dir, volumes[v] + 1, &cold, &after_cold);
+
+        int ok = restart_ms >= 0 && rebuild_ms >= 0 && after_warm == before && warm.origin == LOG_FROM_CHECKPOINT &&
+                 cold.origin == LOG_FROM_SEGMENTS;
+        failed |= !ok;
+        printf("    { \"logs\": %ld, \"ok\": %s, \"segment_bytes\": %ld, \"checkpoint_bytes\": %ld, \"restart_ms\": %.2f, \"replayed\": %llu, "
+               "\"rebuild_ms\": %.2f, \"rebuild_replayed\": %llu }%s\n",
+               volumes[v], ok ? "true" : "false", volumes[v] * LOG_RECORD_SIZE, checkpoint_bytes, restart_ms,
+               (unsigned long long)warm.replayed, rebuild_ms, (unsigned long long)cold.replayed, v == nvolumes - 1 ? "" : ",");
+        fflush(stdout);
+    }
+    printf("  ],\n");
+
+    long small = volumes[0] < 200000 ? volumes[0] : 200000;
+    snprintf(dir, sizeof(dir), "%s/corruption", base);
+    printf("  \"corruption\": {\n");
+    failed |= !corruption_case("torn_checkpoint", dir, small, LOG_FROM_PREVIOUS, 0);
+    failed |= !corruption_case("damaged_checkpoint", dir, small, LOG_FROM_PREVIOUS, 0);
+    failed |= !corruption_case("both_damaged", dir, small, LOG_FROM_SEGMENTS, 0);
+    failed |= !corruption_case("torn_record", dir, small, LOG_FROM_CHECKPOINT, 0);
+    failed |= !corruption_case("leftover_tmp", dir, small, LOG_FROM_CHECKPOINT, 1);
+    printf("  }\n");
+    printf("}\n");
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", base);
+    if(system(command) != 0)
+        return 1;
+    return failed;
+}
@@ -0,0 +1,147 @@
+/*
+ * This program measures how the worker pool (common/worker_pool.c) scales with the number of threads.
+ *
+ * One thread plays the role of the libmosquitto network thread and submits noise packets for
+ * 'rooms' rooms round robin. The handler tokenizes the packet like the consumers do, checks that the
+ * messages of each room arrive in order, and then spins for 'work' microseconds to stand in for the
+ * rest of the handler (echo publish, output).
+ *
+ *      usage: bench_pool [-m messages] [-r rooms] [-w work_usec] [-q room_limit] [-t max_threads]
+ *
+ * It prints one line per thread count (1, 2, 4, ... max_threads) with the throughput, the speedup
+ * against one thread, and the number of messages that were handled out of order (must be 0).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "worker_pool.h"
+
+struct bench_ctx {
+    long *last_seq;         // last sequence number handled per room
+    atomic_long out_of_order;
+    long work_ns;
+};
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * The handler: tokenize the packet, check the order of the room and simulate the remaining work.
+*/
+void handle_packet(void *obj, char *topic, char *payload, int payloadlen) {
+    struct bench_ctx *ctx = obj;
+    char *tokens[8];
+    char *save = NULL;
+    int index = 0;
+
+    char *token = strtok_r(payload, ",", &save);
+    while(token != NULL && index < 8) {
+        tokens[index++] = token;
+        token = strtok_r(NULL, ",", &save);
+    }
+    if(index < 8)
+        return;
+
+    int room = atoi(tokens[2]);
+    long seq = atol(tokens[7]);
+    if(ctx->last_seq[room] != seq - 1)
+        atomic_fetch_add(&ctx->out_of_order, 1);
+    ctx->last_seq[room] = seq;
+
+    long until = now_ns() + ctx->work_ns;
+    while(now_ns() < until);
+}
+
+
+/*
+ * This function runs one measurement and returns the throughput in messages per second.
+*/
+double run(int threads, long messages, int rooms, int room_limit, long work_ns, long *out_of_order) {
+    struct bench_ctx ctx;
+    struct worker_pool *pool;
+    char payload[128];
+    char topic[40];
+    long *seq = calloc(rooms, sizeof(long));
+
+    ctx.last_seq = calloc(rooms, sizeof(long));
+    atomic_init(&ctx.out_of_order, 0);
+    ctx.work_ns = work_ns;
+
+    pool = wp_create(threads, room_limit, room_limit * rooms, WP_BLOCK, handle_packet, &ctx);
+    if(pool == NULL || seq == NULL || ctx.last_seq == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(1);
+    }
+
+    long start = now_ns();
+    for(long i=0; i<messages; i++) {
+        int room = i % rooms;
+        int len = snprintf(payload, sizeof(payload), "handong,NTH,%d,230601120000,2,70.500000,1,%ld", room, ++seq[room]);
+        snprintf(topic, sizeof(topic), "handong/NTH/%d", room);
+        wp_submit(pool, payload, wp_room_key(payload, len), topic, payload, len);
+    }
+    wp_drain(pool);
+    long elapsed = now_ns() - start;
+
+    wp_destroy(pool);
+    *out_of_order = atomic_load(&ctx.out_of_order);
+    free(ctx.last_seq);
+    free(seq);
+
+    return messages * 1e9 / elapsed;
+}
+
+
+int main(int argc, char *argv[]) {
+    long messages = 200000;
+    int rooms = 256;
+    long work_usec = 5;
+    int room_limit = 64;
+    int max_threads = 16;
+    int opt;
+
+    while((opt = getopt(argc, argv, "m:r:w:q:t:")) != -1) {
+        switch(opt) {
+            case 'm': messages = atol(optarg); break;
+            case 'r': rooms = atoi(optarg); break;
+            case 'w': work_usec = atol(optarg); break;
+            case 'q': room_limit = atoi(optarg); break;
+            case 't': max_threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-m messages] [-r rooms] [-w work_usec] [-q room_limit] [-t max_threads]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("messages=%ld rooms=%d work=%ldus room_limit=%d cpus=%ld\n", messages, rooms, work_usec, room_limit, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("threads      msgs/s   speedup  out_of_order\n");
+
+    double base = 0.0;
+    long reordered = 0;
+    for(int threads=1; threads<=max_threads; threads*=2) {
+        long out_of_order;
+        double rate = run(threads, messages, rooms, room_limit, work_usec * 1000, &out_of_order);
+        if(threads == 1)
+            base = rate;
+        printf("%7d %11.0f %9.2f %13ld\n", threads, rate, rate / base, out_of_order);
+        reordered += out_of_order;
+    }
+
+    // the pool keeps the messages of a room in order, so any reordering is a failure
+    if(reordered > 0) {
+        fprintf(stderr, "Error: %ld messages were handled out of order\n", reordered);
+        return 1;
+    }
+    return 0;
+}
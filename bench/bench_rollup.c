@@ -0,0 +1,339 @@
+/*
+ * This program checks the rollups of the gateway (common/rollup.c) against exact values computed from the raw
+ * stream, and measures the cost of a reading.
+ *
+ * It generates a window of readings for 'institutions' institutions with 'locations' locations of 'rooms' rooms
+ * each: full and compact packets on the room topics, some of them in a warning level, and unhealthy readings on
+ * 'admin/alerts'. The stream goes
+ *  - through one gateway (rollup_add_reading()), and
+ *  - split between two edge gateways, whose location rollups are formatted (rollup_format()) and merged by a
+ *    central gateway (rollup_add_rollup()), like stacked gateways.
+ * Every rollup of the window (locations and institutions) of the single and of the central gateway is compared
+ * field by field with the exact values: count, mean, max, faults, the rooms in warning with their highest level,
+ * and the p50/p90/p99 of the sketch (within SKETCH_ALPHA). Readings and rollups with a scope that does not fit
+ * or does not match their topic have to be rejected. The program exits with 1 if a check fails.
+ *
+ *      usage: bench_rollup [-i institutions] [-l locations] [-r rooms] [-n readings_per_room]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "packet.h"
+#include "rollup.h"
+
+#define MAX_LOCATIONS   256
+#define MAX_ROOMS       256
+
+int ninstitutions = 2, nlocations = 5, nrooms = 20;
+long per_room = 60;
+
+// the exact values of every location
+struct exact {
+    char scope[ROLLUP_SCOPE_LEN];
+    unsigned long count;
+    unsigned long faults;
+    double sum;
+    double max;
+    int levels[MAX_ROOMS];          // highest warning level of a room, 0 if none
+    double *values;
+} exact[MAX_LOCATIONS];
+
+int failures = 0;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+void fail(const char *who, const char *scope, const char *what) {
+    fprintf(stderr, "%s: %s: %s\n", who, scope, what);
+    failures++;
+}
+
+
+/*
+ * This function compares a rollup with the exact values of the locations 'first' to 'last' (one location,
+ * or the locations of an institution). 'tolerance' is the error allowed on the mean (rollups of other gateways
+ * carry the mean with six decimals).
+*/
+void check(const char *who, const struct aggregate *agg, int first, int last, double tolerance) {
+    unsigned long count = 0, faults = 0, listed = 0;
+    double sum = 0.0, max = 0.0;
+    double *values;
+    long n = 0;
+
+    for(int l=first; l<=last; l++) {
+        if(exact[l].count > 0 && (count == 0 || exact[l].max > max))
+            max = exact[l].max;
+        count += exact[l].count;
+        faults += exact[l].faults;
+        sum += exact[l].sum;
+    }
+    if(agg->count != count)
+        fail(who, agg->scope, "count");
+    if(agg->faults != faults)
+        fail(who, agg->scope, "faults");
+    if(count > 0 && agg->max != max)
+        fail(who, agg->scope, "max");
+    if(count > 0 && fabs(agg->sum / agg->count - sum / count) > tolerance)
+        fail(who, agg->scope, "mean");
+
+    // the rooms in warning, with their highest level
+    for(int l=first; l<=last; l++) {
+        for(int r=0; r<nrooms; r++) {
+            char name[ROLLUP_ROOM_LEN];
+            int found = 0;
+
+            if(exact[l].levels[r] == 0)
+                continue;
+            listed++;
+            snprintf(name, sizeof(name), "%s/%d", exact[l].scope, r);
+            for(int i=0; i<agg->nrooms; i++)
+                found |= strcmp(agg->rooms[i].name, name) == 0 && agg->rooms[i].level == exact[l].levels[r];
+            if(!found)
+                fail(who, agg->scope, "room missing or at the wrong level");
+        }
+    }
+    if((unsigned long)agg->nrooms != listed)
+        fail(who, agg->scope, "rooms in warning");
+
+    // the quantiles, with the same rank as sketch_quantile()
+    values = malloc((count + 1) * sizeof(double));
+    for(int l=first; l<=last; l++) {
+        memcpy(values + n, exact[l].values, exact[l].count * sizeof(double));
+        n += exact[l].count;
+    }
+    qsort(values, n, sizeof(double), compare_double);
+    if(agg->sk.total != count)
+        fail(who, agg->scope, "sketch count");
+    for(int q=0; q<3 && n > 0; q++) {
+        static const double qs[] = { 0.5, 0.9, 0.99 };
+        double value = values[(long)(qs[q] * (n - 1))];
+        if(fabs(sketch_quantile(&agg->sk, qs[q]) - value) / value > SKETCH_ALPHA + 1e-9)
+            fail(who, agg->scope, "quantile");
+    }
+    free(values);
+}
+
+
+/*
+ * This function checks a closed window: one rollup per location, then one per institution.
+*/
+void check_window(const char *who, struct aggregate *closed, double tolerance) {
+    int rollups = 0;
+
+    for(struct aggregate *agg = closed; agg != NULL; agg = agg->next, rollups++) {
+        int l = 0, k = 0;
+
+        if(strchr(agg->scope, '/') != NULL) {
+            for(l=0; l<ninstitutions * nlocations && strcmp(exact[l].scope, agg->scope) != 0; l++);
+            if(l == ninstitutions * nlocations)
+                fail(who, agg->scope, "unknown location");
+            else
+                check(who, agg, l, l, tolerance);
+        }
+        else {
+            int n = strlen(agg->scope);
+            for(k=0; k<ninstitutions && (strncmp(exact[k * nlocations].scope, agg->scope, n) != 0 || exact[k * nlocations].scope[n] != '/'); k++);
+            if(k == ninstitutions)
+                fail(who, agg->scope, "unknown institution");
+            else
+                check(who, agg, k * nlocations, (k + 1) * nlocations - 1, tolerance);
+        }
+    }
+    if(rollups != ninstitutions * nlocations + ninstitutions)
+        fail(who, "window", "number of rollups");
+}
+
+
+/*
+ * This function returns a reading of a room: normally distributed around the room's own level,
+ * limited to the healthy range 1-100 like the publisher's averages.
+*/
+double reading(double mean) {
+    double u1 = (random() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (random() + 1.0) / (RAND_MAX + 2.0);
+    double value = mean + 8.0 * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+
+    if(value < 1.0)
+        value = 1.0;
+    if(value > 100.0)
+        value = 100.0;
+    return value;
+}
+
+
+/*
+ * This function moves the location rollups of an edge gateway to the central gateway, through their text.
+*/
+void forward(struct aggregate *closed, struct rollup_table *central) {
+    static char buffer[ROLLUP_MAX];
+
+    for(struct aggregate *agg = closed; agg != NULL; agg = agg->next) {
+        if(strchr(agg->scope, '/') == NULL)
+            continue;   // the central gateway subscribes to '<edge>/+/+', the locations only
+        if(rollup_format(buffer, sizeof(buffer), agg, "230601120000") < 0)
+            fail("edge", agg->scope, "rollup too large");
+        else
+            rollup_add_rollup(central, agg->scope, buffer);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    static struct rollup_table single, edges[2], central;
+    static char forged[ROLLUP_MAX];
+    char topic[128], payload[PACKET_MAX + 64], buffer[ROLLUP_MAX];
+    long readings = 0, add_ns = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "i:l:r:n:")) != -1) {
+        switch(opt) {
+            case 'i': ninstitutions = atoi(optarg); break;
+            case 'l': nlocations = atoi(optarg); break;
+            case 'r': nrooms = atoi(optarg); break;
+            case 'n': per_room = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-i institutions] [-l locations] [-r rooms] [-n readings_per_room]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(ninstitutions < 1 || nlocations < 1 || ninstitutions * nlocations > MAX_LOCATIONS || nrooms < 1 || nrooms > MAX_ROOMS ||
+       per_room < 1) {
+        fprintf(stderr, "usage: %s [-i institutions] [-l locations (%d in all)] [-r rooms (max %d)] [-n readings_per_room]\n",
+                argv[0], MAX_LOCATIONS, MAX_ROOMS);
+        return 1;
+    }
+
+    for(int l=0; l<ninstitutions * nlocations; l++) {
+        snprintf(exact[l].scope, sizeof(exact[l].scope), "inst%d/B%d", l / nlocations, l % nlocations);
+        exact[l].values = malloc(nrooms * per_room * sizeof(double));
+        if(exact[l].values == NULL) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            return 1;
+        }
+    }
+
+    // the raw stream, one reading of every room in turn
+    srandom(313);
+    double means[MAX_LOCATIONS][MAX_ROOMS];
+    for(int l=0; l<ninstitutions * nlocations; l++)
+        for(int r=0; r<nrooms; r++)
+            means[l][r] = 30.0 + 60.0 * random() / RAND_MAX;
+
+    for(long i=0; i<per_room; i++) {
+        for(int l=0; l<ninstitutions * nlocations; l++) {
+            for(int r=0; r<nrooms; r++, readings++) {
+                struct exact *e = &exact[l];
+                int health = random() % 50 != 0;
+                int level = health ? (int)(random() % 10) - 6 : -1;     // mostly quiet, some levels 1-3
+                char copy[sizeof(payload)];
+                int len;
+
+                if(level < 0 && health)
+                    level = 0;
+                // the decibel as it is in the packet
+                snprintf(payload, sizeof(payload), "%f", reading(means[l][r]));
+                double decibel = atof(payload);
+
+                if(!health) {
+                    snprintf(topic, sizeof(topic), "admin/alerts");
+                    len = snprintf(payload, sizeof(payload), "inst%d,B%d,%d,230601120000,-1,%f,0,%ld", l / nlocations, l % nlocations,
+                                   r, decibel, i + 1);
+                    e->faults++;
+                }
+                else if(readings % 3 == 0) {
+                    // compact: the room is in the topic
+                    snprintf(topic, sizeof(topic), "inst%d/B%d/%d", l / nlocations, l % nlocations, r);
+                    len = snprintf(payload, sizeof(payload), "230601120000,%d,%f,1,%ld", level, decibel, i + 1);
+                }
+                else {
+                    snprintf(topic, sizeof(topic), "inst%d/B%d/%d", l / nlocations, l % nlocations, r);
+                    len = snprintf(payload, sizeof(payload), "inst%d,B%d,%d,230601120000,%d,%f,1,%ld", l / nlocations, l % nlocations,
+                                   r, level, decibel, i + 1);
+                }
+                if(health) {
+                    if(e->count == 0 || decibel > e->max)
+                        e->max = decibel;
+                    e->values[e->count++] = decibel;
+                    e->sum += decibel;
+                    if(level > e->levels[r])
+                        e->levels[r] = level;
+                }
+
+                // parsing is in place
+                memcpy(copy, payload, len + 1);
+                long start = now_ns();
+                rollup_add_reading(&single, topic, copy, len);
+                add_ns += now_ns() - start;
+                memcpy(copy, payload, len + 1);
+                rollup_add_reading(&edges[readings % 2], topic, copy, len);
+            }
+        }
+    }
+
+    // a location that does not fit a scope is not truncated into another one
+    snprintf(topic, sizeof(topic), "admin/alerts");
+    int len = snprintf(payload, sizeof(payload), "an-institution-with-a-very-long-name,B0,1,230601120000,-1,50.0,0,1");
+    rollup_add_reading(&single, topic, payload, len);
+    if(single.rejected != 1)
+        fail("single", "an-institution-with-a-very-long-name/B0", "not rejected");
+
+    struct aggregate *closed = rollup_close_window(&single);
+    check_window("single", closed, 1e-9);
+    rollup_free_list(closed);
+
+    // stacked: two edges under a central gateway, and two rollups on a topic of another scope
+    for(int e=0; e<2; e++) {
+        closed = rollup_close_window(&edges[e]);
+        if(e == 0 && closed != NULL) {
+            if(rollup_format(buffer, sizeof(buffer), closed, "230601120000") < 0)
+                fail("edge", closed->scope, "rollup too large");
+            char *fields = strchr(buffer, ',');
+            snprintf(forged, sizeof(forged), "inst0%s", fields);
+            rollup_add_rollup(&central, "inst0", forged);
+            snprintf(forged, sizeof(forged), "other/B0%s", fields);
+            rollup_add_rollup(&central, closed->scope, forged);
+        }
+        forward(closed, &central);
+        rollup_free_list(closed);
+    }
+    if(central.rejected != 2)
+        fail("central", "inst0", "rollups of a wrong scope not rejected");
+
+    closed = rollup_close_window(&central);
+    check_window("central", closed, 1e-6);
+    rollup_free_list(closed);
+
+    // the next window starts empty
+    closed = rollup_close_window(&single);
+    if(closed != NULL)
+        fail("single", "window", "not cleared");
+
+    printf("readings: %ld, locations: %d, institutions: %d\n", readings, ninstitutions * nlocations, ninstitutions);
+    printf("rollup_add_reading: %.1f ns/reading\n", (double)add_ns / readings);
+    printf("single and stacked rollups against exact values: %s (%d failures)\n", failures ? "FAILED" : "ok", failures);
+
+    rollup_free(&single);
+    rollup_free(&edges[0]);
+    rollup_free(&edges[1]);
+    rollup_free(&central);
+    for(int l=0; l<ninstitutions * nlocations; l++)
+        free(exact[l].values);
+    return failures ? 1 : 0;
+}
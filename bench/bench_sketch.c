@@ -0,0 +1,161 @@
+/*
+ * This program checks the rollup sketch (common/sketch.c) against exact values and measures its cost.
+ *
+ * It generates a window of synthetic readings for 'locations' locations with 'rooms' rooms each,
+ * builds one sketch per location like the gateway does, merges the location sketches into the
+ * institution sketch, and compares the p50/p90/p99 of every sketch with the exact quantiles of the
+ * raw readings. The relative error must stay within SKETCH_ALPHA (the program exits with 1 if not).
+ *
+ *      usage: bench_sketch [-l locations] [-r rooms] [-n readings_per_room]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "sketch.h"
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * This function returns a reading of a room: normally distributed around the room's own level,
+ * limited to the healthy range 1-100 like the publisher's averages.
+*/
+double reading(double mean) {
+    double u1 = (random() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (random() + 1.0) / (RAND_MAX + 2.0);
+    double value = mean + 8.0 * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+
+    if(value < 1.0)
+        value = 1.0;
+    if(value > 100.0)
+        value = 100.0;
+    return value;
+}
+
+
+/*
+ * This function compares the quantiles of a sketch with the exact quantiles of the sorted values,
+ * using the same rank as sketch_quantile(). It returns the largest relative error.
+*/
+double check(const char *name, const struct sketch *sk, double *values, long count, int verbose) {
+    static const double qs[] = { 0.5, 0.9, 0.99 };
+    double worst = 0.0;
+
+    qsort(values, count, sizeof(double), compare_double);
+    for(int i=0; i<3; i++) {
+        double exact = values[(long)(qs[i] * (count - 1))];
+        double approx = sketch_quantile(sk, qs[i]);
+        double error = fabs(approx - exact) / exact;
+        if(error > worst)
+            worst = error;
+        if(verbose)
+            printf("%-14s p%-3.0f exact %8.3f  sketch %8.3f  error %.4f%%\n", name, qs[i] * 100, exact, approx, error * 100);
+    }
+    return worst;
+}
+
+
+int main(int argc, char *argv[]) {
+    int nlocations = 20, nrooms = 50;
+    long per_room = 60;
+    int opt;
+
+    while((opt = getopt(argc, argv, "l:r:n:")) != -1) {
+        switch(opt) {
+            case 'l': nlocations = atoi(optarg); break;
+            case 'r': nrooms = atoi(optarg); break;
+            case 'n': per_room = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-l locations] [-r rooms] [-n readings_per_room]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    long per_location = nrooms * per_room;
+    long total = per_location * nlocations;
+    struct sketch *sketches = malloc(nlocations * sizeof(struct sketch));
+    double *values = malloc(total * sizeof(double));
+    double *copy = malloc(total * sizeof(double));
+    struct sketch institution;
+    double worst = 0.0;
+    long add_ns = 0;
+
+    if(sketches == NULL || values == NULL || copy == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    srandom(313);
+    for(int l=0; l<nlocations; l++) {
+        for(int r=0; r<nrooms; r++) {
+            double mean = 30.0 + 60.0 * random() / RAND_MAX;    // quiet library ... lecture hall
+            for(long i=0; i<per_room; i++)
+                values[l * per_location + r * per_room + i] = reading(mean);
+        }
+    }
+
+    // the gateway side: one sketch per location, then the merge for the institution
+    for(int l=0; l<nlocations; l++) {
+        long start = now_ns();
+        sketch_init(&sketches[l]);
+        for(long i=0; i<per_location; i++)
+            sketch_add(&sketches[l], values[l * per_location + i]);
+        add_ns += now_ns() - start;
+    }
+
+    long start = now_ns();
+    sketch_init(&institution);
+    for(int l=0; l<nlocations; l++)
+        sketch_merge(&institution, &sketches[l]);
+    long merge_ns = now_ns() - start;
+
+    // round trip through the rollup text format, as a stacked gateway would receive it
+    char *text = malloc(SKETCH_BUCKETS * 16);
+    struct sketch decoded;
+    int encoded_len = sketch_encode(&institution, text, SKETCH_BUCKETS * 16);
+    if(encoded_len < 0 || sketch_decode(&decoded, text) != 0 || memcmp(decoded.counts, institution.counts, sizeof(decoded.counts)) != 0) {
+        fprintf(stderr, "Error: sketch does not survive encode/decode\n");
+        return 1;
+    }
+
+    // the exact side, computed from the raw stream
+    char name[32];
+    for(int l=0; l<nlocations; l++) {
+        memcpy(copy, values + l * per_location, per_location * sizeof(double));
+        snprintf(name, sizeof(name), "location %d", l);
+        double error = check(name, &sketches[l], copy, per_location, l < 3);
+        if(error > worst)
+            worst = error;
+    }
+    memcpy(copy, values, total * sizeof(double));
+    double error = check("institution", &institution, copy, total, 1);
+    if(error > worst)
+        worst = error;
+
+    printf("\nreadings: %ld, rollup messages: %d (fan-in reduction %.0fx)\n", total, nlocations + 1, (double)total / (nlocations + 1));
+    printf("sketch_add: %.1f ns/reading, sketch_merge: %.1f us/sketch, encoded institution sketch: %d bytes\n",
+           (double)add_ns / total, merge_ns / 1000.0 / nlocations, encoded_len);
+    printf("worst relative error: %.4f%% (bound %.2f%%)\n", worst * 100, SKETCH_ALPHA * 100);
+
+    free(text);
+    free(copy);
+    free(values);
+    free(sketches);
+    return worst <= SKETCH_ALPHA + 1e-9 ? 0 : 1;
+}
@@ -0,0 +1,311 @@
+/*
+ * This program measures the live tail of admin_logs (common/tail_server.h) with 100 clients while logs come
+ * in at full speed, and checks what every client got (make bench-tail).
+ *
+ * The logs are offered with tail_server_publish() by one thread, like the logging thread of admin_logs, as fast
+ * as it can, in three scenarios:
+ *      idle        no client connected
+ *      fast        'clients' clients that read all the time
+ *      mixed       the same, but 'slow' of them read slowly and 'stalled' of them not at all until the end
+ * The clients have different filters (everything, a building, level>=2, health=0, the subscribers...) and are
+ * threads of this program on the Unix socket of the server. Reported per scenario:
+ *      logs_per_sec        logs offered per second, with making their fields (the idle scenario is that
+ *                          alone), the filtering and the copies to the buffers
+ *      max_publish_us      the slowest tail_server_publish()
+ *      delivered, dropped  logs x clients put into a buffer or dropped because the buffer was full
+ *      received            lines the clients read
+ * Every client has to account for every log its filter matches (the matches are counted again here):
+ * delivered + dropped = matched, and a client that is not stalled reads every delivered line.
+ * The program exits with 1 if a check fails.
+ *
+ *      usage: bench_tail [-n logs] [-c clients] [-s slow] [-t stalled] [-r rooms]
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "tail_server.h"
+
+#define MAX_CLIENTS     256
+#define SOCKET_PATH     "/tmp/noise_bench_tail.sock"
+
+enum pace { FAST, SLOW, STALLED };
+
+struct client {
+    pthread_t thread;
+    int id;
+    enum pace pace;
+    char request[TAIL_REQUEST_MAX];
+    struct tail_filter filter;
+    unsigned long matched;          // counted by the benchmark
+    unsigned long delivered;        // by the server
+    unsigned long dropped;
+    unsigned long received;         // lines read
+    unsigned long reported;         // in "# dropped" lines
+    int ok;                         // the filter was accepted
+};
+
+long logs = 1000000;
+int rooms = 1000;
+struct client clients[MAX_CLIENTS];
+atomic_int release;                 // the stalled clients may read
+
+
+double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/*
+ * This function makes log 'i': one reading of every room per second, some of them alerts or unhealthy,
+ * every other one a log of a subscriber.
+*/
+int make_log(long i, char *topic, int topic_size, char **fields, char storage[PACKET_FIELDS][24])
+{
+    long second = i / rooms;
+    int r = i % rooms;
+
+    snprintf(storage[0], 24, "handong");
+    snprintf(storage[1], 24, "B%d", r / 100);
+    snprintf(storage[2], 24, "%d", r);
+    snprintf(storage[3], 24, "2306%02ld%02ld%02ld%02ld", 1 + second / 86400 % 28, second / 3600 % 24, second / 60 % 60, second % 60);
+    snprintf(storage[4], 24, "%d", i % 97 == 0 ? -1 : (int)(i % 4));
+    snprintf(storage[5], 24, "%.6f", 30.0 + (i * 7919 % 7000) / 100.0);
+    snprintf(storage[6], 24, "%d", i % 13 != 0);
+    snprintf(storage[7], 24, "%ld", second + 1);
+    snprintf(storage[8], 24, "1700000000");
+    for(int f=0; f<PACKET_FIELDS; f++)
+        fields[f] = storage[f];
+    snprintf(topic, topic_size, "admin/logs/%s/handong/B%d/%d", i % 2 ? "sub" : "pub", r / 100, r);
+    return PACKET_FIELDS;
+}
+
+
+/*
+ * This function counts the lines of 'data', with the state of the current line in 'line' (0 at the start of a
+ * line, 1 in a log, 2 in a "# dropped" line, 3 in the "ok" line) and the number of a "# dropped" line in 'note'.
+*/
+void count_lines(struct client *c, const char *data, ssize_t n, int *line, unsigned long *note)
+{
+    for(ssize_t i=0; i<n; i++) {
+        if(*line == 0)
+            *line = data[i] == '#' ? 2 : 1;
+        if(data[i] == '\n') {
+            if(*line == 1)
+                c->received++;
+            else if(*line == 2)
+                c->reported += *note;
+            *line = 0;
+            *note = 0;
+        }
+        else if(*line == 2 && data[i] >= '0' && data[i] <= '9')
+            *note = *note * 10 + (data[i] - '0');
+    }
+}
+
+
+void *run_client(void *arg) {
+    struct client *c = arg;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char buffer[65536];
+    int fd, line = 3;
+    unsigned long note = 0;
+    ssize_t n;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SOCKET_PATH);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || write(fd, c->request, strlen(c->request)) < 0) {
+        perror("client");
+        return NULL;
+    }
+    if(c->pace == STALLED) {
+        while(!atomic_load(&release))
+            usleep(1000);
+    }
+    while((n = read(fd, buffer, c->pace == SLOW ? 4096 : sizeof(buffer))) > 0) {
+        if(line == 3 && !c->ok) {
+            c->ok = strncmp(buffer, "ok\n", 3) == 0;
+            if(!c->ok)
+                break;
+        }
+        count_lines(c, buffer, n, &line, &note);
+        if(c->pace == SLOW)
+            usleep(2000);
+    }
+    close(fd);
+    return NULL;
+}
+
+
+/*
+ * This function gives client 'i' its filter. The "from=<i>" in every filter matches every log and tells
+ * the clients apart on the server.
+*/
+void make_filter(struct client *c, int i)
+{
+    const char *kinds[] = { "", "room=handong/B%d/", "level>=2", "health=0", "source=sub level>=1", "room=handong/B%d/1 source=pub",
+                            "level>=-1 to=230601000100" };
+    char words[128], error[TAIL_REQUEST_MAX + 32];
+
+    snprintf(words, sizeof(words), kinds[i % 7], i % 10);
+    snprintf(c->request, sizeof(c->request), "from=%d %s\n", i, words);
+    if(tail_filter_parse(&c->filter, c->request, error, sizeof(error)) != 0) {
+        fprintf(stderr, "Error: %s\n", error);
+        exit(1);
+    }
+}
+
+
+/*
+ * This function runs one scenario and prints it. It returns 1 if every check passed.
+*/
+int scenario(const char *name, int nclients, int slow, int stalled, int last)
+{
+    struct tail_server *server;
+    struct tail_stats stats;
+    char topic[128], storage[PACKET_FIELDS][24], *fields[PACKET_FIELDS];
+    double start, elapsed, slowest = 0;
+    int ok = 1;
+
+    server = tail_server_start(SOCKET_PATH);
+    if(server == NULL)
+        return 0;
+    atomic_store(&release, 0);
+    for(int i=0; i<nclients; i++) {
+        struct client *c = &clients[i];
+        memset(c, 0, sizeof(*c));
+        c->id = i;
+        c->pace = i < stalled ? STALLED : i < stalled + slow ? SLOW : FAST;
+        make_filter(c, i);
+        pthread_create(&c->thread, NULL, run_client, c);
+    }
+    while(atomic_load(&server->streaming) < nclients)
+        usleep(1000);
+
+    // the logging thread, at full speed
+    start = now_us();
+    for(long i=0; i<logs; i++) {
+        int n = make_log(i, topic, sizeof(topic), fields, storage);
+        double before = (i & 63) == 0 ? now_us() : 0;
+
+        tail_server_publish(server, topic, fields, n);
+        if(before > 0 && now_us() - before > slowest)
+            slowest = now_us() - before;
+    }
+    elapsed = now_us() - start;
+
+    // what every client was offered: the server has sent everything it buffered to the readers
+    for(double wait = now_us(); now_us() - wait < 30e6; usleep(1000)) {
+        int pending = 0;
+        pthread_mutex_lock(&server->lock);
+        for(int s=0; s<server->max_clients; s++) {
+            struct tail_client *t = &server->clients[s];
+            if(t->fd >= 0 && t->streaming && t->filter.from >= (uint64_t)stalled && t->head != t->tail)
+                pending++;
+        }
+        pthread_mutex_unlock(&server->lock);
+        if(pending == 0)
+            break;
+    }
+    pthread_mutex_lock(&server->lock);
+    for(int s=0; s<server->max_clients; s++) {
+        struct tail_client *t = &server->clients[s];
+        if(t->fd >= 0 && t->streaming && t->filter.from < (uint64_t)nclients) {
+            clients[t->filter.from].delivered = t->delivered;
+            clients[t->filter.from].dropped = t->dropped;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    tail_server_get_stats(server, &stats);
+
+    // the server closes the sockets, the clients read what is left and stop
+    tail_server_stop(server);
+    atomic_store(&release, 1);
+    for(int i=0; i<nclients; i++)
+        pthread_join(clients[i].thread, NULL);
+
+    // the matches, counted again
+    for(long i=0; i<logs && nclients > 0; i++) {
+        struct tail_record record;
+        int n = make_log(i, topic, sizeof(topic), fields, storage);
+
+        if(tail_record_from_fields(&record, topic, fields, n) != 0)
+            continue;
+        for(int c=0; c<nclients; c++)
+            clients[c].matched += tail_filter_match(&clients[c].filter, &record);
+    }
+
+    unsigned long delivered[3] = {0}, dropped[3] = {0}, received[3] = {0};
+    for(int i=0; i<nclients; i++) {
+        struct client *c = &clients[i];
+        int good = c->ok && c->delivered + c->dropped == c->matched && c->reported <= c->dropped &&
+                   (c->pace == STALLED || c->received == c->delivered);
+        if(!good) {
+            fprintf(stderr, "bench_tail: %s: client %d (%s) matched %lu delivered %lu dropped %lu received %lu reported %lu\n",
+                    name, i, c->request, c->matched, c->delivered, c->dropped, c->received, c->reported);
+            ok = 0;
+        }
+        delivered[c->pace] += c->delivered;
+        dropped[c->pace] += c->dropped;
+        received[c->pace] += c->received;
+    }
+    if(stats.logs != (unsigned long)(nclients > 0 ? logs : 0))
+        ok = 0;
+
+    printf("    \"%s\": { \"ok\": %s, \"clients\": %d, \"slow\": %d, \"stalled\": %d, \"logs_per_sec\": %.0f, \"max_publish_us\": %.1f,\n",
+           name, ok ? "true" : "false", nclients, slow, stalled, logs / (elapsed / 1e6), slowest);
+    printf("      \"fast\": { \"delivered\": %lu, \"dropped\": %lu, \"received\": %lu },\n", delivered[FAST], dropped[FAST], received[FAST]);
+    printf("      \"slow\": { \"delivered\": %lu, \"dropped\": %lu, \"received\": %lu },\n", delivered[SLOW], dropped[SLOW], received[SLOW]);
+    printf("      \"stalled\": { \"delivered\": %lu, \"dropped\": %lu, \"received\": %lu } }%s\n",
+           delivered[STALLED], dropped[STALLED], received[STALLED], last ? "" : ",");
+    fflush(stdout);
+    return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int nclients = 100, slow = 5, stalled = 5, opt, failed = 0;
+
+    while((opt = getopt(argc, argv, "n:c:s:t:r:")) != -1) {
+        switch(opt) {
+            case 'n': logs = atol(optarg); break;
+            case 'c': nclients = atoi(optarg); break;
+            case 's': slow = atoi(optarg); break;
+            case 't': stalled = atoi(optarg); break;
+            case 'r': rooms = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n logs] [-c clients] [-s slow] [-t stalled] [-r rooms]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(logs < 1 || nclients < 1 || nclients > MAX_CLIENTS || slow < 0 || stalled < 0 || slow + stalled > nclients || rooms < 1) {
+        fprintf(stderr, "usage: %s [-n logs] [-c clients (max %d)] [-s slow] [-t stalled] [-r rooms]\n", argv[0], MAX_CLIENTS);
+        return 1;
+    }
+    setenv("NOISE_TAIL_CLIENTS", "256", 0);
+
+    printf("{\n");
+    printf("  \"logs\": %ld,\n", logs);
+    printf("  \"buffer_bytes\": %ld,\n", config_long("NOISE_TAIL_BUFFER", 65536));
+    printf("  \"scenarios\": {\n");
+    failed |= !scenario("idle", 0, 0, 0, 0);
+    failed |= !scenario("fast", nclients, 0, 0, 0);
+    failed |= !scenario("mixed", nclients, slow, stalled, 1);
+    printf("  }\n");
+    printf("}\n");
+    return failed;
+}
@@ -0,0 +1,358 @@
+/*
+ * This program measures what TLS costs the MQTT connections of common/tls.h (make bench-tls).
+ *
+ *      handshakes  'count' connects (connect until CONNACK, then disconnect) of one client:
+ *                  plaintext, TLS with a full handshake every time, and TLS resuming the last session
+ *      throughput  'messages' QoS 1 packets that a client publishes to itself, plaintext and TLS
+ *
+ * For every round it reports the wall time, the CPU time of this process and, with -b, of the broker
+ * (from /proc, in clock ticks, so use enough handshakes). The results are printed as a JSON object to stdout.
+ *
+ * The broker of NOISE_MQTT_HOST needs a plaintext listener (-p) and a TLS listener (-s) with a certificate
+ * signed by NOISE_TLS_CAFILE; the other NOISE_TLS_* settings apply as well. bench/run_tls_bench.sh
+ * starts such a broker with certificates of tls/gen_certs.sh.
+ *
+ *      usage: bench_tls -p plain_port -s tls_port [-b broker_pid] [-n handshakes] [-m messages]
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "tls.h"
+
+#define DATA_TOPIC      "bench/tls"
+#define WINDOW          1000        // packets published but not received yet
+
+struct round {
+    long count;
+    double seconds;
+    double p50_us, p99_us;          // handshake rounds only
+    double client_cpu_us;           // per handshake or per packet
+    double broker_cpu_us;
+    struct tls_stats tls;
+};
+
+_Atomic int connected = 0;
+_Atomic int subscribed = 0;
+_Atomic long received = 0;
+
+pid_t broker_pid = 0;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * This function returns the user + system CPU time of this process in microseconds.
+*/
+long self_cpu_us(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+
+/*
+ * This function returns the user + system CPU time of the broker in microseconds, or 0 without -b.
+*/
+long broker_cpu_us(void) {
+    char path[64];
+    unsigned long utime = 0, stime = 0;
+    FILE *fp;
+
+    if(broker_pid <= 0)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)broker_pid);
+    if((fp = fopen(path, "r")) == NULL)
+        return 0;
+    // fields 14 and 15; the command name (field 2) has no spaces for mosquitto
+    if(fscanf(fp, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(fp);
+    return (long)((utime + stime) * 1000000.0 / sysconf(_SC_CLK_TCK));
+}
+
+
+void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    atomic_store(&connected, reason_code == 0 ? 1 : -1);
+}
+
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+    atomic_store(&subscribed, 1);
+}
+
+
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    atomic_fetch_add_explicit(&received, 1, memory_order_relaxed);
+}
+
+
+/*
+ * This function creates a client, with TLS if 'tls' is set (resuming sessions if 'resume' is set).
+ * It returns NULL on error.
+*/
+struct mosquitto *new_client(int tls, int resume, struct tls_client **client)
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+    struct tls_options opts;
+
+    *client = NULL;
+    if(mosq == NULL)
+        return NULL;
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    mosquitto_message_callback_set(mosq, on_message);
+
+    if(tls) {
+        tls_options_from_config(&opts);
+        opts.resume = resume;
+        if((*client = tls_client_setup(mosq, &opts)) == NULL) {
+            mosquitto_destroy(mosq);
+            return NULL;
+        }
+    }
+    return mosq;
+}
+
+
+/*
+ * This function connects 'count' times and measures the time from the TCP connect to the CONNACK.
+ * It returns 0 on success and -1 if a connect failed.
+*/
+int run_handshakes(int port, int tls, int resume, long count, struct round *r)
+{
+    struct tls_client *client;
+    struct mosquitto *mosq = new_client(tls, resume, &client);
+    long *times = malloc(count * sizeof(long));
+    long start, cpu, broker;
+    int rc = 0;
+
+    memset(r, 0, sizeof(struct round));
+    if(mosq == NULL || times == NULL) {
+        free(times);
+        if(mosq != NULL)
+            mosquitto_destroy(mosq);
+        return -1;
+    }
+
+    start = now_ns();
+    cpu = self_cpu_us();
+    broker = broker_cpu_us();
+    for(long i=0; i<count && rc == 0; i++) {
+        long t0 = now_ns();
+
+        atomic_store(&connected, 0);
+        if(mosquitto_connect(mosq, config_mqtt_host(), port, 60) != MOSQ_ERR_SUCCESS) {
+            rc = -1;
+            break;
+        }
+        while(atomic_load(&connected) == 0) {
+            if(mosquitto_loop(mosq, 1000, 1) != MOSQ_ERR_SUCCESS || now_ns() - t0 > 5000000000L) {
+                rc = -1;
+                break;
+            }
+        }
+        if(atomic_load(&connected) != 1)
+            rc = -1;
+        times[i] = now_ns() - t0;
+
+        // DISCONNECT and a TLS close_notify, so that the session stays resumable
+        mosquitto_disconnect(mosq);
+        mosquitto_loop(mosq, 10, 1);
+    }
+
+    if(rc == 0) {
+        r->count = count;
+        r->seconds = (now_ns() - start) / 1e9;
+        r->client_cpu_us = (double)(self_cpu_us() - cpu) / count;
+        r->broker_cpu_us = (double)(broker_cpu_us() - broker) / count;
+        qsort(times, count, sizeof(long), compare_long);
+        r->p50_us = times[count / 2] / 1e3;
+        r->p99_us = times[count * 99 / 100] / 1e3;
+        if(client != NULL)
+            tls_client_stats(client, &r->tls);
+    }
+
+    free(times);
+    mosquitto_destroy(mosq);
+    tls_client_free(client);
+    return rc;
+}
+
+
+/*
+ * This function publishes 'count' QoS 1 packets to a topic the client subscribed to itself,
+ * with at most WINDOW packets on the way, and waits until all are received.
+ * It returns 0 on success and -1 on error.
+*/
+int run_throughput(int port, int tls, long count, struct round *r)
+{
+    struct tls_client *client;
+    struct mosquitto *mosq = new_client(tls, 1, &client);
+    char topic[64], payload[64];
+    long start, cpu, broker, deadline;
+    int rc = 0;
+
+    memset(r, 0, sizeof(struct round));
+    if(mosq == NULL)
+        return -1;
+    snprintf(topic, sizeof(topic), DATA_TOPIC "/%d", (int)getpid());
+    atomic_store(&connected, 0);
+    atomic_store(&subscribed, 0);
+    atomic_store(&received, 0);
+
+    if(mosquitto_connect(mosq, config_mqtt_host(), port, 60) != MOSQ_ERR_SUCCESS ||
+       mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(mosq);
+        tls_client_free(client);
+        return -1;
+    }
+    mosquitto_subscribe(mosq, NULL, topic, 1);
+    deadline = now_ns() + 5000000000L;
+    while(!atomic_load(&subscribed) && now_ns() < deadline)
+        usleep(1000);
+    if(!atomic_load(&subscribed))
+        rc = -1;
+
+    start = now_ns();
+    cpu = self_cpu_us();
+    broker = broker_cpu_us();
+    for(long sent=0; sent<count && rc == 0; ) {
+        if(sent - atomic_load_explicit(&received, memory_order_relaxed) >= WINDOW) {
+            usleep(50);
+            continue;
+        }
+        // a noise packet of the usual size
+        int len = snprintf(payload, sizeof(payload), "handong,NTH,%ld,230601120000,1,52.3,OK,%ld", sent % 1000, sent);
+        if(mosquitto_publish(mosq, NULL, topic, len, payload, 1, false) != MOSQ_ERR_SUCCESS)
+            rc = -1;
+        sent++;
+    }
+    deadline = now_ns() + 30000000000L;
+    while(rc == 0 && atomic_load(&received) < count && now_ns() < deadline)
+        usleep(1000);
+    if(atomic_load(&received) < count)
+        rc = -1;
+
+    if(rc == 0) {
+        r->count = count;
+        r->seconds = (now_ns() - start) / 1e9;
+        r->client_cpu_us = (double)(self_cpu_us() - cpu) / count;
+        r->broker_cpu_us = (double)(broker_cpu_us() - broker) / count;
+    }
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+    tls_client_free(client);
+    return rc;
+}
+
+
+void print_handshakes(const char *name, const struct round *r, int last)
+{
+    printf("    \"%s\": {\n", name);
+    printf("      \"connects\": %ld,\n", r->count);
+    printf("      \"connects_per_sec\": %.1f,\n", r->seconds > 0 ? r->count / r->seconds : 0.0);
+    printf("      \"p50_us\": %.1f,\n", r->p50_us);
+    printf("      \"p99_us\": %.1f,\n", r->p99_us);
+    printf("      \"client_cpu_us\": %.1f,\n", r->client_cpu_us);
+    printf("      \"broker_cpu_us\": %.1f,\n", r->broker_cpu_us);
+    printf("      \"full\": %lu,\n", r->tls.full);
+    printf("      \"resumed\": %lu\n", r->tls.resumed);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+
+void print_throughput(const char *name, const struct round *r, int last)
+{
+    printf("    \"%s\": {\n", name);
+    printf("      \"messages\": %ld,\n", r->count);
+    printf("      \"msgs_per_sec\": %.1f,\n", r->seconds > 0 ? r->count / r->seconds : 0.0);
+    printf("      \"client_cpu_us\": %.2f,\n", r->client_cpu_us);
+    printf("      \"broker_cpu_us\": %.2f\n", r->broker_cpu_us);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -p plain_port -s tls_port [-b broker_pid] [-n handshakes] [-m messages]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int plain_port = 0, tls_port = 0, opt;
+    long handshakes = 1000, messages = 100000;
+    struct round plain, full, resumed, plain_data, tls_data;
+
+    while((opt = getopt(argc, argv, "p:s:b:n:m:")) != -1) {
+        switch(opt) {
+            case 'p': plain_port = atoi(optarg); break;
+            case 's': tls_port = atoi(optarg); break;
+            case 'b': broker_pid = atoi(optarg); break;
+            case 'n': handshakes = atol(optarg); break;
+            case 'm': messages = atol(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(plain_port <= 0 || tls_port <= 0 || handshakes <= 0 || messages <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mosquitto_lib_init();
+
+    if(run_handshakes(plain_port, 0, 0, handshakes, &plain) != 0 ||
+       run_handshakes(tls_port, 1, 0, handshakes, &full) != 0 ||
+       run_handshakes(tls_port, 1, 1, handshakes, &resumed) != 0) {
+        fprintf(stderr, "Handshake round failed (broker %s, ports %d/%d)\n", config_mqtt_host(), plain_port, tls_port);
+        mosquitto_lib_cleanup();
+        return 1;
+    }
+    if(run_throughput(plain_port, 0, messages, &plain_data) != 0 ||
+       run_throughput(tls_port, 1, messages, &tls_data) != 0) {
+        fprintf(stderr, "Throughput round failed\n");
+        mosquitto_lib_cleanup();
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"handshakes\": {\n");
+    print_handshakes("plaintext", &plain, 0);
+    print_handshakes("tls_full", &full, 0);
+    print_handshakes("tls_resumed", &resumed, 1);
+    printf("  },\n");
+    printf("  \"throughput\": {\n");
+    print_throughput("plaintext", &plain_data, 0);
+    print_throughput("tls", &tls_data, 1);
+    printf("  }\n");
+    printf("}\n");
+
+    mosquitto_lib_cleanup();
+    return 0;
+}
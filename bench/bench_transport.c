@@ -0,0 +1,370 @@
+/*
+ * This program compares the two backends of common/transport.h on one host (make bench-transport):
+ *      mqtt    producer -> TCP -> mosquitto -> TCP -> consumer
+ *      shm     producer -> shared-memory ring -> consumer
+ *
+ * For every backend it forks a consumer process, waits until it is subscribed, and runs two rounds:
+ *      throughput  'messages' packets as fast as the producer can publish them
+ *      latency     packets at a fixed rate for 'seconds' seconds
+ * A packet is a normal noise packet with the send time in nanoseconds as last field (like bench/noise_bench.c).
+ * The consumer reports what it received, and the results are printed as a JSON object to stdout.
+ *
+ * The MQTT backend uses the broker of NOISE_MQTT_HOST/NOISE_MQTT_PORT; it is skipped if there is none.
+ * The shm backend uses a private ring that is removed at the end.
+ *
+ *      usage: bench_transport [-b mqtt|shm|both] [-n messages] [-r msgs_per_sec] [-d seconds] [-q qos]
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "shm_ring.h"
+#include "transport.h"
+
+#define DATA_TOPIC  "bench/data"
+
+struct result {
+    long received;
+    long lost;
+    long first_ns, last_ns;     // receive time of the first and last packet
+    double p50_us, p99_us, max_us;
+};
+
+// consumer side
+long *latencies = NULL;
+long capacity = 0;
+_Atomic long received = 0;
+_Atomic long last_ns = 0;
+long first_ns = 0;
+_Atomic int done = 0;
+_Atomic int subscribed = 0;
+
+char ring_name[64];
+int qos = 1;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * This function records the latency of a packet, or ends the round on the "end" packet.
+ * Both backends call it on a single thread (network thread or ring reader), so it needs no lock.
+*/
+void on_packet(void *ctx, char *topic, char *payload, int payloadlen)
+{
+    long now = now_ns();
+    char *field = strrchr(payload, ',');
+
+    if(strcmp(payload, "end") == 0) {
+        atomic_store(&done, 1);
+        return;
+    }
+    if(field == NULL)
+        return;
+
+    long n = atomic_load_explicit(&received, memory_order_relaxed);
+    if(n == 0)
+        first_ns = now;
+    if(n < capacity)
+        latencies[n] = now - strtol(field + 1, NULL, 10);
+    atomic_store_explicit(&last_ns, now, memory_order_relaxed);
+    atomic_store_explicit(&received, n + 1, memory_order_release);
+}
+
+
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    on_packet(obj, msg->topic, msg->payload, msg->payloadlen);
+}
+
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+    atomic_store(&subscribed, 1);
+}
+
+
+/*
+ * This function connects a client to the broker and starts its network thread. It returns NULL if there is no broker.
+*/
+struct mosquitto *connect_broker(void)
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+
+    if(mosq == NULL)
+        return NULL;
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    mosquitto_message_callback_set(mosq, on_message);
+    mosquitto_max_inflight_messages_set(mosq, 0);
+
+    if(mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60) != MOSQ_ERR_SUCCESS ||
+       mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+    return mosq;
+}
+
+
+/*
+ * This function is the consumer process. It writes one line to 'out' when it is subscribed ("ready")
+ * and one with its results when the round ends: received lost first_ns last_ns p50_us p99_us max_us
+*/
+int run_consumer(const char *backend, long expected, int out)
+{
+    struct mosquitto *mosq = NULL;
+    struct transport *transport;
+    struct transport_stats stats;
+    char line[256];
+    int len;
+
+    capacity = expected;
+    latencies = malloc(capacity * sizeof(long));
+    if(latencies == NULL)
+        return 1;
+
+    if(strcmp(backend, "mqtt") == 0) {
+        mosquitto_lib_init();
+        if((mosq = connect_broker()) == NULL)
+            return 1;
+        transport = transport_create_shm(mosq, NULL, NULL, on_packet, NULL);
+    }
+    else {
+        transport = transport_create_shm(NULL, ring_name, "bench/#", on_packet, NULL);
+        atomic_store(&subscribed, 1);
+    }
+    if(transport == NULL || transport_subscribe(transport, DATA_TOPIC, qos) != MOSQ_ERR_SUCCESS)
+        return 1;
+
+    // the shm subscription is immediate; MQTT waits for the SUBACK
+    for(int i=0; i<500 && !atomic_load(&subscribed); i++)
+        usleep(10000);
+    if(!atomic_load(&subscribed) || write(out, "ready\n", 6) != 6)
+        return 1;
+
+    // the round ends with the "end" packet, or 3 sec after the last packet if it was lost
+    long idle_since = now_ns();
+    long seen = 0;
+    while(!atomic_load(&done) && now_ns() - idle_since < 3000000000L) {
+        usleep(1000);
+        if(atomic_load(&received) != seen) {
+            seen = atomic_load(&received);
+            idle_since = now_ns();
+        }
+    }
+
+    if(mosq != NULL) {
+        mosquitto_disconnect(mosq);
+        mosquitto_loop_stop(mosq, false);
+    }
+    transport_get_stats(transport, &stats);
+    transport_destroy(transport);
+
+    long n = atomic_load(&received);
+    long kept = n < capacity ? n : capacity;
+    qsort(latencies, kept, sizeof(long), compare_long);
+    len = snprintf(line, sizeof(line), "%ld %lu %ld %ld %.1f %.1f %.1f\n", n, stats.shm_lost, first_ns, atomic_load(&last_ns),
+                   kept ? latencies[kept / 2] / 1000.0 : 0.0, kept ? latencies[(long)(kept * 0.99)] / 1000.0 : 0.0,
+                   kept ? latencies[kept - 1] / 1000.0 : 0.0);
+    return write(out, line, len) == len ? 0 : 1;
+}
+
+
+/*
+ * This function reads a line from the consumer, waiting at most 'timeout_ms'. It returns 0 on success.
+*/
+int read_line(int fd, char *line, int size, int timeout_ms)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int len = 0;
+
+    while(len < size - 1) {
+        if(poll(&pfd, 1, timeout_ms) <= 0 || read(fd, line + len, 1) != 1)
+            return -1;
+        if(line[len++] == '\n')
+            break;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+
+/*
+ * This function runs one round: it starts a consumer, publishes 'count' packets at 'rate' per second
+ * (0 = as fast as possible) and collects the result. It returns 0 on success.
+*/
+int run_round(const char *backend, long count, double rate, struct result *result, double *publish_ns)
+{
+    struct mosquitto *mosq = NULL;
+    struct transport *transport;
+    char buffer[128], line[256];
+    int fds[2], status;
+    pid_t pid;
+
+    if(pipe(fds) != 0)
+        return -1;
+
+    pid = fork();
+    if(pid == 0) {
+        close(fds[0]);
+        _exit(run_consumer(backend, count, fds[1]));
+    }
+    close(fds[1]);
+
+    if(read_line(fds[0], line, sizeof(line), 10000) != 0 || strcmp(line, "ready\n") != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        close(fds[0]);
+        return -1;
+    }
+
+    if(strcmp(backend, "mqtt") == 0) {
+        if((mosq = connect_broker()) == NULL) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            close(fds[0]);
+            return -1;
+        }
+        transport = transport_create_shm(mosq, NULL, NULL, NULL, NULL);
+    }
+    else {
+        transport = transport_create_shm(NULL, ring_name, "bench/#", NULL, NULL);
+    }
+    if(transport == NULL)
+        return -1;
+
+    long interval = rate > 0 ? (long)(1e9 / rate) : 0;
+    long start = now_ns(), next = start, busy = 0;
+    struct timespec wake;
+
+    for(long i=0; i<count; i++) {
+        if(interval > 0) {
+            wake.tv_sec = next / 1000000000L;
+            wake.tv_nsec = next % 1000000000L;
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+            next += interval;
+        }
+
+        long before = now_ns();
+        int len = snprintf(buffer, sizeof(buffer), "handong,BENCH,0,000000000000,1,60.000000,1,%ld,%ld", i + 1, before);
+        if(transport_publish(transport, DATA_TOPIC, len, buffer, qos, false) != MOSQ_ERR_SUCCESS)
+            fprintf(stderr, "Error publishing to %s\n", backend);
+        busy += now_ns() - before;
+    }
+    transport_publish(transport, DATA_TOPIC, 3, "end", qos, false);
+    *publish_ns = (double)busy / count;
+
+    int rc = read_line(fds[0], line, sizeof(line), 60000);
+    if(rc == 0 && sscanf(line, "%ld %ld %ld %ld %lf %lf %lf", &result->received, &result->lost, &result->first_ns, &result->last_ns,
+                         &result->p50_us, &result->p99_us, &result->max_us) != 7)
+        rc = -1;
+    result->first_ns = start;
+
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    if(mosq != NULL) {
+        mosquitto_disconnect(mosq);
+        mosquitto_loop_stop(mosq, false);
+        mosquitto_destroy(mosq);
+    }
+    transport_destroy(transport);
+    return rc;
+}
+
+
+void print_round(const char *name, long sent, const struct result *r, double publish_ns, int last)
+{
+    double elapsed = (r->last_ns - r->first_ns) / 1e9;
+
+    printf("    \"%s\": {\n", name);
+    printf("      \"sent\": %ld,\n", sent);
+    printf("      \"received\": %ld,\n", r->received);
+    printf("      \"lost\": %ld,\n", r->lost > sent - r->received ? r->lost : sent - r->received);
+    printf("      \"msgs_per_sec\": %.1f,\n", elapsed > 0 ? r->received / elapsed : 0.0);
+    printf("      \"publish_ns\": %.1f,\n", publish_ns);
+    printf("      \"p50_us\": %.1f,\n", r->p50_us);
+    printf("      \"p99_us\": %.1f,\n", r->p99_us);
+    printf("      \"max_us\": %.1f\n", r->max_us);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b mqtt|shm|both] [-n messages] [-r msgs_per_sec] [-d seconds] [-q qos]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *backends[2] = { "shm", "mqtt" };
+    const char *which = "both";
+    long messages = 200000;
+    double rate = 10000, seconds = 2;
+    struct result throughput, latency;
+    double throughput_ns, latency_ns;
+    int printed = 0, opt;
+
+    while((opt = getopt(argc, argv, "b:n:r:d:q:")) != -1) {
+        switch(opt) {
+            case 'b': which = optarg; break;
+            case 'n': messages = atol(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'q': qos = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(messages <= 0 || rate <= 0 || seconds <= 0 || qos < 0 || qos > 2 ||
+       (strcmp(which, "both") != 0 && strcmp(which, "mqtt") != 0 && strcmp(which, "shm") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    snprintf(ring_name, sizeof(ring_name), "/noise_bench_%d", (int)getpid());
+    mosquitto_lib_init();
+
+    printf("{\n");
+    for(int b=0; b<2; b++) {
+        if(strcmp(which, "both") != 0 && strcmp(which, backends[b]) != 0)
+            continue;
+
+        if(run_round(backends[b], messages, 0, &throughput, &throughput_ns) != 0 ||
+           run_round(backends[b], (long)(rate * seconds), rate, &latency, &latency_ns) != 0) {
+            fprintf(stderr, "Skipping %s backend (%s)\n", backends[b], b == 1 ? "no broker?" : "shared memory failed");
+            continue;
+        }
+
+        printf("%s  \"%s\": {\n", printed ? ",\n" : "", backends[b]);
+        print_round("throughput", messages, &throughput, throughput_ns, 0);
+        print_round("latency", (long)(rate * seconds), &latency, latency_ns, 1);
+        printf("  }");
+        printed = 1;
+    }
+    printf("\n}\n");
+
+    shm_ring_unlink(ring_name);
+    mosquitto_lib_cleanup();
+    return printed ? 0 : 1;
+}
@@ -0,0 +1,306 @@
+/*
+ * This program measures what one noise reading costs on the wire and in the broker for the packet
+ * formats and MQTT versions of the publisher (make bench-wire):
+ *      v311_full       MQTT v3.1.1, full packet, QoS 1 (the format before compact packets)
+ *      v5_full         MQTT v5, full packet, QoS 1
+ *      v5_compact      MQTT v5, compact packet (room only in the topic), QoS 1
+ *      v311_compact_q0 MQTT v3.1.1, compact packet, QoS 0
+ *      v5_compact_q0   MQTT v5, compact packet, QoS 0 with a topic alias
+ *
+ * In every round a publisher sends 'messages' readings of one room through common/transport.h to a
+ * subscriber of the room topic. The round reports:
+ *      publish_bytes   size of the MQTT PUBLISH packet of a reading (after the first one, that sets the alias)
+ *      rx/tx_bytes     bytes the broker received and sent per reading, from $SYS/broker/bytes/received|sent
+ *                      (the broker needs a short sys_interval; acknowledgements are included)
+ *      broker_cpu_us   CPU time of the broker per reading, with -b (from /proc, in clock ticks)
+ * The results are printed as a JSON object to stdout. bench/run_wire_bench.sh starts a private broker for it.
+ *
+ *      usage: bench_wire [-b broker_pid] [-n messages] [-w sys_wait_ms]
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "config.h"
+#include "packet.h"
+#include "transport.h"
+
+#define ROOM_TOPIC      "handong/BENCH/313"
+#define WINDOW          1000        // readings published but not received yet
+
+struct variant {
+    const char *name;
+    int protocol;
+    int compact;
+    int qos;
+};
+
+struct round {
+    long received;
+    double seconds;
+    int publish_bytes;
+    double rx_bytes, tx_bytes;      // per reading
+    double broker_cpu_us;
+    unsigned long aliased;
+};
+
+const struct variant variants[] = {
+    { "v311_full",       MQTT_PROTOCOL_V311, 0, 1 },
+    { "v5_full",         MQTT_PROTOCOL_V5,   0, 1 },
+    { "v5_compact",      MQTT_PROTOCOL_V5,   1, 1 },
+    { "v311_compact_q0", MQTT_PROTOCOL_V311, 1, 0 },
+    { "v5_compact_q0",   MQTT_PROTOCOL_V5,   1, 0 },
+};
+
+_Atomic int connected = 0;
+_Atomic int subscribed = 0;
+_Atomic long received = 0;
+_Atomic long sys_received = -1;     // $SYS/broker/bytes/received
+_Atomic long sys_sent = -1;
+
+pid_t broker_pid = 0;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * This function returns the user + system CPU time of the broker in microseconds, or 0 without -b.
+*/
+long broker_cpu_us(void) {
+    char path[64];
+    unsigned long utime = 0, stime = 0;
+    FILE *fp;
+
+    if(broker_pid <= 0)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)broker_pid);
+    if((fp = fopen(path, "r")) == NULL)
+        return 0;
+    // fields 14 and 15; the command name (field 2) has no spaces for mosquitto
+    if(fscanf(fp, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(fp);
+    return (long)((utime + stime) * 1000000.0 / sysconf(_SC_CLK_TCK));
+}
+
+
+/*
+ * This function returns the size of an MQTT PUBLISH packet: fixed header, topic (or none with an alias),
+ * packet id for QoS > 0, the properties of v5 (just the topic alias here) and the payload.
+*/
+int publish_size(int protocol, int topiclen, int alias, int qos, int payloadlen) {
+    int remaining = 2 + topiclen + (qos > 0 ? 2 : 0) + payloadlen;
+
+    if(protocol == MQTT_PROTOCOL_V5)
+        remaining += 1 + (alias ? 3 : 0);
+    return 1 + (remaining < 128 ? 1 : remaining < 16384 ? 2 : 3) + remaining;
+}
+
+
+void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    if(reason_code == 0)
+        atomic_store(&connected, 1);
+}
+
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+    atomic_store(&subscribed, 1);
+}
+
+
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    if(strcmp(msg->topic, "$SYS/broker/bytes/received") == 0)
+        atomic_store(&sys_received, atol(msg->payload));
+    else if(strcmp(msg->topic, "$SYS/broker/bytes/sent") == 0)
+        atomic_store(&sys_sent, atol(msg->payload));
+    else
+        atomic_fetch_add(&received, 1);
+}
+
+
+struct mosquitto *connect_client(struct transport **transport, int protocol)
+{
+    struct mosquitto *mosq = mosquitto_new(NULL, true, NULL);
+
+    if(mosq == NULL)
+        return NULL;
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    mosquitto_message_callback_set(mosq, on_message);
+
+    // the transport sets the v5 callbacks, so it has to exist before the connect
+    if(transport != NULL) {
+        *transport = transport_create_shm(mosq, NULL, NULL, NULL, NULL);
+        if(*transport == NULL) {
+            mosquitto_destroy(mosq);
+            return NULL;
+        }
+        transport_set_protocol(*transport, protocol);
+    }
+
+    atomic_store(&connected, 0);
+    if(mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60) != MOSQ_ERR_SUCCESS ||
+       mosquitto_loop_start(mosq) != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+    for(int i=0; i<500 && !atomic_load(&connected); i++)
+        usleep(10000);
+    return mosq;
+}
+
+
+void close_client(struct mosquitto *mosq)
+{
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+}
+
+
+/*
+ * This function waits for the next $SYS update and returns the bytes the broker received and sent so far.
+*/
+void sys_bytes(struct mosquitto *sys, int wait_ms, long *rx, long *tx)
+{
+    atomic_store(&sys_received, -1);
+    atomic_store(&sys_sent, -1);
+    // a new subscription gets the retained values at once; then wait for the next interval
+    mosquitto_unsubscribe(sys, NULL, "$SYS/broker/bytes/+");
+    usleep(wait_ms * 1000);
+    mosquitto_subscribe(sys, NULL, "$SYS/broker/bytes/+", 0);
+    for(int i=0; i<300 && (atomic_load(&sys_received) < 0 || atomic_load(&sys_sent) < 0); i++)
+        usleep(10000);
+    *rx = atomic_load(&sys_received);
+    *tx = atomic_load(&sys_sent);
+}
+
+
+int run_round(const struct variant *v, long count, int wait_ms, struct round *r)
+{
+    struct mosquitto *sub, *pub, *sys;
+    struct transport *transport;
+    struct transport_stats stats;
+    struct packet_writer writer;
+    char packet[PACKET_MAX];
+    long rx0, tx0, rx1, tx1;
+
+    memset(r, 0, sizeof(*r));
+    atomic_store(&received, 0);
+    atomic_store(&subscribed, 0);
+    if((sys = connect_client(NULL, MQTT_PROTOCOL_V311)) == NULL || (sub = connect_client(NULL, MQTT_PROTOCOL_V311)) == NULL)
+        return -1;
+    mosquitto_subscribe(sub, NULL, ROOM_TOPIC, v->qos);
+    for(int i=0; i<500 && !atomic_load(&subscribed); i++)
+        usleep(10000);
+    if((pub = connect_client(&transport, v->protocol)) == NULL || !atomic_load(&subscribed))
+        return -1;
+    // the v5 CONNACK (with the alias maximum) is handled right after the connect callback
+    usleep(100000);
+
+    packet_writer_init(&writer, "handong", "BENCH", "313");
+    sys_bytes(sys, wait_ms, &rx0, &tx0);
+    long cpu = broker_cpu_us(), start = now_ns();
+
+    for(long i=0; i<count; i++) {
+        int len = packet_format(&writer, packet, time(NULL), 1, 55.5f + i % 10, 1, i + 1);
+        char *payload = v->compact ? packet + writer.header_len : packet;
+
+        len -= v->compact ? writer.header_len : 0;
+        if(i == 1)
+            r->publish_bytes = publish_size(v->protocol, v->protocol == MQTT_PROTOCOL_V5 && v->qos == 0 ? 0 : strlen(ROOM_TOPIC),
+                                            v->protocol == MQTT_PROTOCOL_V5 && v->qos == 0, v->qos, len);
+        while(i - atomic_load(&received) >= WINDOW)
+            usleep(100);
+        transport_publish(transport, ROOM_TOPIC, len, payload, v->qos, false);
+    }
+    for(int i=0; i<1000 && atomic_load(&received) < count; i++)
+        usleep(10000);
+
+    r->seconds = (now_ns() - start) / 1e9;
+    r->broker_cpu_us = (double)(broker_cpu_us() - cpu) / count;
+    r->received = atomic_load(&received);
+    sys_bytes(sys, wait_ms, &rx1, &tx1);
+    if(rx0 >= 0 && rx1 >= 0) {
+        r->rx_bytes = (double)(rx1 - rx0) / count;
+        r->tx_bytes = (double)(tx1 - tx0) / count;
+    }
+    transport_get_stats(transport, &stats);
+    r->aliased = stats.mqtt_aliased;
+
+    transport_destroy(transport);
+    close_client(pub);
+    close_client(sub);
+    close_client(sys);
+    return 0;
+}
+
+
+void print_round(const char *name, const struct round *r, int last)
+{
+    printf("    \"%s\": {\n", name);
+    printf("      \"received\": %ld,\n", r->received);
+    printf("      \"msgs_per_sec\": %.1f,\n", r->seconds > 0 ? r->received / r->seconds : 0.0);
+    printf("      \"publish_bytes\": %d,\n", r->publish_bytes);
+    printf("      \"rx_bytes\": %.1f,\n", r->rx_bytes);
+    printf("      \"tx_bytes\": %.1f,\n", r->tx_bytes);
+    printf("      \"broker_cpu_us\": %.2f,\n", r->broker_cpu_us);
+    printf("      \"aliased\": %lu\n", r->aliased);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int nvariants = sizeof(variants) / sizeof(variants[0]);
+    struct round rounds[sizeof(variants) / sizeof(variants[0])];
+    long messages = 100000;
+    int wait_ms = 1500, opt;
+
+    while((opt = getopt(argc, argv, "b:n:w:")) != -1) {
+        switch(opt) {
+            case 'b': broker_pid = atoi(optarg); break;
+            case 'n': messages = atol(optarg); break;
+            case 'w': wait_ms = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-b broker_pid] [-n messages] [-w sys_wait_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(messages < 2 || wait_ms < 0) {
+        fprintf(stderr, "usage: %s [-b broker_pid] [-n messages] [-w sys_wait_ms]\n", argv[0]);
+        return 1;
+    }
+
+    mosquitto_lib_init();
+    for(int i=0; i<nvariants; i++) {
+        if(run_round(&variants[i], messages, wait_ms, &rounds[i]) != 0) {
+            fprintf(stderr, "Error: round %s failed (broker %s:%d)\n", variants[i].name, config_mqtt_host(), config_mqtt_port());
+            return 1;
+        }
+    }
+    mosquitto_lib_cleanup();
+
+    printf("{\n");
+    printf("  \"messages\": %ld,\n", messages);
+    printf("  \"rounds\": {\n");
+    for(int i=0; i<nvariants; i++)
+        print_round(variants[i].name, &rounds[i], i == nvariants - 1);
+    printf("  }\n");
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Compares two benchmark reports written by run_bench.sh.
+#
+#   usage: compare_bench.sh baseline.json current.json [tolerance_percent]
+#
+# Every numeric metric is flattened to a dotted path (e.g. components.admin_logs.rss_kb)
+# and compared. Throughput metrics (msgs_per_sec, received) are better when higher, every
+# other metric (latency, loss, CPU, memory) is better when lower. The "config" section must
+# match, otherwise the reports are not comparable.
+# The script exits with 1 if any metric regressed by more than the tolerance (default 10%).
+
+set -u
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 baseline.json current.json [tolerance_percent]" >&2
+    exit 2
+fi
+
+BASELINE=$1
+CURRENT=$2
+TOLERANCE=${3:-10}
+
+# prints "path value" for every numeric member of a report written by run_bench.sh
+flatten() {
+    awk '
+        /^[ \t]*"[^"]+": *\{/ { match($0, /"[^"]+"/); path[++depth] = substr($0, RSTART + 1, RLENGTH - 2); next }
+        /^[ \t]*\}/           { depth--; next }
+        /^[ \t]*"[^"]+": *-?[0-9]/ {
+            match($0, /"[^"]+"/); key = substr($0, RSTART + 1, RLENGTH - 2)
+            value = $0; sub(/^[^:]*: */, "", value); sub(/,.*$/, "", value)
+            name = ""
+            for(i = 1; i <= depth; i++) name = name path[i] "."
+            print name key, value
+        }
+    ' "$1"
+}
+
+if ! diff <(flatten "$BASELINE" | grep '^config\.') <(flatten "$CURRENT" | grep '^config\.') > /dev/null; then
+    echo "compare: the reports were produced with different configurations" >&2
+    exit 2
+fi
+
+join <(flatten "$BASELINE" | grep -v '^config\.' | sort) <(flatten "$CURRENT" | grep -v '^config\.' | sort) | awk -v tol="$TOLERANCE" '
+    {
+        name = $1; base = $2; cur = $3
+        higher_better = (name ~ /msgs_per_sec$/ || name ~ /received$/ || name ~ /sent$/)
+        change = (base != 0) ? (cur - base) * 100.0 / base : 0
+        regressed = higher_better ? (change < -tol) : (change > tol)
+        status = regressed ? "REGRESSION" : "ok"
+        if(regressed) failed = 1
+        printf "%-45s %14.3f %14.3f %+8.1f%%  %s\n", name, base, cur, change, status
+    }
+    END { exit failed }
+'
@@ -0,0 +1,279 @@
+/*
+ * This program is the measuring probe of the Noise Warning Program benchmark suite (make bench).
+ *
+ * It publishes noise packets at a fixed rate to a set of benchmark rooms ('<prefix>/<n>'),
+ * and measures how long they take to come back:
+ *      direct  - publisher -> broker -> probe, on the room topic
+ *      echo    - publisher -> broker -> nth_313_sub -> broker -> probe, on 'admin/logs/sub'
+ *
+ * A probe packet is a normal packet with one extra field, the send time in nanoseconds:
+ *      institution,location,room,timestamp,noise_level,avg_decibel,health_status,seq,epoch,send_ns
+ * The consumers do not look past the epoch, so they handle it like any other reading.
+ *
+ * At the end of the run, the results are printed as a JSON object to stdout.
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "tls.h"
+
+#define MAX_TOKEN   10
+
+struct latency_log {
+    pthread_mutex_t lock;
+    long *samples;
+    long count;
+    long capacity;
+};
+
+struct latency_log direct_log = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+struct latency_log echo_log = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+char room_prefix[30] = "handong/BENCH";
+volatile int subscribed = 0;
+
+
+/*
+ * This function returns the monotonic time in nanoseconds.
+*/
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * This function appends a latency sample (in nanoseconds) to the given log.
+*/
+void record_latency(struct latency_log *log, long latency) {
+    pthread_mutex_lock(&log->lock);
+    if(log->count == log->capacity) {
+        long capacity = log->capacity ? log->capacity * 2 : 4096;
+        long *samples = realloc(log->samples, capacity * sizeof(long));
+        if(samples == NULL) {
+            pthread_mutex_unlock(&log->lock);
+            return;
+        }
+        log->samples = samples;
+        log->capacity = capacity;
+    }
+    log->samples[log->count++] = latency;
+    pthread_mutex_unlock(&log->lock);
+}
+
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * This function returns the given percentile (0-100) of a sorted sample array in microseconds.
+*/
+double percentile_us(const long *sorted, long count, double pct) {
+    if(count == 0)
+        return 0.0;
+
+    long index = (long)(pct / 100.0 * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+
+void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    char sub_topic[40];
+    char *topics[2];
+
+    if(reason_code != 0){
+        fprintf(stderr, "on_connect: %s\n", mosquitto_connack_string(reason_code));
+        mosquitto_disconnect(mosq);
+        return;
+    }
+
+    snprintf(sub_topic, sizeof(sub_topic), "%s/+", room_prefix);
+    topics[0] = sub_topic;
+    topics[1] = "admin/logs/sub/#";
+    mosquitto_subscribe_multiple(mosq, NULL, 2, topics, 1, 0, NULL);
+}
+
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+    subscribed = 1;
+}
+
+
+/*
+ * This function takes the send time out of a returning probe packet and records its latency.
+ * Packets without the 10th field (the regular publishers also log to 'admin/logs/sub/...') are ignored.
+*/
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    long received = now_ns();
+    const char *payload = msg->payload;
+    const char *field = payload;
+    int commas = 0;
+
+    for(int i=0; i<msg->payloadlen && commas < MAX_TOKEN - 1; i++) {
+        if(payload[i] == ',') {
+            commas++;
+            field = payload + i + 1;
+        }
+    }
+    if(commas < MAX_TOKEN - 1)
+        return;
+
+    long sent = strtol(field, NULL, 10);
+    if(sent <= 0)
+        return;
+
+    if(strncmp(msg->topic, "admin/logs/sub", 14) == 0)
+        record_latency(&echo_log, received - sent);
+    else
+        record_latency(&direct_log, received - sent);
+}
+
+
+/*
+ * This function prints the statistics of one latency log as a JSON object.
+*/
+void print_latency(const char *name, struct latency_log *log, long sent, double duration, int last) {
+    pthread_mutex_lock(&log->lock);
+    qsort(log->samples, log->count, sizeof(long), compare_long);
+
+    printf("    \"%s\": {\n", name);
+    printf("      \"received\": %ld,\n", log->count);
+    printf("      \"loss_ratio\": %.6f,\n", sent > 0 && log->count < sent ? 1.0 - (double)log->count / sent : 0.0);
+    printf("      \"msgs_per_sec\": %.1f,\n", log->count / duration);
+    printf("      \"p50_us\": %.1f,\n", percentile_us(log->samples, log->count, 50));
+    printf("      \"p99_us\": %.1f,\n", percentile_us(log->samples, log->count, 99));
+    printf("      \"max_us\": %.1f\n", log->count ? log->samples[log->count - 1] / 1000.0 : 0.0);
+    printf("    }%s\n", last ? "" : ",");
+    pthread_mutex_unlock(&log->lock);
+}
+
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-r msgs_per_sec] [-d seconds] [-n rooms] [-t room_prefix]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct mosquitto *mosq;
+    char buffer[256];
+    char topic[sizeof(room_prefix) + 24];    // prefix, "/", a room number
+    double rate = 100.0;
+    double duration = 10.0;
+    int rooms = 1;
+    int opt, rc;
+
+    while((opt = getopt(argc, argv, "r:d:n:t:")) != -1) {
+        switch(opt) {
+            case 'r': rate = atof(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'n': rooms = atoi(optarg); break;
+            case 't': snprintf(room_prefix, sizeof(room_prefix), "%s", optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(rate <= 0 || duration <= 0 || rooms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mosquitto_lib_init();
+
+    mosq = mosquitto_new(NULL, true, NULL);
+    if(mosq == NULL){
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_subscribe_callback_set(mosq, on_subscribe);
+    mosquitto_message_callback_set(mosq, on_message);
+    mosquitto_max_inflight_messages_set(mosq, 0);
+
+    /* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+    if(tls_configure(mosq) != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
+    if(rc != MOSQ_ERR_SUCCESS){
+        fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+    rc = mosquitto_loop_start(mosq);
+    if(rc != MOSQ_ERR_SUCCESS){
+        fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    // wait for the SUBACK before sending anything
+    for(int i=0; i<500 && !subscribed; i++)
+        usleep(10000);
+    if(!subscribed) {
+        fprintf(stderr, "Error: no SUBACK from broker\n");
+        return 1;
+    }
+
+    long interval = (long)(1e9 / rate);
+    long start = now_ns();
+    long end = start + (long)(duration * 1e9);
+    long next = start;
+    long epoch = time(NULL);
+    long sent = 0;
+    struct timespec wake;
+
+    // publish at a fixed rate, using absolute deadlines so that slow publishes do not shift the rate
+    while(next < end) {
+        wake.tv_sec = next / 1000000000L;
+        wake.tv_nsec = next % 1000000000L;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+
+        snprintf(topic, sizeof(topic), "%s/%ld", room_prefix, sent % rooms);
+        int len = snprintf(buffer, sizeof(buffer), "handong,BENCH,%ld,000000000000,1,60.000000,1,%ld,%ld,%ld", sent % rooms, sent / rooms + 1, epoch, now_ns());
+        rc = mosquitto_publish(mosq, NULL, topic, len, buffer, 1, false);
+        if(rc != MOSQ_ERR_SUCCESS)
+            fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
+        else
+            sent++;
+
+        next += interval;
+    }
+
+    // give the pipeline a moment to drain
+    sleep(2);
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+
+    double elapsed = (end - start) / 1e9;
+    printf("{\n");
+    printf("  \"probe\": {\n");
+    printf("    \"sent\": %ld,\n", sent);
+    printf("    \"target_msgs_per_sec\": %.1f,\n", rate);
+    printf("    \"msgs_per_sec\": %.1f,\n", sent / elapsed);
+    print_latency("direct", &direct_log, sent, elapsed, 0);
+    print_latency("echo", &echo_log, sent, elapsed, 1);
+    printf("  }\n");
+    printf("}\n");
+
+    mosquitto_destroy(mosq);
+    mosquitto_lib_cleanup();
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * This program reports how many messages report-by-exception (common/report_policy.h) saves on recorded traffic.
+ *
+ * The input is a recording of packets, one per line, as printed by nth_313_pub:
+ *      institution,location,room,timestamp,noise_level,avg_decibel,health_status[,seq]
+ * e.g. a day of every publisher's output ('./bin/nth_313_pub | tee -a day.csv'). Other lines are skipped.
+ * The time of a reading is taken from its timestamp, so the recording is replayed as fast as it can be read.
+ *
+ *      usage: rbe_report [-d deadband] [-b heartbeat_sec] [recording.csv]
+ *
+ * It prints the message count of the current behaviour (every reading to the room or alert topic plus its
+ * copy to 'admin/logs/pub') and of report-by-exception for a grid of deadbands and heartbeats, followed by
+ * the reasons for the sent readings with the given (or default) deadband and heartbeat.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "report_policy.h"
+
+#define MAX_TOKEN       8
+#define MAX_ROOMS       4096
+
+struct reading {
+    int room;
+    int level;
+    double decibel;
+    time_t time;
+};
+
+char room_names[MAX_ROOMS][32];
+int nrooms = 0;
+
+
+/*
+ * This function returns the index of a room ("institution,location,room"), adding it if it is new.
+*/
+int room_index(const char *name) {
+    for(int i=0; i<nrooms; i++) {
+        if(strcmp(room_names[i], name) == 0)
+            return i;
+    }
+    if(nrooms == MAX_ROOMS)
+        return -1;
+    snprintf(room_names[nrooms], sizeof(room_names[nrooms]), "%s", name);
+    return nrooms++;
+}
+
+
+/*
+ * This function converts a 'YYMMDDHHMMSS' timestamp to time_t. It returns -1 if it is malformed.
+*/
+time_t parse_timestamp(const char *text) {
+    struct tm tm;
+
+    if(strlen(text) != 12)
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(text, "%2d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    tm.tm_year += 100;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+
+/*
+ * This function replays the readings through a policy and returns the number of sent readings.
+ * If 'reasons' is not NULL, it counts the sent readings per reason.
+*/
+long replay(const struct reading *readings, long count, const struct report_policy *policy, long *reasons) {
+    static struct report_state states[MAX_ROOMS];
+    long sent = 0;
+
+    for(int i=0; i<nrooms; i++)
+        report_state_init(&states[i]);
+
+    for(long i=0; i<count; i++) {
+        const struct reading *r = &readings[i];
+        enum report_reason reason = report_check(policy, &states[r->room], r->level, r->decibel, r->time);
+        if(reason != REPORT_SUPPRESSED)
+            sent++;
+        if(reasons != NULL)
+            reasons[reason]++;
+    }
+    return sent;
+}
+
+
+int main(int argc, char *argv[]) {
+    static const double deadbands[] = { 1.0, 2.0, 3.0, 5.0, 10.0 };
+    static const long heartbeats[] = { 60, 300, 900, 3600 };
+    struct report_policy policy = { REPORT_EXCEPTION, 3.0, 300 };
+    struct reading *readings = NULL;
+    long count = 0, capacity = 0, skipped = 0;
+    char line[256], name[32];
+    FILE *in = stdin;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:b:")) != -1) {
+        switch(opt) {
+            case 'd': policy.deadband = atof(optarg); break;
+            case 'b': policy.heartbeat = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-d deadband] [-b heartbeat_sec] [recording.csv]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind < argc) {
+        in = fopen(argv[optind], "r");
+        if(in == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+
+    while(fgets(line, sizeof(line), in) != NULL) {
+        char *tokens[MAX_TOKEN];
+        char *save = NULL;
+        int index = 0;
+
+        for(char *t = strtok_r(line, ",\n", &save); t != NULL && index < MAX_TOKEN; t = strtok_r(NULL, ",\n", &save))
+            tokens[index++] = t;
+
+        time_t time = index >= 7 ? parse_timestamp(tokens[3]) : -1;
+        if(time < 0) {
+            skipped++;
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "%s,%s,%s", tokens[0], tokens[1], tokens[2]);
+        int room = room_index(name);
+        if(room < 0) {
+            skipped++;
+            continue;
+        }
+
+        // the array grows with the recording
+        if(count == capacity) {
+            long grown = capacity ? capacity * 2 : 65536;
+            struct reading *more = realloc(readings, grown * sizeof(struct reading));
+            if(more == NULL) {
+                fprintf(stderr, "Error: Out of memory after %ld readings.\n", count);
+                free(readings);
+                return 1;
+            }
+            readings = more;
+            capacity = grown;
+        }
+        readings[count].room = room;
+        readings[count].level = atoi(tokens[4]);
+        readings[count].decibel = atof(tokens[5]);
+        readings[count].time = time;
+        count++;
+    }
+    if(in != stdin)
+        fclose(in);
+
+    if(count == 0) {
+        fprintf(stderr, "No readings found (%ld lines skipped)\n", skipped);
+        return 1;
+    }
+
+    time_t first = readings[0].time, last = readings[count - 1].time;
+    printf("readings: %ld from %d rooms over %.1f hours (%ld lines skipped)\n", count, nrooms, difftime(last, first) / 3600.0, skipped);
+    printf("current behaviour: %ld messages (reading + admin/logs/pub copy)\n\n", count * 2);
+
+    printf("deadband  heartbeat    messages  reduction\n");
+    for(int d=0; d<5; d++) {
+        for(int h=0; h<4; h++) {
+            struct report_policy grid = { REPORT_EXCEPTION, deadbands[d], heartbeats[h] };
+            long sent = replay(readings, count, &grid, NULL);
+            printf("%6.1fdB %9lds %11ld %9.1f%%\n", deadbands[d], heartbeats[h], sent * 2, 100.0 * (count - sent) / count);
+        }
+    }
+
+    long reasons[REPORT_EVERY + 1] = { 0 };
+    long sent = replay(readings, count, &policy, reasons);
+    printf("\ndeadband %.1f dB, heartbeat %ld s: %ld of %ld readings sent (%.1f%% fewer messages)\n",
+           policy.deadband, policy.heartbeat, sent, count, 100.0 * (count - sent) / count);
+    for(int r=REPORT_SUPPRESSED; r<REPORT_EVERY; r++)
+        printf("  %-10s %ld\n", report_reason_name(r), reasons[r]);
+
+    free(readings);
+    return 0;
+}
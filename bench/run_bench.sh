@@ -0,0 +1,193 @@
+#!/bin/bash
+#
+# End-to-end benchmark of the Noise Warning Program (make bench).
+#
+# Starts a private mosquitto on a random local port, launches the components headless,
+# drives them at a fixed rate with bin/noise_bench and prints a JSON report with
+# throughput, p50/p99 latency, CPU per message and peak RSS per component.
+#
+# All knobs are environment variables:
+#   BENCH_PUBLISHERS     number of nth_313_pub instances            (default 4)
+#   BENCH_PUB_SAMPLE_USEC  sample period of those publishers        (default 1000 -> 100 msgs/s each)
+#   BENCH_SUBSCRIBERS    number of nth_313_sub instances (one room each) (default 4)
+#   BENCH_ADMIN_LOGS     number of admin_logs instances             (default 1)
+#   BENCH_ADMIN_ALERTS   number of admin_alerts instances           (default 1)
+#   BENCH_RATE           probe messages per second                  (default 1000)
+#   BENCH_DURATION       measuring time in seconds                  (default 10)
+#   BENCH_OUT            file to write the JSON report to           (default bench_output.json)
+#   BENCH_BASELINE       stored report to compare against           (default: none)
+#   BENCH_TOLERANCE      allowed regression in percent              (default 10)
+#   MOSQUITTO            broker binary                              (default mosquitto)
+#
+# Output of every component goes to a log file in a temporary directory, which is
+# kept (and printed) when the run fails.
+
+set -u
+
+BIN_DIR="$(cd "$(dirname "$0")/.." && pwd)/bin"
+
+PUBLISHERS=${BENCH_PUBLISHERS:-4}
+PUB_SAMPLE_USEC=${BENCH_PUB_SAMPLE_USEC:-1000}
+SUBSCRIBERS=${BENCH_SUBSCRIBERS:-4}
+ADMIN_LOGS=${BENCH_ADMIN_LOGS:-1}
+ADMIN_ALERTS=${BENCH_ADMIN_ALERTS:-1}
+RATE=${BENCH_RATE:-1000}
+DURATION=${BENCH_DURATION:-10}
+OUT=${BENCH_OUT:-bench_output.json}
+BASELINE=${BENCH_BASELINE:-}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+
+WORK_DIR=$(mktemp -d /tmp/noise_bench.XXXXXX)
+PIDS=()
+NAMES=()
+BROKER_PID=
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+fail() {
+    echo "bench: $*" >&2
+    echo "bench: logs kept in $WORK_DIR" >&2
+    exit 1
+}
+
+command -v "$MOSQUITTO" >/dev/null || fail "broker '$MOSQUITTO' not found"
+for bin in nth_313_pub nth_313_sub admin_logs admin_alerts noise_bench; do
+    [ -x "$BIN_DIR/$bin" ] || fail "$BIN_DIR/$bin is missing, run 'make' first"
+done
+
+# --- private broker on a random free port -------------------------------------------------
+
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    PORT=$(( RANDOM % 30000 + 20000 ))
+    printf "listener %d 127.0.0.1\nallow_anonymous true\nmax_queued_messages 100000\n" "$PORT" > "$WORK_DIR/mosquitto.conf"
+    "$MOSQUITTO" -c "$WORK_DIR/mosquitto.conf" > "$WORK_DIR/mosquitto.log" 2>&1 &
+    BROKER_PID=$!
+
+    # the broker is ready when it accepts a TCP connection
+    for i in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+        kill -0 "$BROKER_PID" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -0 "$BROKER_PID" 2>/dev/null && break
+    BROKER_PID=
+done
+[ -n "$BROKER_PID" ] || fail "could not start a private broker"
+
+export NOISE_MQTT_HOST=127.0.0.1
+export NOISE_MQTT_PORT=$PORT
+
+# --- components -----------------------------------------------------------------------------
+
+launch() {
+    local name=$1; shift
+    "$@" > "$WORK_DIR/$name.${#PIDS[@]}.log" 2>&1 &
+    PIDS+=($!)
+    NAMES+=("$name")
+}
+
+for i in $(seq 0 $((ADMIN_LOGS - 1))); do launch admin_logs "$BIN_DIR/admin_logs"; done
+for i in $(seq 0 $((ADMIN_ALERTS - 1))); do launch admin_alerts "$BIN_DIR/admin_alerts"; done
+for i in $(seq 0 $((SUBSCRIBERS - 1))); do
+    NOISE_ROOM="handong/BENCH/$i" launch nth_313_sub "$BIN_DIR/nth_313_sub"
+done
+sleep 0.5
+for i in $(seq 0 $((PUBLISHERS - 1))); do
+    NOISE_ROOM="handong/LOAD/$i" NOISE_SAMPLE_USEC=$PUB_SAMPLE_USEC NOISE_SKIP_TEST_CASES=1 \
+        launch nth_313_pub "$BIN_DIR/nth_313_pub"
+done
+sleep 0.5
+
+for pid in "${PIDS[@]}"; do
+    kill -0 "$pid" 2>/dev/null || fail "a component exited during startup"
+done
+
+# --- measurement ----------------------------------------------------------------------------
+
+# user+system CPU time of a process in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null || echo 0
+}
+
+# peak resident set size of a process in kB
+peak_rss() {
+    awk '/^VmHWM:/ { print $2 }' "/proc/$1/status" 2>/dev/null || echo 0
+}
+
+declare -A CPU_BEFORE
+for pid in "${PIDS[@]}" "$BROKER_PID"; do
+    CPU_BEFORE[$pid]=$(cpu_ticks "$pid")
+done
+
+"$BIN_DIR/noise_bench" -r "$RATE" -d "$DURATION" -n "$(( SUBSCRIBERS > 0 ? SUBSCRIBERS : 1 ))" \
+    -t handong/BENCH > "$WORK_DIR/probe.json" 2> "$WORK_DIR/probe.log" || fail "probe failed"
+
+# messages put into the system during the run: the probe plus the load publishers
+SENT=$(awk -F': ' '/"sent"/ { gsub(",", "", $2); print $2; exit }' "$WORK_DIR/probe.json")
+PUB_MSGS=$(awk -v n="$PUBLISHERS" -v d="$DURATION" -v u="$PUB_SAMPLE_USEC" 'BEGIN { printf "%d", n * d * 1e6 / (10 * u) }')
+TOTAL_MSGS=$(( SENT + PUB_MSGS ))
+[ "$TOTAL_MSGS" -gt 0 ] || TOTAL_MSGS=1
+HZ=$(getconf CLK_TCK)
+
+# per component: instances, CPU microseconds per message and peak RSS
+component_json() {
+    local name=$1 count=0 ticks=0 rss=0 pid
+    for idx in "${!PIDS[@]}"; do
+        [ "${NAMES[$idx]}" = "$name" ] || continue
+        pid=${PIDS[$idx]}
+        count=$((count + 1))
+        ticks=$((ticks + $(cpu_ticks "$pid") - ${CPU_BEFORE[$pid]}))
+        local r; r=$(peak_rss "$pid"); [ "${r:-0}" -gt "$rss" ] && rss=$r
+    done
+    awk -v name="$name" -v c="$count" -v t="$ticks" -v hz="$HZ" -v m="$TOTAL_MSGS" -v rss="$rss" 'BEGIN {
+        printf "    \"%s\": {\n      \"instances\": %d,\n      \"cpu_us_per_msg\": %.3f,\n      \"rss_kb\": %d\n    }", name, c, t * 1e6 / hz / m, rss
+    }'
+}
+
+broker_json() {
+    local ticks=$(( $(cpu_ticks "$BROKER_PID") - ${CPU_BEFORE[$BROKER_PID]} ))
+    awk -v t="$ticks" -v hz="$HZ" -v m="$TOTAL_MSGS" -v rss="$(peak_rss "$BROKER_PID")" 'BEGIN {
+        printf "    \"mosquitto\": {\n      \"instances\": 1,\n      \"cpu_us_per_msg\": %.3f,\n      \"rss_kb\": %d\n    }", t * 1e6 / hz / m, rss
+    }'
+}
+
+{
+    echo "{"
+    echo "  \"config\": {"
+    echo "    \"publishers\": $PUBLISHERS,"
+    echo "    \"pub_sample_usec\": $PUB_SAMPLE_USEC,"
+    echo "    \"subscribers\": $SUBSCRIBERS,"
+    echo "    \"admin_logs\": $ADMIN_LOGS,"
+    echo "    \"admin_alerts\": $ADMIN_ALERTS,"
+    echo "    \"rate\": $RATE,"
+    echo "    \"duration\": $DURATION"
+    echo "  },"
+    echo "  \"total_msgs\": $TOTAL_MSGS,"
+    sed '1d;$d' "$WORK_DIR/probe.json" | sed '$s/$/,/'
+    echo "  \"components\": {"
+    broker_json; echo ","
+    component_json nth_313_pub; echo ","
+    component_json nth_313_sub; echo ","
+    component_json admin_logs; echo ","
+    component_json admin_alerts; echo
+    echo "  }"
+    echo "}"
+} > "$OUT"
+
+cat "$OUT"
+
+cleanup
+trap - EXIT
+rm -rf "$WORK_DIR"
+
+if [ -n "$BASELINE" ]; then
+    "$(dirname "$0")/compare_bench.sh" "$BASELINE" "$OUT" "$TOLERANCE"
+fi
@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# Log capture benchmark (make bench-capture).
+#
+# Runs bin/bench_capture twice, each time against a private mosquitto on a random local port with
+# sys_interval 1:
+#   echo     a plain broker; the readings are logged by republishing them (NOISE_LOG_ECHO=1)
+#   plugin   a broker with bin/noise_log_plugin.so writing into a private ring (NOISE_LOG_ECHO=0)
+# and writes both JSON reports together to BENCH_OUT: readings per second, broker CPU and PUBLISH packets
+# in and out of the broker per reading.
+#
+#   BENCH_MESSAGES       readings per run                           (default 100000)
+#   BENCH_QOS            QoS of the readings and logs               (default 1)
+#   BENCH_OUT            file to write the JSON report to           (default bench_capture.json)
+#   MOSQUITTO            broker binary, 2.0 or later for the plugin (default mosquitto)
+
+set -u
+
+ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+MESSAGES=${BENCH_MESSAGES:-100000}
+QOS=${BENCH_QOS:-1}
+OUT=${BENCH_OUT:-bench_capture.json}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+
+WORK_DIR=$(mktemp -d /tmp/noise_capture_bench.XXXXXX)
+RING=/noise_capture_bench.$$
+BROKER_PID=
+
+stop_broker() {
+    [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null && wait "$BROKER_PID" 2>/dev/null
+    BROKER_PID=
+}
+
+cleanup() {
+    stop_broker
+    rm -f "/dev/shm$RING"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "bench-capture: $*" >&2
+    echo "bench-capture: logs kept in $WORK_DIR" >&2
+    exit 1
+}
+
+# start_broker <mode> [conf lines...]
+start_broker() {
+    local mode=$1
+    shift
+    for attempt in 1 2 3 4 5 6 7 8 9 10; do
+        PORT=$(( RANDOM % 30000 + 20000 ))
+        {
+            echo "listener $PORT 127.0.0.1"
+            echo "allow_anonymous true"
+            echo "sys_interval 1"
+            echo "max_queued_messages 100000"
+            for line in "$@"; do echo "$line"; done
+        } > "$WORK_DIR/$mode.conf"
+        "$MOSQUITTO" -c "$WORK_DIR/$mode.conf" > "$WORK_DIR/mosquitto_$mode.log" 2>&1 &
+        BROKER_PID=$!
+
+        for i in $(seq 50); do
+            (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+            kill -0 "$BROKER_PID" 2>/dev/null || break
+            sleep 0.1
+        done
+        kill -0 "$BROKER_PID" 2>/dev/null && return 0
+        BROKER_PID=
+    done
+    fail "could not start a private broker ($mode)"
+}
+
+command -v "$MOSQUITTO" >/dev/null || fail "broker '$MOSQUITTO' not found"
+[ -x "$ROOT_DIR/bin/bench_capture" ] || fail "$ROOT_DIR/bin/bench_capture is missing, run 'make bin/bench_capture' first"
+[ -f "$ROOT_DIR/bin/noise_log_plugin.so" ] || fail "$ROOT_DIR/bin/noise_log_plugin.so is missing, run 'make plugin' first"
+
+start_broker echo
+NOISE_MQTT_HOST=127.0.0.1 NOISE_MQTT_PORT="$PORT" \
+    "$ROOT_DIR/bin/bench_capture" -m echo -b "$BROKER_PID" -n "$MESSAGES" -q "$QOS" \
+    > "$WORK_DIR/echo.json" 2> "$WORK_DIR/echo.log" || fail "bench_capture -m echo failed"
+stop_broker
+
+start_broker plugin "plugin $ROOT_DIR/bin/noise_log_plugin.so" "plugin_opt_shm $RING"
+NOISE_MQTT_HOST=127.0.0.1 NOISE_MQTT_PORT="$PORT" \
+    "$ROOT_DIR/bin/bench_capture" -m plugin -s "$RING" -b "$BROKER_PID" -n "$MESSAGES" -q "$QOS" \
+    > "$WORK_DIR/plugin.json" 2> "$WORK_DIR/plugin.log" || fail "bench_capture -m plugin failed"
+stop_broker
+
+{
+    echo "{"
+    echo "  \"echo\": $(cat "$WORK_DIR/echo.json"),"
+    echo "  \"plugin\": $(cat "$WORK_DIR/plugin.json")"
+    echo "}"
+} > "$OUT"
+
+cat "$OUT"
+rm -rf "$WORK_DIR"
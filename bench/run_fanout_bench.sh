@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# Subscriber fan-out benchmark (make bench-fanout).
+#
+# Starts a private mosquitto on a random local port and runs bin/bench_fanout against it three times,
+# ramp, steady and churn, with BENCH_CONNECTIONS subscribers of handong/+/+. The JSON reports of the
+# three scenarios are written together to BENCH_OUT.
+#
+# Every connection takes a file descriptor in the broker and in bench_fanout, so the open file limit is
+# raised to BENCH_NOFILE first (the hard limit may have to be raised too, e.g. in /etc/security/limits.conf).
+#
+#   BENCH_CONNECTIONS    subscriber connections                     (default 10000)
+#   BENCH_THREADS        event loops of bench_fanout                (default 2)
+#   BENCH_RATE           readings per second, each to every subscriber (default 10)
+#   BENCH_SECONDS        measured seconds per scenario              (default 30)
+#   BENCH_CONNECT_RATE   new connections per second of the ramp     (default 2000)
+#   BENCH_CHURN          reconnections per second of the churn      (default 100)
+#   BENCH_QOS            QoS of the readings and subscriptions      (default 0)
+#   BENCH_NOFILE         open file limit                            (default connections + 1024)
+#   BENCH_OUT            file to write the JSON report to           (default bench_fanout.json)
+#   MOSQUITTO            broker binary                              (default mosquitto)
+
+set -u
+
+ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+CONNECTIONS=${BENCH_CONNECTIONS:-10000}
+THREADS=${BENCH_THREADS:-2}
+RATE=${BENCH_RATE:-10}
+SECONDS_RUN=${BENCH_SECONDS:-30}
+CONNECT_RATE=${BENCH_CONNECT_RATE:-2000}
+CHURN=${BENCH_CHURN:-100}
+QOS=${BENCH_QOS:-0}
+NOFILE=${BENCH_NOFILE:-$(( CONNECTIONS + 1024 ))}
+OUT=${BENCH_OUT:-bench_fanout.json}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+
+WORK_DIR=$(mktemp -d /tmp/noise_fanout_bench.XXXXXX)
+BROKER_PID=
+
+cleanup() {
+    [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+fail() {
+    echo "bench-fanout: $*" >&2
+    echo "bench-fanout: logs kept in $WORK_DIR" >&2
+    exit 1
+}
+
+command -v "$MOSQUITTO" >/dev/null || fail "broker '$MOSQUITTO' not found"
+[ -x "$ROOT_DIR/bin/bench_fanout" ] || fail "$ROOT_DIR/bin/bench_fanout is missing, run 'make bin/bench_fanout' first"
+ulimit -n "$NOFILE" 2>/dev/null || fail "cannot raise the open file limit to $NOFILE (hard limit $(ulimit -Hn))"
+
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    PORT=$(( RANDOM % 30000 + 20000 ))
+    cat > "$WORK_DIR/mosquitto.conf" <<CONF
+listener $PORT 127.0.0.1
+allow_anonymous true
+max_connections -1
+max_queued_messages 1000
+CONF
+    "$MOSQUITTO" -c "$WORK_DIR/mosquitto.conf" > "$WORK_DIR/mosquitto.log" 2>&1 &
+    BROKER_PID=$!
+
+    for i in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+        kill -0 "$BROKER_PID" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -0 "$BROKER_PID" 2>/dev/null && break
+    BROKER_PID=
+done
+[ -n "$BROKER_PID" ] || fail "could not start a private broker"
+
+for scenario in ramp steady churn; do
+    echo "bench-fanout: $scenario, $CONNECTIONS connections" >&2
+    NOISE_MQTT_HOST=127.0.0.1 NOISE_MQTT_PORT="$PORT" \
+        "$ROOT_DIR/bin/bench_fanout" -s "$scenario" -c "$CONNECTIONS" -T "$THREADS" -m "$RATE" -d "$SECONDS_RUN" \
+        -r "$CONNECT_RATE" -k "$CHURN" -q "$QOS" \
+        > "$WORK_DIR/$scenario.json" 2> "$WORK_DIR/$scenario.log" || fail "bench_fanout -s $scenario failed"
+    kill -0 "$BROKER_PID" 2>/dev/null || fail "the broker exited during $scenario"
+done
+
+{
+    echo "{"
+    echo "  \"ramp\": $(cat "$WORK_DIR/ramp.json"),"
+    echo "  \"steady\": $(cat "$WORK_DIR/steady.json"),"
+    echo "  \"churn\": $(cat "$WORK_DIR/churn.json")"
+    echo "}"
+} > "$OUT"
+
+cat "$OUT"
+rm -rf "$WORK_DIR"
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Cold-start benchmark of a full site (make bench-startup).
+#
+# Starts bench/startup.topology with bin/noise_supervisor on a private broker (random local port) several
+# times and prints a JSON report: per run, the time until every process was ready and until the first
+# message was delivered to a component, and their min/median/max.
+#
+#   BENCH_RUNS           cold starts                                (default 5)
+#   BENCH_TOPOLOGY       topology to start                          (default bench/startup.topology)
+#   BENCH_OUT            file to write the JSON report to           (default bench_startup.json)
+#   MOSQUITTO            broker binary                              (default mosquitto)
+
+set -u
+
+ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+RUNS=${BENCH_RUNS:-5}
+TOPOLOGY=${BENCH_TOPOLOGY:-$ROOT_DIR/bench/startup.topology}
+OUT=${BENCH_OUT:-bench_startup.json}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+
+WORK_DIR=$(mktemp -d /tmp/noise_startup_bench.XXXXXX)
+
+fail() {
+    echo "bench-startup: $*" >&2
+    echo "bench-startup: logs kept in $WORK_DIR" >&2
+    exit 1
+}
+
+command -v "$MOSQUITTO" >/dev/null || fail "broker '$MOSQUITTO' not found"
+for bin in noise_supervisor nth_313_pub nth_313_sub admin_logs admin_alerts noise_gateway state_cache; do
+    [ -x "$ROOT_DIR/bin/$bin" ] || fail "$ROOT_DIR/bin/$bin is missing, run 'make' first"
+done
+
+cd "$ROOT_DIR" || fail "cannot enter $ROOT_DIR"
+READY=()
+FIRST=()
+for run in $(seq "$RUNS"); do
+    PORT=$(( RANDOM % 30000 + 20000 ))
+    printf "listener %d 127.0.0.1\nallow_anonymous true\nmax_queued_messages 100000\n" "$PORT" > "$WORK_DIR/mosquitto.conf"
+
+    MOSQUITTO="$MOSQUITTO" NOISE_MQTT_HOST=127.0.0.1 NOISE_MQTT_PORT=$PORT BENCH_BROKER_CONF="$WORK_DIR/mosquitto.conf" \
+        "$ROOT_DIR/bin/noise_supervisor" -s -l "$WORK_DIR/run$run" -o "$WORK_DIR/run$run.json" "$TOPOLOGY" \
+        > "$WORK_DIR/run$run.out" 2>&1 || fail "run $run failed (see $WORK_DIR/run$run.out)"
+
+    READY+=("$(awk -F': ' '/"all_ready_ms"/ { gsub(",", "", $2); print $2 }' "$WORK_DIR/run$run.json")")
+    FIRST+=("$(awk -F': ' '/"first_message_ms"/ { gsub(",", "", $2); print $2; exit }' "$WORK_DIR/run$run.json")")
+done
+
+# min, median and max of a list of numbers, as JSON members
+stats() {
+    printf "%s\n" "$@" | sort -n | awk '{ v[NR] = $1 } END {
+        printf "\"min\": %.1f, \"median\": %.1f, \"max\": %.1f", v[1], v[int((NR + 1) / 2)], v[NR]
+    }'
+}
+
+{
+    echo "{"
+    echo "  \"runs\": $RUNS,"
+    echo "  \"all_ready_ms\": [$(IFS=,; echo "${READY[*]}")],"
+    echo "  \"first_message_ms\": [$(IFS=,; echo "${FIRST[*]}")],"
+    echo "  \"all_ready\": { $(stats "${READY[@]}") },"
+    echo "  \"first_message\": { $(stats "${FIRST[@]}") }"
+    echo "}"
+} > "$OUT"
+
+cat "$OUT"
+rm -rf "$WORK_DIR"
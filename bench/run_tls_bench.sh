@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# TLS connection-cost benchmark (make bench-tls).
+#
+# Generates throwaway certificates with tls/gen_certs.sh, starts a private mosquitto with a plaintext
+# and a TLS listener on random local ports and runs bin/bench_tls against it, which prints a JSON report:
+# handshake time and CPU (client and broker) for plaintext, full and resumed TLS handshakes, and the
+# QoS 1 throughput with and without TLS.
+#
+#   BENCH_HANDSHAKES     connects per handshake round               (default 1000)
+#   BENCH_MESSAGES       packets per throughput round               (default 100000)
+#   BENCH_OUT            file to write the JSON report to           (default bench_tls.json)
+#   MOSQUITTO            broker binary                              (default mosquitto)
+#   NOISE_TLS_*          client TLS settings, e.g. NOISE_TLS_VERSION=tlsv1.3 (see common/tls.h)
+
+set -u
+
+ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+HANDSHAKES=${BENCH_HANDSHAKES:-1000}
+MESSAGES=${BENCH_MESSAGES:-100000}
+OUT=${BENCH_OUT:-bench_tls.json}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+
+WORK_DIR=$(mktemp -d /tmp/noise_tls_bench.XXXXXX)
+BROKER_PID=
+
+cleanup() {
+    [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+fail() {
+    echo "bench-tls: $*" >&2
+    echo "bench-tls: logs kept in $WORK_DIR" >&2
+    exit 1
+}
+
+command -v "$MOSQUITTO" >/dev/null || fail "broker '$MOSQUITTO' not found"
+[ -x "$ROOT_DIR/bin/bench_tls" ] || fail "$ROOT_DIR/bin/bench_tls is missing, run 'make bin/bench_tls' first"
+"$ROOT_DIR/tls/gen_certs.sh" "$WORK_DIR/certs" > /dev/null || fail "could not generate certificates"
+
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    PORT=$(( RANDOM % 30000 + 20000 ))
+    TLS_PORT=$(( PORT + 1 ))
+    # the generated listeners, moved to the random ports
+    sed -e "s/^listener 1883$/listener $PORT 127.0.0.1/" -e "s/^listener 8883$/listener $TLS_PORT 127.0.0.1/" \
+        "$WORK_DIR/certs/mosquitto.conf" > "$WORK_DIR/mosquitto.conf"
+    echo "max_queued_messages 100000" >> "$WORK_DIR/mosquitto.conf"
+    "$MOSQUITTO" -c "$WORK_DIR/mosquitto.conf" > "$WORK_DIR/mosquitto.log" 2>&1 &
+    BROKER_PID=$!
+
+    for i in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$TLS_PORT") 2>/dev/null && break
+        kill -0 "$BROKER_PID" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -0 "$BROKER_PID" 2>/dev/null && break
+    BROKER_PID=
+done
+[ -n "$BROKER_PID" ] || fail "could not start a private broker"
+
+NOISE_MQTT_HOST=localhost NOISE_TLS_CAFILE="$WORK_DIR/certs/ca.crt" \
+    "$ROOT_DIR/bin/bench_tls" -p "$PORT" -s "$TLS_PORT" -b "$BROKER_PID" -n "$HANDSHAKES" -m "$MESSAGES" \
+    > "$OUT" 2> "$WORK_DIR/bench_tls.log" || fail "bench_tls failed"
+
+cat "$OUT"
+rm -rf "$WORK_DIR"
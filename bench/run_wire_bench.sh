@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# Wire-size benchmark of the packet formats and MQTT versions (make bench-wire).
+#
+# Starts a private mosquitto on a random local port with sys_interval 1, so $SYS/broker/bytes/* follows
+# every round, and runs bin/bench_wire against it, which prints a JSON report: PUBLISH size, broker
+# bytes in and out and broker CPU per reading for v3.1.1 and v5, full and compact packets, QoS 1 and
+# QoS 0 with topic aliases.
+#
+#   BENCH_MESSAGES       readings per round                         (default 100000)
+#   BENCH_OUT            file to write the JSON report to           (default bench_wire.json)
+#   MOSQUITTO            broker binary, 2.0 or later for MQTT v5    (default mosquitto)
+
+set -u
+
+ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+MESSAGES=${BENCH_MESSAGES:-100000}
+OUT=${BENCH_OUT:-bench_wire.json}
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+
+WORK_DIR=$(mktemp -d /tmp/noise_wire_bench.XXXXXX)
+BROKER_PID=
+
+cleanup() {
+    [ -n "$BROKER_PID" ] && kill "$BROKER_PID" 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+fail() {
+    echo "bench-wire: $*" >&2
+    echo "bench-wire: logs kept in $WORK_DIR" >&2
+    exit 1
+}
+
+command -v "$MOSQUITTO" >/dev/null || fail "broker '$MOSQUITTO' not found"
+[ -x "$ROOT_DIR/bin/bench_wire" ] || fail "$ROOT_DIR/bin/bench_wire is missing, run 'make bin/bench_wire' first"
+
+for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    PORT=$(( RANDOM % 30000 + 20000 ))
+    cat > "$WORK_DIR/mosquitto.conf" <<CONF
+listener $PORT 127.0.0.1
+allow_anonymous true
+sys_interval 1
+max_queued_messages 100000
+CONF
+    "$MOSQUITTO" -c "$WORK_DIR/mosquitto.conf" > "$WORK_DIR/mosquitto.log" 2>&1 &
+    BROKER_PID=$!
+
+    for i in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+        kill -0 "$BROKER_PID" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -0 "$BROKER_PID" 2>/dev/null && break
+    BROKER_PID=
+done
+[ -n "$BROKER_PID" ] || fail "could not start a private broker"
+
+NOISE_MQTT_HOST=127.0.0.1 NOISE_MQTT_PORT="$PORT" NOISE_TLS=0 \
+    "$ROOT_DIR/bin/bench_wire" -b "$BROKER_PID" -n "$MESSAGES" \
+    > "$OUT" 2> "$WORK_DIR/bench_wire.log" || fail "bench_wire failed"
+
+cat "$OUT"
+rm -rf "$WORK_DIR"
@@ -0,0 +1,238 @@
+/*
+ * This program is the current-state cache of Noise Warning Program.
+ * It keeps the latest reading, noise level and health status of every room in memory
+ * (common/state_table.c), so that a display or operator tool does not have to wait for the next reading.
+ *
+ * 1. Request/response queries (MQTT v5)
+ *    A client publishes a query to 'state/query' with a Response Topic (and optionally Correlation Data).
+ *    The answer is published to the response topic with the same Correlation Data.
+ *        "point handong/NTH/313"     the room
+ *        "prefix handong/NTH"        every room of a location (or "prefix handong" for an institution)
+ *        "level 2"                   every room at noise level 2 or higher
+ *    The answer has the number of rooms on the first line and one room per line after it:
+ *        institution/location/room,timestamp,noise_level,avg_decibel,health_status,seq
+ *
+ * 2. Retained snapshots
+ *    The state of every room is published retained to 'state/rooms/<institution>/<location>/<room>' as
+ *        timestamp,noise_level,avg_decibel,health_status,seq
+ *    whenever its level or health status changes, and at least every NOISE_CACHE_RETAIN_SEC seconds
+ *    (default 60) while it keeps reporting. A new subscriber to 'state/rooms/#' gets every room at once.
+ *
+ *      NOISE_CACHE_TOPICS          room topics to cache          (default handong/+/+)
+ *      NOISE_CACHE_MAX_RESPONSE    max size of an answer (bytes) (default 1048576)
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "config.h"
+#include "packet.h"
+#include "ready.h"
+#include "state_table.h"
+#include "tls.h"
+#include "transport.h"
+#include "vclock.h"
+
+char topics[256];
+char *const alert_topic = "admin/alerts/#";
+char *const query_topic = "state/query";
+char *const snapshot_prefix = "state/rooms";
+
+// subscriptions go through a transport, so a supervisor knows when they are granted (common/ready.h)
+struct transport *transport = NULL;
+
+struct state_table table;
+char *response = NULL;
+int response_size = 1048576;
+long retain_sec = 60;
+
+/*
+ * This function subscribes to the room topics, the alert topic and the query topic.
+*/
+void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    char copy[256];
+    char *save = NULL;
+    int rc = MOSQ_ERR_SUCCESS;
+
+    printf("on_connect: %s\n", mosquitto_connack_string(reason_code));
+    if(reason_code != 0){
+        mosquitto_disconnect(mosq);
+        return;
+    }
+
+    snprintf(copy, sizeof(copy), "%s", topics);
+    for(char *t = strtok_r(copy, ",", &save); t != NULL && rc == MOSQ_ERR_SUCCESS; t = strtok_r(NULL, ",", &save))
+        rc = transport_subscribe(transport, t, 1);
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = transport_subscribe(transport, alert_topic, 1);
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = transport_subscribe(transport, query_topic, 1);
+
+    if(rc != MOSQ_ERR_SUCCESS){
+        fprintf(stderr, "Error subscribing: %s\n", mosquitto_strerror(rc));
+        mosquitto_disconnect(mosq);
+    }
+}
+
+
+/*
+ * This function stores a reading and publishes the retained snapshot of the room if needed.
+*/
+void handle_reading(struct mosquitto *mosq, const struct mosquitto_message *msg)
+{
+    char *tokens[PACKET_FIELDS];
+    char room[PACKET_ROOM_LEN];
+    char key[STATE_KEY_LEN + 1], topic[64], snapshot[96];     // a key cut at STATE_KEY_LEN is still too long
+    int index, changed, len, rc;
+
+    // a full packet, or a compact one with the room in the topic (see common/packet.h)
+    index = packet_parse(msg->topic, msg->payload, msg->payloadlen, tokens, room);
+    if(index < 7)
+        return;
+
+    snprintf(key, sizeof(key), "%s/%s/%s", tokens[0], tokens[1], tokens[2]);
+    struct state_entry *e = state_update(&table, key, tokens[3], atoi(tokens[4]), atof(tokens[5]), atoi(tokens[6]),
+                                         index > 7 ? strtoul(tokens[7], NULL, 10) : 0, &changed);
+    if(e == NULL && strlen(key) >= STATE_KEY_LEN) {
+        // rooms are not truncated into each other; the first one and every 1000th are reported
+        if(table.rejected % 1000 == 1)
+            fprintf(stderr, "Ignoring rooms with a name of %d characters or more (%lu readings, e.g. %s...)\n",
+                    STATE_KEY_LEN, table.rejected, key);
+        return;
+    }
+    if(e == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return;
+    }
+
+    time_t now = vclock_time();
+    if(!changed && now - e->retained_at < retain_sec)
+        return;
+    e->retained_at = now;
+
+    snprintf(topic, sizeof(topic), "%s/%s", snapshot_prefix, key);
+    len = snprintf(snapshot, sizeof(snapshot), "%s,%d,%f,%d,%u", e->timestamp, e->level, e->decibel, e->health, e->seq);
+    rc = mosquitto_publish(mosq, NULL, topic, len, snapshot, 1, true);
+    if(rc != MOSQ_ERR_SUCCESS){
+        fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
+    }
+}
+
+
+/*
+ * This function answers a query on the response topic of the request, with its correlation data.
+*/
+void handle_query(struct mosquitto *mosq, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+    char *response_topic = NULL;
+    void *correlation = NULL;
+    uint16_t correlation_len = 0;
+    mosquitto_property *reply_props = NULL;
+    char query[128];
+    int len, rc;
+
+    if(mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false) == NULL) {
+        fprintf(stderr, "Ignoring query without response topic\n");
+        return;
+    }
+    mosquitto_property_read_binary(props, MQTT_PROP_CORRELATION_DATA, &correlation, &correlation_len, false);
+
+    snprintf(query, sizeof(query), "%.*s", msg->payloadlen, (char *)msg->payload);
+    len = state_answer(&table, query, response, response_size);
+    if(len < 0)
+        len = snprintf(response, response_size, "error,unknown query '%s'", query);
+
+    if(correlation != NULL)
+        mosquitto_property_add_binary(&reply_props, MQTT_PROP_CORRELATION_DATA, correlation, correlation_len);
+
+    rc = mosquitto_publish_v5(mosq, NULL, response_topic, len, response, 0, false, reply_props);
+    if(rc != MOSQ_ERR_SUCCESS){
+        fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
+    }
+
+    mosquitto_property_free_all(&reply_props);
+    free(correlation);
+    free(response_topic);
+}
+
+
+/*
+ * Callback called when the client receives a message.
+ * Everything runs on the network thread, so the table needs no locking.
+*/
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg, const mosquitto_property *props)
+{
+    ready_first_message();
+    if(strcmp(msg->topic, query_topic) == 0)
+        handle_query(mosq, msg, props);
+    else
+        handle_reading(mosq, msg);
+}
+
+
+int main(int argc, char *argv[])
+{
+    printf("----------------------\n");
+    printf("      STATE CACHE     \n");
+    printf("----------------------\n\n");
+
+    struct mosquitto *mosq = NULL;
+    int rc;
+
+    snprintf(topics, sizeof(topics), "%s", config_str("NOISE_CACHE_TOPICS", "handong/+/+"));
+    response_size = config_long("NOISE_CACHE_MAX_RESPONSE", response_size);
+    retain_sec = config_long("NOISE_CACHE_RETAIN_SEC", retain_sec);
+
+    response = malloc(response_size);
+    if(response == NULL || state_table_init(&table) != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    /* Required before calling other mosquitto functions */
+    mosquitto_lib_init();
+
+    mosq = mosquitto_new(NULL, true, NULL);
+    if(mosq == NULL){
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    /* Configure callbacks. This should be done before connecting ideally. */
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_message_v5_callback_set(mosq, on_message);
+
+    transport = transport_create(mosq, NULL, NULL);
+    if(transport == NULL){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+    /* Request/response needs MQTT v5 (response topic and correlation data properties), whatever NOISE_MQTT_VERSION says */
+    transport_set_protocol(transport, MQTT_PROTOCOL_V5);
+
+    /* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+    if(tls_configure(mosq) != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
+    if(rc != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+        return 1;
+    }
+
+    /* Run the network loop in a blocking call. Queries are answered from the message callback. */
+    mosquitto_loop_forever(mosq, -1, 1);
+
+    state_table_free(&table);
+    free(response);
+    mosquitto_lib_cleanup();
+    return 0;
+}
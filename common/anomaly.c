@@ -0,0 +1,428 @@
+/*
+ * Streaming per-room anomaly detector (see anomaly.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "anomaly.h"
+#include "config.h"
+
+#define NONE            (-1)
+#define MAX_GAP         60          // seconds one reading stands for at most (e.g. after a restart)
+#define OVERALL_MEMORY  86400       // memory of the overall baseline, seconds
+#define SEEN_MAX        65535
+#define CENTI(x)        ((x) < 0 ? 0 : (x) > 655.35 ? 65535 : (uint16_t)((x) * 100 + 0.5))
+
+#define CHECKPOINT_MAGIC    0x4d4e414e      // "NANM"
+#define CHECKPOINT_VERSION  1
+
+struct checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t room_size;         // sizeof(struct anomaly_room) of the writer
+    uint32_t buckets;
+    int32_t count;
+    uint32_t reserved;
+    uint64_t checksum;          // of the room records
+};
+
+
+void anomaly_options_from_config(struct anomaly_options *opts) {
+    opts->z_enter = config_double("NOISE_ANOMALY_Z", 3.0);
+    opts->z_exit = config_double("NOISE_ANOMALY_Z_EXIT", 2.0);
+    opts->persist = config_long("NOISE_ANOMALY_PERSIST", 3);
+    opts->min_std = config_double("NOISE_ANOMALY_MIN_STD", 2.0);
+    opts->memory = config_long("NOISE_ANOMALY_MEMORY", 10800);
+    opts->warmup = config_long("NOISE_ANOMALY_WARMUP", 1800);
+}
+
+
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u;
+
+    while(*key)
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    return hash;
+}
+
+
+static int32_t *new_slots(int32_t n) {
+    int32_t *slots = malloc(n * sizeof(int32_t));
+
+    if(slots != NULL)
+        memset(slots, 0xff, n * sizeof(int32_t));
+    return slots;
+}
+
+
+int anomaly_table_init(struct anomaly_table *table, const struct anomaly_options *opts) {
+    memset(table, 0, sizeof(struct anomaly_table));
+    table->opts = *opts;
+    if(table->opts.persist < 1)
+        table->opts.persist = 1;
+    if(table->opts.memory < 1)
+        table->opts.memory = 1;
+
+    table->nslots = 1024;
+    table->slots = new_slots(table->nslots);
+    return table->slots == NULL ? -1 : 0;
+}
+
+
+void anomaly_table_free(struct anomaly_table *table) {
+    free(table->rooms);
+    free(table->slots);
+    memset(table, 0, sizeof(struct anomaly_table));
+}
+
+
+/*
+ * This function returns the hash slot of 'key': the slot holding it, or the empty slot where it belongs.
+*/
+static int32_t find_slot(const struct anomaly_table *table, const char *key) {
+    uint32_t mask = table->nslots - 1;
+    uint32_t i = hash_key(key) & mask;
+
+    while(table->slots[i] != NONE && strcmp(table->rooms[table->slots[i]].key, key) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+
+/*
+ * This function builds the hash table again for 'nslots' slots.
+*/
+static int rehash(struct anomaly_table *table, int32_t nslots) {
+    int32_t *slots = new_slots(nslots);
+
+    if(slots == NULL)
+        return -1;
+    free(table->slots);
+    table->slots = slots;
+    table->nslots = nslots;
+    for(int32_t r=0; r<table->count; r++)
+        table->slots[find_slot(table, table->rooms[r].key)] = r;
+    return 0;
+}
+
+
+/*
+ * This function adds a room that has not reported yet. It returns its index or NONE if out of memory.
+*/
+static int32_t add_room(struct anomaly_table *table, int32_t slot, const char *key) {
+    struct anomaly_room *room;
+
+    if(table->count == table->capacity) {
+        int32_t cap = table->capacity ? table->capacity * 2 : 1024;
+        struct anomaly_room *rooms = realloc(table->rooms, (size_t)cap * sizeof(struct anomaly_room));
+        if(rooms == NULL)
+            return NONE;
+        table->rooms = rooms;
+        table->capacity = cap;
+    }
+
+    if((table->count + 1) * 2 > table->nslots) {
+        if(rehash(table, table->nslots * 2) != 0)
+            return NONE;
+        slot = find_slot(table, key);
+    }
+
+    room = &table->rooms[table->count];
+    memset(room, 0, sizeof(struct anomaly_room));      // also the padding, which goes into checkpoints
+    strcpy(room->key, key);        // anomaly_update() checked the length
+    table->slots[slot] = table->count;
+    return table->count++;
+}
+
+
+const struct anomaly_room *anomaly_lookup(const struct anomaly_table *table, const char *key) {
+    int32_t idx = table->slots[find_slot(table, key)];
+
+    return idx == NONE ? NULL : &table->rooms[idx];
+}
+
+
+/*
+ * This function parses a 'YYMMDDHHMMSS' timestamp into seconds since 2000-01-01 and the hour of the week.
+ * It returns -1 if the timestamp is malformed.
+*/
+static int parse_time(const char *ts, int64_t *seconds, int *hour_of_week) {
+    int f[6];
+    int64_t y, m, era, yoe, doy, doe, days;
+
+    for(int i=0; i<6; i++) {
+        if(ts[2*i] < '0' || ts[2*i] > '9' || ts[2*i+1] < '0' || ts[2*i+1] > '9')
+            return -1;
+        f[i] = (ts[2*i] - '0') * 10 + ts[2*i+1] - '0';
+    }
+    if(f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > 31 || f[3] > 23 || f[4] > 59 || f[5] > 60)
+        return -1;
+
+    // days from civil (proleptic Gregorian), counted from 2000-01-01
+    y = 2000 + f[0] - (f[1] <= 2);
+    m = f[1];
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + f[2] - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = era * 146097 + doe - 730425;
+
+    *seconds = days * 86400 + f[3] * 3600 + f[4] * 60 + f[5];
+    *hour_of_week = ((days % 7 + 12) % 7) * 24 + f[3];     // 2000-01-01 was a Saturday (day 5 from Monday)
+    return 0;
+}
+
+
+/*
+ * This function moves a baseline (mean and variance in dB, 'seen' seconds of readings) towards a reading
+ * that stands for 'dt' seconds. Until 'memory' seconds are seen it is the plain average of all readings,
+ * after that an exponentially weighted one.
+*/
+static void learn(double *mean, double *var, double seen, double x, double dt, double memory, const struct anomaly_options *opts) {
+    double a = dt / (seen + dt < memory ? seen + dt : memory);
+    double limit = opts->z_enter * sqrt(*var > opts->min_std * opts->min_std ? *var : opts->min_std * opts->min_std);
+    double d = x - *mean;
+
+    if(a > 1)
+        a = 1;
+    if(d > limit)
+        d = limit;
+    else if(d < -limit)
+        d = -limit;
+    *mean += a * d;
+    *var = (1 - a) * (*var + a * d * d);
+}
+
+
+/*
+ * This function scores a reading of a room against its baseline and then learns from it.
+ * 'event' gets the score (may be NULL). It returns the change of the room's anomaly state (ANOMALY_*),
+ * or -1 if the timestamp is malformed, the key has ANOMALY_KEY_LEN characters or more, or out of memory.
+*/
+int anomaly_update(struct anomaly_table *table, const char *key, const char *timestamp, double decibel, struct anomaly_event *event) {
+    const struct anomaly_options *opts = &table->opts;
+    struct anomaly_event score = { 0, 0, 0, -1 };
+    struct anomaly_room *room;
+    struct anomaly_bucket *bucket;
+    int32_t slot, idx;
+    int64_t now, gap;
+    int hour, kind = ANOMALY_NONE;
+    double mean, var, dt;
+
+    if(strlen(key) >= ANOMALY_KEY_LEN) {
+        table->rejected++;
+        return -1;
+    }
+    if(parse_time(timestamp, &now, &hour) != 0)
+        return -1;
+
+    slot = find_slot(table, key);
+    idx = table->slots[slot];
+    if(idx == NONE && (idx = add_room(table, slot, key)) == NONE)
+        return -1;
+    room = &table->rooms[idx];
+    bucket = &room->buckets[hour];
+
+    gap = room->seen == 0 ? 1 : now - room->last;
+    dt = gap < 1 ? 1 : gap > MAX_GAP ? MAX_GAP : gap;
+    room->last = now;
+
+    // score against the hour of the week if it is known, else against the overall baseline
+    if(bucket->seen >= opts->warmup) {
+        score.mean = bucket->mean / 100.0;
+        score.dev = bucket->dev / 100.0;
+        score.seasonal = 1;
+    }
+    else if(room->seen >= opts->warmup) {
+        score.mean = room->mean;
+        score.dev = sqrt(room->var);
+        score.seasonal = 0;
+    }
+
+    if(score.seasonal >= 0) {
+        score.z = (decibel - score.mean) / (score.dev > opts->min_std ? score.dev : opts->min_std);
+
+        // enter after 'persist' readings in a row, leave below z_exit (or when it flips side)
+        int side = score.z >= opts->z_enter ? 1 : score.z <= -opts->z_enter ? -1 : 0;
+        if(room->state == 0) {
+            room->streak = side == 0 ? 0 : room->streak < 255 ? room->streak + 1 : 255;
+            if(room->streak >= opts->persist) {
+                room->state = side;
+                room->streak = 0;
+                kind = side > 0 ? ANOMALY_LOUD : ANOMALY_QUIET;
+            }
+        }
+        else if(fabs(score.z) < opts->z_exit || score.z * room->state < 0) {
+            room->state = 0;
+            kind = ANOMALY_CLEAR;
+        }
+    }
+
+    // learn: the overall baseline, then the bucket (which starts from the overall deviation)
+    if(room->seen == 0) {
+        room->mean = decibel;
+        room->var = opts->min_std * opts->min_std;
+    }
+    else {
+        mean = room->mean;
+        var = room->var;
+        learn(&mean, &var, room->seen, decibel, dt, OVERALL_MEMORY, opts);
+        room->mean = mean;
+        room->var = var;
+    }
+    room->seen = room->seen + dt < UINT32_MAX ? room->seen + dt : UINT32_MAX;
+
+    if(bucket->seen == 0) {
+        mean = decibel;
+        var = room->var;
+    }
+    else {
+        mean = bucket->mean / 100.0;
+        var = bucket->dev / 100.0 * (bucket->dev / 100.0);
+        learn(&mean, &var, bucket->seen, decibel, dt, opts->memory, opts);
+    }
+    bucket->mean = CENTI(mean);
+    bucket->dev = CENTI(sqrt(var));
+    bucket->seen = bucket->seen + dt < SEEN_MAX ? bucket->seen + dt : SEEN_MAX;
+
+    if(event != NULL)
+        *event = score;
+    return kind;
+}
+
+
+/*
+ * This function makes 'copy' (initialized, or a copy made before) a copy of 'table', reusing its memory.
+ * It returns 0, or -1 if out of memory; 'copy' is then unchanged.
+*/
+int anomaly_snapshot(struct anomaly_table *copy, const struct anomaly_table *table) {
+    if(copy->capacity < table->count) {
+        struct anomaly_room *rooms = realloc(copy->rooms, (size_t)table->capacity * sizeof(struct anomaly_room));
+        if(rooms == NULL)
+            return -1;
+        copy->rooms = rooms;
+        copy->capacity = table->capacity;
+    }
+    if(copy->nslots != table->nslots) {
+        int32_t *slots = realloc(copy->slots, table->nslots * sizeof(int32_t));
+        if(slots == NULL)
+            return -1;
+        copy->slots = slots;
+        copy->nslots = table->nslots;
+    }
+
+    copy->opts = table->opts;
+    copy->count = table->count;
+    copy->rejected = table->rejected;
+    memcpy(copy->rooms, table->rooms, (size_t)table->count * sizeof(struct anomaly_room));
+    memcpy(copy->slots, table->slots, table->nslots * sizeof(int32_t));
+    return 0;
+}
+
+
+static uint64_t checksum(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t word;
+    size_t i;
+
+    // 8 bytes per step: a checkpoint of 100k rooms is about 100 MB
+    for(i=0; i + 8 <= size; i += 8) {
+        memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for(; i<size; i++)
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    return hash;
+}
+
+
+/*
+ * This function writes the table to 'path'. The file is written next to it and renamed,
+ * so a crash while saving leaves the previous checkpoint. It returns 0 on success and -1 on error.
+*/
+int anomaly_save(const struct anomaly_table *table, const char *path) {
+    struct checkpoint_header header;
+    size_t size = (size_t)table->count * sizeof(struct anomaly_room);
+    char tmp[512];
+    FILE *fp;
+    int ok;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.room_size = sizeof(struct anomaly_room);
+    header.buckets = ANOMALY_BUCKETS;
+    header.count = table->count;
+    header.checksum = checksum(table->rooms, size);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 && (size == 0 || fwrite(table->rooms, size, 1, fp) == 1);
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * This function replaces the rooms of the table with the checkpoint in 'path' (the options are kept).
+ * It returns the number of rooms loaded, or -1 if the file is missing, from another version or damaged;
+ * the table is then unchanged.
+*/
+int anomaly_load(struct anomaly_table *table, const char *path) {
+    struct checkpoint_header header;
+    struct anomaly_room *rooms = NULL;
+    int32_t capacity = 1024, nslots = 1024;
+    FILE *fp = fopen(path, "rb");
+    size_t size;
+
+    if(fp == NULL)
+        return -1;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CHECKPOINT_MAGIC ||
+       header.version != CHECKPOINT_VERSION || header.room_size != sizeof(struct anomaly_room) ||
+       header.buckets != ANOMALY_BUCKETS || header.count < 0) {
+        fprintf(stderr, "Error: %s is not an anomaly checkpoint of this version\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    while(capacity < header.count)
+        capacity *= 2;
+    while(nslots < header.count * 2 + 2)
+        nslots *= 2;
+    size = (size_t)header.count * sizeof(struct anomaly_room);
+    rooms = malloc((size_t)capacity * sizeof(struct anomaly_room));
+    if(rooms == NULL || (size > 0 && fread(rooms, size, 1, fp) != 1) || checksum(rooms, size) != header.checksum) {
+        fprintf(stderr, "Error: %s is truncated or damaged\n", path);
+        free(rooms);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    free(table->rooms);
+    table->rooms = rooms;
+    table->count = header.count;
+    table->capacity = capacity;
+    if(rehash(table, nslots) != 0) {
+        table->count = 0;
+        return -1;
+    }
+    return table->count;
+}
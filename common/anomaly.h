@@ -0,0 +1,108 @@
+/*
+ * Streaming per-room noise anomaly detector.
+ *
+ * The fixed thresholds of cal_alert_level() cannot tell a loud library from a quiet lecture hall, so the
+ * detector learns what is normal for every room and flags readings that deviate from the room's own baseline.
+ * Per room it keeps, in constant memory (about 1 KB):
+ *  - one baseline per hour of the week (168 buckets): exponentially weighted mean and deviation of the
+ *    decibel, so Monday 10:00 is compared with earlier Mondays at 10:00,
+ *  - one overall baseline of about the last day, used while the bucket of the current hour has not seen
+ *    enough readings.
+ * The weights follow the time between readings, not their number, so a room that reports every second
+ * and one that reports by exception (report_policy.h) learn at the same speed.
+ *
+ * A reading scores z = (decibel - mean) / max(deviation, min_std). A room enters an anomaly after 'persist'
+ * readings in a row with |z| >= z_enter (loud or quiet) and leaves it when |z| drops below z_exit, so an
+ * event is reported once and not for every reading. Deviations are clipped to z_enter deviations before
+ * they update the baseline, so that an event does not become the new normal.
+ *
+ * A key of ANOMALY_KEY_LEN characters or more is rejected (and counted), never truncated: two rooms with a
+ * long common prefix would otherwise share one baseline.
+ *
+ * The table can be checkpointed to a file and loaded again, so a restart keeps what was learned.
+ * anomaly_snapshot() copies the table (a memcpy, a few ms for 100k rooms), so a checkpoint can be written
+ * from the copy while the table keeps learning.
+ *
+ *      NOISE_ANOMALY_Z             |z| to enter an anomaly                        (default 3.0)
+ *      NOISE_ANOMALY_Z_EXIT        |z| below which it ends                        (default 2.0)
+ *      NOISE_ANOMALY_PERSIST       readings in a row to enter                     (default 3)
+ *      NOISE_ANOMALY_MIN_STD       smallest deviation used, dB                    (default 2.0)
+ *      NOISE_ANOMALY_MEMORY        memory of an hour bucket, in seconds of readings in that hour
+ *                                  (default 10800: about the last 3 weeks)
+ *      NOISE_ANOMALY_WARMUP        seconds of readings before a baseline is used  (default 1800)
+ *
+ * The table is not thread safe.
+*/
+
+#ifndef NOISE_ANOMALY_H
+#define NOISE_ANOMALY_H
+
+#include <stdint.h>
+
+#define ANOMALY_KEY_LEN     32
+#define ANOMALY_BUCKETS     168         // hours of a week, Monday 00:00 first
+
+enum anomaly_kind {
+    ANOMALY_NONE = 0,       // no change (normal, learning, or still in the same anomaly)
+    ANOMALY_LOUD,           // the room became louder than usual
+    ANOMALY_QUIET,          // the room became quieter than usual (e.g. a muffled or dead sensor)
+    ANOMALY_CLEAR           // the room is back to normal
+};
+
+struct anomaly_options {
+    double z_enter;
+    double z_exit;
+    double min_std;
+    int persist;
+    long memory;            // seconds
+    long warmup;            // seconds
+};
+
+// one hour of the week, in 1/100 dB
+struct anomaly_bucket {
+    uint16_t mean;
+    uint16_t dev;
+    uint16_t seen;          // seconds of readings, saturating
+};
+
+struct anomaly_room {
+    char key[ANOMALY_KEY_LEN];
+    int64_t last;           // time of the last reading, seconds since 2000-01-01
+    float mean;             // overall baseline
+    float var;
+    uint32_t seen;
+    int8_t state;           // -1 quiet anomaly, 0 normal, 1 loud anomaly
+    uint8_t streak;         // readings in a row beyond z_enter
+    struct anomaly_bucket buckets[ANOMALY_BUCKETS];
+};
+
+// the score of a reading against the baseline it was compared with
+struct anomaly_event {
+    double z;
+    double mean;
+    double dev;
+    int seasonal;           // 1 = hour bucket, 0 = overall baseline, -1 = still learning
+};
+
+struct anomaly_table {
+    struct anomaly_options opts;
+    struct anomaly_room *rooms;
+    int32_t count, capacity;
+    int32_t *slots;         // hash table of room indexes, -1 if empty
+    int32_t nslots;
+    unsigned long rejected;     // readings with a key too long
+};
+
+void anomaly_options_from_config(struct anomaly_options *opts);
+
+int anomaly_table_init(struct anomaly_table *table, const struct anomaly_options *opts);
+void anomaly_table_free(struct anomaly_table *table);
+
+int anomaly_update(struct anomaly_table *table, const char *key, const char *timestamp, double decibel, struct anomaly_event *event);
+const struct anomaly_room *anomaly_lookup(const struct anomaly_table *table, const char *key);
+
+int anomaly_snapshot(struct anomaly_table *copy, const struct anomaly_table *table);
+int anomaly_save(const struct anomaly_table *table, const char *path);
+int anomaly_load(struct anomaly_table *table, const char *path);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Environment based configuration (see config.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+
+/*
+ * This function returns the value of the environment variable 'name'.
+ * If the variable is not set or empty, it returns the default value.
+*/
+const char *config_str(const char *name, const char *def) {
+    const char *value = getenv(name);
+
+    if(value == NULL || value[0] == '\0')
+        return def;
+    return value;
+}
+
+
+/*
+ * This function returns the environment variable 'name' as an integer.
+ * If the variable is not set or is not a number, it returns the default value.
+*/
+long config_long(const char *name, long def) {
+    const char *value = getenv(name);
+    char *end;
+    long result;
+
+    if(value == NULL || value[0] == '\0')
+        return def;
+
+    result = strtol(value, &end, 10);
+    if(*end != '\0') {
+        fprintf(stderr, "Ignoring invalid value for %s: %s\n", name, value);
+        return def;
+    }
+    return result;
+}
+
+
+/*
+ * This function returns the environment variable 'name' as a floating point number.
+ * If the variable is not set or is not a number, it returns the default value.
+*/
+double config_double(const char *name, double def) {
+    const char *value = getenv(name);
+    char *end;
+    double result;
+
+    if(value == NULL || value[0] == '\0')
+        return def;
+
+    result = strtod(value, &end);
+    if(*end != '\0') {
+        fprintf(stderr, "Ignoring invalid value for %s: %s\n", name, value);
+        return def;
+    }
+    return result;
+}
+
+
+const char *config_mqtt_host(void) {
+    return config_str("NOISE_MQTT_HOST", MQTT_HOST);
+}
+
+
+int config_mqtt_port(void) {
+    return (int)config_long("NOISE_MQTT_PORT", config_long("NOISE_TLS", 0) ? MQTT_TLS_PORT : MQTT_PORT);
+}
+
+
+/*
+ * This function reads the room identity from NOISE_ROOM ("institution/location/room").
+ * The given buffers keep their current (default) values if NOISE_ROOM is not set.
+ * It returns 1 if the room was overridden, 0 if not, and -1 if NOISE_ROOM is malformed.
+*/
+int config_room(char *institution, char *location, char *room, int size) {
+    const char *value = getenv("NOISE_ROOM");
+    char copy[128];
+    char *save = NULL;
+    char *parts[3];
+
+    if(value == NULL || value[0] == '\0')
+        return 0;
+
+    snprintf(copy, sizeof(copy), "%s", value);
+    parts[0] = strtok_r(copy, "/", &save);
+    parts[1] = strtok_r(NULL, "/", &save);
+    parts[2] = strtok_r(NULL, "/", &save);
+    if(parts[0] == NULL || parts[1] == NULL || parts[2] == NULL || strtok_r(NULL, "/", &save) != NULL) {
+        fprintf(stderr, "Ignoring invalid NOISE_ROOM (expected institution/location/room): %s\n", value);
+        return -1;
+    }
+
+    snprintf(institution, size, "%s", parts[0]);
+    snprintf(location, size, "%s", parts[1]);
+    snprintf(room, size, "%s", parts[2]);
+    return 1;
+}
@@ -0,0 +1,28 @@
+/*
+ * Runtime configuration shared by every component of the Noise Warning Program.
+ *
+ * Each value has a compiled-in default (the values used in the lab setup) and can be
+ * overridden with an environment variable, so the same binaries can be started by hand,
+ * by run_program.sh, or headless by the benchmark suite on a private broker.
+ *
+ *      NOISE_MQTT_HOST     broker address          (default 127.0.0.1)
+ *      NOISE_MQTT_PORT     broker port             (default 1883, 8883 with NOISE_TLS=1, see tls.h)
+*/
+
+#ifndef NOISE_CONFIG_H
+#define NOISE_CONFIG_H
+
+#define MQTT_HOST   "127.0.0.1"
+#define MQTT_PORT   1883
+#define MQTT_TLS_PORT   8883
+
+const char *config_mqtt_host(void);
+int config_mqtt_port(void);
+
+const char *config_str(const char *name, const char *def);
+long config_long(const char *name, long def);
+double config_double(const char *name, double def);
+
+int config_room(char *institution, char *location, char *room, int size);
+
+#endif
@@ -0,0 +1,657 @@
+/*
+ * Durable log of admin_logs (see log_store.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log_store.h"
+#include "config.h"
+
+#define INDEX_MAGIC     0x474c4f4e      // "NOLG"
+#define INDEX_VERSION   1
+#define FIRST_SEGMENTS  1024
+#define FIRST_ROOMS     1024
+#define REPLAY_CHUNK    4096            // records read at once
+
+_Static_assert(sizeof(struct log_record) == LOG_RECORD_SIZE, "log records have a fixed size");
+
+
+static uint64_t checksum(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t word;
+    size_t i;
+
+    for(i=0; i + 8 <= size; i += 8) {
+        memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for(; i<size; i++)
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    return hash;
+}
+
+
+static uint32_t record_check(const struct log_record *record) {
+    uint64_t hash = checksum((const char *)record + 4, LOG_RECORD_SIZE - 4);
+
+    return (uint32_t)(hash ^ hash >> 32);
+}
+
+
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u;
+
+    while(*key)
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    return hash;
+}
+
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static size_t block_size(uint32_t segment_capacity, uint32_t room_capacity) {
+    return sizeof(struct log_index_header) + (size_t)segment_capacity * sizeof(struct log_segment) +
+           (size_t)room_capacity * sizeof(struct log_room) + (size_t)room_capacity * 2 * sizeof(int32_t);
+}
+
+
+/*
+ * This function points the store at the parts of its index block.
+*/
+static void bind_block(struct log_store *store, struct log_index_header *index) {
+    store->index = index;
+    store->segments = (struct log_segment *)(index + 1);
+    store->rooms = (struct log_room *)(store->segments + index->segment_capacity);
+    store->slots = (int32_t *)(store->rooms + index->room_capacity);
+}
+
+
+/*
+ * This function returns a new, empty index block (zeroed anonymous memory), or NULL.
+*/
+static struct log_index_header *new_block(uint32_t segment_capacity, uint32_t room_capacity, uint32_t segment_records) {
+    size_t size = block_size(segment_capacity, room_capacity);
+    struct log_index_header *index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(index == MAP_FAILED)
+        return NULL;
+    index->magic = INDEX_MAGIC;
+    index->version = INDEX_VERSION;
+    index->record_size = sizeof(struct log_record);
+    index->segment_size = sizeof(struct log_segment);
+    index->room_size = sizeof(struct log_room);
+    index->segment_records = segment_records;
+    index->size = size;
+    index->segment_capacity = segment_capacity;
+    index->room_capacity = room_capacity;
+    index->nslots = room_capacity * 2;
+    memset((char *)index + size - index->nslots * sizeof(int32_t), 0xff, index->nslots * sizeof(int32_t));
+    return index;
+}
+
+
+static int32_t *find_slot(struct log_store *store, const char *room) {
+    uint32_t mask = store->index->nslots - 1;
+    uint32_t i = hash_key(room) & mask;
+
+    while(store->slots[i] >= 0 && strcmp(store->rooms[store->slots[i]].room, room) != 0)
+        i = (i + 1) & mask;
+    return &store->slots[i];
+}
+
+
+/*
+ * This function moves the index into a block with room for more segments or rooms.
+*/
+static int grow(struct log_store *store, uint32_t segment_capacity, uint32_t room_capacity) {
+    struct log_index_header *old = store->index;
+    struct log_index_header *index = new_block(segment_capacity, room_capacity, old->segment_records);
+
+    if(index == NULL) {
+        fprintf(stderr, "Error: out of memory for the log index\n");
+        return -1;
+    }
+    index->records = old->records;
+    index->saved = old->saved;
+    index->segment_count = old->segment_count;
+    index->room_count = old->room_count;
+    memcpy((void *)(index + 1), store->segments, old->segment_count * sizeof(struct log_segment));
+
+    struct log_room *rooms = store->rooms;
+    bind_block(store, index);
+    memcpy(store->rooms, rooms, old->room_count * sizeof(struct log_room));
+    for(uint32_t i=0; i<index->room_count; i++)
+        *find_slot(store, store->rooms[i].room) = i;
+    munmap(old, old->size);
+    return 0;
+}
+
+
+/*
+ * This function returns the index of a room in the room table, added if it is new, or -1.
+ * Adding a room can move the tables (grow()), so pointers into them are taken after it.
+*/
+static int32_t get_room(struct log_store *store, const char *room) {
+    int32_t *slot = find_slot(store, room);
+
+    if(*slot >= 0)
+        return *slot;
+    if(store->index->room_count == store->index->room_capacity) {
+        if(grow(store, store->index->segment_capacity, store->index->room_capacity * 2) != 0)
+            return -1;
+        slot = find_slot(store, room);
+    }
+    *slot = store->index->room_count++;
+    snprintf(store->rooms[*slot].room, sizeof(store->rooms[*slot].room), "%s", room);
+    return *slot;
+}
+
+
+/*
+ * This function makes room for segment 'id' in the segment table. It returns 0, or -1.
+*/
+static int add_segment(struct log_store *store, uint32_t id) {
+    uint32_t capacity = store->index->segment_capacity;
+
+    while(id >= capacity)
+        capacity *= 2;
+    if(capacity != store->index->segment_capacity && grow(store, capacity, store->index->room_capacity) != 0)
+        return -1;
+    if(id >= store->index->segment_count)
+        store->index->segment_count = id + 1;
+    return 0;
+}
+
+
+/*
+ * This function adds record 'number' to the segment table and the rollup of its room.
+*/
+static int index_record(struct log_store *store, uint64_t number, const struct log_record *record) {
+    uint32_t id = number / store->index->segment_records;
+    int32_t index;
+
+    if(add_segment(store, id) != 0 || (index = get_room(store, record->room)) < 0)
+        return -1;
+    struct log_segment *segment = &store->segments[id];
+    struct log_room *room = &store->rooms[index];
+
+    if(segment->records == 0)
+        segment->first_time = record->time;
+    segment->last_time = record->time;
+    segment->records = number % store->index->segment_records + 1;
+
+    if(room->count == 0)
+        room->first_time = record->time;
+    room->last_time = record->time;
+    room->head = number + 1;
+    room->count++;
+    room->levels[record->level < -1 ? 0 : record->level > LOG_LEVELS - 2 ? LOG_LEVELS - 1 : record->level + 1]++;
+    room->unhealthy += record->health == 0;
+    room->decibel_sum += record->decibel;
+    if(record->decibel > room->decibel_max)
+        room->decibel_max = record->decibel;
+    store->index->records++;
+    return 0;
+}
+
+
+static void segment_path(const struct log_store *store, uint32_t id, char *path, int size) {
+    snprintf(path, size, "%s/%08u.seg", store->dir, id);
+}
+
+
+/*
+ * This function maps a checkpoint and checks it. It returns the block, or NULL if the file is missing or damaged.
+*/
+static struct log_index_header *load_checkpoint(const char *path) {
+    struct log_index_header *index;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct log_index_header)) {
+        fprintf(stderr, "Error: %s is truncated or damaged\n", path);
+        close(fd);
+        return NULL;
+    }
+    // private: the index changes in memory from here on, the file only by the next checkpoint
+    index = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(index == MAP_FAILED)
+        return NULL;
+
+    if(index->magic != INDEX_MAGIC || index->version != INDEX_VERSION || index->record_size != sizeof(struct log_record) ||
+       index->segment_size != sizeof(struct log_segment) || index->room_size != sizeof(struct log_room)) {
+        fprintf(stderr, "Error: %s is not a log index of this version\n", path);
+        munmap(index, st.st_size);
+        return NULL;
+    }
+    if(index->size != (uint64_t)st.st_size || index->size != block_size(index->segment_capacity, index->room_capacity) ||
+       index->nslots != index->room_capacity * 2 || index->segment_count > index->segment_capacity ||
+       index->room_count > index->room_capacity || index->segment_records == 0 ||
+       checksum(index + 1, index->size - sizeof(struct log_index_header)) != index->checksum) {
+        fprintf(stderr, "Error: %s is truncated or damaged\n", path);
+        munmap(index, st.st_size);
+        return NULL;
+    }
+    return index;
+}
+
+
+/*
+ * This function returns the records per segment of a store without a checkpoint: the size of the first
+ * segment if there is a second one (only full segments are followed by another), else NOISE_LOG_SEGMENT_RECORDS.
+*/
+static uint32_t guess_segment_records(struct log_store *store) {
+    char path[320];
+    struct stat st;
+
+    segment_path(store, 1, path, sizeof(path));
+    if(stat(path, &st) == 0) {
+        segment_path(store, 0, path, sizeof(path));
+        if(stat(path, &st) == 0 && st.st_size >= LOG_RECORD_SIZE)
+            return st.st_size / LOG_RECORD_SIZE;
+    }
+    return config_long("NOISE_LOG_SEGMENT_RECORDS", 1048576);
+}
+
+
+/*
+ * This function replays the records of segment 'id' after those in the index, and cuts off a torn or damaged end.
+ * It returns the number of valid records in the segment, or -1 if there is no such segment.
+*/
+static long long replay_segment(struct log_store *store, uint32_t id) {
+    struct log_record *chunk;
+    uint64_t base = (uint64_t)id * store->index->segment_records;
+    uint64_t valid = id < store->index->segment_count ? store->segments[id].records : 0;
+    char path[320];
+    struct stat st;
+    int fd;
+
+    segment_path(store, id, path, sizeof(path));
+    if((fd = open(path, O_RDWR)) < 0)
+        return -1;
+    if(fstat(fd, &st) != 0 || (chunk = malloc(REPLAY_CHUNK * sizeof(struct log_record))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    uint64_t present = st.st_size / LOG_RECORD_SIZE;
+    if(present > store->index->segment_records)
+        present = store->index->segment_records;
+    if(present < valid)
+        fprintf(stderr, "Warning: %s has %llu records, the index %llu\n", path, (unsigned long long)present, (unsigned long long)valid);
+
+    while(valid < present) {
+        int n = present - valid < REPLAY_CHUNK ? present - valid : REPLAY_CHUNK, i;
+        ssize_t got = pread(fd, chunk, (size_t)n * LOG_RECORD_SIZE, valid * LOG_RECORD_SIZE);
+
+        if(got < (ssize_t)n * LOG_RECORD_SIZE)
+            n = got < 0 ? 0 : got / LOG_RECORD_SIZE;
+        for(i=0; i<n && chunk[i].check == record_check(&chunk[i]); i++) {
+            if(index_record(store, base + valid + i, &chunk[i]) != 0)
+                break;
+        }
+        valid += i;
+        store->stats.replayed += i;
+        if(i < n || n == 0)
+            break;
+    }
+
+    if((uint64_t)st.st_size > valid * LOG_RECORD_SIZE) {
+        store->stats.truncated += st.st_size - valid * LOG_RECORD_SIZE;
+        fprintf(stderr, "Warning: %s: %llu bytes after record %llu are torn or damaged, cut off\n", path,
+                (unsigned long long)(st.st_size - valid * LOG_RECORD_SIZE), (unsigned long long)valid);
+        if(ftruncate(fd, valid * LOG_RECORD_SIZE) != 0)
+            fprintf(stderr, "Error: cannot truncate %s: %s\n", path, strerror(errno));
+    }
+    free(chunk);
+    close(fd);
+    return valid;
+}
+
+
+static int open_segment(struct log_store *store, uint32_t id) {
+    char path[320];
+
+    segment_path(store, id, path, sizeof(path));
+    store->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if(store->fd < 0) {
+        fprintf(stderr, "Error: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    store->current = id;
+    return 0;
+}
+
+
+/*
+ * This function writes the batch to the current segment, after its 'written' records.
+ * The index already counts the batch, so on an error the batch stays for the next call, which writes it
+ * at the same place again: a part that did reach the file is overwritten, and no record is numbered twice.
+*/
+static int flush_batch(struct log_store *store) {
+    size_t size = (size_t)store->batched * LOG_RECORD_SIZE, done = 0;
+    off_t end = (off_t)store->written * LOG_RECORD_SIZE;
+
+    while(done < size) {
+        ssize_t n = pwrite(store->fd, store->batch + done, size - done, end + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            fprintf(stderr, "Error: cannot write segment %u: %s\n", store->current, strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+    store->written += store->batched;
+    store->batched = 0;
+    return 0;
+}
+
+
+static int write_file(const char *path, const void *data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t done = 0;
+
+    if(fd < 0)
+        return -1;
+    while(done < size) {
+        ssize_t n = write(fd, (const char *)data + done, size - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    if(fsync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+
+static int checkpoint_locked(struct log_store *store) {
+    char path[320], prev[320], tmp[320];
+    struct log_index_header *index = store->index;
+
+    // the index may only count records that are on disk
+    if(flush_batch(store) != 0 || fdatasync(store->fd) != 0)
+        return -1;
+
+    index->saved = time(NULL);
+    index->checksum = checksum(index + 1, index->size - sizeof(struct log_index_header));
+    snprintf(path, sizeof(path), "%s/index.ckpt", store->dir);
+    snprintf(prev, sizeof(prev), "%s/index.ckpt.prev", store->dir);
+    snprintf(tmp, sizeof(tmp), "%s/index.ckpt.tmp", store->dir);
+    if(write_file(tmp, index, index->size) != 0 || (rename(path, prev) != 0 && errno != ENOENT) || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    store->checkpointed = index->saved;
+    return 0;
+}
+
+
+/*
+ * The thread of the store: it writes the batch every second, so an idle store has nothing in memory for long,
+ * and the checkpoints.
+*/
+static void *flusher(void *arg) {
+    struct log_store *store = arg;
+    struct timespec until;
+
+    pthread_mutex_lock(&store->lock);
+    while(!store->stopping) {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec++;
+        pthread_cond_timedwait(&store->wake, &store->lock, &until);
+        if(store->stopping)
+            break;
+        if(store->checkpoint_sec > 0 && time(NULL) - store->checkpointed >= store->checkpoint_sec)
+            checkpoint_locked(store);
+        else if(store->batched > 0)
+            flush_batch(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+
+/*
+ * This function opens the store in 'dir' (created if needed): it loads the last good checkpoint and replays
+ * the tail of the segments. It returns 0, or -1 on error.
+*/
+int log_store_open(struct log_store *store, const char *dir) {
+    char path[320];
+    double start = now_ms();
+    long long valid;
+    uint32_t id, last;
+
+    memset(store, 0, sizeof(*store));
+    pthread_mutex_init(&store->lock, NULL);
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->fd = -1;
+    store->checkpoint_sec = config_long("NOISE_LOG_CHECKPOINT_SEC", 60);
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    struct log_index_header *index;
+    snprintf(path, sizeof(path), "%s/index.ckpt", dir);
+    store->stats.origin = LOG_FROM_CHECKPOINT;
+    if((index = load_checkpoint(path)) == NULL) {
+        snprintf(path, sizeof(path), "%s/index.ckpt.prev", dir);
+        store->stats.origin = LOG_FROM_PREVIOUS;
+        index = load_checkpoint(path);
+    }
+    if(index == NULL) {
+        segment_path(store, 0, path, sizeof(path));
+        store->stats.origin = access(path, F_OK) == 0 ? LOG_FROM_SEGMENTS : LOG_FROM_NOTHING;
+        if((index = new_block(FIRST_SEGMENTS, FIRST_ROOMS, guess_segment_records(store))) == NULL) {
+            fprintf(stderr, "Error: out of memory for the log index\n");
+            return -1;
+        }
+    }
+    bind_block(store, index);
+
+    // the tail: segments from the first one that was not full at the checkpoint, and any newer ones
+    for(id=0; id<index->segment_count && store->segments[id].records == index->segment_records; id++);
+    if(id > 0 && id == index->segment_count)
+        id--;
+    last = id;
+    valid = id < index->segment_count ? store->segments[id].records : 0;
+    for(long long n; (n = replay_segment(store, id)) >= 0; id++) {
+        last = id;
+        valid = n;
+    }
+
+    store->written = valid;
+    store->checkpointed = time(NULL);
+    if(open_segment(store, last) != 0) {
+        munmap(store->index, store->index->size);
+        return -1;
+    }
+    pthread_cond_init(&store->wake, NULL);
+    if(pthread_create(&store->flusher, NULL, flusher, store) != 0) {
+        close(store->fd);
+        munmap(store->index, store->index->size);
+        return -1;
+    }
+    store->stats.open_ms = now_ms() - start;
+    return 0;
+}
+
+
+/*
+ * This function writes a checkpoint of the index. It returns 0, or -1 on error (the previous checkpoint stays).
+*/
+int log_store_checkpoint(struct log_store *store) {
+    pthread_mutex_lock(&store->lock);
+    int rc = checkpoint_locked(store);
+    pthread_mutex_unlock(&store->lock);
+    return rc;
+}
+
+
+/*
+ * This function appends a parsed packet (packet_parse(), at least seven fields) that was logged on 'stream'.
+ * It returns 0, or -1 on error or for a room of PACKET_ROOM_LEN characters or more (not cut into another room).
+*/
+int log_store_append(struct log_store *store, enum log_stream stream, char **fields, int nfields) {
+    struct log_record record;
+
+    if(nfields < 7)
+        return -1;
+    memset(&record, 0, sizeof(record));
+    record.stream = stream;
+    record.level = atoi(fields[4]);
+    record.health = atoi(fields[6]);
+    record.decibel = strtof(fields[5], NULL);
+    record.time = strtoull(fields[3], NULL, 10);
+    record.seq = nfields > 7 ? strtoull(fields[7], NULL, 10) : 0;
+    record.epoch = nfields > 8 ? strtoull(fields[8], NULL, 10) : 0;
+
+    pthread_mutex_lock(&store->lock);
+    if(snprintf(record.room, sizeof(record.room), "%s/%s/%s", fields[0], fields[1], fields[2]) >= (int)sizeof(record.room)) {
+        store->stats.rejected++;
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    uint32_t per_segment = store->index->segment_records;
+
+    // a batch that could not be written is still full: the record is refused until it is
+    if(store->batched == LOG_WRITE_BATCH && flush_batch(store) != 0) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+
+    if(store->written + store->batched == per_segment) {
+        // the segment is full: it is synced once and never written again
+        if(flush_batch(store) != 0 || fdatasync(store->fd) != 0 || close(store->fd) != 0 || open_segment(store, store->current + 1) != 0) {
+            pthread_mutex_unlock(&store->lock);
+            return -1;
+        }
+        store->written = 0;
+    }
+
+    uint64_t number = (uint64_t)store->current * per_segment + store->written + store->batched;
+    int32_t room = get_room(store, record.room);
+    if(room < 0) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    record.prev = store->rooms[room].head;
+    record.check = record_check(&record);
+    if(index_record(store, number, &record) != 0) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    memcpy(store->batch + store->batched * LOG_RECORD_SIZE, &record, LOG_RECORD_SIZE);
+    store->batched++;
+
+    // the record is kept: if the write fails, the batch is written again later
+    if(store->batched == LOG_WRITE_BATCH)
+        flush_batch(store);
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+
+/*
+ * This function reads record 'number' (e.g. the head of a room, or the 'prev' of a record, minus one).
+ * It returns 0, or -1 if there is no such record or it is damaged.
+*/
+int log_store_read(struct log_store *store, uint64_t number, struct log_record *record) {
+    char path[320];
+    int rc = -1;
+
+    pthread_mutex_lock(&store->lock);
+    uint32_t per_segment = store->index->segment_records;
+    uint32_t id = number / per_segment;
+    uint64_t at = number % per_segment;
+
+    if(id == store->current && at >= store->written && at < store->written + store->batched) {
+        memcpy(record, store->batch + (at - store->written) * LOG_RECORD_SIZE, LOG_RECORD_SIZE);
+        rc = 0;
+    }
+    else if(id < store->index->segment_count && at < store->segments[id].records) {
+        segment_path(store, id, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if(fd >= 0) {
+            if(pread(fd, record, LOG_RECORD_SIZE, at * LOG_RECORD_SIZE) == LOG_RECORD_SIZE && record->check == record_check(record))
+                rc = 0;
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return rc;
+}
+
+
+/*
+ * This function copies the rollup of a room ("institution/location/room"). It returns 0, or -1 for an unknown room.
+*/
+int log_store_room(struct log_store *store, const char *room, struct log_room *rollup) {
+    int rc = -1;
+
+    pthread_mutex_lock(&store->lock);
+    int32_t *slot = find_slot(store, room);
+    if(*slot >= 0) {
+        *rollup = store->rooms[*slot];
+        rc = 0;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return rc;
+}
+
+
+uint64_t log_store_records(struct log_store *store) {
+    pthread_mutex_lock(&store->lock);
+    uint64_t records = store->index->records;
+    pthread_mutex_unlock(&store->lock);
+    return records;
+}
+
+
+/*
+ * This function writes what is batched, and a checkpoint if 'checkpoint' is set, and closes the store.
+ * Without the checkpoint the next open replays everything since the last one, as after a crash.
+*/
+void log_store_close(struct log_store *store, int checkpoint) {
+    pthread_mutex_lock(&store->lock);
+    store->stopping = 1;
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->flusher, NULL);
+
+    pthread_mutex_lock(&store->lock);
+    if(checkpoint)
+        checkpoint_locked(store);
+    else
+        flush_batch(store);
+    close(store->fd);
+    munmap(store->index, store->index->size);
+    pthread_mutex_unlock(&store->lock);
+    pthread_cond_destroy(&store->wake);
+    pthread_mutex_destroy(&store->lock);
+}
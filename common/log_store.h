@@ -0,0 +1,149 @@
+/*
+ * Durable log of admin_logs: segment files, a per-room index and per-room rollups, with fast restart.
+ *
+ * Every logged packet becomes a fixed-size record (LOG_RECORD_SIZE bytes, with its own checksum) appended to
+ * the current segment file '<dir>/<id>.seg'; a segment holds 'segment_records' records and the next one is
+ * started when it is full. A record is found by its number: segment id * segment_records + index.
+ *
+ * The index is one block of memory: a header, the segment table (records and time range per segment) and the
+ * room table (rollups per room and the number of its latest record; every record links to the previous record
+ * of its room, so the history of a room is a chain through the segments), with an open-addressing hash of the rooms.
+ * A checkpoint writes the block as it is to '<dir>/index.ckpt', after the segments were synced, so the
+ * segment table holds the committed records of every segment. On startup the checkpoint is mapped (MAP_PRIVATE)
+ * and used in place once its checksum matches: nothing is parsed or rehashed. Then only the tail is replayed,
+ * the records after the committed ones of each segment, which is at most one checkpoint interval of logs.
+ *
+ * Crashes:
+ *  - a checkpoint is written next to the old one and renamed; the old one is kept as 'index.ckpt.prev'.
+ *    A checkpoint that is torn or damaged (size, checksum) is skipped for the previous one, which only means a
+ *    longer tail, and without either the index is rebuilt from all segments.
+ *  - a record that was cut off or damaged ends the replay of its segment, and the segment is truncated there.
+ * Records are written in batches, so a crash loses at most LOG_WRITE_BATCH records or one second of logs.
+ * A batch that cannot be written (e.g. a full disk) is kept and written again; while it is full, appends fail.
+ * A thread of the store writes what is batched every second and the checkpoints when they are due.
+ *
+ *      NOISE_LOG_STORE                 directory of the store (admin_logs keeps no store without it)
+ *      NOISE_LOG_CHECKPOINT_SEC        seconds between checkpoints           (default 60)
+ *      NOISE_LOG_SEGMENT_RECORDS       records per segment, for a new store  (default 1048576, 96 MB)
+ *
+ * The store is thread safe.
+*/
+
+#ifndef NOISE_LOG_STORE_H
+#define NOISE_LOG_STORE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "packet.h"
+
+#define LOG_RECORD_SIZE 96
+#define LOG_LEVELS      5           // noise levels -1 (alert) to 3
+#define LOG_WRITE_BATCH 256
+
+enum log_stream {
+    LOG_PUB_READINGS,
+    LOG_PUB_ALERTS,
+    LOG_SUB_READINGS
+};
+
+enum log_origin {
+    LOG_FROM_CHECKPOINT,
+    LOG_FROM_PREVIOUS,      // the last checkpoint was damaged
+    LOG_FROM_SEGMENTS,      // no usable checkpoint, rebuilt
+    LOG_FROM_NOTHING        // a new store
+};
+
+struct log_record {
+    uint32_t check;         // of the rest of the record
+    uint8_t stream;
+    int8_t level;
+    int16_t health;
+    float decibel;
+    uint32_t reserved;
+    uint64_t time;          // the timestamp of the packet as a number (yymmddhhmmss)
+    uint64_t seq;
+    uint64_t epoch;
+    uint64_t prev;          // record number + 1 of the previous record of the room, 0 for the first
+    char room[PACKET_ROOM_LEN];
+};
+
+struct log_segment {
+    uint64_t records;       // committed (checkpoint) or valid (live) records
+    uint64_t first_time;
+    uint64_t last_time;
+    uint64_t reserved;
+};
+
+struct log_room {
+    char room[PACKET_ROOM_LEN];     // "institution/location/room"
+    uint64_t head;                  // record number + 1 of the latest record
+    uint64_t count;
+    uint64_t levels[LOG_LEVELS];
+    uint64_t unhealthy;             // health_status 0
+    double decibel_sum;
+    float decibel_max;
+    uint32_t reserved;
+    uint64_t first_time;
+    uint64_t last_time;
+};
+
+struct log_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;           // of the writer, like the sizes below
+    uint32_t segment_size;
+    uint32_t room_size;
+    uint32_t segment_records;
+    uint64_t size;                  // of the whole block
+    uint64_t checksum;              // of the block after the header
+    uint64_t records;               // all records indexed
+    int64_t saved;                  // time of the checkpoint
+    uint32_t segment_capacity;
+    uint32_t segment_count;
+    uint32_t room_capacity;
+    uint32_t room_count;
+    uint32_t nslots;                // 2 * room_capacity
+    uint32_t reserved;
+};
+
+struct log_store_stats {
+    enum log_origin origin;
+    uint64_t replayed;              // tail records replayed by log_store_open()
+    uint64_t truncated;             // bytes of torn or damaged records cut off
+    uint64_t rejected;              // packets of a room name too long for a record
+    double open_ms;
+};
+
+struct log_store {
+    pthread_mutex_t lock;
+    char dir[256];
+    struct log_index_header *index;     // the block: header, segments, rooms, slots
+    struct log_segment *segments;
+    struct log_room *rooms;
+    int32_t *slots;                     // index of a room, -1 if empty
+    int fd;                             // the current segment
+    uint32_t current;                   // its id
+    uint64_t written;                   // records of the current segment in the file
+    char batch[LOG_WRITE_BATCH * LOG_RECORD_SIZE];
+    int batched;
+    time_t checkpointed;
+    long checkpoint_sec;
+    pthread_t flusher;
+    pthread_cond_t wake;
+    int stopping;
+    struct log_store_stats stats;
+};
+
+int log_store_open(struct log_store *store, const char *dir);
+void log_store_close(struct log_store *store, int checkpoint);
+
+int log_store_append(struct log_store *store, enum log_stream stream, char **fields, int nfields);
+int log_store_checkpoint(struct log_store *store);
+
+int log_store_read(struct log_store *store, uint64_t number, struct log_record *record);
+int log_store_room(struct log_store *store, const char *room, struct log_room *rollup);
+uint64_t log_store_records(struct log_store *store);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Noise level rules of the publisher (see noise_level.h).
+*/
+
+#include "noise_level.h"
+
+
+/*
+ * This function returns the noise level.
+ * The range of the noise level as follows:
+ *      if avg_decibel >  0 && avg_decibel <=  50 --> Warning Level 1 
+ *      if avg_decibel > 50 && avg_decibel <=  80 --> Warning Level 2
+ *      if avg_decibel > 80 && avg_decibel <= 100 --> Warning Level 3
+ *      if avg_decibel <= 0 || avg_decibel >  100 --> There is an issue with the sound sensor. Reoprt to 'admin/alerts'
+*/
+int cal_alert_level(float avg_decibel) {
+    if(avg_decibel > 0 && avg_decibel <= 50)        // Normal Case
+        return 0;
+    else if(avg_decibel > 50 && avg_decibel <= 65)  // Warning Level 1
+        return 1;
+    else if(avg_decibel > 65 && avg_decibel <= 80)  // Warning Level 2
+        return 2;
+    else if(avg_decibel > 80 && avg_decibel <= 100) // Warning Level 3
+        return 3;
+    else                                            // Unhealthy Sensor 
+        return -1;
+}
+
+
+/*
+ * This function returns the status of sound sensor.
+ * If the value of avg_deciel is bigger than 0 and less equal than 100, the status is healthy (1).
+ * Else, the status is unhealthy (0).
+*/
+int get_health_status(float avg_decibel) {
+    if(avg_decibel > 0 && avg_decibel <= 100) 
+        return 1; // healthy
+    else    
+        return 0; // unhealthy
+}
@@ -0,0 +1,16 @@
+/*
+ * Noise level rules of the publisher, shared with the simulator (sim/noise_sim.c).
+ *
+ * A reading is the average of NOISE_WINDOW_SAMPLES noise samples (one per NOISE_SAMPLE_USEC).
+ * The normal range of noise value is from 1 to 100.
+*/
+
+#ifndef NOISE_LEVEL_H
+#define NOISE_LEVEL_H
+
+#define NOISE_WINDOW_SAMPLES    10
+
+int cal_alert_level(float avg_decibel);
+int get_health_status(float avg_decibel);
+
+#endif
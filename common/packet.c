@@ -0,0 +1,218 @@
+/*
+ * Noise packet writer and splitter (see packet.h).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "packet.h"
+#include "vclock.h"
+
+
+void packet_writer_init(struct packet_writer *writer, const char *institution, const char *location, const char *room) {
+    writer->header_len = snprintf(writer->header, sizeof(writer->header), "%s,%s,%s,", institution, location, room);
+    if(writer->header_len >= (int)sizeof(writer->header))
+        writer->header_len = sizeof(writer->header) - 1;
+    writer->stamped = -1;
+    writer->timestamp[0] = '\0';
+    writer->epoch = 0;
+}
+
+
+void packet_writer_set_epoch(struct packet_writer *writer, unsigned long epoch) {
+    writer->epoch = epoch;
+}
+
+
+/*
+ * This function writes an unsigned number and returns the end of it.
+*/
+static char *put_ulong(char *p, unsigned long value) {
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+    while(n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+
+static char *put_long(char *p, long value) {
+    if(value < 0) {
+        *p++ = '-';
+        return put_ulong(p, -(unsigned long)value);
+    }
+    return put_ulong(p, value);
+}
+
+
+/*
+ * This function writes a number exactly like "%f" and returns the end of it: six decimals, halfway cases
+ * rounded to even (llrint in the default rounding mode) and a '-' for every negative value, also "-0.000000".
+ * The product with 1e6 is exact for a float (24 + 14 bits), so the rounding is the one of the decimal value.
+ * Values beyond the range of a long (no decibel is) fall back to sprintf.
+*/
+static char *put_fixed6(char *p, double value) {
+    double scaled = fabs(value) * 1e6;
+
+    if(!(scaled < 9e18))
+        return p + sprintf(p, "%f", value);
+
+    unsigned long micro = (unsigned long)llrint(scaled);
+    if(signbit(value))
+        *p++ = '-';
+    p = put_ulong(p, micro / 1000000);
+    *p++ = '.';
+    for(unsigned long div = 100000, frac = micro % 1000000; div > 0; div /= 10)
+        *p++ = '0' + frac / div % 10;
+    return p;
+}
+
+
+/*
+ * This function writes a packet into 'buffer' (at least PACKET_MAX bytes), NUL terminated.
+ * It returns the length of the packet.
+*/
+int packet_format(struct packet_writer *writer, char *buffer, time_t now, int noise_level, float avg_decibel, int health_status, unsigned long seq) {
+    char *p = buffer;
+
+    if(now != writer->stamped) {
+        vclock_timestamp(now, writer->timestamp);
+        writer->stamped = now;
+    }
+
+    memcpy(p, writer->header, writer->header_len);
+    p += writer->header_len;
+    memcpy(p, writer->timestamp, 12);
+    p += 12;
+    *p++ = ',';
+    p = put_long(p, noise_level);
+    *p++ = ',';
+    p = put_fixed6(p, avg_decibel);
+    *p++ = ',';
+    p = put_long(p, health_status);
+    *p++ = ',';
+    p = put_ulong(p, seq);
+    if(writer->epoch != 0) {
+        *p++ = ',';
+        p = put_ulong(p, writer->epoch);
+    }
+    *p = '\0';
+    return p - buffer;
+}
+
+
+/*
+ * This function cuts a packet into at most 'max' comma separated fields, in place, and NUL terminates them.
+ * The last field takes the rest of the payload. It returns the number of fields.
+*/
+int packet_split(char *payload, int payloadlen, char **fields, int max) {
+    int n = 0;
+
+    if(max <= 0)
+        return 0;
+    fields[n++] = payload;
+    for(int i=0; i<payloadlen && n < max; i++) {
+        if(payload[i] == ',') {
+            payload[i] = '\0';
+            fields[n++] = payload + i + 1;
+        }
+    }
+    payload[payloadlen] = '\0';
+    return n;
+}
+
+
+/*
+ * This function returns 1 if the payload is a compact packet (five or six fields, no room header).
+*/
+int packet_is_compact(const char *payload, int payloadlen) {
+    int commas = 0;
+
+    for(int i=0; i<payloadlen && commas <= PACKET_COMPACT_FIELDS; i++) {
+        if(payload[i] == ',')
+            commas++;
+    }
+    return commas == PACKET_COMPACT_FIELDS - 2 || commas == PACKET_COMPACT_FIELDS - 1;
+}
+
+
+/*
+ * This function returns the last three levels of a topic ("institution/location/room"), or NULL.
+*/
+static const char *topic_room(const char *topic) {
+    int slashes = 0;
+
+    for(const char *p = topic + strlen(topic); p > topic; p--) {
+        if(p[-1] == '/' && ++slashes == 3)
+            return p;
+    }
+    return slashes == 2 ? topic : NULL;
+}
+
+
+/*
+ * This function returns the room of a packet, to key the worker pool (see wp_submit()):
+ * the header 'institution,location,room' of a full packet, or the room levels of the topic of a compact one.
+ * The length is stored in 'keylen'.
+*/
+const char *packet_room(const char *topic, const char *payload, int payloadlen, int *keylen) {
+    const char *room;
+    int commas = 0;
+
+    if(packet_is_compact(payload, payloadlen) && (room = topic_room(topic)) != NULL) {
+        *keylen = strlen(room);
+        return room;
+    }
+    for(int i=0; i<payloadlen; i++) {
+        if(payload[i] == ',' && ++commas == 3) {
+            *keylen = i;
+            return payload;
+        }
+    }
+    *keylen = payloadlen;
+    return payload;
+}
+
+
+/*
+ * This function cuts a full or compact packet into the fields of a full packet (8, or 9 with the epoch), in place.
+ * For a compact packet the institution, location and room come from the topic and are stored in 'room'
+ * (PACKET_ROOM_LEN bytes). It returns the number of fields, like packet_split() for a full packet.
+*/
+int packet_parse(const char *topic, char *payload, int payloadlen, char **fields, char *room) {
+    int n = packet_split(payload, payloadlen, fields, PACKET_FIELDS);
+    const char *levels;
+    int len;
+
+    if(n != PACKET_COMPACT_FIELDS - 1 && n != PACKET_COMPACT_FIELDS)
+        return n;
+
+    levels = topic_room(topic);
+    if(levels == NULL || (len = strlen(levels)) >= PACKET_ROOM_LEN)
+        return 0;
+    memcpy(room, levels, len + 1);
+    memmove(fields + 3, fields, n * sizeof(char *));
+
+    fields[0] = room;
+    fields[1] = strchr(room, '/') + 1;
+    fields[2] = strchr(fields[1], '/') + 1;
+    fields[1][-1] = '\0';
+    fields[2][-1] = '\0';
+    return n + 3;
+}
+
+
+/*
+ * This function writes the admin log line (with its newline) of a parsed packet that was logged on 'log_topic'.
+ * It returns the length like snprintf().
+*/
+int packet_log_line(char *buffer, int size, const char *log_topic, char **fields) {
+    return snprintf(buffer, size, "[%s] location: %s_%s_%s, decibel: %s, noise_level: %s, health_status: %s, time: %s\n",
+                    log_topic, fields[0], fields[1], fields[2], fields[5], fields[4], fields[6], fields[3]);
+}
@@ -0,0 +1,54 @@
+/*
+ * Noise packets without printf and without the heap.
+ *
+ * A packet is 'institution,location,room,timestamp,noise_level,avg_decibel,health_status,seq[,epoch]'.
+ * The publisher writes one per reading, so the writer keeps what does not change between readings:
+ * the 'institution,location,room,' header is formatted once, and the timestamp only when the second changes.
+ * The numbers are written by hand in the same format as "%d,%f,%d,%lu", and packet_format() returns the
+ * length, so nobody has to strlen() the packet again. Nothing is allocated.
+ *
+ * 'epoch' is the start time of the publisher (milliseconds since 1970) and is only written once set (packet_writer_set_epoch());
+ * with it a consumer can tell a restarted publisher (seq from 1 again) from lost packets (common/seq_track.h).
+ * Consumers that read eight fields still get seq.
+ *
+ * packet_split() is the consumer side: it cuts a packet into its fields in place, like strtok_r(),
+ * but in one pass and keeping empty fields.
+ *
+ * A compact packet (NOISE_PACKET=compact) leaves out the header, 'timestamp,noise_level,avg_decibel,health_status,seq[,epoch]',
+ * because the room is already in the topic: 'institution/location/room', or the room appended to an admin
+ * topic ('admin/alerts/institution/location/room'). It is the full packet without its first header_len bytes.
+ * packet_parse() and packet_room() take both kinds, so consumers do not need to know which one they got.
+ *
+ * packet_log_line() is the line of the admin log for a packet (admin_logs, and the log capture plugin of the broker).
+*/
+
+#ifndef NOISE_PACKET_H
+#define NOISE_PACKET_H
+
+#include <time.h>
+
+#define PACKET_MAX      128         // longest packet (with the 9 byte room fields of config_room)
+#define PACKET_FIELDS   9           // with the epoch; 8 without it
+#define PACKET_COMPACT_FIELDS   6   // with the epoch; 5 without it
+#define PACKET_ROOM_LEN 48          // "institution/location/room" taken from a topic
+#define PACKET_LOG_LINE 384         // enough for packet_log_line() of any packet
+
+struct packet_writer {
+    char header[40];                // "institution,location,room,"
+    int header_len;
+    time_t stamped;                 // time of 'timestamp'
+    char timestamp[13];
+    unsigned long epoch;            // 0: not written
+};
+
+void packet_writer_init(struct packet_writer *writer, const char *institution, const char *location, const char *room);
+void packet_writer_set_epoch(struct packet_writer *writer, unsigned long epoch);
+int packet_format(struct packet_writer *writer, char *buffer, time_t now, int noise_level, float avg_decibel, int health_status, unsigned long seq);
+
+int packet_split(char *payload, int payloadlen, char **fields, int max);
+int packet_is_compact(const char *payload, int payloadlen);
+const char *packet_room(const char *topic, const char *payload, int payloadlen, int *keylen);
+int packet_parse(const char *topic, char *payload, int payloadlen, char **fields, char *room);
+int packet_log_line(char *buffer, int size, const char *log_topic, char **fields);
+
+#endif
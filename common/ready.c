@@ -0,0 +1,42 @@
+/*
+ * Readiness notification to a supervisor (see ready.h).
+*/
+
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "ready.h"
+
+static _Atomic int ready_sent = 0;
+static _Atomic int first_sent = 0;
+
+
+/*
+ * This function writes a line to the readiness socket of the supervisor, if there is one.
+ * It only uses send(), so it can be called from any thread, and a supervisor that is gone does not raise SIGPIPE.
+*/
+static void ready_write(const char *line, int len) {
+    long fd = config_long("NOISE_READY_FD", -1);
+
+    if(fd >= 0 && send(fd, line, len, MSG_NOSIGNAL) != len) {
+        // the supervisor is gone; a component runs without it as well
+    }
+}
+
+
+void ready_notify(void) {
+    if(!atomic_exchange(&ready_sent, 1))
+        ready_write("ready\n", 6);
+}
+
+
+/*
+ * This function reports the first message of the component. It is called for every message,
+ * so after the first one it is a single load.
+*/
+void ready_first_message(void) {
+    if(atomic_load_explicit(&first_sent, memory_order_relaxed) || atomic_exchange(&first_sent, 1))
+        return;
+    ready_write("first\n", 6);
+}
@@ -0,0 +1,19 @@
+/*
+ * Readiness notification to a supervisor (server/noise_supervisor.c).
+ *
+ * The supervisor starts a component with NOISE_READY_FD set to its end of a socket pair, and starts the
+ * components that depend on it only after the component wrote "ready". Two lines are written, once each:
+ *      ready       the component can do its job: connected to the broker, and all its subscriptions granted
+ *      first       the component received its first message
+ * The transport (common/transport.h) writes "ready" for a component that connects and subscribes through it,
+ * and "first" for messages from the ring. A consumer calls ready_first_message() in its message callback.
+ * Without NOISE_READY_FD nothing is written.
+*/
+
+#ifndef NOISE_READY_H
+#define NOISE_READY_H
+
+void ready_notify(void);
+void ready_first_message(void);
+
+#endif
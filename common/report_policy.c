@@ -0,0 +1,79 @@
+/*
+ * Report-by-exception policy (see report_policy.h).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "config.h"
+#include "report_policy.h"
+
+
+/*
+ * This function reads the policy from the environment:
+ *      NOISE_REPORT_MODE       always | exception  (default always)
+ *      NOISE_REPORT_DEADBAND   dB                  (default 3.0)
+ *      NOISE_REPORT_HEARTBEAT  seconds             (default 300)
+*/
+void report_policy_from_config(struct report_policy *policy) {
+    const char *mode = config_str("NOISE_REPORT_MODE", "always");
+
+    policy->mode = REPORT_ALWAYS;
+    if(strcasecmp(mode, "exception") == 0)
+        policy->mode = REPORT_EXCEPTION;
+    else if(strcasecmp(mode, "always") != 0)
+        fprintf(stderr, "Ignoring unknown NOISE_REPORT_MODE '%s' (always, exception)\n", mode);
+
+    policy->deadband = config_double("NOISE_REPORT_DEADBAND", 3.0);
+    policy->heartbeat = config_long("NOISE_REPORT_HEARTBEAT", 300);
+}
+
+
+void report_state_init(struct report_state *state) {
+    memset(state, 0, sizeof(struct report_state));
+}
+
+
+/*
+ * This function decides whether a reading is sent.
+ * If it is, the state is updated and the reason is returned.
+ * Else, REPORT_SUPPRESSED (0) is returned.
+*/
+enum report_reason report_check(const struct report_policy *policy, struct report_state *state, int level, double decibel, time_t now) {
+    enum report_reason reason;
+
+    if(policy->mode == REPORT_ALWAYS)
+        reason = REPORT_EVERY;
+    else if(!state->has_last)
+        reason = REPORT_FIRST;
+    else if(level != state->last_level)
+        reason = REPORT_LEVEL;
+    else if(fabs(decibel - state->last_decibel) > policy->deadband)
+        reason = REPORT_DEADBAND;
+    else if(now - state->last_sent >= policy->heartbeat)
+        reason = REPORT_HEARTBEAT;
+    else {
+        state->suppressed++;
+        return REPORT_SUPPRESSED;
+    }
+
+    state->has_last = 1;
+    state->last_level = level;
+    state->last_decibel = decibel;
+    state->last_sent = now;
+    return reason;
+}
+
+
+const char *report_reason_name(enum report_reason reason) {
+    switch(reason) {
+        case REPORT_FIRST:      return "first";
+        case REPORT_LEVEL:      return "level";
+        case REPORT_DEADBAND:   return "deadband";
+        case REPORT_HEARTBEAT:  return "heartbeat";
+        case REPORT_EVERY:      return "always";
+        default:                return "suppressed";
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Report-by-exception policy of the publisher.
+ *
+ * Instead of publishing every reading, the publisher only sends one when
+ *  - it is the first reading,
+ *  - the alert level (cal_alert_level) differs from the last sent reading,
+ *  - the decibel moved more than 'deadband' away from the last sent reading, or
+ *  - 'heartbeat' seconds passed since the last sent reading (so consumers know the room is alive).
+ *
+ * The sequence numbers of the sent packets are counted by the publisher, per stream (see common/seq_track.h),
+ * so a consumer that sees a gap knows that a message was lost, not suppressed.
+ *
+ * With mode REPORT_ALWAYS every reading is sent (the original behaviour).
+*/
+
+#ifndef NOISE_REPORT_POLICY_H
+#define NOISE_REPORT_POLICY_H
+
+#include <time.h>
+
+enum report_mode {
+    REPORT_ALWAYS,
+    REPORT_EXCEPTION
+};
+
+enum report_reason {
+    REPORT_SUPPRESSED = 0,
+    REPORT_FIRST,
+    REPORT_LEVEL,
+    REPORT_DEADBAND,
+    REPORT_HEARTBEAT,
+    REPORT_EVERY
+};
+
+struct report_policy {
+    enum report_mode mode;
+    double deadband;        // dB
+    long heartbeat;         // seconds
+};
+
+struct report_state {
+    int has_last;
+    int last_level;
+    double last_decibel;
+    time_t last_sent;
+    unsigned long suppressed;
+};
+
+void report_policy_from_config(struct report_policy *policy);
+void report_state_init(struct report_state *state);
+enum report_reason report_check(const struct report_policy *policy, struct report_state *state, int level, double decibel, time_t now);
+const char *report_reason_name(enum report_reason reason);
+
+#endif
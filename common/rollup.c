@@ -0,0 +1,286 @@
+/*
+ * Window aggregates of the edge gateway (see rollup.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rollup.h"
+#include "packet.h"
+
+#define ROLLUP_FIELDS   8
+
+
+static unsigned int hash_scope(const char *scope) {
+    unsigned int hash = 2166136261u;
+
+    while(*scope)
+        hash = (hash ^ (unsigned char)*scope++) * 16777619u;
+    return hash;
+}
+
+
+static void reset_aggregate(struct aggregate *agg) {
+    agg->count = 0;
+    agg->sum = 0.0;
+    agg->max = 0.0;
+    agg->faults = 0;
+    agg->nrooms = 0;
+    sketch_init(&agg->sk);
+}
+
+
+/*
+ * This function returns the aggregate of a location ("institution/location") and creates it on first use.
+*/
+static struct aggregate *get_location(struct rollup_table *table, const char *scope) {
+    unsigned int bucket = hash_scope(scope) % ROLLUP_BUCKETS;
+    struct aggregate *agg;
+
+    for(agg = table->locations[bucket]; agg != NULL; agg = agg->next) {
+        if(strcmp(agg->scope, scope) == 0)
+            return agg;
+    }
+
+    agg = calloc(1, sizeof(struct aggregate));
+    if(agg == NULL)
+        return NULL;
+    snprintf(agg->scope, sizeof(agg->scope), "%s", scope);
+    reset_aggregate(agg);
+    agg->next = table->locations[bucket];
+    table->locations[bucket] = agg;
+    return agg;
+}
+
+
+/*
+ * This function records the warning level of a room. A room is kept with the highest level of the window.
+*/
+static void add_room_level(struct aggregate *agg, const char *name, int level) {
+    for(int i=0; i<agg->nrooms; i++) {
+        if(strcmp(agg->rooms[i].name, name) == 0) {
+            if(level > agg->rooms[i].level)
+                agg->rooms[i].level = level;
+            return;
+        }
+    }
+
+    if(agg->nrooms == agg->cap_rooms) {
+        int cap = agg->cap_rooms ? agg->cap_rooms * 2 : 16;
+        struct room_level *rooms = realloc(agg->rooms, cap * sizeof(struct room_level));
+        if(rooms == NULL)
+            return;
+        agg->rooms = rooms;
+        agg->cap_rooms = cap;
+    }
+    snprintf(agg->rooms[agg->nrooms].name, ROLLUP_ROOM_LEN, "%s", name);
+    agg->rooms[agg->nrooms].level = level;
+    agg->nrooms++;
+}
+
+
+/*
+ * This function merges the aggregate 'src' into 'dst'.
+*/
+void rollup_merge(struct aggregate *dst, const struct aggregate *src) {
+    if(src->count > 0 && (dst->count == 0 || src->max > dst->max))
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->faults += src->faults;
+    for(int i=0; i<src->nrooms; i++)
+        add_room_level(dst, src->rooms[i].name, src->rooms[i].level);
+    sketch_merge(&dst->sk, &src->sk);
+}
+
+
+/*
+ * This function adds a reading ("institution,location,room,timestamp,noise_level,avg_decibel,health_status",
+ * or a compact packet with the room in the topic, see common/packet.h).
+ * Healthy readings come from the room topics, unhealthy readings from 'admin/alerts'.
+ * It returns 0, or -1 if the reading is malformed or its location or room is too long.
+*/
+int rollup_add_reading(struct rollup_table *table, const char *topic, char *payload, int payloadlen) {
+    char *tokens[PACKET_FIELDS];
+    char room[PACKET_ROOM_LEN];
+    char scope[ROLLUP_SCOPE_LEN], name[ROLLUP_ROOM_LEN];
+    int index = packet_parse(topic, payload, payloadlen, tokens, room);
+
+    if(index < 7 || tokens[0][0] == '\0' || tokens[1][0] == '\0' ||
+       snprintf(scope, sizeof(scope), "%s/%s", tokens[0], tokens[1]) >= (int)sizeof(scope) ||
+       snprintf(name, sizeof(name), "%s/%s/%s", tokens[0], tokens[1], tokens[2]) >= (int)sizeof(name)) {
+        table->rejected++;
+        return -1;
+    }
+
+    int level = atoi(tokens[4]);
+    double decibel = atof(tokens[5]);
+    int health = atoi(tokens[6]);
+
+    struct aggregate *agg = get_location(table, scope);
+    if(agg == NULL)
+        return -1;
+
+    if(health == 0) {
+        agg->faults++;
+        return 0;
+    }
+
+    if(agg->count == 0 || decibel > agg->max)
+        agg->max = decibel;
+    agg->count++;
+    agg->sum += decibel;
+    sketch_add(&agg->sk, decibel);
+    if(level > 0)
+        add_room_level(agg, name, level);
+    return 0;
+}
+
+
+/*
+ * This function merges a location rollup of another gateway (see the format in gateway/noise_gateway.c).
+ * 'scope' is "institution/location" of the topic it came on; the rollup has to be of that location.
+ * It returns 0, or -1 if the rollup is malformed or of another scope.
+*/
+int rollup_add_rollup(struct rollup_table *table, const char *scope, char *payload) {
+    char *tokens[ROLLUP_FIELDS];
+    char *save = NULL, *slash = strchr(scope, '/');
+    int index = 0;
+    struct aggregate part;
+
+    for(char *t = strtok_r(payload, ",", &save); t != NULL && index < ROLLUP_FIELDS; t = strtok_r(NULL, ",", &save))
+        tokens[index++] = t;
+    if(index < ROLLUP_FIELDS || slash == NULL || slash == scope || slash[1] == '\0' || strchr(slash + 1, '/') != NULL ||
+       strlen(scope) >= ROLLUP_SCOPE_LEN || strcmp(tokens[0], scope) != 0) {
+        fprintf(stderr, "Ignoring rollup on %s with a wrong scope or fields\n", scope);
+        table->rejected++;
+        return -1;
+    }
+
+    memset(&part, 0, sizeof(part));
+    if(sketch_decode(&part.sk, tokens[7]) != 0) {
+        fprintf(stderr, "Ignoring rollup of %s with a malformed sketch\n", tokens[0]);
+        table->rejected++;
+        return -1;
+    }
+    part.count = strtoul(tokens[2], NULL, 10);
+    part.sum = atof(tokens[3]) * part.count;
+    part.max = atof(tokens[4]);
+    part.faults = strtoul(tokens[5], NULL, 10);
+
+    if(strcmp(tokens[6], "-") != 0) {
+        char *room_save = NULL;
+        for(char *r = strtok_r(tokens[6], "|", &room_save); r != NULL; r = strtok_r(NULL, "|", &room_save)) {
+            char *colon = strrchr(r, ':');
+            if(colon == NULL || colon - r >= ROLLUP_ROOM_LEN)
+                continue;
+            *colon = '\0';
+            add_room_level(&part, r, atoi(colon + 1));
+        }
+    }
+
+    struct aggregate *agg = get_location(table, scope);
+    if(agg != NULL)
+        rollup_merge(agg, &part);
+    free(part.rooms);
+    return agg != NULL ? 0 : -1;
+}
+
+
+/*
+ * This function closes the window: it takes out the aggregate of every location that had data, followed by the
+ * aggregate of every institution (merged from its locations), and clears the aggregates of the table.
+ * The caller publishes the list without holding the table, and frees it with rollup_free_list().
+*/
+struct aggregate *rollup_close_window(struct rollup_table *table) {
+    struct aggregate *list = NULL, **last = &list, *institutions = NULL, *inst, *agg;
+    char name[ROLLUP_SCOPE_LEN], *slash;
+
+    for(int i=0; i<ROLLUP_BUCKETS; i++) {
+        for(agg = table->locations[i]; agg != NULL; agg = agg->next) {
+            if(agg->count == 0 && agg->faults == 0)
+                continue;
+
+            // the closed window keeps the rooms array; the table starts a new one
+            struct aggregate *closed = malloc(sizeof(struct aggregate));
+            if(closed == NULL)
+                continue;
+            *closed = *agg;
+            closed->next = NULL;
+            *last = closed;
+            last = &closed->next;
+            agg->rooms = NULL;
+            agg->cap_rooms = 0;
+            reset_aggregate(agg);
+
+            snprintf(name, sizeof(name), "%s", closed->scope);
+            if((slash = strchr(name, '/')) == NULL)
+                continue;
+            *slash = '\0';
+            for(inst = institutions; inst != NULL && strcmp(inst->scope, name) != 0; inst = inst->next);
+            if(inst == NULL) {
+                inst = calloc(1, sizeof(struct aggregate));
+                if(inst == NULL)
+                    continue;
+                snprintf(inst->scope, sizeof(inst->scope), "%s", name);
+                reset_aggregate(inst);
+                inst->next = institutions;
+                institutions = inst;
+            }
+            rollup_merge(inst, closed);
+        }
+    }
+    *last = institutions;
+    return list;
+}
+
+
+void rollup_free_list(struct aggregate *list) {
+    while(list != NULL) {
+        struct aggregate *next = list->next;
+        free(list->rooms);
+        free(list);
+        list = next;
+    }
+}
+
+
+void rollup_free(struct rollup_table *table) {
+    for(int i=0; i<ROLLUP_BUCKETS; i++) {
+        rollup_free_list(table->locations[i]);
+        table->locations[i] = NULL;
+    }
+}
+
+
+/*
+ * This function writes the rollup message of an aggregate to 'buffer'.
+ * It returns the length of the message or -1 if it does not fit.
+*/
+int rollup_format(char *buffer, int size, const struct aggregate *agg, const char *window_end) {
+    int len, n;
+
+    len = snprintf(buffer, size, "%s,%s,%lu,%f,%f,%lu,", agg->scope, window_end, agg->count,
+                   agg->count ? agg->sum / agg->count : 0.0, agg->max, agg->faults);
+    if(len >= size)
+        return -1;
+
+    if(agg->nrooms == 0)
+        buffer[len++] = '-';
+    for(int i=0; i<agg->nrooms; i++) {
+        n = snprintf(buffer + len, size - len, "%s%s:%d", i ? "|" : "", agg->rooms[i].name, agg->rooms[i].level);
+        if(n >= size - len)
+            return -1;
+        len += n;
+    }
+
+    if(len + 2 >= size)
+        return -1;
+    buffer[len++] = ',';
+    n = sketch_encode(&agg->sk, buffer + len, size - len);
+    if(n < 0)
+        return -1;
+
+    return len + n;
+}
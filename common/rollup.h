@@ -0,0 +1,63 @@
+/*
+ * Window aggregates of the edge gateway (gateway/noise_gateway.c).
+ *
+ * A rollup table holds one aggregate per location ("institution/location") for the current window: the count,
+ * sum and max of the healthy decibels, the number of unhealthy readings, the rooms at warning level 1 or higher
+ * (with their highest level) and the quantile sketch of the decibels (common/sketch.h).
+ *
+ * Readings are added with rollup_add_reading(), location rollups of another gateway with rollup_add_rollup()
+ * (stacked gateways). rollup_close_window() takes the aggregates of the window out of the table: the locations
+ * that had data, then the institutions merged from them, as a list that is formatted with rollup_format() and
+ * freed with rollup_free_list(). The format of a rollup is described in gateway/noise_gateway.c.
+ *
+ * A scope that does not fit ROLLUP_SCOPE_LEN, or a rollup whose scope is not "institution/location" of its topic,
+ * is rejected rather than truncated, so two locations never share an aggregate.
+ *
+ * The table is not thread safe; the gateway holds its lock around every call.
+*/
+
+#ifndef NOISE_ROLLUP_H
+#define NOISE_ROLLUP_H
+
+#include "sketch.h"
+
+#define ROLLUP_SCOPE_LEN    32
+#define ROLLUP_ROOM_LEN     48
+#define ROLLUP_BUCKETS      1024
+#define ROLLUP_MAX          65536       // longest rollup message
+
+struct room_level {
+    char name[ROLLUP_ROOM_LEN];
+    int level;
+};
+
+// aggregate of one location (or institution) in the current window
+struct aggregate {
+    struct aggregate *next;
+    char scope[ROLLUP_SCOPE_LEN];
+    unsigned long count;
+    double sum;
+    double max;
+    unsigned long faults;
+    struct room_level *rooms;
+    int nrooms;
+    int cap_rooms;
+    struct sketch sk;
+};
+
+struct rollup_table {
+    struct aggregate *locations[ROLLUP_BUCKETS];
+    unsigned long rejected;             // readings and rollups that were not added
+};
+
+int rollup_add_reading(struct rollup_table *table, const char *topic, char *payload, int payloadlen);
+int rollup_add_rollup(struct rollup_table *table, const char *scope, char *payload);
+
+struct aggregate *rollup_close_window(struct rollup_table *table);
+void rollup_free_list(struct aggregate *list);
+void rollup_free(struct rollup_table *table);
+
+void rollup_merge(struct aggregate *dst, const struct aggregate *src);
+int rollup_format(char *buffer, int size, const struct aggregate *agg, const char *window_end);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Sequence tracking of the reading streams (see seq_track.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "seq_track.h"
+
+#define WORDS   (SEQ_WINDOW / 64)
+
+
+/*
+ * This function counts the set bits at positions [from, to) of the window.
+*/
+static unsigned long count_bits(const uint64_t *window, int from, int to) {
+    unsigned long n = 0;
+
+    for(int w=from / 64; w<WORDS && w * 64 < to; w++) {
+        uint64_t bits = window[w];
+        int lo = from > w * 64 ? from - w * 64 : 0;
+        int hi = to < (w + 1) * 64 ? to - w * 64 : 64;
+
+        bits >>= lo;
+        if(hi - lo < 64)
+            bits &= (1ULL << (hi - lo)) - 1;
+        n += __builtin_popcountll(bits);
+    }
+    return n;
+}
+
+
+/*
+ * This function moves the window up by 'shift' numbers (bit i becomes bit i + shift) and returns how many
+ * numbers left it without having been received, or were skipped so far that they never entered it.
+*/
+static unsigned long window_shift(uint64_t *window, uint64_t shift) {
+    unsigned long lost;
+
+    if(shift >= SEQ_WINDOW) {
+        lost = SEQ_WINDOW - count_bits(window, 0, SEQ_WINDOW) + (shift - SEQ_WINDOW);
+        memset(window, 0, WORDS * sizeof(uint64_t));
+        return lost;
+    }
+
+    lost = shift - count_bits(window, SEQ_WINDOW - shift, SEQ_WINDOW);
+    int words = shift / 64, bits = shift % 64;
+    for(int w=WORDS - 1; w>=0; w--) {
+        uint64_t value = 0;
+        if(w - words >= 0)
+            value = window[w - words] << bits;
+        if(bits != 0 && w - words - 1 >= 0)
+            value |= window[w - words - 1] >> (64 - bits);
+        window[w] = value;
+    }
+    return lost;
+}
+
+
+void seq_tracker_init(struct seq_tracker *tracker) {
+    memset(tracker, 0, sizeof(*tracker));
+}
+
+
+/*
+ * This function returns the numbers missing in the window, that may still arrive.
+*/
+unsigned long seq_pending(const struct seq_tracker *tracker) {
+    return tracker->started ? SEQ_WINDOW - count_bits(tracker->window, 0, SEQ_WINDOW) : 0;
+}
+
+
+/*
+ * This function records one packet of the stream and returns what it was.
+*/
+enum seq_result seq_observe(struct seq_tracker *t, uint64_t epoch, uint64_t seq) {
+    if(!t->started || epoch > t->epoch) {
+        if(t->started) {
+            // the publisher restarted: the rest of the old epoch will not come, and the new one counts from 1
+            t->stats.restarts++;
+            t->stats.lost += seq_pending(t) + (seq > 1 ? seq - 1 : 0);
+        }
+        t->started = 1;
+        t->epoch = epoch;
+        t->highest = seq;
+        t->base = seq;
+        // numbers below the first one are not expected: they count as received
+        memset(t->window, 0xff, sizeof(t->window));
+        t->stats.received++;
+        return SEQ_FIRST;
+    }
+    if(epoch < t->epoch) {
+        t->stats.stale++;
+        return SEQ_STALE;
+    }
+
+    t->stats.received++;
+    if(seq > t->highest) {
+        t->stats.lost += window_shift(t->window, seq - t->highest);
+        t->window[0] |= 1;
+        t->highest = seq;
+        return SEQ_NEW;
+    }
+
+    uint64_t back = t->highest - seq;
+    if(back >= SEQ_WINDOW || seq < t->base) {
+        t->stats.late++;
+        return SEQ_LATE;
+    }
+    if(t->window[back / 64] & (1ULL << (back % 64))) {
+        t->stats.duplicates++;
+        return SEQ_DUPLICATE;
+    }
+    t->window[back / 64] |= 1ULL << (back % 64);
+    t->stats.reordered++;
+    return SEQ_REORDERED;
+}
+
+
+void seq_table_init(struct seq_table *table, const char *name) {
+    memset(table, 0, sizeof(*table));
+    pthread_mutex_init(&table->lock, NULL);
+    table->name = name;
+}
+
+
+static int put(char *key, int n, const char *s) {
+    while(*s != '\0' && n < SEQ_KEY_LEN - 1)
+        key[n++] = *s++;
+    key[n] = '\0';
+    return n;
+}
+
+
+/*
+ * This function records a parsed packet (common/packet.h, at least seq) of 'stream' and returns what it was.
+ * The tracker of the stream is created the first time; if that fails the packet is not tracked (SEQ_NEW).
+*/
+enum seq_result seq_table_observe(struct seq_table *table, const char *stream, char **fields, int nfields) {
+    char key[SEQ_KEY_LEN];
+    uint32_t hash = 2166136261u;
+    struct seq_entry *e;
+    enum seq_result result = SEQ_NEW;
+    int n;
+
+    if(nfields < 8)
+        return SEQ_NEW;
+
+    n = put(key, 0, stream);
+    n = put(key, n, "|");
+    n = put(key, n, fields[0]);
+    n = put(key, n, "/");
+    n = put(key, n, fields[1]);
+    n = put(key, n, "/");
+    n = put(key, n, fields[2]);
+    for(int i=0; i<n; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+
+    uint64_t seq = strtoull(fields[7], NULL, 10);
+    uint64_t epoch = nfields > 8 ? strtoull(fields[8], NULL, 10) : 0;
+
+    pthread_mutex_lock(&table->lock);
+    for(e = table->buckets[hash % SEQ_BUCKETS]; e != NULL && strcmp(e->key, key) != 0; e = e->next);
+    if(e == NULL && (e = malloc(sizeof(struct seq_entry))) != NULL) {
+        memcpy(e->key, key, n + 1);
+        seq_tracker_init(&e->tracker);
+        e->next = table->buckets[hash % SEQ_BUCKETS];
+        table->buckets[hash % SEQ_BUCKETS] = e;
+        table->count++;
+    }
+    if(e != NULL)
+        result = seq_observe(&e->tracker, epoch, seq);
+    pthread_mutex_unlock(&table->lock);
+    return result;
+}
+
+
+static void add_stats(struct seq_stats *sum, const struct seq_tracker *t) {
+    sum->received += t->stats.received;
+    sum->lost += t->stats.lost;
+    sum->pending += seq_pending(t);
+    sum->duplicates += t->stats.duplicates;
+    sum->reordered += t->stats.reordered;
+    sum->late += t->stats.late;
+    sum->restarts += t->stats.restarts;
+    sum->stale += t->stats.stale;
+}
+
+
+void seq_table_totals(struct seq_table *table, struct seq_stats *totals) {
+    memset(totals, 0, sizeof(*totals));
+    pthread_mutex_lock(&table->lock);
+    for(int b=0; b<SEQ_BUCKETS; b++) {
+        for(struct seq_entry *e = table->buckets[b]; e != NULL; e = e->next)
+            add_stats(totals, &e->tracker);
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+
+static void print_stats(FILE *out, const struct seq_stats *s) {
+    fprintf(out, "received %lu, lost %lu, pending %lu, duplicates %lu, reordered %lu, late %lu, restarts %lu, stale %lu\n",
+            s->received, s->lost, s->pending, s->duplicates, s->reordered, s->late, s->restarts, s->stale);
+}
+
+
+/*
+ * This function prints the totals and one line per stream.
+*/
+void seq_table_report(struct seq_table *table, FILE *out) {
+    struct seq_stats totals, one;
+
+    seq_table_totals(table, &totals);
+    fprintf(out, "[seq] %s: %d streams, ", table->name, table->count);
+    print_stats(out, &totals);
+
+    pthread_mutex_lock(&table->lock);
+    for(int b=0; b<SEQ_BUCKETS; b++) {
+        for(struct seq_entry *e = table->buckets[b]; e != NULL; e = e->next) {
+            memset(&one, 0, sizeof(one));
+            add_stats(&one, &e->tracker);
+            fprintf(out, "[seq]   %s epoch %llu seq %llu: ", e->key, (unsigned long long)e->tracker.epoch, (unsigned long long)e->tracker.highest);
+            print_stats(out, &one);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    fflush(out);
+}
+
+
+static void *report_main(void *arg) {
+    struct seq_table *table = arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, table->signal);
+    while(sigwait(&set, &sig) == 0)
+        seq_table_report(table, stdout);
+    return NULL;
+}
+
+
+/*
+ * This function prints the report to stdout whenever the process gets 'sig'. It blocks the signal in the
+ * calling thread, so it must be called before the other threads (network, workers) are started.
+ * It returns 0, or -1 if the report thread could not be started.
+*/
+int seq_table_report_on_signal(struct seq_table *table, int sig) {
+    sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+    table->signal = sig;
+    if(pthread_create(&thread, NULL, report_main, table) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
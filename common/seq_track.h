@@ -0,0 +1,88 @@
+/*
+ * Delivery quality of the readings: gaps, duplicates and reorders per room.
+ *
+ * Every packet of a publisher carries 'seq' and 'epoch' (common/packet.h). The epoch is the start time of the
+ * publisher in milliseconds, so it changes when the publisher restarts, and seq counts from 1 in every epoch.
+ * The publisher numbers each stream of a room on its own: the readings (room topic) and the alerts (admin/alerts).
+ *
+ * A consumer keeps one tracker per stream it sees: the stream name and the room, e.g. "readings|handong/NTH/313".
+ * A tracker remembers the highest seq of the current epoch and a bitmap of the SEQ_WINDOW numbers below it:
+ *  - a number above the highest moves the window; numbers skipped on the way are missing ("pending"),
+ *  - a missing number that arrives later is a reorder, one that was already seen is a duplicate,
+ *  - a number that leaves the window while still missing is lost,
+ *  - a number below the window, or below the first one seen, arrives too late to tell (counted as late),
+ *  - a new (higher) epoch is a restart: what is missing of the old epoch is lost, and so are the numbers
+ *    before the first one seen of the new epoch; packets of an older epoch are stale.
+ * The first packet of a stream starts its tracker, so a consumer that starts late does not count earlier readings.
+ * Packets without an epoch (older publishers) are tracked with epoch 0.
+ *
+ * A tracker has a fixed size; the table allocates one per stream the first time it is seen and never frees it.
+ * The table is thread safe (worker threads of one consumer share it). seq_table_report() prints every stream,
+ * and seq_table_report_on_signal() prints the report whenever the process gets the signal (SIGUSR1).
+*/
+
+#ifndef NOISE_SEQ_TRACK_H
+#define NOISE_SEQ_TRACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SEQ_WINDOW      256         // numbers below the highest that are remembered (bits)
+#define SEQ_KEY_LEN     64
+#define SEQ_BUCKETS     4096
+
+enum seq_result {
+    SEQ_NEW,            // the next number, or a jump ahead
+    SEQ_FIRST,          // the first packet of the stream, or of a new epoch
+    SEQ_REORDERED,
+    SEQ_DUPLICATE,
+    SEQ_LATE,
+    SEQ_STALE
+};
+
+struct seq_stats {
+    unsigned long received;
+    unsigned long lost;
+    unsigned long pending;      // missing inside the window, not lost yet (filled in by the report)
+    unsigned long duplicates;
+    unsigned long reordered;
+    unsigned long late;
+    unsigned long restarts;
+    unsigned long stale;
+};
+
+struct seq_tracker {
+    uint64_t epoch;
+    uint64_t highest;
+    uint64_t base;                      // first seq of the epoch seen by this consumer
+    uint64_t window[SEQ_WINDOW / 64];   // bit i: highest - i was received
+    int started;
+    struct seq_stats stats;
+};
+
+struct seq_entry {
+    struct seq_entry *next;
+    char key[SEQ_KEY_LEN];
+    struct seq_tracker tracker;
+};
+
+struct seq_table {
+    pthread_mutex_t lock;
+    struct seq_entry *buckets[SEQ_BUCKETS];
+    int count;
+    const char *name;           // the consumer, for the report
+    int signal;                 // of the on-demand report
+};
+
+void seq_tracker_init(struct seq_tracker *tracker);
+enum seq_result seq_observe(struct seq_tracker *tracker, uint64_t epoch, uint64_t seq);
+unsigned long seq_pending(const struct seq_tracker *tracker);
+
+void seq_table_init(struct seq_table *table, const char *name);
+enum seq_result seq_table_observe(struct seq_table *table, const char *stream, char **fields, int nfields);
+void seq_table_totals(struct seq_table *table, struct seq_stats *totals);
+void seq_table_report(struct seq_table *table, FILE *out);
+int seq_table_report_on_signal(struct seq_table *table, int sig);
+
+#endif
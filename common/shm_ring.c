@@ -0,0 +1,330 @@
+/*
+ * Shared-memory message ring (see shm_ring.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+
+#define SHM_RING_MAGIC      0x4e534852      // "NSHR"
+#define SHM_RING_VERSION    1
+#define STALL_TIMEOUT_NS    1000000000L     // skip a slot whose publisher did not finish within 1 sec
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()         __builtin_ia32_pause()
+#else
+#define cpu_relax()         atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+struct shm_header {
+    uint32_t magic;             // written last by the creator
+    uint32_t version;
+    uint32_t slots;             // power of two
+    uint32_t slot_size;
+    char pad1[48];
+    _Atomic uint64_t head;      // next sequence number to claim (own cache line, every publisher writes it)
+    char pad2[56];
+    _Atomic uint32_t signal;    // futex word, bumped when a publisher wakes the readers
+    _Atomic uint32_t waiters;   // readers sleeping (or about to) on 'signal'
+    char pad3[56];
+};
+
+struct shm_slot {
+    _Atomic uint64_t state;     // 2*seq+1 while seq is written, 2*seq+2 when it is complete
+    uint32_t topic_len;
+    uint32_t payload_len;
+    char data[];                // topic '\0' payload '\0'
+};
+
+struct shm_ring {
+    struct shm_header *header;
+    char *slots;
+    size_t size;
+    uint32_t mask;
+    uint32_t slot_size;
+};
+
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static struct shm_slot *slot_at(const struct shm_ring *ring, uint64_t seq) {
+    return (struct shm_slot *)(ring->slots + (size_t)(seq & ring->mask) * ring->slot_size);
+}
+
+
+/*
+ * This function waits until a ring created by another process is initialized, and returns its header
+ * (unmapped by the caller). It returns NULL if the ring does not become ready within a second.
+*/
+static struct shm_header *wait_for_creator(int fd) {
+    struct stat st;
+
+    for(int i=0; i<1000; i++) {
+        if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct shm_header)) {
+            struct shm_header *header = mmap(NULL, sizeof(struct shm_header), PROT_READ, MAP_SHARED, fd, 0);
+            if(header == MAP_FAILED)
+                return NULL;
+            if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHM_RING_MAGIC)
+                return header;
+            munmap(header, sizeof(struct shm_header));
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+
+/*
+ * This function opens the ring 'name', creating it with 'slots' slots of 'slot_size' bytes if it does not exist.
+ * 'slots' is rounded up to a power of two. It returns NULL on error.
+*/
+struct shm_ring *shm_ring_open(const char *name, uint32_t slots, uint32_t slot_size) {
+    struct shm_ring *ring = calloc(1, sizeof(struct shm_ring));
+    struct shm_header *existing = NULL;
+    int created = 1;
+    uint32_t count = 1;
+    int fd;
+
+    if(ring == NULL)
+        return NULL;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if(fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0);
+        if(fd >= 0 && (existing = wait_for_creator(fd)) == NULL) {
+            fprintf(stderr, "Error: shared memory ring %s is not initialized\n", name);
+            close(fd);
+            free(ring);
+            return NULL;
+        }
+    }
+    if(fd < 0) {
+        fprintf(stderr, "Error: shm_open %s: %s\n", name, strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    if(created) {
+        while(count < slots)
+            count <<= 1;
+        slot_size = (slot_size + 63) & ~63u;
+        if(slot_size < 64)
+            slot_size = 64;
+    }
+    else {
+        count = existing->slots;
+        slot_size = existing->slot_size;
+        munmap(existing, sizeof(struct shm_header));
+    }
+
+    ring->size = sizeof(struct shm_header) + (size_t)count * slot_size;
+    ring->mask = count - 1;
+    ring->slot_size = slot_size;
+
+    if(created && ftruncate(fd, ring->size) != 0) {
+        fprintf(stderr, "Error: ftruncate %s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ring->header == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap %s: %s\n", name, strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    ring->slots = (char *)ring->header + sizeof(struct shm_header);
+
+    // a fresh object is zero filled: head 0 and every slot state 0 (older than sequence 0)
+    if(created) {
+        ring->header->version = SHM_RING_VERSION;
+        ring->header->slots = count;
+        ring->header->slot_size = slot_size;
+        __atomic_store_n(&ring->header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if(ring->header->version != SHM_RING_VERSION) {
+        fprintf(stderr, "Error: shared memory ring %s has version %u (expected %d)\n", name, ring->header->version, SHM_RING_VERSION);
+        shm_ring_close(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+
+void shm_ring_close(struct shm_ring *ring) {
+    if(ring == NULL)
+        return;
+    munmap(ring->header, ring->size);
+    free(ring);
+}
+
+
+int shm_ring_unlink(const char *name) {
+    return shm_unlink(name);
+}
+
+
+/*
+ * This function returns the largest topic length + payload length that fits in a slot.
+*/
+int shm_ring_max_message(const struct shm_ring *ring) {
+    return ring->slot_size - sizeof(struct shm_slot) - 2;
+}
+
+
+/*
+ * This function publishes a message. It returns 0 on success and -1 if the message does not fit in a slot.
+*/
+int shm_ring_publish(struct shm_ring *ring, const char *topic, const void *payload, int payloadlen) {
+    struct shm_header *h = ring->header;
+    size_t topic_len = strlen(topic);
+
+    if(payloadlen < 0 || topic_len + payloadlen > (size_t)shm_ring_max_message(ring))
+        return -1;
+
+    uint64_t seq = atomic_fetch_add_explicit(&h->head, 1, memory_order_relaxed);
+    struct shm_slot *slot = slot_at(ring, seq);
+
+    atomic_store_explicit(&slot->state, 2 * seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->topic_len = topic_len;
+    slot->payload_len = payloadlen;
+    memcpy(slot->data, topic, topic_len + 1);
+    memcpy(slot->data + topic_len + 1, payload, payloadlen);
+    slot->data[topic_len + 1 + payloadlen] = '\0';
+
+    atomic_store_explicit(&slot->state, 2 * seq + 2, memory_order_release);
+
+    // pairs with the fence in shm_ring_wait(): either the reader sees the slot or we see the reader
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&h->waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add_explicit(&h->signal, 1, memory_order_relaxed);
+        syscall(SYS_futex, &h->signal, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+
+void shm_cursor_init(struct shm_ring *ring, struct shm_cursor *cursor) {
+    cursor->next = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+    cursor->lost = 0;
+    cursor->stalled_since = 0;
+}
+
+
+/*
+ * This function moves a reader that was overtaken by the publishers to the middle of the ring,
+ * so that it has half a ring of slack before it is overtaken again.
+*/
+static void skip_ahead(struct shm_ring *ring, struct shm_cursor *cursor) {
+    uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+    uint64_t next = head > (ring->mask + 1) / 2 ? head - (ring->mask + 1) / 2 : 0;
+
+    if(next <= cursor->next)
+        next = cursor->next + 1;
+    cursor->lost += next - cursor->next;
+    cursor->next = next;
+}
+
+
+/*
+ * This function reads the next message into 'buffer' (at least shm_ring_max_message() + 2 bytes).
+ * The topic and payload point into the buffer and are NUL terminated.
+ * It returns 1 if a message was read and 0 if there is no message yet.
+*/
+int shm_ring_read(struct shm_ring *ring, struct shm_cursor *cursor, char *buffer, char **topic, char **payload, int *payloadlen) {
+    while(1) {
+        struct shm_slot *slot = slot_at(ring, cursor->next);
+        uint64_t done = 2 * cursor->next + 2;
+        uint64_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+        if(state == done) {
+            uint32_t topic_len = slot->topic_len, len = slot->payload_len;
+            int valid = topic_len + len <= (uint32_t)shm_ring_max_message(ring);
+
+            if(valid)
+                memcpy(buffer, slot->data, topic_len + len + 2);
+
+            // the copy is only good if no publisher started to overwrite the slot meanwhile
+            atomic_thread_fence(memory_order_acquire);
+            if(!valid || atomic_load_explicit(&slot->state, memory_order_relaxed) != state) {
+                skip_ahead(ring, cursor);
+                continue;
+            }
+
+            *topic = buffer;
+            *payload = buffer + topic_len + 1;
+            *payloadlen = len;
+            cursor->next++;
+            cursor->stalled_since = 0;
+            return 1;
+        }
+
+        if(state > done) {
+            skip_ahead(ring, cursor);
+            continue;
+        }
+
+        // the slot is claimed but not complete: a publisher is writing it, or died while writing it
+        if(atomic_load_explicit(&ring->header->head, memory_order_relaxed) > cursor->next) {
+            int64_t now = now_ns();
+            if(cursor->stalled_since == 0) {
+                cursor->stalled_since = now;
+            }
+            else if(now - cursor->stalled_since > STALL_TIMEOUT_NS) {
+                cursor->next++;
+                cursor->lost++;
+                cursor->stalled_since = 0;
+                continue;
+            }
+        }
+        return 0;
+    }
+}
+
+
+/*
+ * This function waits until the next message of the cursor may be ready or 'timeout_ms' passed.
+ * It first checks 'spin' times without sleeping, which is cheaper than a futex when messages are frequent.
+*/
+void shm_ring_wait(struct shm_ring *ring, const struct shm_cursor *cursor, int spin, int timeout_ms) {
+    struct shm_header *h = ring->header;
+    struct shm_slot *slot = slot_at(ring, cursor->next);
+    uint64_t done = 2 * cursor->next + 2;
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+
+    for(int i=0; i<spin; i++) {
+        if(atomic_load_explicit(&slot->state, memory_order_acquire) >= done)
+            return;
+        cpu_relax();
+    }
+
+    atomic_fetch_add_explicit(&h->waiters, 1, memory_order_relaxed);
+    uint32_t signal = atomic_load_explicit(&h->signal, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&slot->state, memory_order_acquire) < done)
+        syscall(SYS_futex, &h->signal, FUTEX_WAIT, signal, &timeout, NULL, 0);
+    atomic_fetch_sub_explicit(&h->waiters, 1, memory_order_relaxed);
+}
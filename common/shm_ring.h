@@ -0,0 +1,44 @@
+/*
+ * Shared-memory message ring for components on the same host.
+ *
+ * A ring is a POSIX shared memory object ('/noise', see shm_open(3)) holding a fixed number of slots.
+ * Any number of processes publish into it and any number read from it, like topics on a broker:
+ *  - A publisher claims the next sequence number with one atomic add and copies the topic and payload
+ *    into the slot of that number. A slot has a state word (2*seq+1 while written, 2*seq+2 when done).
+ *  - Every reader keeps its own cursor (the next sequence number) and copies messages out of the slots,
+ *    so every reader sees every message. Nothing is removed; the ring simply wraps around.
+ *  - A reader that falls more than the ring size behind finds newer messages in its slots. It skips
+ *    ahead and counts the skipped messages as lost (like a broker dropping a slow client's queue).
+ *
+ * Publishing and reading do not enter the kernel. An idle reader sleeps on a futex in the ring,
+ * which a publisher only wakes when somebody is waiting.
+ *
+ * The first process to open a ring creates it with the given geometry; the others use the geometry
+ * stored in the ring. The object stays in /dev/shm until shm_ring_unlink().
+*/
+
+#ifndef NOISE_SHM_RING_H
+#define NOISE_SHM_RING_H
+
+#include <stdint.h>
+
+struct shm_ring;
+
+struct shm_cursor {
+    uint64_t next;              // sequence number of the next message to read
+    unsigned long lost;         // messages skipped because the reader was too slow
+    int64_t stalled_since;      // when the reader started waiting for an unfinished slot (ns), 0 if not
+};
+
+struct shm_ring *shm_ring_open(const char *name, uint32_t slots, uint32_t slot_size);
+void shm_ring_close(struct shm_ring *ring);
+int shm_ring_unlink(const char *name);
+int shm_ring_max_message(const struct shm_ring *ring);
+
+int shm_ring_publish(struct shm_ring *ring, const char *topic, const void *payload, int payloadlen);
+
+void shm_cursor_init(struct shm_ring *ring, struct shm_cursor *cursor);
+int shm_ring_read(struct shm_ring *ring, struct shm_cursor *cursor, char *buffer, char **topic, char **payload, int *payloadlen);
+void shm_ring_wait(struct shm_ring *ring, const struct shm_cursor *cursor, int spin, int timeout_ms);
+
+#endif
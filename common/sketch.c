@@ -0,0 +1,168 @@
+/*
+ * Mergeable quantile sketch (see sketch.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sketch.h"
+
+static double gamma_value = 0.0;
+static double log_gamma = 0.0;
+static int index_offset = 0;
+
+
+static void init_constants(void) {
+    if(log_gamma != 0.0)
+        return;
+    gamma_value = (1.0 + SKETCH_ALPHA) / (1.0 - SKETCH_ALPHA);
+    log_gamma = log(gamma_value);
+    index_offset = -(int)ceil(log(SKETCH_MIN_VALUE) / log_gamma);
+}
+
+
+/*
+ * This function returns the bucket of a value.
+*/
+static int bucket_of(double value) {
+    int index;
+
+    if(value <= SKETCH_MIN_VALUE)
+        return 0;
+
+    index = (int)ceil(log(value) / log_gamma) + index_offset;
+    if(index < 0)
+        index = 0;
+    if(index >= SKETCH_BUCKETS)
+        index = SKETCH_BUCKETS - 1;
+    return index;
+}
+
+
+/*
+ * This function returns the value that represents a bucket. It is the point with the same
+ * relative distance to both bounds of the bucket, so the relative error is at most SKETCH_ALPHA.
+*/
+static double value_of(int index) {
+    return 2.0 * pow(gamma_value, index - index_offset) / (gamma_value + 1.0);
+}
+
+
+void sketch_init(struct sketch *sk) {
+    init_constants();
+    memset(sk->counts, 0, sizeof(sk->counts));
+    sk->total = 0;
+    sk->lowest = SKETCH_BUCKETS;
+    sk->highest = -1;
+}
+
+
+void sketch_add(struct sketch *sk, double value) {
+    int index = bucket_of(value);
+
+    sk->counts[index]++;
+    sk->total++;
+    if(index < sk->lowest)
+        sk->lowest = index;
+    if(index > sk->highest)
+        sk->highest = index;
+}
+
+
+/*
+ * This function adds the counts of 'src' to 'dst'.
+*/
+void sketch_merge(struct sketch *dst, const struct sketch *src) {
+    for(int i=src->lowest; i<=src->highest; i++)
+        dst->counts[i] += src->counts[i];
+
+    dst->total += src->total;
+    if(src->lowest < dst->lowest)
+        dst->lowest = src->lowest;
+    if(src->highest > dst->highest)
+        dst->highest = src->highest;
+}
+
+
+/*
+ * This function returns the q-quantile (0 <= q <= 1) of the values in the sketch, or 0 if it is empty.
+ * The rank used is floor(q * (total - 1)), i.e. the lower of the two middle values for the median.
+*/
+double sketch_quantile(const struct sketch *sk, double q) {
+    uint64_t rank, seen = 0;
+
+    if(sk->total == 0)
+        return 0.0;
+    if(q < 0.0)
+        q = 0.0;
+    if(q > 1.0)
+        q = 1.0;
+
+    rank = (uint64_t)(q * (sk->total - 1));
+    for(int i=sk->lowest; i<=sk->highest; i++) {
+        seen += sk->counts[i];
+        if(seen > rank)
+            return value_of(i);
+    }
+    return value_of(sk->highest);
+}
+
+
+/*
+ * This function writes the non-empty buckets as "index:count" pairs separated by ';'.
+ * An empty sketch is written as "-".
+ * It returns the length of the text, or -1 if the buffer is too small.
+*/
+int sketch_encode(const struct sketch *sk, char *buffer, int size) {
+    int len = 0, n;
+
+    if(sk->total == 0)
+        return snprintf(buffer, size, "-") < size ? 1 : -1;
+
+    for(int i=sk->lowest; i<=sk->highest; i++) {
+        if(sk->counts[i] == 0)
+            continue;
+        n = snprintf(buffer + len, size - len, "%s%d:%u", len ? ";" : "", i, sk->counts[i]);
+        if(n < 0 || n >= size - len)
+            return -1;
+        len += n;
+    }
+    return len;
+}
+
+
+/*
+ * This function reads a sketch written by sketch_encode().
+ * It returns 0 on success and -1 if the text is malformed.
+*/
+int sketch_decode(struct sketch *sk, const char *text) {
+    const char *p = text;
+    char *end;
+    long index;
+    unsigned long count;
+
+    sketch_init(sk);
+    if(strcmp(text, "-") == 0)
+        return 0;
+
+    while(*p != '\0') {
+        index = strtol(p, &end, 10);
+        if(end == p || *end != ':' || index < 0 || index >= SKETCH_BUCKETS)
+            return -1;
+        p = end + 1;
+        count = strtoul(p, &end, 10);
+        if(end == p || (*end != ';' && *end != '\0'))
+            return -1;
+        p = *end == ';' ? end + 1 : end;
+
+        sk->counts[index] += count;
+        sk->total += count;
+        if(index < sk->lowest)
+            sk->lowest = index;
+        if(index > sk->highest)
+            sk->highest = index;
+    }
+    return 0;
+}
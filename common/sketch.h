@@ -0,0 +1,41 @@
+/*
+ * Mergeable quantile sketch of decibel values.
+ *
+ * Values are counted in logarithmic buckets: bucket i holds the values in (gamma^(i-1), gamma^i],
+ * with gamma = (1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA). Every quantile is therefore returned with
+ * a relative error of at most SKETCH_ALPHA (1%), independent of the number of values.
+ *
+ * Two sketches are merged by adding their bucket counts, which gives exactly the sketch of the
+ * combined stream. This is what lets the gateways be stacked: a building gateway merges the room
+ * readings, a campus gateway merges the building sketches, and so on.
+ *
+ * The covered range is SKETCH_MIN_VALUE to SKETCH_MAX_VALUE; values outside are clamped
+ * to the first or last bucket (the healthy decibel range is 1-100).
+*/
+
+#ifndef NOISE_SKETCH_H
+#define NOISE_SKETCH_H
+
+#include <stdint.h>
+
+#define SKETCH_ALPHA        0.01
+#define SKETCH_MIN_VALUE    0.01
+#define SKETCH_MAX_VALUE    10000.0
+#define SKETCH_BUCKETS      700
+
+struct sketch {
+    uint32_t counts[SKETCH_BUCKETS];
+    uint64_t total;
+    int lowest;         // lowest and highest non-empty bucket, lowest > highest if empty
+    int highest;
+};
+
+void sketch_init(struct sketch *sk);
+void sketch_add(struct sketch *sk, double value);
+void sketch_merge(struct sketch *dst, const struct sketch *src);
+double sketch_quantile(const struct sketch *sk, double q);
+
+int sketch_encode(const struct sketch *sk, char *buffer, int size);
+int sketch_decode(struct sketch *sk, const char *text);
+
+#endif
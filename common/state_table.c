@@ -0,0 +1,402 @@
+/*
+ * In-memory room state table (see state_table.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "state_table.h"
+
+#define NONE    (-1)
+
+
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u;
+
+    while(*key)
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    return hash;
+}
+
+
+/*
+ * This function allocates a hash table of 'n' (a power of two) empty slots.
+*/
+static int32_t *new_slots(int32_t n) {
+    int32_t *slots = malloc(n * sizeof(int32_t));
+
+    if(slots != NULL)
+        memset(slots, 0xff, n * sizeof(int32_t));
+    return slots;
+}
+
+
+int state_table_init(struct state_table *table) {
+    memset(table, 0, sizeof(struct state_table));
+
+    table->nslots = 1024;
+    table->slots = new_slots(table->nslots);
+    table->ngroup_slots = 256;
+    table->group_slots = new_slots(table->ngroup_slots);
+    if(table->slots == NULL || table->group_slots == NULL) {
+        state_table_free(table);
+        return -1;
+    }
+
+    for(int i=0; i<STATE_LEVELS; i++)
+        table->level_head[i] = NONE;
+    return 0;
+}
+
+
+void state_table_free(struct state_table *table) {
+    free(table->entries);
+    free(table->slots);
+    free(table->groups);
+    free(table->group_slots);
+    memset(table, 0, sizeof(struct state_table));
+}
+
+
+/*
+ * This function returns the hash slot of 'key' in a table of entries with a 'key' member at the
+ * start of 'stride' byte records: the slot holding it, or the empty slot where it belongs.
+*/
+static int32_t find_slot(const int32_t *slots, int32_t nslots, const void *records, size_t stride, const char *key) {
+    uint32_t mask = nslots - 1;
+    uint32_t i = hash_key(key) & mask;
+
+    while(slots[i] != NONE && strcmp((const char *)records + slots[i] * stride, key) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+
+/*
+ * This function doubles a hash table and inserts every record again.
+*/
+static int grow_slots(int32_t **slots, int32_t *nslots, const void *records, size_t stride, int32_t count) {
+    int32_t n = *nslots * 2;
+    int32_t *grown = new_slots(n);
+
+    if(grown == NULL)
+        return -1;
+    for(int32_t r=0; r<count; r++)
+        grown[find_slot(grown, n, records, stride, (const char *)records + r * stride)] = r;
+
+    free(*slots);
+    *slots = grown;
+    *nslots = n;
+    return 0;
+}
+
+
+/*
+ * This function returns the group (location or institution) with the given key, and creates it on first use.
+*/
+static int32_t get_group(struct state_table *table, const char *key) {
+    int32_t slot = find_slot(table->group_slots, table->ngroup_slots, table->groups, sizeof(struct state_group), key);
+    struct state_group *group;
+
+    if(table->group_slots[slot] != NONE)
+        return table->group_slots[slot];
+
+    // the hash table grows before it is half full, so a probe always ends at an empty slot
+    if((table->ngroups + 1) * 2 > table->ngroup_slots) {
+        if(grow_slots(&table->group_slots, &table->ngroup_slots, table->groups, sizeof(struct state_group), table->ngroups) != 0)
+            return NONE;
+        slot = find_slot(table->group_slots, table->ngroup_slots, table->groups, sizeof(struct state_group), key);
+    }
+
+    if(table->ngroups == table->cap_groups) {
+        int32_t cap = table->cap_groups ? table->cap_groups * 2 : 64;
+        struct state_group *groups = realloc(table->groups, cap * sizeof(struct state_group));
+        if(groups == NULL)
+            return NONE;
+        table->groups = groups;
+        table->cap_groups = cap;
+    }
+
+    group = &table->groups[table->ngroups];
+    strncpy(group->key, key, STATE_KEY_LEN - 1);
+    group->key[STATE_KEY_LEN - 1] = '\0';
+    group->head = NONE;
+    group->count = 0;
+    table->group_slots[slot] = table->ngroups++;
+    return table->ngroups - 1;
+}
+
+
+static int level_index(int level) {
+    if(level < -1)
+        level = -1;
+    if(level > 3)
+        level = 3;
+    return level + 1;
+}
+
+
+/*
+ * These macros link and unlink an entry in one of its three lists, given by the head of the
+ * list and the names of the prev/next members of that list.
+*/
+#define LINK(table, idx, head, prev, next) do {                      \
+        struct state_entry *e_ = &(table)->entries[idx];             \
+        e_->prev = NONE;                                             \
+        e_->next = (head);                                           \
+        if((head) != NONE)                                           \
+            (table)->entries[head].prev = (idx);                     \
+        (head) = (idx);                                              \
+    } while(0)
+
+#define UNLINK(table, idx, head, prev, next) do {                    \
+        struct state_entry *e_ = &(table)->entries[idx];             \
+        if(e_->prev != NONE)                                         \
+            (table)->entries[e_->prev].next = e_->next;              \
+        else                                                         \
+            (head) = e_->next;                                       \
+        if(e_->next != NONE)                                         \
+            (table)->entries[e_->next].prev = e_->prev;              \
+    } while(0)
+
+
+/*
+ * This function adds a new entry for 'key' and links it into its location and institution.
+ * It returns the index of the entry or NONE if out of memory.
+*/
+static int32_t add_entry(struct state_table *table, int32_t slot, const char *key, int level) {
+    char group_key[STATE_KEY_LEN];
+    struct state_entry *e;
+    int32_t idx, loc, inst;
+    char *slash;
+
+    if(table->count == table->capacity) {
+        int32_t cap = table->capacity ? table->capacity * 2 : 1024;
+        struct state_entry *entries = realloc(table->entries, cap * sizeof(struct state_entry));
+        if(entries == NULL)
+            return NONE;
+        table->entries = entries;
+        table->capacity = cap;
+    }
+
+    idx = table->count++;
+    e = &table->entries[idx];
+    memset(e, 0, sizeof(struct state_entry));
+    strncpy(e->key, key, STATE_KEY_LEN - 1);
+    e->level = level;
+    table->slots[slot] = idx;
+
+    // "institution/location/room" -> "institution/location" -> "institution"
+    strncpy(group_key, e->key, STATE_KEY_LEN);
+    slash = strrchr(group_key, '/');
+    if(slash != NULL)
+        *slash = '\0';
+    loc = get_group(table, group_key);
+    slash = strchr(group_key, '/');
+    if(slash != NULL)
+        *slash = '\0';
+    inst = get_group(table, group_key);
+
+    e = &table->entries[idx];
+    e->loc_group = loc;
+    e->inst_group = inst;
+    if(loc != NONE) {
+        LINK(table, idx, table->groups[loc].head, loc_prev, loc_next);
+        table->groups[loc].count++;
+    }
+    if(inst != NONE) {
+        LINK(table, idx, table->groups[inst].head, inst_prev, inst_next);
+        table->groups[inst].count++;
+    }
+    LINK(table, idx, table->level_head[level_index(level)], level_prev, level_next);
+    table->level_count[level_index(level)]++;
+    return idx;
+}
+
+
+/*
+ * This function stores the latest reading of a room.
+ * 'changed' is set to 1 if the room is new or its level or health changed, else 0.
+ * It returns the entry of the room, or NULL if the key is too long (counted in 'rejected') or out of memory.
+ * The pointer is valid until the next update.
+*/
+struct state_entry *state_update(struct state_table *table, const char *key, const char *timestamp, int level, float decibel, int health, uint32_t seq, int *changed) {
+    int32_t slot, idx;
+    struct state_entry *e;
+
+    if(strlen(key) >= STATE_KEY_LEN) {
+        table->rejected++;
+        return NULL;
+    }
+    slot = find_slot(table->slots, table->nslots, table->entries, sizeof(struct state_entry), key);
+    idx = table->slots[slot];
+
+    if(idx == NONE) {
+        // the hash table grows before it is half full, so a probe always ends at an empty slot
+        if((table->count + 1) * 2 > table->nslots) {
+            if(grow_slots(&table->slots, &table->nslots, table->entries, sizeof(struct state_entry), table->count) != 0)
+                return NULL;
+            slot = find_slot(table->slots, table->nslots, table->entries, sizeof(struct state_entry), key);
+        }
+        idx = add_entry(table, slot, key, level);
+        if(idx == NONE)
+            return NULL;
+        *changed = 1;
+    }
+    else {
+        e = &table->entries[idx];
+        *changed = (e->level != level || e->health != health);
+        if(level_index(e->level) != level_index(level)) {
+            UNLINK(table, idx, table->level_head[level_index(e->level)], level_prev, level_next);
+            table->level_count[level_index(e->level)]--;
+            LINK(table, idx, table->level_head[level_index(level)], level_prev, level_next);
+            table->level_count[level_index(level)]++;
+        }
+    }
+
+    e = &table->entries[idx];
+    strncpy(e->timestamp, timestamp, sizeof(e->timestamp) - 1);
+    e->level = level;
+    e->health = health;
+    e->decibel = decibel;
+    e->seq = seq;
+    return e;
+}
+
+
+const struct state_entry *state_lookup(const struct state_table *table, const char *key) {
+    int32_t slot = find_slot(table->slots, table->nslots, table->entries, sizeof(struct state_entry), key);
+
+    return table->slots[slot] == NONE ? NULL : &table->entries[table->slots[slot]];
+}
+
+
+/*
+ * This function calls 'visit' for every room under 'prefix' (whole topic levels, see state_table.h)
+ * until it returns non-zero. It returns the number of visited rooms.
+*/
+int state_query_prefix(const struct state_table *table, const char *prefix, state_visit visit, void *ctx) {
+    const struct state_entry *e;
+    int levels = 0, visited = 0;
+    int32_t slot, group;
+
+    if(prefix[0] == '\0') {
+        for(int32_t i=0; i<table->count; i++) {
+            visited++;
+            if(visit(ctx, &table->entries[i]))
+                break;
+        }
+        return visited;
+    }
+
+    for(const char *p = prefix; *p; p++)
+        levels += (*p == '/');
+
+    if(levels >= 2) {
+        e = state_lookup(table, prefix);
+        if(e == NULL)
+            return 0;
+        visit(ctx, e);
+        return 1;
+    }
+
+    slot = find_slot(table->group_slots, table->ngroup_slots, table->groups, sizeof(struct state_group), prefix);
+    group = table->group_slots[slot];
+    if(group == NONE)
+        return 0;
+
+    for(int32_t i = table->groups[group].head; i != NONE; i = levels == 0 ? e->inst_next : e->loc_next) {
+        e = &table->entries[i];
+        visited++;
+        if(visit(ctx, e))
+            break;
+    }
+    return visited;
+}
+
+
+/*
+ * This function calls 'visit' for every room at 'min_level' or above (highest level first)
+ * until it returns non-zero. It returns the number of visited rooms.
+*/
+int state_query_level(const struct state_table *table, int min_level, state_visit visit, void *ctx) {
+    int visited = 0;
+
+    for(int l = STATE_LEVELS - 1; l >= level_index(min_level); l--) {
+        for(int32_t i = table->level_head[l]; i != NONE; i = table->entries[i].level_next) {
+            visited++;
+            if(visit(ctx, &table->entries[i]))
+                return visited;
+        }
+    }
+    return visited;
+}
+
+
+struct answer {
+    char *buffer;
+    int size;
+    int len;
+    int count;
+    int truncated;
+};
+
+
+/*
+ * This function appends one room to the response. It stops the query when the buffer is full.
+*/
+static int append_entry(void *ctx, const struct state_entry *e) {
+    struct answer *answer = ctx;
+    int n = snprintf(answer->buffer + answer->len, answer->size - answer->len, "\n%s,%s,%d,%f,%d,%u",
+                     e->key, e->timestamp, e->level, e->decibel, e->health, e->seq);
+
+    if(n >= answer->size - answer->len) {
+        answer->truncated = 1;
+        return 1;
+    }
+    answer->len += n;
+    answer->count++;
+    return 0;
+}
+
+
+/*
+ * This function runs a text query (see state_table.h) and writes the response to 'buffer'.
+ * It returns the length of the response, or -1 if the query is malformed.
+*/
+int state_answer(const struct state_table *table, const char *query, char *buffer, int size) {
+    char header[32];
+    struct answer answer;
+    int header_len;
+
+    // the header is written at the end, when the count is known; leave room for it
+    answer.buffer = buffer + sizeof(header);
+    answer.size = size - sizeof(header);
+    answer.len = 0;
+    answer.count = 0;
+    answer.truncated = 0;
+    if(answer.size <= 0)
+        return -1;
+
+    if(strncmp(query, "point ", 6) == 0 || strncmp(query, "prefix ", 7) == 0) {
+        const char *prefix = strchr(query, ' ') + 1;
+        int point_levels = 0;
+        for(const char *p = prefix; *p; p++)
+            point_levels += (*p == '/');
+        if(query[1] == 'o' && point_levels != 2)
+            return -1;
+        state_query_prefix(table, prefix, append_entry, &answer);
+    }
+    else if(strncmp(query, "level ", 6) == 0) {
+        state_query_level(table, atoi(query + 6), append_entry, &answer);
+    }
+    else {
+        return -1;
+    }
+
+    header_len = snprintf(header, sizeof(header), "%d%s", answer.count, answer.truncated ? ",truncated" : "");
+    memmove(buffer + header_len, answer.buffer, answer.len);
+    memcpy(buffer, header, header_len);
+    return header_len + answer.len;
+}
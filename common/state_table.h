@@ -0,0 +1,81 @@
+/*
+ * In-memory table of the current state of every room.
+ *
+ * Every room ("institution/location/room") has one entry with its latest reading. Entries live in one
+ * array and are found through an open addressing hash table, so a point lookup is one hash and a few
+ * compares. Three intrusive lists give the other queries without scanning the table:
+ *  - per warning level (-1 = unhealthy sensor, 0 .. 3), for "all rooms at level >= N",
+ *  - per location ("institution/location") and per institution, for prefix queries.
+ * Prefixes are whole topic levels: "" (every room), "handong", "handong/NTH" or "handong/NTH/313".
+ *
+ * state_answer() runs a text query and writes the response:
+ *      query       "point handong/NTH/313" | "prefix handong/NTH" | "level 2"
+ *      response    "<count>" or "<count>,truncated" on the first line, then one line per room:
+ *                  "institution/location/room,timestamp,noise_level,avg_decibel,health_status,seq"
+ *
+ * A key of STATE_KEY_LEN characters or more is rejected (and counted), never truncated: two rooms with a long
+ * common prefix would otherwise share one entry.
+ *
+ * The table is not thread safe; the state cache uses it from the network thread only.
+*/
+
+#ifndef NOISE_STATE_TABLE_H
+#define NOISE_STATE_TABLE_H
+
+#include <stdint.h>
+
+#define STATE_KEY_LEN   32
+#define STATE_LEVELS    5       // -1 .. 3
+
+struct state_entry {
+    char key[STATE_KEY_LEN];
+    char timestamp[13];
+    int8_t level;
+    int8_t health;
+    float decibel;
+    uint32_t seq;
+    int64_t retained_at;        // when the state cache last published the retained snapshot
+    int32_t level_prev, level_next;
+    int32_t loc_prev, loc_next;
+    int32_t inst_prev, inst_next;
+    int32_t loc_group, inst_group;
+};
+
+struct state_group {
+    char key[STATE_KEY_LEN];
+    int32_t head;
+    int32_t count;
+};
+
+struct state_table {
+    struct state_entry *entries;
+    int32_t count, capacity;
+
+    int32_t *slots;             // hash table of entry indexes, -1 if empty
+    int32_t nslots;
+
+    struct state_group *groups;
+    int32_t ngroups, cap_groups;
+    int32_t *group_slots;
+    int32_t ngroup_slots;
+
+    int32_t level_head[STATE_LEVELS];
+    int32_t level_count[STATE_LEVELS];
+
+    unsigned long rejected;     // updates with a key too long
+};
+
+typedef int (*state_visit)(void *ctx, const struct state_entry *entry);
+
+int state_table_init(struct state_table *table);
+void state_table_free(struct state_table *table);
+
+struct state_entry *state_update(struct state_table *table, const char *key, const char *timestamp, int level, float decibel, int health, uint32_t seq, int *changed);
+const struct state_entry *state_lookup(const struct state_table *table, const char *key);
+
+int state_query_prefix(const struct state_table *table, const char *prefix, state_visit visit, void *ctx);
+int state_query_level(const struct state_table *table, int min_level, state_visit visit, void *ctx);
+
+int state_answer(const struct state_table *table, const char *query, char *buffer, int size);
+
+#endif
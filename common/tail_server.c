@@ -0,0 +1,458 @@
+/*
+ * Live tail of the admin logs over a local Unix socket (see tail_server.h).
+*/
+
+#define _GNU_SOURCE         // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "tail_server.h"
+#include "config.h"
+
+#define MAX_EVENTS      64
+#define DROPPED_NOTE    32          // room for "# dropped <n>\n"
+
+
+/*
+ * This function reads a filter line (see tail_server.h). It returns 0, or -1 with the reason in 'error'.
+*/
+int tail_filter_parse(struct tail_filter *filter, const char *text, char *error, int size) {
+    char copy[TAIL_REQUEST_MAX], *save = NULL, *end;
+
+    memset(filter, 0, sizeof(*filter));
+    filter->min_level = INT_MIN;
+    filter->health = -1;
+    filter->to = UINT64_MAX;
+    snprintf(copy, sizeof(copy), "%s", text);
+
+    for(char *word = strtok_r(copy, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if(strncmp(word, "room=", 5) == 0 && strlen(word + 5) < sizeof(filter->room)) {
+            filter->room_len = snprintf(filter->room, sizeof(filter->room), "%s", word + 5);
+            continue;
+        }
+        if(strncmp(word, "level>=", 7) == 0) {
+            filter->min_level = strtol(word + 7, &end, 10);
+            if(end != word + 7 && *end == '\0')
+                continue;
+        }
+        else if(strcmp(word, "health=0") == 0 || strcmp(word, "health=1") == 0) {
+            filter->health = word[7] - '0';
+            continue;
+        }
+        else if(strncmp(word, "from=", 5) == 0 || strncmp(word, "to=", 3) == 0) {
+            char *digits = strchr(word, '=') + 1;
+            uint64_t value = strtoull(digits, &end, 10);
+            if(end != digits && *end == '\0') {
+                *(word[0] == 'f' ? &filter->from : &filter->to) = value;
+                continue;
+            }
+        }
+        else if(strcmp(word, "source=pub") == 0 || strcmp(word, "source=sub") == 0) {
+            filter->source = word[7];
+            continue;
+        }
+        snprintf(error, size, "bad filter '%s'", word);
+        return -1;
+    }
+    return 0;
+}
+
+
+int tail_filter_match(const struct tail_filter *filter, const struct tail_record *record) {
+    return (filter->room_len == 0 || strncmp(record->room, filter->room, filter->room_len) == 0) &&
+           record->level >= filter->min_level &&
+           (filter->health < 0 || record->health == filter->health) &&
+           record->time >= filter->from && record->time <= filter->to &&
+           (filter->source == 0 || record->source == filter->source);
+}
+
+
+/*
+ * This function fills a record from the fields of a parsed packet (packet_parse()) logged on 'topic'.
+ * It returns 0, or -1 if there are too few fields or the room has PACKET_ROOM_LEN characters or more
+ * (a cut name could match the filter of another room).
+*/
+int tail_record_from_fields(struct tail_record *record, const char *topic, char **fields, int nfields) {
+    if(nfields < 7 ||
+       snprintf(record->room, sizeof(record->room), "%s/%s/%s", fields[0], fields[1], fields[2]) >= (int)sizeof(record->room))
+        return -1;
+    record->level = atoi(fields[4]);
+    record->health = atoi(fields[6]);
+    record->time = strtoull(fields[3], NULL, 10);
+    record->source = strncmp(topic, "admin/logs/sub", 14) == 0 ? 's' : 'p';
+    return 0;
+}
+
+
+static void put(struct tail_server *server, struct tail_client *client, const char *data, int len) {
+    size_t at = client->head % server->buffer_size;
+    size_t first = server->buffer_size - at < (size_t)len ? server->buffer_size - at : (size_t)len;
+
+    memcpy(client->buffer + at, data, first);
+    memcpy(client->buffer, data + first, len - first);
+    client->head += len;
+}
+
+
+/*
+ * This function offers a log to every client. It is called by the thread that logs, and only copies.
+*/
+void tail_server_publish(struct tail_server *server, const char *topic, char **fields, int nfields) {
+    struct tail_record record;
+    char line[PACKET_LOG_LINE];
+    int len = -1, wake = 0;
+    uint64_t one = 1;
+
+    if(atomic_load_explicit(&server->streaming, memory_order_relaxed) == 0)
+        return;
+    if(tail_record_from_fields(&record, topic, fields, nfields) != 0)
+        return;
+
+    pthread_mutex_lock(&server->lock);
+    server->stats.logs++;
+    for(int i=0; i<server->max_clients; i++) {
+        struct tail_client *c = &server->clients[i];
+
+        if(c->fd < 0 || !c->streaming || !tail_filter_match(&c->filter, &record))
+            continue;
+        server->stats.matched++;
+        if(len < 0) {
+            // formatted once, for the first client that wants it
+            len = packet_log_line(line, sizeof(line), topic, fields);
+            if(len >= (int)sizeof(line))
+                len = sizeof(line) - 1;
+        }
+
+        size_t room = server->buffer_size - (c->head - c->tail);
+        int empty = c->head == c->tail;
+        if(c->unreported > 0 && room >= (size_t)len + DROPPED_NOTE) {
+            char note[DROPPED_NOTE];
+            int n = snprintf(note, sizeof(note), "# dropped %lu\n", c->unreported);
+            put(server, c, note, n);
+            room -= n;
+            c->unreported = 0;
+        }
+        if(room < (size_t)len) {
+            c->dropped++;
+            c->unreported++;
+            server->stats.dropped++;
+            continue;
+        }
+        put(server, c, line, len);
+        c->delivered++;
+        wake |= empty && !c->polling_out;
+    }
+    if(wake && !server->wake_pending) {
+        server->wake_pending = 1;
+        wake = 2;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if(wake == 2 && write(server->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("tail server");
+}
+
+
+static void watch_client(struct tail_server *server, int id, int out) {
+    struct epoll_event event = { .events = EPOLLIN | (out ? EPOLLOUT : 0), .data.u32 = id };
+
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->clients[id].fd, &event);
+}
+
+
+static void close_client(struct tail_server *server, int id) {
+    struct tail_client *c = &server->clients[id];
+    int fd = c->fd;
+
+    pthread_mutex_lock(&server->lock);
+    if(c->streaming)
+        atomic_fetch_sub(&server->streaming, 1);
+    c->fd = -1;
+    c->streaming = 0;
+    pthread_mutex_unlock(&server->lock);
+    close(fd);
+}
+
+
+/*
+ * This function sends what is buffered for a client until it is sent or the socket is full.
+ * The buffer is read without the lock: the logging thread only writes where nothing is left to send.
+ * 'polling_out' changes under the lock, together with the check of the buffer: a log put into an empty buffer
+ * wakes the thread unless the client waits for EPOLLOUT.
+*/
+static void flush_client(struct tail_server *server, int id) {
+    struct tail_client *c = &server->clients[id];
+
+    while(1) {
+        pthread_mutex_lock(&server->lock);
+        uint64_t pending = c->head - c->tail;
+        size_t at = c->tail % server->buffer_size;
+        int was_polling = c->polling_out;
+        if(pending == 0)
+            c->polling_out = 0;
+        pthread_mutex_unlock(&server->lock);
+
+        if(pending == 0) {
+            if(was_polling)
+                watch_client(server, id, 0);
+            return;
+        }
+        size_t len = server->buffer_size - at < pending ? server->buffer_size - at : pending;
+        ssize_t n = send(c->fd, c->buffer + at, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if(!was_polling) {
+                pthread_mutex_lock(&server->lock);
+                c->polling_out = 1;
+                pthread_mutex_unlock(&server->lock);
+                watch_client(server, id, 1);
+            }
+            return;
+        }
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            close_client(server, id);
+            return;
+        }
+        pthread_mutex_lock(&server->lock);
+        c->tail += n;
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+
+/*
+ * This function reads the filter line of a client, and after it only notices the disconnect.
+*/
+static void read_client(struct tail_server *server, int id) {
+    struct tail_client *c = &server->clients[id];
+    struct tail_filter filter;
+    char discard[256], error[TAIL_REQUEST_MAX + 32], *newline;
+    ssize_t n;
+
+    if(c->streaming) {
+        while((n = recv(c->fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0);
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            close_client(server, id);
+        return;
+    }
+
+    n = recv(c->fd, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len, MSG_DONTWAIT);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if(n <= 0) {
+        close_client(server, id);
+        return;
+    }
+    c->request_len += n;
+    c->request[c->request_len] = '\0';
+    if((newline = strchr(c->request, '\n')) == NULL) {
+        if(c->request_len < (int)sizeof(c->request) - 1)
+            return;
+        snprintf(error, sizeof(error), "error filter too long\n");
+    }
+    else {
+        *newline = '\0';
+        if(tail_filter_parse(&filter, c->request, error + 6, sizeof(error) - 7) == 0) {
+            // "ok" is the first thing in the buffer, so it comes before any log
+            pthread_mutex_lock(&server->lock);
+            c->filter = filter;
+            c->head = c->tail = 0;
+            c->delivered = c->dropped = c->unreported = 0;
+            put(server, c, "ok\n", 3);
+            c->streaming = 1;
+            atomic_fetch_add(&server->streaming, 1);
+            server->stats.clients++;
+            pthread_mutex_unlock(&server->lock);
+            flush_client(server, id);
+            return;
+        }
+        memcpy(error, "error ", 6);
+        strcat(error, "\n");
+    }
+    send(c->fd, error, strlen(error), MSG_NOSIGNAL | MSG_DONTWAIT);
+    pthread_mutex_lock(&server->lock);
+    server->stats.rejected++;
+    pthread_mutex_unlock(&server->lock);
+    close_client(server, id);
+}
+
+
+static void accept_clients(struct tail_server *server) {
+    int fd, id;
+
+    while((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for(id=0; id<server->max_clients && server->clients[id].fd >= 0; id++);
+        if(id == server->max_clients || (server->clients[id].buffer == NULL &&
+           (server->clients[id].buffer = malloc(server->buffer_size)) == NULL)) {
+            send(fd, "error too many clients\n", 23, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            pthread_mutex_lock(&server->lock);
+            server->stats.rejected++;
+            pthread_mutex_unlock(&server->lock);
+            continue;
+        }
+
+        struct tail_client *c = &server->clients[id];
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = id };
+        c->request_len = 0;
+        c->polling_out = 0;
+        c->streaming = 0;
+        pthread_mutex_lock(&server->lock);
+        c->fd = fd;
+        pthread_mutex_unlock(&server->lock);
+        if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+            close_client(server, id);
+    }
+}
+
+
+/*
+ * The thread of the server: it accepts clients, reads their filters and sends their buffers.
+*/
+static void *serve(void *arg) {
+    struct tail_server *server = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint32_t listen_id = server->max_clients, wake_id = server->max_clients + 1;
+    uint64_t count;
+
+    while(!atomic_load(&server->stopping)) {
+        int n = epoll_wait(server->epoll_fd, events, MAX_EVENTS, 500);
+
+        for(int i=0; i<n && !atomic_load(&server->stopping); i++) {
+            uint32_t id = events[i].data.u32;
+
+            if(id == listen_id)
+                accept_clients(server);
+            else if(id == wake_id) {
+                if(read(server->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("tail server");
+                pthread_mutex_lock(&server->lock);
+                server->wake_pending = 0;
+                pthread_mutex_unlock(&server->lock);
+                for(int c=0; c<server->max_clients; c++) {
+                    if(server->clients[c].fd >= 0 && server->clients[c].streaming && !server->clients[c].polling_out)
+                        flush_client(server, c);
+                }
+            }
+            else if(server->clients[id].fd >= 0) {
+                if(events[i].events & (EPOLLERR | EPOLLHUP))
+                    close_client(server, id);
+                else {
+                    if(events[i].events & EPOLLIN)
+                        read_client(server, id);
+                    if((events[i].events & EPOLLOUT) && server->clients[id].fd >= 0)
+                        flush_client(server, id);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * This function creates the socket at 'path' (replacing an old one) and starts the server thread.
+ * It returns the server, or NULL on error.
+*/
+struct tail_server *tail_server_start(const char *path) {
+    struct tail_server *server = calloc(1, sizeof(struct tail_server));
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event event = { .events = EPOLLIN };
+
+    if(server == NULL)
+        return NULL;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: the tail socket path %s is too long\n", path);
+        free(server);
+        return NULL;
+    }
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    server->max_clients = config_long("NOISE_TAIL_CLIENTS", 256);
+    server->buffer_size = config_long("NOISE_TAIL_BUFFER", 65536);
+    if(server->max_clients < 1)
+        server->max_clients = 1;
+    if(server->buffer_size < PACKET_LOG_LINE + DROPPED_NOTE)
+        server->buffer_size = PACKET_LOG_LINE + DROPPED_NOTE;
+    pthread_mutex_init(&server->lock, NULL);
+
+    server->clients = calloc(server->max_clients, sizeof(struct tail_client));
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(server->clients == NULL || server->listen_fd < 0 || server->epoll_fd < 0 || server->wake_fd < 0) {
+        fprintf(stderr, "Error: cannot start the tail server: %s\n", strerror(errno));
+        goto fail;
+    }
+    for(int i=0; i<server->max_clients; i++)
+        server->clients[i].fd = -1;
+
+    unlink(path);
+    if(bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server->listen_fd, 128) != 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    event.data.u32 = server->max_clients;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+    event.data.u32 = server->max_clients + 1;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &event);
+
+    if(pthread_create(&server->thread, NULL, serve, server) != 0) {
+        fprintf(stderr, "Error: cannot start the tail server thread\n");
+        unlink(path);
+        goto fail;
+    }
+    return server;
+
+fail:
+    if(server->listen_fd >= 0)
+        close(server->listen_fd);
+    if(server->epoll_fd >= 0)
+        close(server->epoll_fd);
+    if(server->wake_fd >= 0)
+        close(server->wake_fd);
+    free(server->clients);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+    return NULL;
+}
+
+
+void tail_server_stop(struct tail_server *server) {
+    uint64_t one = 1;
+
+    atomic_store(&server->stopping, 1);
+    if(write(server->wake_fd, &one, sizeof(one)) < 0)
+        perror("tail server");
+    pthread_join(server->thread, NULL);
+
+    for(int i=0; i<server->max_clients; i++) {
+        if(server->clients[i].fd >= 0)
+            close(server->clients[i].fd);
+        free(server->clients[i].buffer);
+    }
+    close(server->listen_fd);
+    close(server->epoll_fd);
+    close(server->wake_fd);
+    unlink(server->path);
+    free(server->clients);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
+
+
+void tail_server_get_stats(struct tail_server *server, struct tail_stats *stats) {
+    pthread_mutex_lock(&server->lock);
+    *stats = server->stats;
+    pthread_mutex_unlock(&server->lock);
+}
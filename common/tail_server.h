@@ -0,0 +1,104 @@
+/*
+ * Live tail of the admin logs over a local Unix socket, with a filter per client.
+ *
+ * A client connects to the socket (NOISE_TAIL_SOCKET) and sends one line with its filter, words of
+ *      room=<prefix>       rooms ("institution/location/room") that start with the prefix
+ *      level>=<n>          noise level n or higher (alerts are level -1)
+ *      health=<0|1>        health status
+ *      from=<timestamp>    packets from this time on (yymmddhhmmss, like the packets)
+ *      to=<timestamp>      packets up to this time
+ *      source=<pub|sub>    logs of the publishers or of the subscribers
+ * (an empty line is everything). The server answers "ok" or "error <reason>" and then sends every log that
+ * matches, as the line admin_logs prints (packet_log_line()), until the client disconnects.
+ *
+ * The filter is evaluated on the parsed packet when it is logged, once per client, and the line is only
+ * formatted if some client wants it. Every client has a buffer of NOISE_TAIL_BUFFER bytes that the thread
+ * of the server sends from (non-blocking, epoll). A log that does not fit the buffer of a slow client is
+ * dropped for that client only, and the client gets "# dropped <n>" once there is room again; logging never
+ * waits for a client.
+ *
+ *      NOISE_TAIL_SOCKET       path of the socket (admin_logs has no tail server without it)
+ *      NOISE_TAIL_BUFFER       bytes buffered per client          (default 65536)
+ *      NOISE_TAIL_CLIENTS      clients at once                    (default 256)
+*/
+
+#ifndef NOISE_TAIL_SERVER_H
+#define NOISE_TAIL_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "packet.h"
+
+#define TAIL_REQUEST_MAX    512
+
+// a parsed log, what filters are evaluated against
+struct tail_record {
+    char room[PACKET_ROOM_LEN];     // "institution/location/room"
+    int level;
+    int health;
+    uint64_t time;                  // yymmddhhmmss
+    int source;                     // 'p' publisher, 's' subscriber
+};
+
+struct tail_filter {
+    char room[PACKET_ROOM_LEN];
+    int room_len;                   // 0: every room
+    int min_level;
+    int health;                     // -1: any
+    uint64_t from;
+    uint64_t to;
+    int source;                     // 0: any
+};
+
+struct tail_client {
+    int fd;                         // -1: free slot
+    int streaming;                  // the filter was accepted
+    int polling_out;                // waits for EPOLLOUT
+    char request[TAIL_REQUEST_MAX];
+    int request_len;
+    struct tail_filter filter;
+    char *buffer;
+    uint64_t head;                  // bytes ever put into the buffer
+    uint64_t tail;                  // bytes ever sent
+    unsigned long delivered;        // logs put into the buffer
+    unsigned long dropped;
+    unsigned long unreported;       // dropped since the last "# dropped" line
+};
+
+struct tail_stats {
+    unsigned long logs;             // logs offered while a client was streaming
+    unsigned long matched;          // logs x clients that matched
+    unsigned long dropped;
+    unsigned long clients;          // accepted so far
+    unsigned long rejected;         // bad filter, or too many clients
+};
+
+struct tail_server {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    char path[108];
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;                    // eventfd: there is something to send
+    int wake_pending;
+    struct tail_client *clients;
+    int max_clients;
+    size_t buffer_size;
+    _Atomic int streaming;          // clients with an accepted filter
+    _Atomic int stopping;
+    struct tail_stats stats;
+};
+
+int tail_filter_parse(struct tail_filter *filter, const char *text, char *error, int size);
+int tail_filter_match(const struct tail_filter *filter, const struct tail_record *record);
+int tail_record_from_fields(struct tail_record *record, const char *topic, char **fields, int nfields);
+
+struct tail_server *tail_server_start(const char *path);
+void tail_server_stop(struct tail_server *server);
+void tail_server_publish(struct tail_server *server, const char *topic, char **fields, int nfields);
+void tail_server_get_stats(struct tail_server *server, struct tail_stats *stats);
+
+#endif
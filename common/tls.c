@@ -0,0 +1,165 @@
+/*
+ * TLS with session resumption for the MQTT clients (see tls.h).
+*/
+
+#include <mosquitto.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "tls.h"
+
+#define DEFAULT_CIPHERS         "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-CHACHA20-POLY1305:" \
+                                "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-RSA-CHACHA20-POLY1305"
+#define DEFAULT_CIPHERSUITES    "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256"
+
+struct tls_client {
+    SSL_CTX *ctx;
+    int resume;
+    pthread_mutex_t lock;       // the session is saved on the network thread, offered on the connecting thread
+    SSL_SESSION *session;
+    unsigned long full;
+    unsigned long resumed;
+};
+
+
+int tls_enabled(void) {
+    return config_long("NOISE_TLS", 0) != 0;
+}
+
+
+void tls_options_from_config(struct tls_options *opts) {
+    opts->cafile = config_str("NOISE_TLS_CAFILE", "certs/ca.crt");
+    opts->certfile = config_str("NOISE_TLS_CERT", NULL);
+    opts->keyfile = config_str("NOISE_TLS_KEY", NULL);
+    opts->version = config_str("NOISE_TLS_VERSION", "tlsv1.2");
+    opts->ciphers = config_str("NOISE_TLS_CIPHERS", DEFAULT_CIPHERS);
+    opts->ciphersuites = config_str("NOISE_TLS_CIPHERSUITES", DEFAULT_CIPHERSUITES);
+    opts->resume = config_long("NOISE_TLS_RESUME", 1) != 0;
+    opts->insecure = config_long("NOISE_TLS_INSECURE", 0) != 0;
+}
+
+
+/*
+ * Called by OpenSSL when the broker gives us a session (after the handshake, or a TLS 1.3 ticket later).
+ * The client keeps the newest one; returning 1 keeps the reference.
+*/
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    struct tls_client *client = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    pthread_mutex_lock(&client->lock);
+    if(client->session != NULL)
+        SSL_SESSION_free(client->session);
+    client->session = session;
+    pthread_mutex_unlock(&client->lock);
+    return 1;
+}
+
+
+/*
+ * Called by OpenSSL during the handshake. libmosquitto creates the SSL object inside mosquitto_connect(),
+ * so the start of the handshake (before the ClientHello is written) is where the saved session is offered.
+*/
+static void on_handshake(const SSL *ssl, int where, int ret) {
+    struct tls_client *client = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if(where & SSL_CB_HANDSHAKE_START) {
+        pthread_mutex_lock(&client->lock);
+        if(client->resume && client->session != NULL && SSL_SESSION_is_resumable(client->session))
+            SSL_set_session((SSL *)ssl, client->session);
+        pthread_mutex_unlock(&client->lock);
+    }
+    else if(where & SSL_CB_HANDSHAKE_DONE) {
+        pthread_mutex_lock(&client->lock);
+        if(SSL_session_reused((SSL *)ssl))
+            client->resumed++;
+        else
+            client->full++;
+        pthread_mutex_unlock(&client->lock);
+    }
+}
+
+
+/*
+ * This function sets up TLS for a client: libmosquitto loads the certificates and checks the broker,
+ * into an SSL_CTX of ours that keeps the session for the next connect.
+ * It must be called before mosquitto_connect(); the client must be freed after mosquitto_destroy().
+ * It returns NULL on error.
+*/
+struct tls_client *tls_client_setup(struct mosquitto *mosq, const struct tls_options *opts) {
+    struct tls_client *client = calloc(1, sizeof(struct tls_client));
+    int rc;
+
+    if(client == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&client->lock, NULL);
+    client->resume = opts->resume;
+
+    client->ctx = SSL_CTX_new(TLS_client_method());
+    if(client->ctx == NULL || SSL_CTX_set_ciphersuites(client->ctx, opts->ciphersuites) != 1) {
+        fprintf(stderr, "Error: invalid TLS 1.3 cipher suites '%s'\n", opts->ciphersuites);
+        tls_client_free(client);
+        return NULL;
+    }
+    SSL_CTX_set_app_data(client->ctx, client);
+    SSL_CTX_set_session_cache_mode(client->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(client->ctx, on_new_session);
+    SSL_CTX_set_info_callback(client->ctx, on_handshake);
+
+    // libmosquitto applies the CA, client certificate, version, TLS 1.2 ciphers and host name check to our context
+    rc = mosquitto_int_option(mosq, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 1);
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = mosquitto_void_option(mosq, MOSQ_OPT_SSL_CTX, client->ctx);
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = mosquitto_tls_set(mosq, opts->cafile, NULL, opts->certfile, opts->keyfile, NULL);
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = mosquitto_tls_opts_set(mosq, 1, opts->version, opts->ciphers);
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = mosquitto_tls_insecure_set(mosq, opts->insecure);
+    if(rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "Error: TLS setup (CA %s): %s\n", opts->cafile, mosquitto_strerror(rc));
+        tls_client_free(client);
+        return NULL;
+    }
+    return client;
+}
+
+
+void tls_client_stats(struct tls_client *client, struct tls_stats *stats) {
+    pthread_mutex_lock(&client->lock);
+    stats->full = client->full;
+    stats->resumed = client->resumed;
+    pthread_mutex_unlock(&client->lock);
+}
+
+
+void tls_client_free(struct tls_client *client) {
+    if(client == NULL)
+        return;
+    if(client->session != NULL)
+        SSL_SESSION_free(client->session);
+    SSL_CTX_free(client->ctx);      // libmosquitto holds its own reference while the client exists
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+
+/*
+ * This function enables TLS on a client if NOISE_TLS is set. The TLS state lives as long as the process.
+ * It returns MOSQ_ERR_SUCCESS, or MOSQ_ERR_TLS if TLS is enabled but cannot be set up.
+*/
+int tls_configure(struct mosquitto *mosq) {
+    struct tls_options opts;
+
+    if(!tls_enabled())
+        return MOSQ_ERR_SUCCESS;
+
+    tls_options_from_config(&opts);
+    return tls_client_setup(mosq, &opts) != NULL ? MOSQ_ERR_SUCCESS : MOSQ_ERR_TLS;
+}
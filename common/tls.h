@@ -0,0 +1,53 @@
+/*
+ * TLS for the MQTT connections of the Noise Warning Program.
+ *
+ * With NOISE_TLS=1 every component connects to the broker with TLS (default port 8883), using:
+ *      NOISE_TLS_CAFILE        CA certificate of the broker          (default certs/ca.crt)
+ *      NOISE_TLS_CERT          client certificate, if the broker requires one (default none)
+ *      NOISE_TLS_KEY           key of the client certificate          (default none)
+ *      NOISE_TLS_VERSION       minimum version, tlsv1.2 | tlsv1.3    (default tlsv1.2)
+ *      NOISE_TLS_CIPHERS       TLS 1.2 cipher list   (default: ECDHE with AES-128-GCM or ChaCha20-Poly1305)
+ *      NOISE_TLS_CIPHERSUITES  TLS 1.3 cipher suites (default TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256)
+ *      NOISE_TLS_RESUME        resume the last session on reconnect   (default 1)
+ *      NOISE_TLS_INSECURE      1 = do not check the broker host name  (default 0)
+ * tls/gen_certs.sh generates a test CA, broker and client certificates and a matching mosquitto listener.
+ *
+ * Session resumption: libmosquitto opens a new TLS connection on every (re)connect, which would be a full
+ * handshake each time. The client keeps the last session (TLS 1.3 ticket or TLS 1.2 session ID) of its
+ * SSL_CTX and offers it in the next handshake, so a reconnect costs one symmetric round instead of
+ * certificate verification and a new key exchange. The ciphers favour AEADs that are cheap with and
+ * without AES instructions; put ChaCha20 first for gateways without them.
+*/
+
+#ifndef NOISE_TLS_H
+#define NOISE_TLS_H
+
+struct mosquitto;
+
+struct tls_options {
+    const char *cafile;
+    const char *certfile;
+    const char *keyfile;
+    const char *version;
+    const char *ciphers;
+    const char *ciphersuites;
+    int resume;
+    int insecure;
+};
+
+struct tls_stats {
+    unsigned long full;         // handshakes with a new session
+    unsigned long resumed;      // handshakes that resumed the previous session
+};
+
+struct tls_client;
+
+int tls_enabled(void);
+void tls_options_from_config(struct tls_options *opts);
+struct tls_client *tls_client_setup(struct mosquitto *mosq, const struct tls_options *opts);
+void tls_client_stats(struct tls_client *client, struct tls_stats *stats);
+void tls_client_free(struct tls_client *client);
+
+int tls_configure(struct mosquitto *mosq);
+
+#endif
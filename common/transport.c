@@ -0,0 +1,622 @@
+/*
+ * Message transport over MQTT and a shared-memory ring (see transport.h).
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "ready.h"
+#include "shm_ring.h"
+#include "tls.h"
+#include "transport.h"
+
+#define MAX_PATTERNS    8
+#define MAX_FILTERS     16
+#define FILTER_LEN      128
+#define MAX_ALIASES     16
+#define MAX_TRANSPORTS  8
+
+/*
+ * The MQTT v5 topic aliases of one connection. Alias i+1 stands for topics[i] once a message with
+ * the topic and the alias has been sent; the aliases start over on every connection.
+*/
+struct alias_table {
+    pthread_mutex_t lock;
+    int max;                                    // topic alias maximum of the broker, 0 = no aliases
+    int count;
+    char topics[MAX_ALIASES][FILTER_LEN];
+    mosquitto_property *props[MAX_ALIASES];     // the topic alias property of alias i+1, built once
+};
+
+struct transport {
+    struct mosquitto *mosq;
+    int protocol;               // MQTT_PROTOCOL_V5 or MQTT_PROTOCOL_V311
+    struct alias_table aliases;
+    _Atomic int subscribing;    // broker subscriptions of this connection without a SUBACK yet
+    _Atomic int rejected;       // the broker refused a subscription of this connection
+    struct shm_ring *ring;
+    int mirror;
+    int spin;
+
+    char patterns[MAX_PATTERNS][FILTER_LEN];     // NOISE_SHM_TOPICS
+    int npatterns;
+
+    // subscriptions served from the ring; only appended to, so the reader needs no lock
+    char filters[MAX_FILTERS][FILTER_LEN];
+    _Atomic int nfilters;
+    pthread_mutex_t subscribe_lock;
+
+    transport_handler handler;
+    void *ctx;
+    struct shm_cursor cursor;   // position of the reader thread, starts at the first local subscription
+    pthread_t reader;
+    int reader_started;
+    _Atomic int running;
+
+    _Atomic unsigned long shm_published;
+    _Atomic unsigned long mqtt_published;
+    _Atomic unsigned long shm_received;
+    _Atomic unsigned long shm_lost;
+    _Atomic unsigned long mqtt_aliased;
+
+    // bulk lane (NOISE_LANES): a second connection, shed beyond 'bulk_limit' messages waiting for it
+    struct mosquitto *bulk;
+    struct alias_table bulk_aliases;
+    char bulk_patterns[MAX_PATTERNS][FILTER_LEN];
+    int nbulk;
+    int bulk_limit;
+    _Atomic int bulk_queued;
+    _Atomic unsigned long bulk_published;
+    _Atomic unsigned long bulk_shed;
+};
+
+
+// transports by connection, for the v5 callbacks of a connection that belongs to the component
+static struct transport *registry[MAX_TRANSPORTS];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static struct transport *find_transport(struct mosquitto *mosq) {
+    struct transport *t = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    for(int i=0; i<MAX_TRANSPORTS && t == NULL; i++) {
+        if(registry[i] != NULL && registry[i]->mosq == mosq)
+            t = registry[i];
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return t;
+}
+
+
+/*
+ * This function starts the aliases of a connection over, with the maximum the broker sent in its CONNACK.
+*/
+static void aliases_connected(struct alias_table *a, int reason_code, const mosquitto_property *props) {
+    uint16_t max = 0;
+
+    if(reason_code == 0 && props != NULL)
+        mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &max, false);
+
+    pthread_mutex_lock(&a->lock);
+    a->count = 0;
+    a->max = max < MAX_ALIASES ? max : MAX_ALIASES;
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+static void aliases_lost(struct alias_table *a) {
+    pthread_mutex_lock(&a->lock);
+    a->count = 0;
+    a->max = 0;
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+/*
+ * This function falls back to MQTT v3.1.1 for the next connect if the broker refused v5
+ * (a v3.1.1 broker answers with "unacceptable protocol version", 1).
+*/
+static void check_protocol(struct mosquitto *mosq, int reason_code) {
+    if(reason_code == 1 || reason_code == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION) {
+        fprintf(stderr, "The broker does not support MQTT v5, falling back to v3.1.1\n");
+        mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V311);
+    }
+}
+
+
+static void on_connect_v5(struct mosquitto *mosq, void *obj, int reason_code, int flags, const mosquitto_property *props) {
+    struct transport *t = find_transport(mosq);
+
+    check_protocol(mosq, reason_code);
+    if(t == NULL)
+        return;
+    aliases_connected(&t->aliases, reason_code, props);
+
+    // a refusal of the previous connection does not count: its SUBACKs for this one come after this callback
+    atomic_store(&t->rejected, 0);
+
+    // the component subscribed in its own connect callback, which ran before this one
+    if(reason_code == 0 && atomic_load(&t->subscribing) == 0)
+        ready_notify();
+}
+
+
+/*
+ * Called for every SUBACK: the component is ready (common/ready.h) once the broker granted all its subscriptions.
+*/
+static void on_subscribe_v5(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos, const mosquitto_property *props) {
+    struct transport *t = find_transport(mosq);
+
+    if(t == NULL)
+        return;
+    for(int i=0; i<qos_count; i++) {
+        if(granted_qos[i] > 2)
+            atomic_store(&t->rejected, 1);
+    }
+    if(atomic_fetch_sub(&t->subscribing, 1) == 1 && !atomic_load(&t->rejected))
+        ready_notify();
+}
+
+
+static void on_disconnect_v5(struct mosquitto *mosq, void *obj, int reason_code, const mosquitto_property *props) {
+    struct transport *t = find_transport(mosq);
+
+    if(t == NULL)
+        return;
+    aliases_lost(&t->aliases);
+    // the SUBACKs of this connection will not come; the component subscribes again on the next connect
+    atomic_store(&t->subscribing, 0);
+}
+
+
+/*
+ * This function splits comma separated topic filters into 'patterns' and returns how many there are.
+*/
+static int parse_patterns(const char *topics, char patterns[][FILTER_LEN]) {
+    char copy[MAX_PATTERNS * FILTER_LEN];
+    char *save = NULL;
+    int n = 0;
+
+    snprintf(copy, sizeof(copy), "%s", topics);
+    for(char *p = strtok_r(copy, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save)) {
+        if(n == MAX_PATTERNS) {
+            fprintf(stderr, "Ignoring topics after the first %d of %s\n", MAX_PATTERNS, topics);
+            break;
+        }
+        snprintf(patterns[n++], FILTER_LEN, "%s", p);
+    }
+    return n;
+}
+
+
+/*
+ * This function creates the transport of a component from the environment (see transport.h).
+ * 'handler' gets the messages of subscriptions served from the ring; it may be NULL for a publisher.
+ * It returns NULL on error.
+*/
+struct transport *transport_create(struct mosquitto *mosq, transport_handler handler, void *ctx) {
+    struct transport *t = transport_create_shm(mosq, config_str("NOISE_SHM", NULL), config_str("NOISE_SHM_TOPICS", "admin/#"), handler, ctx);
+
+    if(t != NULL && mosq != NULL && config_long("NOISE_MQTT_VERSION", 5) == 5)
+        transport_set_protocol(t, MQTT_PROTOCOL_V5);
+
+    if(t != NULL && mosq != NULL && config_long("NOISE_LANES", 0)) {
+        if(transport_open_bulk(t, config_str("NOISE_BULK_TOPICS", "admin/logs/#"), config_long("NOISE_BULK_INFLIGHT", 10),
+                               config_long("NOISE_BULK_QUEUE", 1000)) != MOSQ_ERR_SUCCESS) {
+            transport_destroy(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+
+/*
+ * This function creates a transport with the given ring name (NULL for MQTT only) and comma separated
+ * topic filters routed to the ring. The other settings come from the environment.
+*/
+struct transport *transport_create_shm(struct mosquitto *mosq, const char *name, const char *topics, transport_handler handler, void *ctx) {
+    struct transport *t = calloc(1, sizeof(struct transport));
+
+    if(t == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return NULL;
+    }
+    t->mosq = mosq;
+    t->protocol = MQTT_PROTOCOL_V311;
+    t->handler = handler;
+    t->ctx = ctx;
+    pthread_mutex_init(&t->subscribe_lock, NULL);
+    pthread_mutex_init(&t->aliases.lock, NULL);
+    pthread_mutex_init(&t->bulk_aliases.lock, NULL);
+
+    if(name != NULL) {
+        t->mirror = config_long("NOISE_SHM_MIRROR", 0) != 0;
+        t->spin = config_long("NOISE_SHM_SPIN", 1000);
+        t->ring = shm_ring_open(name, config_long("NOISE_SHM_SLOTS", 65536), config_long("NOISE_SHM_SLOT_SIZE", 256));
+        if(t->ring == NULL) {
+            transport_destroy(t);
+            return NULL;
+        }
+        t->npatterns = parse_patterns(topics, t->patterns);
+    }
+
+    // the component keeps its own (v3) callbacks, libmosquitto calls the v5 ones as well;
+    // they find the transport in the registry, so it is registered last, once it is complete
+    if(mosq != NULL) {
+        int registered = 0;
+
+        pthread_mutex_lock(&registry_lock);
+        for(int i=0; i<MAX_TRANSPORTS && !registered; i++) {
+            if(registry[i] == NULL) {
+                registry[i] = t;
+                registered = 1;
+            }
+        }
+        pthread_mutex_unlock(&registry_lock);
+        if(!registered) {
+            fprintf(stderr, "Error: more than %d transports in one process\n", MAX_TRANSPORTS);
+            transport_destroy(t);
+            return NULL;
+        }
+        mosquitto_connect_v5_callback_set(mosq, on_connect_v5);
+        mosquitto_disconnect_v5_callback_set(mosq, on_disconnect_v5);
+        mosquitto_subscribe_v5_callback_set(mosq, on_subscribe_v5);
+    }
+    return t;
+}
+
+
+/*
+ * This function sets the MQTT version of the connections of the transport (MQTT_PROTOCOL_V5 or
+ * MQTT_PROTOCOL_V311), for the next connect. A transport starts with v3.1.1.
+*/
+void transport_set_protocol(struct transport *t, int protocol) {
+    t->protocol = protocol;
+    if(t->mosq != NULL)
+        mosquitto_int_option(t->mosq, MOSQ_OPT_PROTOCOL_VERSION, protocol);
+    if(t->bulk != NULL)
+        mosquitto_int_option(t->bulk, MOSQ_OPT_PROTOCOL_VERSION, protocol);
+}
+
+
+static void on_bulk_connect(struct mosquitto *mosq, void *obj, int reason_code, int flags, const mosquitto_property *props) {
+    struct transport *t = obj;
+
+    printf("on_connect (bulk lane): %s\n", mosquitto_connack_string(reason_code));
+    check_protocol(mosq, reason_code);
+    aliases_connected(&t->bulk_aliases, reason_code, props);
+}
+
+
+static void on_bulk_disconnect(struct mosquitto *mosq, void *obj, int reason_code, const mosquitto_property *props) {
+    struct transport *t = obj;
+
+    aliases_lost(&t->bulk_aliases);
+}
+
+
+/*
+ * Called when a bulk message has been sent (QoS 0) or acknowledged (QoS 1 and 2): it no longer waits for the lane.
+*/
+static void on_bulk_publish(struct mosquitto *mosq, void *obj, int mid) {
+    struct transport *t = obj;
+
+    atomic_fetch_sub(&t->bulk_queued, 1);
+}
+
+
+/*
+ * This function opens the bulk lane: a second connection to the broker for the topics matching the
+ * comma separated filters 'topics', with at most 'inflight' unacknowledged messages and 'queue'
+ * messages waiting for it. The connection runs in its own network thread and reconnects by itself.
+ * It returns a MOSQ_ERR_* code.
+*/
+int transport_open_bulk(struct transport *t, const char *topics, int inflight, int queue) {
+    int rc;
+
+    t->bulk = mosquitto_new(NULL, true, t);
+    if(t->bulk == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return MOSQ_ERR_NOMEM;
+    }
+    t->nbulk = parse_patterns(topics, t->bulk_patterns);
+    t->bulk_limit = queue;
+
+    mosquitto_int_option(t->bulk, MOSQ_OPT_PROTOCOL_VERSION, t->protocol);
+    mosquitto_connect_v5_callback_set(t->bulk, on_bulk_connect);
+    mosquitto_disconnect_v5_callback_set(t->bulk, on_bulk_disconnect);
+    mosquitto_publish_callback_set(t->bulk, on_bulk_publish);
+    mosquitto_max_inflight_messages_set(t->bulk, inflight);
+    mosquitto_reconnect_delay_set(t->bulk, 1, 30, true);
+
+    rc = tls_configure(t->bulk);
+    if(rc != MOSQ_ERR_SUCCESS)
+        return rc;
+
+    // a broker that is not up yet is not an error, the network thread keeps trying
+    rc = mosquitto_connect_async(t->bulk, config_mqtt_host(), config_mqtt_port(), 60);
+    if(rc != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Cannot connect the bulk lane yet: %s\n", mosquitto_strerror(rc));
+
+    rc = mosquitto_loop_start(t->bulk);
+    if(rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+        return rc;
+    }
+    printf("Bulk lane for %s (%d in flight, %d queued before shedding)\n", topics, inflight, queue);
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+void transport_destroy(struct transport *t) {
+    if(t == NULL)
+        return;
+
+    if(t->reader_started) {
+        atomic_store(&t->running, 0);
+        pthread_join(t->reader, NULL);
+    }
+    if(t->bulk != NULL) {
+        mosquitto_disconnect(t->bulk);
+        mosquitto_loop_stop(t->bulk, false);
+        mosquitto_destroy(t->bulk);
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    for(int i=0; i<MAX_TRANSPORTS; i++) {
+        if(registry[i] == t)
+            registry[i] = NULL;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    for(int i=0; i<MAX_ALIASES; i++) {
+        mosquitto_property_free_all(&t->aliases.props[i]);
+        mosquitto_property_free_all(&t->bulk_aliases.props[i]);
+    }
+    pthread_mutex_destroy(&t->aliases.lock);
+    pthread_mutex_destroy(&t->bulk_aliases.lock);
+    shm_ring_close(t->ring);
+    pthread_mutex_destroy(&t->subscribe_lock);
+    free(t);
+}
+
+
+/*
+ * This function returns 1 if the topic matches one of the 'n' filters in 'patterns'.
+*/
+static int matches_any(char patterns[][FILTER_LEN], int n, const char *topic) {
+    bool match;
+
+    for(int i=0; i<n; i++) {
+        if(mosquitto_topic_matches_sub(patterns[i], topic, &match) == MOSQ_ERR_SUCCESS && match)
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * This function returns 1 if every topic matched by 'filter' is also matched by 'pattern',
+ * e.g. "admin/#" covers "admin/logs/+" and "admin/alerts", but not "#".
+*/
+static int covers(const char *pattern, const char *filter) {
+    while(1) {
+        size_t plen = strcspn(pattern, "/"), flen = strcspn(filter, "/");
+
+        if(plen == 1 && pattern[0] == '#')
+            return 1;
+        if(flen == 1 && filter[0] == '#')
+            return 0;
+        // '+' covers any single level (including '+'), a word only covers itself
+        if(!(plen == 1 && pattern[0] == '+') && (plen != flen || strncmp(pattern, filter, plen) != 0))
+            return 0;
+        pattern += plen;
+        filter += flen;
+
+        if(*filter == '\0')
+            return *pattern == '\0' || strcmp(pattern, "/#") == 0;
+        if(*pattern == '\0')
+            return 0;
+        pattern++;
+        filter++;
+    }
+}
+
+
+static int is_local_filter(struct transport *t, const char *filter) {
+    for(int i=0; i<t->npatterns; i++) {
+        if(covers(t->patterns[i], filter))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * This function publishes a message to the broker. QoS 0 messages use a topic alias when the broker
+ * allows them: the first message of a topic carries the topic and its alias, the next ones only the alias.
+ * QoS 1 and 2 messages always carry the topic, because libmosquitto sends them again as they are after
+ * a reconnect, and the broker forgets the aliases of the old connection.
+*/
+static int publish_mqtt(struct transport *t, struct mosquitto *mosq, struct alias_table *a, const char *topic, int payloadlen, const void *payload, int qos, bool retain) {
+    int rc, i;
+
+    if(qos != 0 || t->protocol != MQTT_PROTOCOL_V5)
+        return mosquitto_publish(mosq, NULL, topic, payloadlen, payload, qos, retain);
+
+    pthread_mutex_lock(&a->lock);
+    for(i=0; i<a->count && strcmp(a->topics[i], topic) != 0; i++);
+
+    if(i < a->count) {
+        rc = mosquitto_publish_v5(mosq, NULL, NULL, payloadlen, payload, qos, retain, a->props[i]);
+        if(rc == MOSQ_ERR_SUCCESS)
+            atomic_fetch_add_explicit(&t->mqtt_aliased, 1, memory_order_relaxed);
+    }
+    else if(i < a->max && strlen(topic) < FILTER_LEN &&
+            (a->props[i] != NULL || mosquitto_property_add_int16(&a->props[i], MQTT_PROP_TOPIC_ALIAS, i + 1) == MOSQ_ERR_SUCCESS)) {
+        rc = mosquitto_publish_v5(mosq, NULL, topic, payloadlen, payload, qos, retain, a->props[i]);
+        if(rc == MOSQ_ERR_SUCCESS) {
+            strcpy(a->topics[i], topic);
+            a->count++;
+        }
+    }
+    else {
+        rc = mosquitto_publish(mosq, NULL, topic, payloadlen, payload, qos, retain);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return rc;
+}
+
+
+/*
+ * This function publishes a message on the bulk lane, or sheds it if the lane already has 'bulk_limit'
+ * messages waiting. Both count as success: the caller must not reconnect its own connection for a log.
+*/
+static int publish_bulk(struct transport *t, const char *topic, int payloadlen, const void *payload, int qos, bool retain) {
+    if(atomic_fetch_add(&t->bulk_queued, 1) >= t->bulk_limit) {
+        atomic_fetch_sub(&t->bulk_queued, 1);
+        atomic_fetch_add_explicit(&t->bulk_shed, 1, memory_order_relaxed);
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    if(publish_mqtt(t, t->bulk, &t->bulk_aliases, topic, payloadlen, payload, qos, retain) != MOSQ_ERR_SUCCESS) {
+        atomic_fetch_sub(&t->bulk_queued, 1);
+        atomic_fetch_add_explicit(&t->bulk_shed, 1, memory_order_relaxed);
+        return MOSQ_ERR_SUCCESS;
+    }
+    atomic_fetch_add_explicit(&t->bulk_published, 1, memory_order_relaxed);
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/*
+ * This function publishes a message to the ring if its topic is routed there, and to the broker otherwise
+ * (or as well, with NOISE_SHM_MIRROR=1). On the broker side, topics of the bulk lane take the bulk connection.
+ * It returns a MOSQ_ERR_* code like mosquitto_publish().
+*/
+int transport_publish(struct transport *t, const char *topic, int payloadlen, const void *payload, int qos, bool retain) {
+    if(t->ring != NULL && matches_any(t->patterns, t->npatterns, topic)) {
+        if(shm_ring_publish(t->ring, topic, payload, payloadlen) != 0)
+            return MOSQ_ERR_PAYLOAD_SIZE;
+        atomic_fetch_add_explicit(&t->shm_published, 1, memory_order_relaxed);
+        if(!t->mirror)
+            return MOSQ_ERR_SUCCESS;
+    }
+
+    if(t->bulk != NULL && matches_any(t->bulk_patterns, t->nbulk, topic))
+        return publish_bulk(t, topic, payloadlen, payload, qos, retain);
+
+    int rc = publish_mqtt(t, t->mosq, &t->aliases, topic, payloadlen, payload, qos, retain);
+    if(rc == MOSQ_ERR_SUCCESS)
+        atomic_fetch_add_explicit(&t->mqtt_published, 1, memory_order_relaxed);
+    return rc;
+}
+
+
+/*
+ * This function is the reader thread. It hands every message of the ring that matches a subscription
+ * to the handler, and sleeps in the ring when there is nothing to read.
+*/
+static void *reader_main(void *arg) {
+    struct transport *t = arg;
+    struct shm_cursor *cursor = &t->cursor;
+    char *buffer = malloc(shm_ring_max_message(t->ring) + 2);
+    char *topic, *payload;
+    unsigned long lost = 0;
+    int len;
+    bool match;
+
+    if(buffer == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return NULL;
+    }
+
+    while(atomic_load_explicit(&t->running, memory_order_relaxed)) {
+        if(!shm_ring_read(t->ring, cursor, buffer, &topic, &payload, &len)) {
+            shm_ring_wait(t->ring, cursor, t->spin, 100);
+            continue;
+        }
+        if(cursor->lost != lost) {
+            atomic_fetch_add_explicit(&t->shm_lost, cursor->lost - lost, memory_order_relaxed);
+            lost = cursor->lost;
+        }
+
+        int nfilters = atomic_load_explicit(&t->nfilters, memory_order_acquire);
+        for(int i=0; i<nfilters; i++) {
+            if(mosquitto_topic_matches_sub(t->filters[i], topic, &match) == MOSQ_ERR_SUCCESS && match) {
+                atomic_fetch_add_explicit(&t->shm_received, 1, memory_order_relaxed);
+                ready_first_message();
+                t->handler(t->ctx, topic, payload, len);
+                break;
+            }
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+/*
+ * This function subscribes to a topic filter: from the ring if NOISE_SHM_TOPICS covers the filter,
+ * from the broker otherwise. It is safe to call again on every reconnect.
+ * It returns a MOSQ_ERR_* code like mosquitto_subscribe().
+*/
+int transport_subscribe(struct transport *t, const char *filter, int qos) {
+    int rc = MOSQ_ERR_SUCCESS;
+
+    if(t->ring == NULL || t->handler == NULL || !is_local_filter(t, filter)) {
+        atomic_fetch_add(&t->subscribing, 1);
+        rc = mosquitto_subscribe(t->mosq, NULL, filter, qos);
+        if(rc != MOSQ_ERR_SUCCESS)
+            atomic_fetch_sub(&t->subscribing, 1);
+        return rc;
+    }
+
+    pthread_mutex_lock(&t->subscribe_lock);
+    int nfilters = atomic_load(&t->nfilters);
+    for(int i=0; i<nfilters; i++) {
+        if(strcmp(t->filters[i], filter) == 0) {
+            pthread_mutex_unlock(&t->subscribe_lock);
+            return MOSQ_ERR_SUCCESS;
+        }
+    }
+
+    if(nfilters == MAX_FILTERS || strlen(filter) >= FILTER_LEN) {
+        rc = MOSQ_ERR_INVAL;
+    }
+    else {
+        snprintf(t->filters[nfilters], FILTER_LEN, "%s", filter);
+        atomic_store_explicit(&t->nfilters, nfilters + 1, memory_order_release);
+
+        // messages published after this call returns are delivered
+        if(!t->reader_started) {
+            shm_cursor_init(t->ring, &t->cursor);
+            atomic_store(&t->running, 1);
+            if(pthread_create(&t->reader, NULL, reader_main, t) == 0)
+                t->reader_started = 1;
+            else
+                rc = MOSQ_ERR_ERRNO;
+        }
+    }
+    pthread_mutex_unlock(&t->subscribe_lock);
+    return rc;
+}
+
+
+void transport_get_stats(struct transport *t, struct transport_stats *stats) {
+    stats->shm_published = atomic_load(&t->shm_published);
+    stats->mqtt_published = atomic_load(&t->mqtt_published);
+    stats->shm_received = atomic_load(&t->shm_received);
+    stats->shm_lost = atomic_load(&t->shm_lost);
+    stats->mqtt_aliased = atomic_load(&t->mqtt_aliased);
+    stats->bulk_published = atomic_load(&t->bulk_published);
+    stats->bulk_shed = atomic_load(&t->bulk_shed);
+    stats->bulk_queued = atomic_load(&t->bulk_queued);
+}
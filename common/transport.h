@@ -0,0 +1,85 @@
+/*
+ * Message transport of the Noise Warning Program components.
+ *
+ * The components publish and subscribe through a transport instead of calling libmosquitto directly.
+ * A transport has two backends:
+ *  - MQTT, the existing mosquitto client. Always used, unless a topic is routed to the ring.
+ *  - a shared-memory ring (common/shm_ring.h) for components on the same host, when NOISE_SHM names one.
+ *    Topics matching NOISE_SHM_TOPICS are published into the ring instead of to the broker,
+ *    and subscriptions covered by NOISE_SHM_TOPICS are served from the ring by a reader thread.
+ *
+ *      NOISE_SHM               name of the ring, e.g. /noise        (default: none, MQTT only)
+ *      NOISE_SHM_TOPICS        topic filters routed to the ring      (default admin/#)
+ *      NOISE_SHM_MIRROR        1 = also publish those topics to MQTT, for consumers on other hosts (default 0)
+ *      NOISE_SHM_SLOTS         slots of a new ring                   (default 65536)
+ *      NOISE_SHM_SLOT_SIZE     bytes per slot of a new ring          (default 256)
+ *      NOISE_SHM_SPIN          polls before a reader sleeps          (default 1000)
+ *
+ * The MQTT connection of a transport made by transport_create() speaks MQTT v5 (NOISE_MQTT_VERSION=5, the default),
+ * and falls back to v3.1.1 on the next connect if the broker does not support v5 (NOISE_MQTT_VERSION=3 forces it).
+ * With v5, QoS 0 messages use topic aliases up to the maximum the broker allows: after the first message of a
+ * topic, the topic is sent as a two byte alias. The aliases start over with every connection.
+ * The transport sets the v5 callbacks of the connection for this; the v3 callbacks of the component are still called.
+ *
+ * The transport also tells a supervisor when the component is ready (common/ready.h): at the CONNACK if the
+ * component has no broker subscriptions, or else when the SUBACKs of all subscriptions it made in its connect
+ * callback came back granted. It reports the first message from the ring; the component reports its first
+ * message from the broker in its message callback (ready_first_message()).
+ *
+ *      NOISE_MQTT_VERSION      5 or 3 (3.1.1)                        (default 5)
+ *
+ * With NOISE_LANES=1 the MQTT backend has two lanes, so that log traffic cannot delay alerts:
+ *  - the priority lane is the connection of the component (room readings, admin/alerts, ...),
+ *  - the bulk lane is a second connection of the transport for topics matching NOISE_BULK_TOPICS.
+ *    It has its own in-flight window, and at most NOISE_BULK_QUEUE messages may wait for it; beyond that
+ *    (a burst, a slow broker or a lost connection) bulk messages are shed and counted, never the priority ones.
+ *    A shed or failed bulk publish is not an error for the caller.
+ *
+ *      NOISE_LANES             1 = separate bulk connection          (default 0, one connection)
+ *      NOISE_BULK_TOPICS       topic filters of the bulk lane        (default admin/logs/#)
+ *      NOISE_BULK_INFLIGHT     QoS 1/2 messages in flight on the bulk lane (default 10)
+ *      NOISE_BULK_QUEUE        bulk messages not yet sent or acknowledged before shedding (default 1000)
+ *
+ * All components of a host must use the same NOISE_SHM and NOISE_SHM_TOPICS: a consumer subscribed
+ * through the ring does not see messages that a producer sent to the broker, and the other way around.
+ * Messages in the ring are not retained and do not have a QoS; a reader that falls a whole ring behind
+ * loses messages (counted in transport_stats).
+*/
+
+#ifndef NOISE_TRANSPORT_H
+#define NOISE_TRANSPORT_H
+
+#include <stdbool.h>
+
+struct mosquitto;
+
+/*
+ * Called for a message from the ring, on the reader thread of the transport.
+ * The topic and payload are NUL terminated and may be modified (same as wp_handler).
+*/
+typedef void (*transport_handler)(void *ctx, char *topic, char *payload, int payloadlen);
+
+struct transport_stats {
+    unsigned long shm_published;
+    unsigned long mqtt_published;   // accepted by the connection; the caller's on_publish sees each of them once
+    unsigned long shm_received;
+    unsigned long shm_lost;
+    unsigned long mqtt_aliased;     // messages sent with a topic alias instead of the topic
+    unsigned long bulk_published;
+    unsigned long bulk_shed;
+    long bulk_queued;               // bulk messages not acknowledged yet
+};
+
+struct transport;
+
+struct transport *transport_create(struct mosquitto *mosq, transport_handler handler, void *ctx);
+struct transport *transport_create_shm(struct mosquitto *mosq, const char *name, const char *topics, transport_handler handler, void *ctx);
+void transport_set_protocol(struct transport *transport, int protocol);
+int transport_open_bulk(struct transport *transport, const char *topics, int inflight, int queue);
+void transport_destroy(struct transport *transport);
+
+int transport_publish(struct transport *transport, const char *topic, int payloadlen, const void *payload, int qos, bool retain);
+int transport_subscribe(struct transport *transport, const char *filter, int qos);
+void transport_get_stats(struct transport *transport, struct transport_stats *stats);
+
+#endif
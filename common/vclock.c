@@ -0,0 +1,238 @@
+/*
+ * Pluggable clock and discrete-event scheduler (see vclock.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "vclock.h"
+
+struct event {
+    int64_t time;
+    uint64_t order;     // insertion order, breaks ties between events of the same time
+    sched_fn fn;
+    void *ctx;
+};
+
+struct scheduler {
+    struct event *heap;
+    long count;
+    long capacity;
+    uint64_t next_order;
+};
+
+static int virtual_clock = 0;
+static int64_t virtual_now = 0;
+
+
+/*
+ * This function selects the clock from the environment:
+ *      NOISE_CLOCK         real | sim              (default real)
+ *      NOISE_SIM_START     'YYMMDDHHMMSS' local    (default: the current time)
+*/
+void vclock_configure(void) {
+    const char *mode = config_str("NOISE_CLOCK", "real");
+    const char *start = config_str("NOISE_SIM_START", NULL);
+    int64_t start_usec = (int64_t)time(NULL) * 1000000;
+    int64_t parsed;
+
+    if(strcasecmp(mode, "sim") != 0) {
+        if(strcasecmp(mode, "real") != 0)
+            fprintf(stderr, "Ignoring unknown NOISE_CLOCK '%s' (real, sim)\n", mode);
+        return;
+    }
+
+    if(start != NULL) {
+        if((parsed = vclock_parse_usec(start)) >= 0)
+            start_usec = parsed;
+        else
+            fprintf(stderr, "Ignoring invalid NOISE_SIM_START '%s' (YYMMDDHHMMSS)\n", start);
+    }
+
+    vclock_use_virtual(start_usec);
+}
+
+
+/*
+ * This function converts a local 'YYMMDDHHMMSS' timestamp to microseconds since the epoch.
+ * It returns -1 if it is malformed.
+*/
+int64_t vclock_parse_usec(const char *timestamp) {
+    struct tm tm;
+
+    if(strlen(timestamp) != 12)
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(timestamp, "%2d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    tm.tm_year += 100;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    return (int64_t)mktime(&tm) * 1000000;
+}
+
+
+void vclock_use_virtual(int64_t start_usec) {
+    virtual_clock = 1;
+    virtual_now = start_usec;
+}
+
+
+int vclock_is_virtual(void) {
+    return virtual_clock;
+}
+
+
+/*
+ * This function returns the current time in microseconds since the epoch.
+*/
+int64_t vclock_now_usec(void) {
+    struct timespec ts;
+
+    if(virtual_clock)
+        return virtual_now;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+time_t vclock_time(void) {
+    return (time_t)(vclock_now_usec() / 1000000);
+}
+
+
+/*
+ * This function sleeps for the given time. With the virtual clock, it only moves the clock forward.
+*/
+void vclock_sleep_usec(int64_t usec) {
+    struct timespec ts;
+
+    if(usec <= 0)
+        return;
+
+    if(virtual_clock) {
+        virtual_now += usec;
+        return;
+    }
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    while(nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+
+/*
+ * This function writes the local time 't' as 'YYMMDDHHMMSS' (13 bytes with the terminating NUL).
+*/
+void vclock_timestamp(time_t t, char *timestamp) {
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strftime(timestamp, 13, "%y%m%d%H%M%S", &tm);
+}
+
+
+struct scheduler *sched_create(void) {
+    return calloc(1, sizeof(struct scheduler));
+}
+
+
+void sched_destroy(struct scheduler *sched) {
+    if(sched == NULL)
+        return;
+    free(sched->heap);
+    free(sched);
+}
+
+
+static int event_before(const struct event *a, const struct event *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+
+/*
+ * This function schedules 'fn(ctx)' at the given time (microseconds since the epoch).
+ * It returns 0 on success and -1 if out of memory.
+*/
+int sched_at(struct scheduler *sched, int64_t usec, sched_fn fn, void *ctx) {
+    struct event ev = { usec, sched->next_order++, fn, ctx };
+    long i;
+
+    if(sched->count == sched->capacity) {
+        long capacity = sched->capacity ? sched->capacity * 2 : 1024;
+        struct event *heap = realloc(sched->heap, capacity * sizeof(struct event));
+        if(heap == NULL)
+            return -1;
+        sched->heap = heap;
+        sched->capacity = capacity;
+    }
+
+    // sift up
+    for(i = sched->count++; i > 0 && event_before(&ev, &sched->heap[(i - 1) / 2]); i = (i - 1) / 2)
+        sched->heap[i] = sched->heap[(i - 1) / 2];
+    sched->heap[i] = ev;
+    return 0;
+}
+
+
+int sched_after(struct scheduler *sched, int64_t delay_usec, sched_fn fn, void *ctx) {
+    return sched_at(sched, vclock_now_usec() + delay_usec, fn, ctx);
+}
+
+
+/*
+ * This function removes the earliest event from the heap.
+*/
+static struct event pop_event(struct scheduler *sched) {
+    struct event top = sched->heap[0];
+    struct event last = sched->heap[--sched->count];
+    long i = 0, child;
+
+    // sift down
+    while((child = 2 * i + 1) < sched->count) {
+        if(child + 1 < sched->count && event_before(&sched->heap[child + 1], &sched->heap[child]))
+            child++;
+        if(!event_before(&sched->heap[child], &last))
+            break;
+        sched->heap[i] = sched->heap[child];
+        i = child;
+    }
+    if(sched->count > 0)
+        sched->heap[i] = last;
+    return top;
+}
+
+
+/*
+ * This function runs the events up to (and including) 'until_usec' in time order, including the events
+ * they schedule. The clock is left at 'until_usec'. It returns the number of events that ran.
+*/
+long sched_run(struct scheduler *sched, int64_t until_usec) {
+    long ran = 0;
+
+    while(sched->count > 0 && sched->heap[0].time <= until_usec) {
+        struct event ev = pop_event(sched);
+        int64_t now = vclock_now_usec();
+
+        if(ev.time > now)
+            vclock_sleep_usec(ev.time - now);
+        ev.fn(ev.ctx);
+        ran++;
+    }
+
+    int64_t now = vclock_now_usec();
+    if(until_usec > now)
+        vclock_sleep_usec(until_usec - now);
+    return ran;
+}
+
+
+long sched_pending(const struct scheduler *sched) {
+    return sched->count;
+}
@@ -0,0 +1,43 @@
+/*
+ * Pluggable clock and event scheduler.
+ *
+ * The publisher and the simulator read the time and sleep only through this module.
+ *  - Real clock (default): vclock_now_usec() is the wall clock and vclock_sleep_usec() sleeps.
+ *  - Virtual clock (NOISE_CLOCK=sim): time starts at NOISE_SIM_START ('YYMMDDHHMMSS', default now)
+ *    and only moves when somebody sleeps or the scheduler runs the next event, so a day of readings
+ *    takes as long as the CPU needs to compute it. The virtual clock is meant for one thread.
+ *
+ * The scheduler is a discrete-event queue (binary min-heap ordered by time, then by insertion).
+ * sched_run() takes the events in time order; with the virtual clock it jumps to the time of each
+ * event, with the real clock it sleeps until then. Events with the same time run in the order they
+ * were scheduled, so a simulation is deterministic for a given seed.
+*/
+
+#ifndef NOISE_VCLOCK_H
+#define NOISE_VCLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+void vclock_configure(void);
+void vclock_use_virtual(int64_t start_usec);
+int vclock_is_virtual(void);
+
+int64_t vclock_now_usec(void);
+time_t vclock_time(void);
+void vclock_sleep_usec(int64_t usec);
+void vclock_timestamp(time_t t, char *timestamp);
+int64_t vclock_parse_usec(const char *timestamp);
+
+typedef void (*sched_fn)(void *ctx);
+
+struct scheduler;
+
+struct scheduler *sched_create(void);
+void sched_destroy(struct scheduler *sched);
+int sched_at(struct scheduler *sched, int64_t usec, sched_fn fn, void *ctx);
+int sched_after(struct scheduler *sched, int64_t delay_usec, sched_fn fn, void *ctx);
+long sched_run(struct scheduler *sched, int64_t until_usec);
+long sched_pending(const struct scheduler *sched);
+
+#endif
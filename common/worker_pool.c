@@ -0,0 +1,616 @@
+/*
+ * Worker pool with per-room ordering (see worker_pool.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+
+#include "config.h"
+#include "worker_pool.h"
+
+#define WP_BUCKETS  4096    // buckets of the room table
+#define WP_BATCH    32      // messages handled from one room before it goes back to the run queue
+#define WP_KEY_MAX  64
+#define WP_MSG_DATA 216     // topic + payload bytes of a pooled message buffer (256 bytes in all)
+
+struct wp_msg {
+    struct wp_msg *next;
+    char *topic;
+    char *payload;
+    int payloadlen;
+    int pooled;             // the buffer goes back to the free list of the pool, not to free()
+    char data[];
+};
+
+struct wp_room {
+    struct wp_room *hash_next;
+    struct wp_room *ready_next;
+    pthread_mutex_t lock;
+    struct wp_msg *head;
+    struct wp_msg *tail;
+    atomic_int count;
+    int scheduled;          // the room is in a run queue or being handled by a worker
+    int home;               // worker the room is scheduled on first
+    int keylen;
+    char key[WP_KEY_MAX];
+};
+
+struct wp_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct wp_room *head;   // run queue of ready rooms
+    struct wp_room *tail;
+    struct worker_pool *pool;
+    int index;
+    unsigned long handled;
+    unsigned long steals;
+};
+
+struct worker_pool {
+    int nthreads;
+    int room_limit;
+    int total_limit;
+    enum wp_policy policy;
+    wp_handler handler;
+    void *ctx;
+
+    struct wp_worker *workers;
+
+    pthread_mutex_t table_lock;
+    struct wp_room *table[WP_BUCKETS];
+
+    atomic_int pending;     // queued messages of all rooms
+    atomic_int ready;       // rooms in the run queues
+    atomic_int sleepers;    // workers waiting for work
+    atomic_int waiters;     // threads waiting for space (submit with WP_BLOCK, drain)
+    atomic_int stop;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t space_cv;
+
+    // message buffers of handled messages, reused so that a steady stream of messages does not allocate
+    pthread_mutex_t free_lock;
+    struct wp_msg *free_msgs;
+
+    atomic_ulong submitted;
+    atomic_ulong dropped;
+    atomic_ulong blocked;
+    atomic_ulong buffers;
+};
+
+
+/*
+ * FNV-1a hash of the room key.
+*/
+static unsigned int hash_key(const char *key, int keylen) {
+    unsigned int hash = 2166136261u;
+
+    for(int i=0; i<keylen; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * This function returns the room of the given key, and creates it on first use.
+ * Rooms live as long as the pool.
+*/
+static struct wp_room *get_room(struct worker_pool *pool, const char *key, int keylen) {
+    struct wp_room *room;
+    unsigned int hash;
+
+    if(keylen > WP_KEY_MAX)
+        keylen = WP_KEY_MAX;
+    hash = hash_key(key, keylen);
+
+    pthread_mutex_lock(&pool->table_lock);
+    for(room = pool->table[hash % WP_BUCKETS]; room != NULL; room = room->hash_next) {
+        if(room->keylen == keylen && memcmp(room->key, key, keylen) == 0)
+            break;
+    }
+    if(room == NULL) {
+        room = calloc(1, sizeof(struct wp_room));
+        if(room != NULL) {
+            pthread_mutex_init(&room->lock, NULL);
+            room->home = (hash >> 12) % pool->nthreads;
+            room->keylen = keylen;
+            memcpy(room->key, key, keylen);
+            room->hash_next = pool->table[hash % WP_BUCKETS];
+            pool->table[hash % WP_BUCKETS] = room;
+        }
+    }
+    pthread_mutex_unlock(&pool->table_lock);
+
+    return room;
+}
+
+
+/*
+ * This function returns a buffer for a message of 'size' bytes of topic and payload:
+ * a pooled one if it fits, else one of its own size. It returns NULL if out of memory.
+*/
+static struct wp_msg *alloc_msg(struct worker_pool *pool, int size) {
+    struct wp_msg *msg = NULL;
+
+    if(size > WP_MSG_DATA) {
+        msg = malloc(sizeof(struct wp_msg) + size);
+        if(msg != NULL)
+            msg->pooled = 0;
+        return msg;
+    }
+
+    pthread_mutex_lock(&pool->free_lock);
+    msg = pool->free_msgs;
+    if(msg != NULL)
+        pool->free_msgs = msg->next;
+    pthread_mutex_unlock(&pool->free_lock);
+
+    if(msg == NULL) {
+        msg = malloc(sizeof(struct wp_msg) + WP_MSG_DATA);
+        if(msg == NULL)
+            return NULL;
+        msg->pooled = 1;
+        atomic_fetch_add(&pool->buffers, 1);
+    }
+    return msg;
+}
+
+
+/*
+ * This function gives back a list of message buffers (linked by 'next') with one lock for the whole list.
+*/
+static void release_msgs(struct worker_pool *pool, struct wp_msg *list) {
+    struct wp_msg *head = NULL, *tail = NULL, *next;
+
+    for(; list != NULL; list = next) {
+        next = list->next;
+        if(!list->pooled) {
+            free(list);
+            continue;
+        }
+        list->next = head;
+        head = list;
+        if(tail == NULL)
+            tail = list;
+    }
+
+    if(head != NULL) {
+        pthread_mutex_lock(&pool->free_lock);
+        tail->next = pool->free_msgs;
+        pool->free_msgs = head;
+        pthread_mutex_unlock(&pool->free_lock);
+    }
+}
+
+
+/*
+ * This function appends a ready room to the run queue of a worker and wakes up an idle worker.
+*/
+static void push_ready(struct worker_pool *pool, struct wp_worker *worker, struct wp_room *room) {
+    room->ready_next = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->tail == NULL)
+        worker->head = room;
+    else
+        worker->tail->ready_next = room;
+    worker->tail = room;
+    pthread_mutex_unlock(&worker->lock);
+
+    atomic_fetch_add(&pool->ready, 1);
+    if(atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->work_cv);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+
+static struct wp_room *pop_ready(struct worker_pool *pool, struct wp_worker *worker) {
+    struct wp_room *room;
+
+    pthread_mutex_lock(&worker->lock);
+    room = worker->head;
+    if(room != NULL) {
+        worker->head = room->ready_next;
+        if(worker->head == NULL)
+            worker->tail = NULL;
+        atomic_fetch_sub(&pool->ready, 1);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return room;
+}
+
+
+/*
+ * This function returns the next ready room for a worker: first from its own run queue,
+ * then stolen from the other workers.
+*/
+static struct wp_room *next_room(struct worker_pool *pool, struct wp_worker *self) {
+    struct wp_room *room = pop_ready(pool, self);
+
+    for(int i=1; room == NULL && i<pool->nthreads; i++) {
+        room = pop_ready(pool, &pool->workers[(self->index + i) % pool->nthreads]);
+        if(room != NULL)
+            self->steals++;
+    }
+    return room;
+}
+
+
+/*
+ * This function wakes up threads waiting for space in the queues.
+*/
+static void notify_space(struct worker_pool *pool) {
+    if(atomic_load(&pool->waiters) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->space_cv);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+
+/*
+ * This function handles up to WP_BATCH messages of a room, in order.
+ * Afterwards the room goes back to the end of the run queue if it still has messages,
+ * so that a busy room cannot starve the others. The buffers of the batch are given back together.
+*/
+static void run_room(struct worker_pool *pool, struct wp_worker *self, struct wp_room *room) {
+    struct wp_msg *msg, *done = NULL;
+    int handled = 0;
+
+    for(int i=0; i<WP_BATCH; i++) {
+        pthread_mutex_lock(&room->lock);
+        msg = room->head;
+        if(msg != NULL) {
+            room->head = msg->next;
+            if(room->head == NULL)
+                room->tail = NULL;
+        }
+        pthread_mutex_unlock(&room->lock);
+
+        if(msg == NULL)
+            break;
+
+        pool->handler(pool->ctx, msg->topic, msg->payload, msg->payloadlen);
+        msg->next = done;
+        done = msg;
+        self->handled++;
+        handled++;
+
+        // the message stays counted until it has been handled, so that drain waits for it
+        atomic_fetch_sub(&room->count, 1);
+    }
+
+    // pending counts the buffers of the batch until they are back, so there are never more than total_limit
+    release_msgs(pool, done);
+    if(handled > 0) {
+        atomic_fetch_sub(&pool->pending, handled);
+        notify_space(pool);
+    }
+
+    pthread_mutex_lock(&room->lock);
+    if(room->head == NULL) {
+        room->scheduled = 0;
+        pthread_mutex_unlock(&room->lock);
+    }
+    else {
+        pthread_mutex_unlock(&room->lock);
+        push_ready(pool, self, room);
+    }
+}
+
+
+static void *worker_main(void *arg) {
+    struct wp_worker *self = arg;
+    struct worker_pool *pool = self->pool;
+    struct wp_room *room;
+
+    while(1) {
+        room = next_room(pool, self);
+        if(room != NULL) {
+            run_room(pool, self, room);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while(atomic_load(&pool->ready) == 0 && !atomic_load(&pool->stop))
+            pthread_cond_wait(&pool->work_cv, &pool->idle_lock);
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if(atomic_load(&pool->stop) && atomic_load(&pool->ready) == 0)
+            break;
+    }
+    return NULL;
+}
+
+
+/*
+ * This function waits (at most 100 ms, the caller checks again) for a worker to free space.
+*/
+static void wait_for_space(struct worker_pool *pool) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->waiters, 1);
+    pthread_cond_timedwait(&pool->space_cv, &pool->idle_lock, &deadline);
+    atomic_fetch_sub(&pool->waiters, 1);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+
+/*
+ * This function creates a pool of 'threads' workers that call 'handler' for every submitted message.
+ * It returns NULL if the pool cannot be created.
+*/
+struct worker_pool *wp_create(int threads, int room_limit, int total_limit, enum wp_policy policy, wp_handler handler, void *ctx) {
+    struct worker_pool *pool;
+
+    if(threads <= 0 || room_limit <= 0 || total_limit <= 0 || handler == NULL)
+        return NULL;
+
+    pool = calloc(1, sizeof(struct worker_pool));
+    if(pool == NULL)
+        return NULL;
+
+    pool->nthreads = threads;
+    pool->room_limit = room_limit;
+    pool->total_limit = total_limit;
+    pool->policy = policy;
+    pool->handler = handler;
+    pool->ctx = ctx;
+    pthread_mutex_init(&pool->table_lock, NULL);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->space_cv, NULL);
+    pthread_mutex_init(&pool->free_lock, NULL);
+
+    pool->workers = calloc(threads, sizeof(struct wp_worker));
+    if(pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    for(int i=0; i<threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].lock, NULL);
+    }
+    for(int i=0; i<threads; i++) {
+        if(pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            fprintf(stderr, "Error: cannot start worker thread %d\n", i);
+            pool->nthreads = i;
+            wp_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+
+/*
+ * This function creates a pool configured by the NOISE_WORKER* environment variables (see worker_pool.h).
+ * It returns NULL and prints the reason if the configuration is invalid or the pool cannot be created.
+*/
+struct worker_pool *wp_create_configured(wp_handler handler, void *ctx) {
+    struct worker_pool *pool;
+    enum wp_policy policy;
+    const char *policy_name = config_str("NOISE_WORKER_POLICY", "block");
+    int threads = config_long("NOISE_WORKERS", 0);
+    int room_limit = config_long("NOISE_WORKER_ROOM_QUEUE", 256);
+    int total_limit = config_long("NOISE_WORKER_QUEUE", 4096);
+
+    if(wp_parse_policy(policy_name, &policy) != 0) {
+        fprintf(stderr, "Error: unknown NOISE_WORKER_POLICY '%s' (block, drop-newest, drop-oldest)\n", policy_name);
+        return NULL;
+    }
+
+    pool = wp_create(threads, room_limit, total_limit, policy, handler, ctx);
+    if(pool == NULL) {
+        fprintf(stderr, "Error: cannot create a worker pool with %d threads\n", threads);
+        return NULL;
+    }
+
+    printf("Handling messages with %d worker threads (queue %d per room, %d in total, policy %s)\n", threads, room_limit, total_limit, policy_name);
+    return pool;
+}
+
+
+/*
+ * This function queues a message for the room identified by 'key'.
+ * The topic and payload are copied, so the caller may free them as soon as this returns.
+ * It returns 0 if the message was queued and 1 if it was dropped by the backpressure policy.
+*/
+int wp_submit(struct worker_pool *pool, const char *key, int keylen, const char *topic, const void *payload, int payloadlen) {
+    struct wp_room *room;
+    struct wp_msg *msg, *evicted = NULL;
+    int topiclen = strlen(topic);
+    int waited = 0;
+    int schedule;
+
+    room = get_room(pool, key, keylen);
+    if(room == NULL) {
+        atomic_fetch_add(&pool->dropped, 1);
+        return 1;
+    }
+
+    atomic_fetch_add(&pool->submitted, 1);
+
+    // make room before taking a buffer, so that a full queue never needs more than total_limit of them
+    while(atomic_load(&room->count) >= pool->room_limit || atomic_load(&pool->pending) >= pool->total_limit) {
+        if(pool->policy == WP_BLOCK) {
+            if(!waited)
+                atomic_fetch_add(&pool->blocked, 1);
+            waited = 1;
+            wait_for_space(pool);
+            continue;
+        }
+
+        if(pool->policy == WP_DROP_OLDEST) {
+            // a worker takes a message off the list before handling it, so the head is never in use
+            pthread_mutex_lock(&room->lock);
+            evicted = room->head;
+            if(evicted != NULL) {
+                room->head = evicted->next;
+                if(room->head == NULL)
+                    room->tail = NULL;
+            }
+            pthread_mutex_unlock(&room->lock);
+
+            if(evicted != NULL) {
+                evicted->next = NULL;
+                release_msgs(pool, evicted);
+                atomic_fetch_sub(&room->count, 1);
+                atomic_fetch_sub(&pool->pending, 1);
+                atomic_fetch_add(&pool->dropped, 1);
+                break;
+            }
+        }
+
+        atomic_fetch_add(&pool->dropped, 1);
+        return 1;
+    }
+
+    msg = alloc_msg(pool, topiclen + 1 + payloadlen + 1);
+    if(msg == NULL) {
+        atomic_fetch_add(&pool->dropped, 1);
+        return 1;
+    }
+
+    msg->next = NULL;
+    msg->topic = msg->data;
+    msg->payload = msg->data + topiclen + 1;
+    msg->payloadlen = payloadlen;
+    memcpy(msg->topic, topic, topiclen + 1);
+    memcpy(msg->payload, payload, payloadlen);
+    msg->payload[payloadlen] = '\0';
+
+    pthread_mutex_lock(&room->lock);
+    if(room->tail == NULL)
+        room->head = msg;
+    else
+        room->tail->next = msg;
+    room->tail = msg;
+    atomic_fetch_add(&room->count, 1);
+    atomic_fetch_add(&pool->pending, 1);
+    schedule = !room->scheduled;
+    room->scheduled = 1;
+    pthread_mutex_unlock(&room->lock);
+
+    if(schedule)
+        push_ready(pool, &pool->workers[room->home], room);
+
+    return 0;
+}
+
+
+/*
+ * This function waits until every queued message has been handled.
+*/
+void wp_drain(struct worker_pool *pool) {
+    while(atomic_load(&pool->pending) > 0)
+        wait_for_space(pool);
+}
+
+
+void wp_get_stats(struct worker_pool *pool, struct wp_stats *stats) {
+    memset(stats, 0, sizeof(struct wp_stats));
+    stats->submitted = atomic_load(&pool->submitted);
+    stats->dropped = atomic_load(&pool->dropped);
+    stats->blocked = atomic_load(&pool->blocked);
+    stats->buffers = atomic_load(&pool->buffers);
+    for(int i=0; i<pool->nthreads; i++) {
+        stats->handled += pool->workers[i].handled;
+        stats->steals += pool->workers[i].steals;
+    }
+}
+
+
+/*
+ * This function handles every queued message, stops the workers and frees the pool.
+*/
+void wp_destroy(struct worker_pool *pool) {
+    struct wp_room *room, *next;
+    struct wp_msg *msg;
+
+    if(pool == NULL)
+        return;
+
+    wp_drain(pool);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for(int i=0; i<pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for(int i=0; i<WP_BUCKETS; i++) {
+        for(room = pool->table[i]; room != NULL; room = next) {
+            next = room->hash_next;
+            pthread_mutex_destroy(&room->lock);
+            free(room);
+        }
+    }
+    while((msg = pool->free_msgs) != NULL) {
+        pool->free_msgs = msg->next;
+        free(msg);
+    }
+    pthread_mutex_destroy(&pool->free_lock);
+    free(pool->workers);
+    free(pool);
+}
+
+
+/*
+ * This function converts a policy name ("block", "drop-newest", "drop-oldest") to enum wp_policy.
+ * It returns 0 on success and -1 if the name is unknown.
+*/
+int wp_parse_policy(const char *name, enum wp_policy *policy) {
+    if(strcasecmp(name, "block") == 0)
+        *policy = WP_BLOCK;
+    else if(strcasecmp(name, "drop-newest") == 0)
+        *policy = WP_DROP_NEWEST;
+    else if(strcasecmp(name, "drop-oldest") == 0)
+        *policy = WP_DROP_OLDEST;
+    else
+        return -1;
+    return 0;
+}
+
+
+/*
+ * This function returns the length of the room identity at the start of a packet
+ * ("institution,location,room"), which is used as the ordering key of the message.
+ * If the packet has less than three fields, the whole payload is the key.
+*/
+int wp_room_key(const char *payload, int payloadlen) {
+    int commas = 0;
+
+    for(int i=0; i<payloadlen; i++) {
+        if(payload[i] == ',' && ++commas == 3)
+            return i;
+    }
+    return payloadlen;
+}
@@ -0,0 +1,65 @@
+/*
+ * Worker pool for message handlers.
+ *
+ * The consumers of the Noise Warning Program used to do all their work inside on_message, on the
+ * single network thread of libmosquitto. With a worker pool, on_message only copies the message into
+ * the queue of its room, and a pool of threads runs the handler.
+ *
+ *  - Messages of the same room are handled one at a time, in arrival order.
+ *    A room with queued messages is "ready" and sits in the run queue of exactly one worker.
+ *  - Different rooms are handled in parallel. Every worker owns a run queue; an idle worker
+ *    steals ready rooms from the other workers.
+ *  - Queues are bounded: at most 'room_limit' messages per room and 'total_limit' messages overall.
+ *    When a limit is reached, the backpressure policy decides what happens:
+ *      WP_BLOCK        the submitting (network) thread waits for space. This delays the PUBACKs,
+ *                      so the broker stops sending once its in-flight window is full.
+ *      WP_DROP_NEWEST  the new message is dropped.
+ *      WP_DROP_OLDEST  the oldest queued message of the same room is dropped (keeps the latest
+ *                      readings). If the room itself has nothing queued, the new message is dropped.
+ *  - Message buffers are reused: a handled message goes back to a free list of the pool (a whole batch
+ *    at once), so in steady state submitting a message does not allocate. Messages larger than a
+ *    pooled buffer (216 bytes of topic and payload) get a buffer of their own.
+ *
+ * The consumers create their pool with wp_create_configured(), which reads:
+ *      NOISE_WORKERS           number of worker threads (0 = handle messages on the network thread)
+ *      NOISE_WORKER_ROOM_QUEUE messages queued per room     (default 256)
+ *      NOISE_WORKER_QUEUE      messages queued in total     (default 4096)
+ *      NOISE_WORKER_POLICY     block | drop-newest | drop-oldest (default block)
+*/
+
+#ifndef NOISE_WORKER_POOL_H
+#define NOISE_WORKER_POOL_H
+
+enum wp_policy {
+    WP_BLOCK,
+    WP_DROP_NEWEST,
+    WP_DROP_OLDEST
+};
+
+/*
+ * Called on a worker thread. The topic and payload are NUL terminated and may be modified.
+*/
+typedef void (*wp_handler)(void *ctx, char *topic, char *payload, int payloadlen);
+
+struct wp_stats {
+    unsigned long submitted;
+    unsigned long handled;
+    unsigned long dropped;
+    unsigned long blocked;      // number of submits that had to wait for space
+    unsigned long steals;
+    unsigned long buffers;      // message buffers allocated; stops growing once the queues reached their usual depth
+};
+
+struct worker_pool;
+
+struct worker_pool *wp_create(int threads, int room_limit, int total_limit, enum wp_policy policy, wp_handler handler, void *ctx);
+struct worker_pool *wp_create_configured(wp_handler handler, void *ctx);
+int wp_submit(struct worker_pool *pool, const char *key, int keylen, const char *topic, const void *payload, int payloadlen);
+void wp_drain(struct worker_pool *pool);
+void wp_get_stats(struct worker_pool *pool, struct wp_stats *stats);
+void wp_destroy(struct worker_pool *pool);
+
+int wp_parse_policy(const char *name, enum wp_policy *policy);
+int wp_room_key(const char *payload, int payloadlen);
+
+#endif
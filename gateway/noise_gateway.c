@@ -0,0 +1,242 @@
+/*
+ * This program is the edge aggregation gateway of Noise Warning Program.
+ * It subscribes to the room topics and, every window, publishes one rollup message per location
+ * and one per institution instead of forwarding every reading to the central consumers.
+ *
+ * A rollup message is published to '<prefix>/<institution>/<location>' and '<prefix>/<institution>':
+ *    scope,             "handong/NTH" or "handong"
+ *    window_end,        'YYMMDDHHMMSS'
+ *    count,             number of healthy readings in the window
+ *    mean,              mean decibel of those readings
+ *    max,               max decibel of those readings
+ *    faults,            number of unhealthy readings (from 'admin/alerts')
+ *    rooms,             rooms at warning level 1 or higher, as 'institution/location/room:level' separated by '|'
+ *                       (the highest level of the room in the window), '-' if there is none
+ *    sketch             mergeable quantile sketch of the decibels (see common/sketch.h), '-' if empty
+ * The data in the packet is separated by commas.
+ *
+ * Gateways can be stacked: a gateway also accepts location rollups of other gateways on the topics
+ * under NOISE_GATEWAY_ROLLUP_INPUT and merges them like its own readings. For example, every building
+ * runs a gateway with NOISE_GATEWAY_PREFIX=edge, and the central gateway subscribes to 'edge/+/+'.
+ * The aggregation itself is in common/rollup.c (checked against exact values by make bench-rollup).
+ * Windows are closed by the event scheduler of common/vclock.c on the real clock; sim/noise_sim.c runs the
+ * same windows on the virtual clock.
+ *
+ *      NOISE_GATEWAY_TOPICS        room topics to aggregate        (default handong/+/+)
+ *      NOISE_GATEWAY_ROLLUP_INPUT  prefix of rollups to merge      (default: none)
+ *      NOISE_GATEWAY_PREFIX        prefix of published rollups     (default rollup)
+ *      NOISE_GATEWAY_WINDOW_SEC    length of a window in seconds   (default 60)
+*/
+
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "ready.h"
+#include "rollup.h"
+#include "sketch.h"
+#include "tls.h"
+#include "transport.h"
+#include "vclock.h"
+
+// the aggregates of the current window, under 'lock'
+struct rollup_table table;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the main thread closes the windows from the event scheduler
+struct scheduler *sched = NULL;
+int64_t window_usec;
+
+char topics[256];
+char rollup_input[32];
+char prefix[32];
+char *const alert_topic = "admin/alerts/#";
+
+// subscriptions go through a transport, so a supervisor knows when they are granted (common/ready.h)
+struct transport *transport = NULL;
+
+/*
+ * This function subscribes to the room topics, the alert topic and the rollup input (if any).
+*/
+void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    char copy[256], sub[64];
+    char *save = NULL;
+    int rc = MOSQ_ERR_SUCCESS;
+
+    printf("on_connect: %s\n", mosquitto_connack_string(reason_code));
+    if(reason_code != 0){
+        mosquitto_disconnect(mosq);
+        return;
+    }
+
+    snprintf(copy, sizeof(copy), "%s", topics);
+    for(char *t = strtok_r(copy, ",", &save); t != NULL && rc == MOSQ_ERR_SUCCESS; t = strtok_r(NULL, ",", &save))
+        rc = transport_subscribe(transport, t, 1);
+
+    if(rc == MOSQ_ERR_SUCCESS)
+        rc = transport_subscribe(transport, alert_topic, 1);
+
+    if(rc == MOSQ_ERR_SUCCESS && rollup_input[0] != '\0') {
+        snprintf(sub, sizeof(sub), "%s/+/+", rollup_input);
+        rc = transport_subscribe(transport, sub, 1);
+    }
+
+    if(rc != MOSQ_ERR_SUCCESS){
+        fprintf(stderr, "Error subscribing: %s\n", mosquitto_strerror(rc));
+        mosquitto_disconnect(mosq);
+    }
+}
+
+
+/*
+ * Callback called when the client receives a message.
+*/
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    int input_len = strlen(rollup_input);
+
+    ready_first_message();
+    pthread_mutex_lock(&lock);
+    // a rollup of another gateway is on '<input>/<institution>/<location>' and has to be of that location
+    if(input_len > 0 && strncmp(msg->topic, rollup_input, input_len) == 0 && msg->topic[input_len] == '/')
+        rollup_add_rollup(&table, msg->topic + input_len + 1, msg->payload);
+    else
+        rollup_add_reading(&table, msg->topic, msg->payload, msg->payloadlen);
+    pthread_mutex_unlock(&lock);
+}
+
+
+void publish_rollup(struct transport *t, const struct aggregate *agg, const char *window_end) {
+    static char buffer[ROLLUP_MAX];
+    char topic[80];
+    int len, rc;
+
+    len = rollup_format(buffer, sizeof(buffer), agg, window_end);
+    if(len < 0) {
+        fprintf(stderr, "Rollup of %s is too large\n", agg->scope);
+        return;
+    }
+
+    snprintf(topic, sizeof(topic), "%s/%s", prefix, agg->scope);
+    // the network thread reconnects by itself; a rollup that cannot be sent is lost with its window
+    rc = transport_publish(t, topic, len, buffer, 1, false);
+    if(rc != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "Error publishing %s: %s\n", topic, mosquitto_strerror(rc));
+    printf("[%s] count: %lu, max: %.1f, p50: %.1f, p99: %.1f, rooms in warning: %d, faults: %lu\n", topic, agg->count, agg->max,
+           sketch_quantile(&agg->sk, 0.5), sketch_quantile(&agg->sk, 0.99), agg->nrooms, agg->faults);
+}
+
+
+/*
+ * This function closes the window: it publishes the rollup of every location that had data,
+ * then the rollup of every institution (merged from its locations), and clears the aggregates.
+ * The window is taken out under the lock and published after it, so the network thread keeps receiving.
+*/
+void flush_window(struct transport *t) {
+    struct aggregate *closed, *agg;
+    char window_end[13];
+
+    vclock_timestamp(vclock_time(), window_end);
+
+    pthread_mutex_lock(&lock);
+    closed = rollup_close_window(&table);
+    pthread_mutex_unlock(&lock);
+
+    for(agg = closed; agg != NULL; agg = agg->next)
+        publish_rollup(t, agg, window_end);
+    rollup_free_list(closed);
+}
+
+
+/*
+ * This function is the scheduler event of the end of a window: it closes the window and schedules the next end.
+ * Windows are aligned to multiples of the window length, so stacked gateways close them together.
+*/
+void on_window_end(void *ctx) {
+    struct transport *t = ctx;
+
+    flush_window(t);
+    if(sched_at(sched, (vclock_now_usec() / window_usec + 1) * window_usec, on_window_end, t) != 0)
+        fprintf(stderr, "Error: cannot schedule the next window\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    printf("----------------------\n");
+    printf("     NOISE GATEWAY    \n");
+    printf("----------------------\n\n");
+
+    struct mosquitto *mosq = NULL;
+    int rc;
+
+    snprintf(topics, sizeof(topics), "%s", config_str("NOISE_GATEWAY_TOPICS", "handong/+/+"));
+    snprintf(rollup_input, sizeof(rollup_input), "%s", config_str("NOISE_GATEWAY_ROLLUP_INPUT", ""));
+    snprintf(prefix, sizeof(prefix), "%s", config_str("NOISE_GATEWAY_PREFIX", "rollup"));
+    long window_sec = config_long("NOISE_GATEWAY_WINDOW_SEC", 60);
+    if(window_sec <= 0) {
+        fprintf(stderr, "Error: NOISE_GATEWAY_WINDOW_SEC must be positive\n");
+        return 1;
+    }
+    window_usec = (int64_t)window_sec * 1000000;
+    sched = sched_create();
+    if(sched == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    /* Required before calling other mosquitto functions */
+    mosquitto_lib_init();
+
+    mosq = mosquitto_new(NULL, true, NULL);
+    if(mosq == NULL){
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    /* Configure callbacks. This should be done before connecting ideally. */
+    mosquitto_connect_callback_set(mosq, on_connect);
+    mosquitto_message_callback_set(mosq, on_message);
+
+    transport = transport_create(mosq, NULL, NULL);
+    if(transport == NULL){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    /* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+    if(tls_configure(mosq) != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
+    if(rc != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+        return 1;
+    }
+
+    /* Run the network loop in a background thread, the main thread closes the windows. */
+    rc = mosquitto_loop_start(mosq);
+    if(rc != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+        return 1;
+    }
+
+    printf("Aggregating %s every %ld seconds to '%s/...'\n", topics, window_sec, prefix);
+
+    sched_at(sched, (vclock_now_usec() / window_usec + 1) * window_usec, on_window_end, transport);
+    sched_run(sched, INT64_MAX);
+
+    sched_destroy(sched);
+    mosquitto_lib_cleanup();
+    return 0;
+}
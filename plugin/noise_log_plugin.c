@@ -0,0 +1,259 @@
+/*
+ * This is the log capture plugin of Noise Warning Program, for mosquitto 2.0 or later.
+ *
+ * Without it every reading crosses the broker three times: the publisher sends it to the room topic and a copy
+ * to 'admin/logs/pub', the subscriber republishes it to 'admin/logs/sub', and admin_logs receives the copies.
+ * With it the broker logs the readings and alerts itself, as it receives them (MOSQ_EVT_MESSAGE), and the
+ * publishers run with NOISE_LOG_ECHO=0. The broker only sees what arrives, not what it delivers, so the
+ * subscribers keep sending their delivery logs to 'admin/logs/sub'. The log goes to
+ *  - a file, in the line format of admin_logs ("[admin/logs/pub] location: ..., decibel: ..."), and/or
+ *  - the shared-memory ring of the site (common/shm_ring.h), as 'admin/logs/pub' messages with the packet
+ *    as payload, where admin_logs (NOISE_SHM) reads them like the logs of any co-located publisher.
+ * Logging never blocks the broker: the file is written through a buffer that is flushed every second,
+ * and the ring overwrites what its readers did not take in time.
+ *
+ * mosquitto.conf:
+ *      plugin /path/to/bin/noise_log_plugin.so
+ *      plugin_opt_topics handong/#,admin/alerts/#      topics to log (default)
+ *      plugin_opt_file logs/capture.log                 log file (default: none)
+ *      plugin_opt_shm /noise                            ring (default: none), with
+ *      plugin_opt_shm_slots 65536                       the geometry of NOISE_SHM_SLOTS and
+ *      plugin_opt_shm_slot_size 256                     NOISE_SHM_SLOT_SIZE if the plugin creates it
+ * At least one of file and shm has to be given.
+ *
+ * A compact packet (without the room, see common/packet.h) is logged to 'admin/logs/pub/<room>', like the
+ * publisher logs it. Messages on admin/logs topics are never logged again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mosquitto.h>
+#include <mosquitto_broker.h>
+#include <mosquitto_plugin.h>
+
+#include "packet.h"
+#include "shm_ring.h"
+
+#define MAX_FILTERS     16
+#define FILTER_LEN      128
+#define LOG_TOPIC       "admin/logs/pub"
+
+struct capture {
+    mosquitto_plugin_id_t *id;
+    char filters[MAX_FILTERS][FILTER_LEN];
+    int nfilters;
+    FILE *file;
+    char *file_buffer;
+    struct shm_ring *ring;
+    time_t flushed;
+    unsigned long captured;
+    unsigned long skipped;      // not a noise packet
+};
+
+
+/*
+ * This function returns 1 if the topic matches the filter ('+' one level, '#' the rest).
+ * The broker has its own matcher, but it is not part of the plugin API of every 2.0 release.
+*/
+static int topic_matches(const char *filter, const char *topic) {
+    while(*filter != '\0') {
+        if(filter[0] == '#')
+            return 1;
+        if(filter[0] == '+') {
+            while(*topic != '\0' && *topic != '/')
+                topic++;
+            filter++;
+        }
+        else {
+            while(*filter != '\0' && *filter != '/' && *filter == *topic) {
+                filter++;
+                topic++;
+            }
+            if(*filter != '\0' && *filter != '/')
+                return 0;
+            if(*topic != '\0' && *topic != '/')
+                return 0;
+        }
+        if(*filter == '\0')
+            return *topic == '\0';
+        // both are at a '/'; "a/#" also matches "a"
+        if(*topic == '\0')
+            return strcmp(filter, "/#") == 0;
+        filter++;
+        topic++;
+    }
+    return *topic == '\0';
+}
+
+
+/*
+ * This function returns the log topic of a message: 'admin/logs/pub', with the room appended for a compact packet.
+ * The room is the room topic, or what follows 'admin/alerts/'.
+*/
+static void log_topic(char *buffer, int size, const char *topic, int compact) {
+    if(!compact) {
+        snprintf(buffer, size, "%s", LOG_TOPIC);
+        return;
+    }
+    if(strncmp(topic, "admin/alerts/", 13) == 0)
+        topic += 13;
+    snprintf(buffer, size, "%s/%s", LOG_TOPIC, topic);
+}
+
+
+/*
+ * This function logs a message the broker received, if it is on one of the topics. It runs on the broker thread.
+*/
+static int on_message(int event, void *event_data, void *userdata) {
+    struct mosquitto_evt_message *ed = event_data;
+    struct capture *c = userdata;
+    char payload[PACKET_MAX + 1], topic[128], room[PACKET_ROOM_LEN], line[PACKET_LOG_LINE];
+    char *fields[PACKET_FIELDS];
+    int i, len = ed->payloadlen;
+
+    if(ed->topic == NULL || strncmp(ed->topic, "admin/logs", 10) == 0)
+        return MOSQ_ERR_SUCCESS;
+    for(i=0; i<c->nfilters && !topic_matches(c->filters[i], ed->topic); i++);
+    if(i == c->nfilters)
+        return MOSQ_ERR_SUCCESS;
+
+    if(len <= 0 || len > PACKET_MAX) {
+        c->skipped++;
+        return MOSQ_ERR_SUCCESS;
+    }
+    memcpy(payload, ed->payload, len);
+    log_topic(topic, sizeof(topic), ed->topic, packet_is_compact(payload, len));
+    // packet_parse() cuts the copy in place; the ring gets the payload of the broker as it is
+    if(packet_parse(ed->topic, payload, len, fields, room) < 7) {
+        c->skipped++;
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    if(c->ring != NULL)
+        shm_ring_publish(c->ring, topic, ed->payload, len);
+    if(c->file != NULL) {
+        int n = packet_log_line(line, sizeof(line), topic, fields);
+        fwrite(line, 1, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1, c->file);
+    }
+    c->captured++;
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/*
+ * This function flushes the log file once a second.
+*/
+static int on_tick(int event, void *event_data, void *userdata) {
+    struct capture *c = userdata;
+    time_t now = time(NULL);
+
+    if(c->file != NULL && now != c->flushed) {
+        fflush(c->file);
+        c->flushed = now;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int mosquitto_plugin_version(int supported_version_count, const int *supported_versions) {
+    for(int i=0; i<supported_version_count; i++) {
+        if(supported_versions[i] == 5)
+            return 5;
+    }
+    return -1;
+}
+
+
+static void add_filters(struct capture *c, const char *list) {
+    char copy[MAX_FILTERS * FILTER_LEN];
+    char *save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    c->nfilters = 0;
+    for(char *f = strtok_r(copy, ",", &save); f != NULL && c->nfilters < MAX_FILTERS; f = strtok_r(NULL, ",", &save))
+        snprintf(c->filters[c->nfilters++], FILTER_LEN, "%s", f);
+}
+
+
+static void close_capture(struct capture *c) {
+    if(c->file != NULL)
+        fclose(c->file);
+    free(c->file_buffer);
+    if(c->ring != NULL)
+        shm_ring_close(c->ring);
+    free(c);
+}
+
+
+int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **userdata, struct mosquitto_opt *options, int option_count) {
+    struct capture *c = calloc(1, sizeof(struct capture));
+    const char *file = NULL, *shm = NULL;
+    long slots = 65536, slot_size = 256;
+
+    if(c == NULL)
+        return MOSQ_ERR_NOMEM;
+    c->id = identifier;
+    add_filters(c, "handong/#,admin/alerts/#");
+
+    for(int i=0; i<option_count; i++) {
+        if(strcmp(options[i].key, "topics") == 0)
+            add_filters(c, options[i].value);
+        else if(strcmp(options[i].key, "file") == 0)
+            file = options[i].value;
+        else if(strcmp(options[i].key, "shm") == 0)
+            shm = options[i].value;
+        else if(strcmp(options[i].key, "shm_slots") == 0)
+            slots = atol(options[i].value);
+        else if(strcmp(options[i].key, "shm_slot_size") == 0)
+            slot_size = atol(options[i].value);
+    }
+    if(file == NULL && shm == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "noise_log_plugin: plugin_opt_file or plugin_opt_shm is required");
+        close_capture(c);
+        return MOSQ_ERR_INVAL;
+    }
+
+    if(file != NULL) {
+        c->file = fopen(file, "a");
+        c->file_buffer = malloc(65536);
+        if(c->file == NULL || c->file_buffer == NULL) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "noise_log_plugin: cannot open %s", file);
+            close_capture(c);
+            return MOSQ_ERR_INVAL;
+        }
+        setvbuf(c->file, c->file_buffer, _IOFBF, 65536);
+    }
+    if(shm != NULL && (c->ring = shm_ring_open(shm, slots, slot_size)) == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "noise_log_plugin: cannot open the ring %s", shm);
+        close_capture(c);
+        return MOSQ_ERR_INVAL;
+    }
+
+    if(mosquitto_callback_register(identifier, MOSQ_EVT_MESSAGE, on_message, NULL, c) != MOSQ_ERR_SUCCESS ||
+       mosquitto_callback_register(identifier, MOSQ_EVT_TICK, on_tick, NULL, c) != MOSQ_ERR_SUCCESS) {
+        mosquitto_callback_unregister(identifier, MOSQ_EVT_MESSAGE, on_message, NULL);
+        close_capture(c);
+        return MOSQ_ERR_UNKNOWN;
+    }
+
+    mosquitto_log_printf(MOSQ_LOG_INFO, "noise_log_plugin: logging %d topic filters to%s%s%s%s", c->nfilters,
+                         file ? " " : "", file ? file : "", shm ? " ring " : "", shm ? shm : "");
+    *userdata = c;
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int mosquitto_plugin_cleanup(void *userdata, struct mosquitto_opt *options, int option_count) {
+    struct capture *c = userdata;
+
+    if(c == NULL)
+        return MOSQ_ERR_SUCCESS;
+    mosquitto_callback_unregister(c->id, MOSQ_EVT_MESSAGE, on_message, NULL);
+    mosquitto_callback_unregister(c->id, MOSQ_EVT_TICK, on_tick, NULL);
+    mosquitto_log_printf(MOSQ_LOG_INFO, "noise_log_plugin: %lu messages logged, %lu skipped", c->captured, c->skipped);
+    close_capture(c);
+    return MOSQ_ERR_SUCCESS;
+}
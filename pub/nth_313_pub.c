@@ -15,6 +15,24 @@
  * 
  * If the average of noise value is outside the normal range, this event will be published to the 'admin/alerts' topic.
  * Also, all data transmission logs are published to the 'admin/logs/pub' topic.
+ * With NOISE_LOG_ECHO=0 they are not: the log capture plugin of the broker (plugin/noise_log_plugin.c) logs
+ * the readings and alerts as the broker receives them.
+ * With NOISE_LANES=1 the logs take a connection of their own and are shed first (see common/transport.h),
+ * so a burst of logs never delays the readings and alerts.
+ *
+ * With NOISE_PACKET=compact the packets are published without the 'institution,location,room,' header:
+ * the room is the room topic, and it is appended to the admin topics ('admin/alerts/handong/NTH/313').
+ * NOISE_READING_QOS sets the QoS of the readings (default 1); at QoS 0 an MQTT v5 connection sends
+ * the topic as a two byte alias after the first reading.
+ *
+ * With NOISE_REPORT_MODE=exception, a reading is only published when the noise level changes, when the
+ * decibel moves beyond a deadband, or when the heartbeat interval elapses (see common/report_policy.h).
+ *
+ * Every sample is an event of the scheduler of common/vclock.h. With NOISE_CLOCK=sim it runs on a
+ * virtual clock starting at NOISE_SIM_START: the samples are taken as fast as possible with virtual timestamps,
+ * and the publisher stops after NOISE_SIM_SECONDS of virtual time (default one day), once the broker has
+ * acknowledged what was sent (or after NOISE_DRAIN_SEC, default 30).
+ * The noise level rules (cal_alert_level, get_health_status) are in common/noise_level.c.
 */
 
 #include <mosquitto.h>
@@ -22,18 +40,59 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
 
-#define MQTT_HOST   "127.0.0.1" 
-#define MQTT_PORT   1883
+#include "config.h"
+#include "tls.h"
+#include "noise_level.h"
+#include "packet.h"
+#include "report_policy.h"
+#include "transport.h"
+#include "vclock.h"
 
 char institution[10] = "handong";
 char location[10] = "NTH";
 char room[10] = "313";
 
 char topic[30] = "handong/NTH/313";
-char admin_alerts[30] = "admin/alerts";
-char admin_logs[30] = "admin/logs/pub";
+char admin_alerts[64] = "admin/alerts";
+char admin_logs[64] = "admin/logs/pub";
+
+// the packets are published without their header, the room is in the topic (NOISE_PACKET=compact)
+int compact = 0;
+// a copy of every packet goes to admin/logs/pub, unless the broker captures the logs (NOISE_LOG_ECHO=0)
+int log_echo = 1;
+int reading_qos = 1;
+
+// the 'institution,location,room,' header and the timestamp of the packets, formatted once (common/packet.h)
+struct packet_writer writer;
+
+// MQTT, or the shared-memory ring for topics routed there (NOISE_SHM, see common/transport.h)
+struct transport *transport = NULL;
+
+// time between two noise samples (NOISE_SAMPLE_USEC), 1 sec by default
+long sample_usec = 1000000;
+
+// sequence numbers of the readings (room topic) and of the alerts (admin/alerts), counted apart
+// so that a consumer of one stream sees no gaps for the packets of the other (common/seq_track.h)
+unsigned long reading_seq = 0;
+unsigned long alert_seq = 0;
+
+// the samples are events of the scheduler, until 'sim_end' on the virtual clock
+struct scheduler *sched = NULL;
+time_t sim_end;
+struct report_policy policy;
+struct report_state report;
+
+// the window being measured: the 5 test cases first (a sample every half interval), then random noise
+int test_samples = 0;
+int window_sum = 0;
+int window_samples = 0;
+
+// messages of the connection that the broker has acknowledged (or that were sent, at QoS 0)
+_Atomic unsigned long acknowledged = 0;
 
 int test_case[5][10] = {
     {10, 23, 5, 50, 1, 17, 40, 32, 8, 12},              // Warning Level 1 
@@ -67,7 +126,7 @@ void reconnect(struct mosquitto *mosq) {
         printf("Try to reconnect to broker...\n");
 
         // reconnect to a new broker
-        int rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+        int rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 
         // if connection failed, wait for a second and reconnect to a broker
         if (rc != MOSQ_ERR_SUCCESS) {
@@ -91,6 +150,7 @@ void reconnect(struct mosquitto *mosq) {
 void on_publish(struct mosquitto *mosq, void *obj, int mid)
 {
     // printf("Message with mid %d has been published.\n", mid);
+    atomic_fetch_add(&acknowledged, 1);
 }
 
 
@@ -103,84 +163,6 @@ int get_decibel(void)
 }
 
 
-/*
- * This function calculates the average noise value.
- * If the parameter "test" is true and case_num, it will calculate the average with the given test case.
- * Else, it will calculate it with the random noise value returned by get_decibel().
-*/
-float cal_avg_decibel(bool test, int case_num) {
-    int curr_decibel = 0;
-    float avg_decibel = 0.0;
-
-    if(test) {
-        for(int i=0; i<10; i++) {
-            avg_decibel += test_case[case_num][i];
-            usleep(500000); // sleep during 0.5 sec
-        }
-    }
-    else {
-        for(int i=0; i<10; i++) {
-            avg_decibel += get_decibel();
-            sleep(1);       // sleep during 1 sec
-        }
-    }
-
-    avg_decibel = avg_decibel / 10;
-    
-    return avg_decibel;
-}
-
-
-/*
- * This function returns the noise level.
- * The range of the noise level as follows:
- *      if avg_decibel >  0 && avg_decibel <=  50 --> Warning Level 1 
- *      if avg_decibel > 50 && avg_decibel <=  80 --> Warning Level 2
- *      if avg_decibel > 80 && avg_decibel <= 100 --> Warning Level 3
- *      if avg_decibel <= 0 || avg_decibel >  100 --> There is an issue with the sound sensor. Reoprt to 'admin/alerts'
-*/
-int cal_alert_level(float avg_decibel) {
-    if(avg_decibel > 0 && avg_decibel <= 50)        // Normal Case
-        return 0;
-    else if(avg_decibel > 50 && avg_decibel <= 65)  // Warning Level 1
-        return 1;
-    else if(avg_decibel > 65 && avg_decibel <= 80)  // Warning Level 2
-        return 2;
-    else if(avg_decibel > 80 && avg_decibel <= 100) // Warning Level 3
-        return 3;
-    else                                            // Unhealthy Sensor 
-        return -1;
-}
-
-
-/*
- * This function returns the timestamp to string.
- * The format of timestamp is 'YYMMDDHHMMSS'.
-*/
-void get_timestamp(char* timestamp) {
-    time_t rawtime;
-    struct tm *timeinfo;
-
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-
-    strftime(timestamp, 13, "%y%m%d%H%M%S", timeinfo);
-}
-
-
-/*
- * This function returns the status of sound sensor.
- * If the value of avg_deciel is bigger than 0 and less equal than 100, the status is healthy (1).
- * Else, the status is unhealthy (0).
-*/
-int get_health_status(float avg_decibel) {
-    if(avg_decibel > 0 && avg_decibel <= 100) 
-        return 1; // healthy
-    else    
-        return 0; // unhealthy
-}
-
-
 /*
  * This function makes the packet to publish.
  * The format of packet is as follows :
@@ -190,17 +172,31 @@ int get_health_status(float avg_decibel) {
  *    timestamp[13],
  *    noise_level[2],
  *    avg_decibel[10],
- *    health_status[1]
+ *    health_status[1],
+ *    seq[10],
+ *    epoch[13]
  * The data in the packet is separated by commas.
+ * The sequence number grows by one per published packet of the stream (see next_seq()), so consumers can tell
+ * lost packets from suppressed ones. The epoch is the start time of the publisher in milliseconds, so they can also
+ * tell a restart, even one within the same second.
+ * The timestamp is 'YYMMDDHHMMSS'. The packet is written without printf or the heap, and its length is returned.
 */
-void make_packet(char* buffer, float avg_decibel, int noise_level) {
-    char timestamp[13];         // "yymmddhhmmss"에 해당하는 12자리 타임스탬프 + 널 종료 문자('\0')를 위한 공간
-    get_timestamp(timestamp);
-    
+int make_packet(char* buffer, float avg_decibel, int noise_level, unsigned long seq) {
     int health_status = get_health_status(avg_decibel);
+    int len = packet_format(&writer, buffer, vclock_time(), noise_level, avg_decibel, health_status, seq);
 
-    sprintf(buffer, "%s,%s,%s,%s,%d,%f,%d", institution, location, room, timestamp, noise_level, avg_decibel, health_status);
-    printf("%s\n", buffer);
+    buffer[len] = '\n';
+    fwrite(buffer, 1, len + 1, stdout);
+    buffer[len] = '\0';
+    return len;
+}
+
+
+/*
+ * This function returns the sequence number of the next packet: alerts and readings are numbered apart.
+*/
+unsigned long next_seq(int noise_level) {
+    return noise_level == -1 ? ++alert_seq : ++reading_seq;
 }
 
 
@@ -209,12 +205,18 @@ void make_packet(char* buffer, float avg_decibel, int noise_level) {
  * If the noise_level is normal(the case of sensor is unhealthy), the packet will be published to the given topic.
  * Else unnormal, it will be published to the 'admin/alerts' topic to report this issue to administrator. 
 */
-void publish_decibel_data(struct mosquitto *mosq, char* buffer, int noise_level) {
+void publish_decibel_data(struct mosquitto *mosq, char* buffer, int len, int noise_level) {
     int rc;
 
+    // a compact packet is the packet without its 'institution,location,room,' header (see common/packet.h)
+    if(compact) {
+        buffer += writer.header_len;
+        len -= writer.header_len;
+    }
+
     // if the range of decibel is normal, publish data to the topic
     if(noise_level != -1) {
-        rc = mosquitto_publish(mosq, NULL, topic, strlen(buffer), buffer, 1, false);
+        rc = transport_publish(transport, topic, len, buffer, reading_qos, false);
         if(rc != MOSQ_ERR_SUCCESS){
             fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
             reconnect(mosq);
@@ -222,7 +224,7 @@ void publish_decibel_data(struct mosquitto *mosq, char* buffer, int noise_level)
     }
     // if the range of decibel is unnormal, publish data to admin/alerts
     else {
-        rc = mosquitto_publish(mosq, NULL, admin_alerts, strlen(buffer), buffer, 1, false);
+        rc = transport_publish(transport, admin_alerts, len, buffer, 1, false);
         if(rc != MOSQ_ERR_SUCCESS){
             fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
             reconnect(mosq);
@@ -230,7 +232,9 @@ void publish_decibel_data(struct mosquitto *mosq, char* buffer, int noise_level)
     }
     
     // publish logs to admin/logs
-    rc = mosquitto_publish(mosq, NULL, admin_logs, strlen(buffer), buffer, 1, false);
+    if(!log_echo)
+        return;
+    rc = transport_publish(transport, admin_logs, len, buffer, 1, false);
     if(rc != MOSQ_ERR_SUCCESS){
         fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
         reconnect(mosq);
@@ -238,6 +242,69 @@ void publish_decibel_data(struct mosquitto *mosq, char* buffer, int noise_level)
 }
 
 
+/*
+ * This function reports the average noise value of a window: in report-by-exception mode, unchanged readings
+ * are not published.
+*/
+void report_window(struct mosquitto *mosq, float avg_decibel) {
+    char buffer[PACKET_MAX];
+    int noise_level = cal_alert_level(avg_decibel);
+    int len;
+
+    if(report_check(&policy, &report, noise_level, avg_decibel, vclock_time()) != REPORT_SUPPRESSED) {
+        len = make_packet(buffer, avg_decibel, noise_level, next_seq(noise_level));
+        publish_decibel_data(mosq, buffer, len, noise_level);
+    }
+}
+
+
+/*
+ * This function is the event of one noise sample.
+ * The samples of the test cases (skipped with NOISE_SKIP_TEST_CASES=1) come first, every half interval,
+ * then a random value (get_decibel()) every interval. Every NOISE_WINDOW_SAMPLES samples, the average is reported.
+*/
+void on_sample(void *ctx) {
+    struct mosquitto *mosq = ctx;
+    int testing = test_samples < 5 * NOISE_WINDOW_SAMPLES;
+
+    if(testing) {
+        window_sum += test_case[test_samples / NOISE_WINDOW_SAMPLES][test_samples % NOISE_WINDOW_SAMPLES];
+        test_samples++;
+    }
+    else {
+        window_sum += get_decibel();
+    }
+
+    if(++window_samples == NOISE_WINDOW_SAMPLES) {
+        report_window(mosq, (float)window_sum / NOISE_WINDOW_SAMPLES);
+        window_sum = 0;
+        window_samples = 0;
+    }
+
+    testing = test_samples < 5 * NOISE_WINDOW_SAMPLES;
+    sched_after(sched, testing ? sample_usec / 2 : sample_usec, on_sample, mosq);
+}
+
+
+/*
+ * This function waits until the broker has acknowledged every message that was handed to the connection
+ * (and to the bulk lane), for at most 'timeout_sec' seconds of real time.
+ * It returns the number of messages that are still not acknowledged.
+*/
+long wait_acknowledged(long timeout_sec) {
+    struct transport_stats stats;
+    long pending;
+
+    for(long waited_ms = 0; ; waited_ms += 10) {
+        transport_get_stats(transport, &stats);
+        pending = (long)(stats.mqtt_published - atomic_load(&acknowledged)) + stats.bulk_queued;
+        if(pending <= 0 || waited_ms >= timeout_sec * 1000)
+            return pending > 0 ? pending : 0;
+        usleep(10000);
+    }
+}
+
+
 int main(int argc, char *argv[])
 {
     printf("----------------------\n");
@@ -246,10 +313,36 @@ int main(int argc, char *argv[])
     
     struct mosquitto *mosq = NULL;
     int rc;
-
-    float avg_decibel = 0.0;
-    int noise_level = 0;
-    char buffer[1024];
+    long pending;
+
+    /* The room and the sampling rate can be overridden to run many publishers on one host */
+    config_room(institution, location, room, sizeof(room));
+    snprintf(topic, sizeof(topic), "%s/%s/%s", institution, location, room);
+    packet_writer_init(&writer, institution, location, room);
+    // the real start time in ms, also on the virtual clock: a restarted publisher gets a higher epoch,
+    // even when it restarts within the same second (e.g. under a supervisor)
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    packet_writer_set_epoch(&writer, (unsigned long)start.tv_sec * 1000 + start.tv_nsec / 1000000);
+    compact = strcmp(config_str("NOISE_PACKET", "full"), "compact") == 0;
+    if(compact) {
+        snprintf(admin_alerts, sizeof(admin_alerts), "admin/alerts/%s", topic);
+        snprintf(admin_logs, sizeof(admin_logs), "admin/logs/pub/%s", topic);
+    }
+    reading_qos = config_long("NOISE_READING_QOS", 1);
+    log_echo = config_long("NOISE_LOG_ECHO", 1) != 0;
+    sample_usec = config_long("NOISE_SAMPLE_USEC", sample_usec);
+    vclock_configure();
+    sim_end = vclock_time() + config_long("NOISE_SIM_SECONDS", 86400);
+    report_policy_from_config(&policy);
+    report_state_init(&report);
+    if(config_long("NOISE_SKIP_TEST_CASES", 0))
+        test_samples = 5 * NOISE_WINDOW_SAMPLES;
+    sched = sched_create();
+    if(sched == NULL){
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
 
     /* Required before calling other mosquitto functions */
     mosquitto_lib_init();
@@ -269,11 +362,24 @@ int main(int argc, char *argv[])
     mosquitto_connect_callback_set(mosq, on_connect);
     mosquitto_publish_callback_set(mosq, on_publish);
 
+    /* Co-located consumers can be reached through shared memory instead of the broker */
+    transport = transport_create(mosq, NULL, NULL);
+    if(transport == NULL){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    /* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+    if(tls_configure(mosq) != MOSQ_ERR_SUCCESS){
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
     /* Connect to host(broker) on port 1883, with a keepalive of 60 seconds.
      * This call makes the socket connection only, it does not complete the MQTT
      * CONNECT/CONNACK flow, you should use mosquitto_loop_start() or
      * mosquitto_loop_forever() for processing net traffic. */
-    rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+    rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
     if(rc != MOSQ_ERR_SUCCESS){
         mosquitto_destroy(mosq);
         fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
@@ -288,23 +394,20 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    printf("institution,location,room,timestamp,noise_level,decibel,health_status\n");
-    // test case 
-    for(int i=0; i<5; i++) {
-        avg_decibel = cal_avg_decibel(true, i);
-        noise_level = cal_alert_level(avg_decibel);
-        make_packet(buffer, avg_decibel, noise_level);
-        publish_decibel_data(mosq, buffer, noise_level);
-    }
-
-    // continue to measure noise
-    while(true) {
-        avg_decibel = cal_avg_decibel(false, -1);
-        noise_level = cal_alert_level(avg_decibel);
-        make_packet(buffer, avg_decibel, noise_level);
-        publish_decibel_data(mosq, buffer, noise_level);
-    }
-
+    printf("institution,location,room,timestamp,noise_level,decibel,health_status,seq,epoch\n");
+    // measure noise (on the virtual clock, until the end of the simulated period)
+    sched_after(sched, test_samples < 5 * NOISE_WINDOW_SAMPLES ? sample_usec / 2 : sample_usec, on_sample, mosq);
+    sched_run(sched, vclock_is_virtual() ? (int64_t)sim_end * 1000000 : INT64_MAX);
+
+    /* Only reached with the virtual clock: wait until what was sent is acknowledged, then leave */
+    pending = wait_acknowledged(config_long("NOISE_DRAIN_SEC", 30));
+    if(pending > 0)
+        fprintf(stderr, "Leaving with %ld messages not acknowledged by the broker\n", pending);
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq, false);
+    sched_destroy(sched);
+    transport_destroy(transport);
+    mosquitto_destroy(mosq);
     mosquitto_lib_cleanup();
 
     return 0;
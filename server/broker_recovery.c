@@ -7,21 +7,32 @@
  * If there is a problem, the program attempts to recover until the broker operates normally.
  * 
  * Also, all the logs of the broker's status are published to the 'admin/logs/broker' topic.
+ *
+ * The new broker runs in the background, without a terminal: NOISE_BROKER_BIN (default mosquitto) is started
+ * with '-v' (and '-c NOISE_BROKER_CONF' if set), and its output is appended to '<NOISE_BROKER_LOG_DIR>/mosquitto.log'
+ * (default logs/, like noise_supervisor).
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <mosquitto.h>
 
-#define MQTT_HOST "127.0.0.1" 
-#define MQTT_PORT 1883
+#include "config.h"
+#include "tls.h"
+#include "transport.h"
 
 struct mosquitto *mosq = NULL;
 
+// MQTT, or shared memory (NOISE_SHM): then the log of a broker failure does not depend on the broker
+struct transport *transport = NULL;
+
 char admin_logs[30] = "admin/logs/broker";
 
 /*
@@ -40,24 +51,84 @@ void on_connect(struct mosquitto *mosq, void *obj, int reason_code) {
 }
 
 
+/*
+ * This function starts a new broker in the background: NOISE_BROKER_BIN with '-v' (and '-c NOISE_BROKER_CONF',
+ * e.g. the TLS listener of certs/mosquitto.conf), with its output appended to '<NOISE_BROKER_LOG_DIR>/mosquitto.log'.
+ * It stays in the process group of this program, so noise_supervisor stops it with broker_recovery;
+ * it has no terminal input (/dev/null) and keeps running if this program exits on its own.
+ * It returns the process id of the broker, or -1 if it could not be started.
+*/
+pid_t start_broker(void) {
+    const char *bin = config_str("NOISE_BROKER_BIN", "mosquitto");
+    const char *conf = config_str("NOISE_BROKER_CONF", NULL);
+    const char *log_dir = config_str("NOISE_BROKER_LOG_DIR", "logs");
+    char path[512];
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "%s/mosquitto.log", log_dir);
+    if(mkdir(log_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", log_dir, strerror(errno));
+        return -1;
+    }
+
+    pid = fork();
+    if(pid < 0) {
+        fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+        return -1;
+    }
+    if(pid == 0) {
+        int log = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        int null = open("/dev/null", O_RDONLY);
+
+        if(log < 0 || null < 0) {
+            perror(path);
+            _exit(127);
+        }
+        dup2(null, STDIN_FILENO);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        close(null);
+        close(log);
+
+        if(conf != NULL)
+            execlp(bin, bin, "-v", "-c", conf, (char *)NULL);
+        else
+            execlp(bin, bin, "-v", (char *)NULL);
+        fprintf(stderr, "Error: cannot run %s: %s\n", bin, strerror(errno));
+        _exit(127);
+    }
+
+    printf("Started %s (pid %d), output in %s\n", bin, (int)pid, path);
+    return pid;
+}
+
+
 /*
  * This function creates new broker.
- * To create new broker, open new terminal window and command 'mosquittio -v'.
- * Then, try to connect to cgreated broker.
- * If cannot connect to new broker, try to recreate broker and connect again.
+ * It starts a new broker (start_broker()) and tries to connect to it for a few seconds.
+ * If the broker exits or cannot be connected to, it creates a broker again.
 */
 void recover_broker() {
     char buffer[1024];
 
     while(1) {
-        // create new broker on another terminal
-        system("gnome-terminal -- mosquitto -v"); 
+        pid_t pid = start_broker();
+        int rc = MOSQ_ERR_NO_CONN;
+
+        // give the new broker up to 5 seconds to listen
+        for(int i=0; i<25 && pid > 0 && rc != MOSQ_ERR_SUCCESS; i++) {
+            usleep(200000);
+            if(waitpid(pid, NULL, WNOHANG) == pid) {
+                fprintf(stderr, "The new broker exited (see its log)\n");
+                break;
+            }
+            rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
+        }
 
-        // reconnect to new broker
-        int rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
         // if cannot connect to new broker, recreate broker again
         if (rc != MOSQ_ERR_SUCCESS) {
             fprintf(stderr, "Cannot connect to new broker: %s\n", mosquitto_strerror(rc));
+            sleep(1);
         }
         // if success to connect to new broker, break and back to monitor_broker_status()
         else {
@@ -67,7 +138,7 @@ void recover_broker() {
 
             // publish log
             sprintf(buffer, "broker,Broker is re-running now");
-            rc = mosquitto_publish(mosq, NULL, admin_logs, strlen(buffer), buffer, 1, false);
+            rc = transport_publish(transport, admin_logs, strlen(buffer), buffer, 1, false);
             if(rc != MOSQ_ERR_SUCCESS){
                 fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
                 continue;
@@ -87,6 +158,10 @@ void monitor_broker_status() {
     while (1) {
         // check the status of broker every 3 seconds.
         int state = mosquitto_loop(mosq, 0, 1);
+
+        // reap the brokers started before that have exited
+        while(waitpid(-1, NULL, WNOHANG) > 0);
+
         if (state != MOSQ_ERR_SUCCESS && state != MOSQ_ERR_CONN_LOST) {
             fprintf(stderr, "Broker connection lost: %s\n", mosquitto_strerror(state));
             recover_broker();
@@ -117,8 +192,20 @@ int main()
     /* Configure callbacks */
     mosquitto_connect_callback_set(mosq, on_connect);
 
+    transport = transport_create(mosq, NULL, NULL);
+    if (transport == NULL) {
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
+    /* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+    if (tls_configure(mosq) != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(mosq);
+        return 1;
+    }
+
     // connect to broker
-    int rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+    int rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
     if (rc != MOSQ_ERR_SUCCESS) {
         mosquitto_destroy(mosq);
         fprintf(stderr, "Could not connect to broker: %s\n", mosquitto_strerror(rc));
@@ -129,6 +216,7 @@ int main()
     monitor_broker_status();
 
     // terminate mosquitto client
+    transport_destroy(transport);
     mosquitto_destroy(mosq);
 
     mosquitto_lib_cleanup();
@@ -0,0 +1,607 @@
+/*
+ * This program starts the broker and the components of Noise Warning Program headless, from a topology file,
+ * and keeps them running (make start). It replaces the terminal windows of run_program.sh.
+ *
+ * Every line of the topology is one process:
+ *      <name> <ready> <after> [KEY=VALUE ...] <command> [args ...]
+ *  - ready     when the process counts as ready:
+ *                  tcp:[host:]port     it accepts TCP connections (the broker)
+ *                  notify              it says so (common/ready.h): connected, and all its subscriptions granted
+ *                  start               as soon as it is started
+ *  - after     comma separated names of processes that must be ready before it is started, '-' for none
+ *  - KEY=VALUE environment of the process, e.g. NOISE_ROOM=handong/NTH/313
+ * '${VAR}' and '${VAR:-default}' are replaced with the environment of the supervisor; '#' starts a comment.
+ *
+ * The output of every process goes to '<log_dir>/<name>.log'. The supervisor prints when each process was
+ * started and ready, and the cold-start times of the site: until every process was ready, and until the first
+ * message was delivered to a component (which includes one measuring window of the publishers).
+ * With -o these are also written as a JSON report; with -s everything is stopped after the report.
+ *
+ * A process that exits while the site starts fails the start. Later exits are reported, and the
+ * process is not started again (the broker has broker_recovery). SIGINT and SIGTERM stop all processes.
+ *
+ *      usage: noise_supervisor [-l log_dir] [-o report.json] [-w timeout_ms] [-s] [topology]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define MAX_PROCESSES   64
+#define MAX_ARGS        32
+#define MAX_ENVS        16
+#define MAX_DEPS        16
+#define NAME_LEN        32
+#define LINE_LEN        1024
+
+enum ready_kind { READY_NOTIFY, READY_TCP, READY_START };
+enum process_state { WAITING, STARTING, READY, EXITED };
+
+struct process {
+    char name[NAME_LEN];
+    enum ready_kind ready;
+    char host[64];
+    char port[8];
+    char after[LINE_LEN];
+    int deps[MAX_DEPS];
+    int ndeps;
+    char line[LINE_LEN];        // the expanded line; args and envs point into it
+    char *args[MAX_ARGS + 1];
+    char *envs[MAX_ENVS];
+    int nenvs;
+
+    enum process_state state;
+    pid_t pid;
+    int fd;                     // supervisor end of the readiness socket, -1 if none
+    long started_ns, ready_ns, first_ns;
+};
+
+struct process processes[MAX_PROCESSES];
+int nprocesses = 0;
+
+const char *log_dir = "logs";
+long start_ns = 0;
+long all_ready_ns = 0;
+long first_ns = 0;
+const char *first_name = NULL;
+
+volatile sig_atomic_t stopping = 0;
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+double since_start_ms(long ns) {
+    return ns > 0 ? (ns - start_ns) / 1e6 : -1;
+}
+
+
+void on_signal(int sig) {
+    stopping = 1;
+}
+
+
+/*
+ * This function copies 'line' to 'out' and replaces ${VAR} and ${VAR:-default} with the environment.
+ * It returns -1 if the result does not fit.
+*/
+int expand_line(const char *line, char *out, int size) {
+    int n = 0;
+
+    while(*line != '\0') {
+        const char *value = NULL, *end;
+        char var[128];
+
+        if(line[0] == '$' && line[1] == '{' && (end = strchr(line, '}')) != NULL && end - line - 2 < (int)sizeof(var)) {
+            memcpy(var, line + 2, end - line - 2);
+            var[end - line - 2] = '\0';
+            char *def = strstr(var, ":-");
+            if(def != NULL) {
+                *def = '\0';
+                def += 2;
+            }
+            value = getenv(var);
+            if(value == NULL || value[0] == '\0')
+                value = def != NULL ? def : "";
+            if(n + (int)strlen(value) >= size)
+                return -1;
+            n += sprintf(out + n, "%s", value);
+            line = end + 1;
+            continue;
+        }
+        if(n + 1 >= size)
+            return -1;
+        out[n++] = *line++;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+
+/*
+ * This function parses one line of the topology into 'p'. It returns 0, or -1 with a message.
+*/
+int parse_process(const char *text, int lineno, struct process *p) {
+    char *save = NULL, *token, *ready, *after;
+    int nargs = 0;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    if(expand_line(text, p->line, sizeof(p->line)) != 0) {
+        fprintf(stderr, "topology:%d: line too long\n", lineno);
+        return -1;
+    }
+
+    token = strtok_r(p->line, " \t\n", &save);
+    ready = strtok_r(NULL, " \t\n", &save);
+    after = strtok_r(NULL, " \t\n", &save);
+    if(token == NULL || ready == NULL || after == NULL || strlen(token) >= NAME_LEN) {
+        fprintf(stderr, "topology:%d: expected '<name> <ready> <after> <command>'\n", lineno);
+        return -1;
+    }
+    snprintf(p->name, sizeof(p->name), "%s", token);
+    snprintf(p->after, sizeof(p->after), "%s", strcmp(after, "-") == 0 ? "" : after);
+
+    if(strcmp(ready, "notify") == 0) {
+        p->ready = READY_NOTIFY;
+    }
+    else if(strcmp(ready, "start") == 0) {
+        p->ready = READY_START;
+    }
+    else if(strncmp(ready, "tcp:", 4) == 0) {
+        char *port = strrchr(ready + 4, ':');
+        p->ready = READY_TCP;
+        snprintf(p->host, sizeof(p->host), "127.0.0.1");
+        if(port != NULL) {
+            *port++ = '\0';
+            snprintf(p->host, sizeof(p->host), "%s", ready + 4);
+        }
+        else {
+            port = ready + 4;
+        }
+        if(atoi(port) <= 0) {
+            fprintf(stderr, "topology:%d: bad port in '%s'\n", lineno, ready);
+            return -1;
+        }
+        snprintf(p->port, sizeof(p->port), "%s", port);
+    }
+    else {
+        fprintf(stderr, "topology:%d: unknown readiness '%s' (tcp:port, notify or start)\n", lineno, ready);
+        return -1;
+    }
+
+    // environment assignments, then the command
+    while((token = strtok_r(NULL, " \t\n", &save)) != NULL) {
+        if(nargs == 0 && strchr(token, '=') != NULL && token[0] != '=' && token[0] != '/' && token[0] != '.') {
+            if(p->nenvs == MAX_ENVS) {
+                fprintf(stderr, "topology:%d: more than %d variables\n", lineno, MAX_ENVS);
+                return -1;
+            }
+            p->envs[p->nenvs++] = token;
+        }
+        else if(nargs < MAX_ARGS) {
+            p->args[nargs++] = token;
+        }
+        else {
+            fprintf(stderr, "topology:%d: more than %d arguments\n", lineno, MAX_ARGS);
+            return -1;
+        }
+    }
+    if(nargs == 0) {
+        fprintf(stderr, "topology:%d: no command\n", lineno);
+        return -1;
+    }
+    p->args[nargs] = NULL;
+    return 0;
+}
+
+
+int find_process(const char *name) {
+    for(int i=0; i<nprocesses; i++) {
+        if(strcmp(processes[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+
+/*
+ * This function reads the topology file and resolves the dependencies. It returns 0, or -1 with a message.
+*/
+int load_topology(const char *path) {
+    char line[LINE_LEN];
+    int lineno = 0;
+    FILE *fp = fopen(path, "r");
+
+    if(fp == NULL) {
+        fprintf(stderr, "Error: cannot open the topology %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        char *comment = strchr(line, '#');
+        lineno++;
+        if(comment != NULL)
+            *comment = '\0';
+        if(strspn(line, " \t\r\n") == strlen(line))
+            continue;
+        if(nprocesses == MAX_PROCESSES) {
+            fprintf(stderr, "topology:%d: more than %d processes\n", lineno, MAX_PROCESSES);
+            fclose(fp);
+            return -1;
+        }
+        if(parse_process(line, lineno, &processes[nprocesses]) != 0) {
+            fclose(fp);
+            return -1;
+        }
+        if(find_process(processes[nprocesses].name) >= 0) {
+            fprintf(stderr, "topology:%d: '%s' is defined twice\n", lineno, processes[nprocesses].name);
+            fclose(fp);
+            return -1;
+        }
+        nprocesses++;
+    }
+    fclose(fp);
+
+    for(int i=0; i<nprocesses; i++) {
+        struct process *p = &processes[i];
+        char *save = NULL;
+
+        for(char *dep = strtok_r(p->after, ",", &save); dep != NULL; dep = strtok_r(NULL, ",", &save)) {
+            int d = find_process(dep);
+            if(d < 0 || d == i || p->ndeps == MAX_DEPS) {
+                fprintf(stderr, "Error: '%s' cannot be started after '%s'\n", p->name, dep);
+                return -1;
+            }
+            p->deps[p->ndeps++] = d;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * This function starts a process with its output in its log file and, for 'notify', with one end
+ * of a socket pair as NOISE_READY_FD (a socket, so a component never gets SIGPIPE from it).
+*/
+int start_process(struct process *p) {
+    char path[512];
+    int fds[2] = { -1, -1 };
+
+    snprintf(path, sizeof(path), "%s/%s.log", log_dir, p->name);
+    if(p->ready == READY_NOTIFY && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        fprintf(stderr, "Error: socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    p->started_ns = now_ns();
+    p->pid = fork();
+    if(p->pid < 0) {
+        fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+        return -1;
+    }
+    if(p->pid == 0) {
+        int log = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int null = open("/dev/null", O_RDONLY);
+        char fd[16];
+
+        // a process group of its own, so stopping it also stops what it started
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        if(log < 0 || null < 0) {
+            perror(path);
+            _exit(127);
+        }
+        dup2(null, STDIN_FILENO);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        close(null);
+        close(log);
+
+        for(int i=0; i<p->nenvs; i++)
+            putenv(p->envs[i]);
+        unsetenv("NOISE_READY_FD");
+        if(fds[1] >= 0) {
+            fcntl(fds[1], F_SETFD, 0);
+            snprintf(fd, sizeof(fd), "%d", fds[1]);
+            setenv("NOISE_READY_FD", fd, 1);
+        }
+        execvp(p->args[0], p->args);
+        fprintf(stderr, "Error: cannot run %s: %s\n", p->args[0], strerror(errno));
+        _exit(127);
+    }
+
+    setpgid(p->pid, p->pid);
+    if(fds[1] >= 0)
+        close(fds[1]);
+    p->fd = fds[0];
+    p->state = STARTING;
+    printf("%9.1f ms  %-16s started (pid %d, log %s)\n", since_start_ms(p->started_ns), p->name, (int)p->pid, path);
+    return 0;
+}
+
+
+void set_ready(struct process *p) {
+    p->state = READY;
+    p->ready_ns = now_ns();
+    printf("%9.1f ms  %-16s ready (%.1f ms after its start)\n", since_start_ms(p->ready_ns), p->name, (p->ready_ns - p->started_ns) / 1e6);
+}
+
+
+/*
+ * This function returns 1 if the process accepts TCP connections.
+*/
+int tcp_ready(struct process *p) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+    int ok = 0;
+
+    if(getaddrinfo(p->host, p->port, &hints, &res) != 0)
+        return 0;
+    for(ai = res; ai != NULL && !ok; ai = ai->ai_next) {
+        int s = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if(s < 0)
+            continue;
+        ok = connect(s, ai->ai_addr, ai->ai_addrlen) == 0;
+        close(s);
+    }
+    freeaddrinfo(res);
+    return ok;
+}
+
+
+/*
+ * This function reads the "ready" and "first" lines of a process (common/ready.h).
+*/
+void read_notify(struct process *p) {
+    char buffer[256];
+    ssize_t n = read(p->fd, buffer, sizeof(buffer) - 1);
+
+    if(n <= 0) {
+        close(p->fd);
+        p->fd = -1;
+        return;
+    }
+    buffer[n] = '\0';
+    if(strstr(buffer, "ready\n") != NULL && p->state == STARTING)
+        set_ready(p);
+    if(strstr(buffer, "first\n") != NULL && p->first_ns == 0) {
+        p->first_ns = now_ns();
+        if(first_ns == 0) {
+            first_ns = p->first_ns;
+            first_name = p->name;
+            printf("%9.1f ms  %-16s first message delivered\n", since_start_ms(first_ns), p->name);
+        }
+    }
+}
+
+
+/*
+ * This function collects the processes that exited. It returns how many did.
+*/
+int reap_processes(void) {
+    int status, exited = 0;
+    pid_t pid;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for(int i=0; i<nprocesses; i++) {
+            struct process *p = &processes[i];
+            if(p->pid != pid)
+                continue;
+            p->state = EXITED;
+            if(WIFEXITED(status))
+                printf("%9.1f ms  %-16s exited with status %d (see %s/%s.log)\n", since_start_ms(now_ns()), p->name, WEXITSTATUS(status), log_dir, p->name);
+            else
+                printf("%9.1f ms  %-16s killed by signal %d (see %s/%s.log)\n", since_start_ms(now_ns()), p->name, WTERMSIG(status), log_dir, p->name);
+            exited++;
+        }
+    }
+    return exited;
+}
+
+
+/*
+ * This function starts every waiting process whose dependencies are ready. It returns -1 if a start failed.
+*/
+int start_ready_processes(void) {
+    for(int i=0; i<nprocesses; i++) {
+        struct process *p = &processes[i];
+        int deps_ready = 1;
+
+        if(p->state != WAITING)
+            continue;
+        for(int d=0; d<p->ndeps; d++)
+            deps_ready &= processes[p->deps[d]].state == READY;
+        if(!deps_ready)
+            continue;
+        if(start_process(p) != 0)
+            return -1;
+        if(p->ready == READY_START)
+            set_ready(p);
+    }
+    return 0;
+}
+
+
+/*
+ * This function stops all processes, the last started first: SIGTERM, and SIGKILL after 3 sec.
+*/
+void stop_processes(void) {
+    long deadline = now_ns() + 3000000000L;
+    int running;
+
+    for(int i=nprocesses - 1; i>=0; i--) {
+        if(processes[i].state == STARTING || processes[i].state == READY)
+            kill(-processes[i].pid, SIGTERM);
+    }
+    do {
+        reap_processes();
+        running = 0;
+        for(int i=0; i<nprocesses; i++)
+            running += processes[i].state == STARTING || processes[i].state == READY;
+        if(running > 0)
+            usleep(10000);
+    } while(running > 0 && now_ns() < deadline);
+
+    for(int i=0; i<nprocesses; i++) {
+        if(processes[i].state == STARTING || processes[i].state == READY) {
+            kill(-processes[i].pid, SIGKILL);
+            waitpid(processes[i].pid, NULL, 0);
+            processes[i].state = EXITED;
+        }
+    }
+}
+
+
+int write_report(const char *path) {
+    FILE *fp = fopen(path, "w");
+
+    if(fp == NULL) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"processes\": %d,\n", nprocesses);
+    fprintf(fp, "  \"all_ready_ms\": %.1f,\n", since_start_ms(all_ready_ns));
+    fprintf(fp, "  \"first_message_ms\": %.1f,\n", since_start_ms(first_ns));
+    fprintf(fp, "  \"first_message_at\": \"%s\",\n", first_name != NULL ? first_name : "");
+    fprintf(fp, "  \"startup\": {\n");
+    for(int i=0; i<nprocesses; i++) {
+        struct process *p = &processes[i];
+        fprintf(fp, "    \"%s\": { \"started_ms\": %.1f, \"ready_ms\": %.1f, \"first_message_ms\": %.1f }%s\n",
+                p->name, since_start_ms(p->started_ns), since_start_ms(p->ready_ns), since_start_ms(p->first_ns),
+                i == nprocesses - 1 ? "" : ",");
+    }
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+    fclose(fp);
+    return 0;
+}
+
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-l log_dir] [-o report.json] [-w timeout_ms] [-s] [topology]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *topology = "server/site.topology", *report = NULL;
+    long timeout_ms = 10000;
+    int once = 0, reported = 0, failed = 0, opt;
+    struct pollfd fds[MAX_PROCESSES];
+    struct process *polled[MAX_PROCESSES];
+
+    while((opt = getopt(argc, argv, "l:o:w:s")) != -1) {
+        switch(opt) {
+            case 'l': log_dir = optarg; break;
+            case 'o': report = optarg; break;
+            case 'w': timeout_ms = atol(optarg); break;
+            case 's': once = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind < argc)
+        topology = argv[optind];
+    if(timeout_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(load_topology(topology) != 0)
+        return 1;
+    if(nprocesses == 0) {
+        fprintf(stderr, "Error: %s has no processes\n", topology);
+        return 1;
+    }
+    if(mkdir(log_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create %s: %s\n", log_dir, strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Starting %d processes of %s, logs in %s/\n", nprocesses, topology, log_dir);
+    start_ns = now_ns();
+
+    while(!stopping) {
+        int nfds = 0, starting = 0, tcp_waiting = 0;
+
+        if(start_ready_processes() != 0) {
+            failed = 1;
+            break;
+        }
+
+        for(int i=0; i<nprocesses; i++) {
+            struct process *p = &processes[i];
+            starting += p->state != READY && p->state != EXITED;
+            tcp_waiting += p->state == STARTING && p->ready == READY_TCP;
+            if(p->fd >= 0) {
+                fds[nfds] = (struct pollfd){ .fd = p->fd, .events = POLLIN };
+                polled[nfds++] = p;
+            }
+        }
+
+        if(all_ready_ns == 0 && starting == 0) {
+            all_ready_ns = now_ns();
+            printf("%9.1f ms  all %d processes ready\n", since_start_ms(all_ready_ns), nprocesses);
+        }
+        if(all_ready_ns == 0 && now_ns() - start_ns > timeout_ms * 1000000L) {
+            for(int i=0; i<nprocesses; i++) {
+                if(processes[i].state == STARTING)
+                    fprintf(stderr, "Error: %s was not ready after %ld ms (see %s/%s.log)\n", processes[i].name, timeout_ms, log_dir, processes[i].name);
+                else if(processes[i].state == WAITING)
+                    fprintf(stderr, "Error: %s was never started, it waits for a process that is not ready\n", processes[i].name);
+            }
+            failed = 1;
+            break;
+        }
+
+        // the report: when the first message arrived, or when it did not come in time
+        if(all_ready_ns != 0 && !reported && (first_ns != 0 || now_ns() - start_ns > 2 * timeout_ms * 1000000L)) {
+            reported = 1;
+            printf("Cold start: all ready in %.1f ms, first message delivered in %.1f ms\n", since_start_ms(all_ready_ns), since_start_ms(first_ns));
+            if(report != NULL && write_report(report) != 0)
+                failed = 1;
+            if(once)
+                break;
+        }
+
+        // the broker is polled every 2 ms until it accepts connections, the rest waits on the sockets
+        if(poll(fds, nfds, tcp_waiting > 0 ? 2 : 100) > 0) {
+            for(int i=0; i<nfds; i++) {
+                if(fds[i].revents != 0)
+                    read_notify(polled[i]);
+            }
+        }
+        for(int i=0; i<nprocesses; i++) {
+            if(processes[i].state == STARTING && processes[i].ready == READY_TCP && tcp_ready(&processes[i]))
+                set_ready(&processes[i]);
+        }
+
+        if(reap_processes() > 0 && all_ready_ns == 0) {
+            fprintf(stderr, "Error: a process exited while the site was starting\n");
+            failed = 1;
+            break;
+        }
+    }
+
+    stop_processes();
+    return failed ? 1 : 0;
+}
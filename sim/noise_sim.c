@@ -0,0 +1,418 @@
+/*
+ * This program is the discrete-event simulator of Noise Warning Program.
+ *
+ * It runs synthetic noise of a whole building through the publisher logic on the virtual clock
+ * (common/vclock.h): the NOISE_WINDOW_SAMPLES samples of a reading, cal_alert_level, get_health_status,
+ * the report policy (NOISE_REPORT_MODE, see common/report_policy.h) and the alert paths
+ * (room topic -> nth_313_sub, 'admin/alerts' -> admin_alerts, 'admin/logs/pub' -> admin_logs).
+ * Every room is one event per reading in the scheduler, so weeks of readings take seconds.
+ *
+ * The sent packets also go through the consumer logic itself, on the same clock: the windows of the gateway
+ * (common/rollup.c, closed by a scheduler event every NOISE_GATEWAY_WINDOW_SEC, default 60) and the anomaly
+ * detector of admin_alerts (common/anomaly.c, NOISE_ANOMALY_* options). Rooms are 100 to a location.
+ * This costs about five times the events alone; -c leaves the consumers out, to compare report policies quickly.
+ *
+ * The rooms get one of four noise profiles (by room number, 8:8:3:1):
+ *      library     quiet, louder while open (08-23), a rare burst
+ *      lecture     classes on weekdays 09-18, 50 minutes of lecture and 10 minutes of break per hour
+ *      party       loud on Friday and Saturday nights (21-02)
+ *      faulty      like library, but the sensor fails about once a day for 30 minutes
+ *
+ *      usage: noise_sim [-r rooms] [-d days] [-t YYMMDDHHMMSS] [-s seed] [-c]
+ *
+ * The start time (-t, or NOISE_SIM_START) is Monday 2026-01-05 00:00 by default, the sample interval is
+ * NOISE_SAMPLE_USEC (default 1 sec). With the same arguments, the output is the same on every run,
+ * except for the wall time and the speedup.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "config.h"
+#include "anomaly.h"
+#include "noise_level.h"
+#include "packet.h"
+#include "report_policy.h"
+#include "rollup.h"
+#include "vclock.h"
+
+enum profile {
+    PROFILE_LIBRARY,
+    PROFILE_LECTURE,
+    PROFILE_PARTY,
+    PROFILE_FAULTY,
+    PROFILES
+};
+
+const char *const profile_names[PROFILES] = { "library", "lecture", "party", "faulty" };
+
+struct room {
+    uint64_t rng;
+    enum profile profile;
+    int episode;            // readings left in a burst (library) or a sensor fault (faulty)
+    int fault_value;        // sample of a failed sensor: dead (-20) or saturated (130)
+    int last_level;
+    int64_t fault_start;    // when the current fault started, 0 if none or already reported
+    struct report_state report;
+    struct packet_writer writer;
+    char topic[ROLLUP_ROOM_LEN];   // "institution/location/room", also the key of the anomaly detector
+    unsigned long reading_seq;
+    unsigned long alert_seq;
+};
+
+struct profile_stats {
+    long rooms;
+    long readings;
+    long sent;
+    long levels[5];         // readings per level -1 .. 3
+    long level3_episodes;   // times a room went to level 3
+};
+
+struct room *rooms;
+int nrooms = 1000;
+struct scheduler *sched;
+struct report_policy policy;
+int64_t sample_usec = 1000000;
+int64_t window_usec;
+int64_t sim_start, sim_end;
+long start_sow;             // second of the week (Sunday 00:00 = 0) at the start
+
+struct profile_stats stats[PROFILES];
+long messages = 0;          // PUBLISH messages the broker receives with the report policy
+long messages_always = 0;   // ... and with the original behaviour
+long health_alerts = 0;     // admin_alerts 'health check required'
+long faults = 0, faults_reported = 0;
+int64_t detect_sum = 0, detect_max = 0;
+long minute = -1, minute_messages = 0, peak_minute_messages = 0;
+
+struct rollup_table gateway;        // the windows of noise_gateway
+int64_t gateway_window_usec;
+long gateway_windows = 0, rollup_messages = 0, gateway_readings = 0;
+struct anomaly_table anomalies;     // the detector of admin_alerts (NOISE_ANOMALY=1)
+int consumers = 1;
+long anomaly_events[ANOMALY_CLEAR + 1];
+
+
+/*
+ * This function returns the next random number of a room (xorshift64*).
+*/
+uint64_t next_random(struct room *r) {
+    r->rng ^= r->rng >> 12;
+    r->rng ^= r->rng << 25;
+    r->rng ^= r->rng >> 27;
+    return r->rng * 2685821657736338717ULL;
+}
+
+
+double uniform(struct room *r) {
+    return ((next_random(r) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+
+/*
+ * This function returns a normally distributed value. The sum of four uniform values (16 bits of one
+ * random number each) is close enough for noise, and much cheaper than Box-Muller.
+*/
+double gaussian(struct room *r, double mean, double sd) {
+    uint64_t x = next_random(r);
+    double sum = (double)(x & 0xffff) + ((x >> 16) & 0xffff) + ((x >> 32) & 0xffff) + (x >> 48);
+
+    return mean + sd * (sum / 65536.0 - 2.0) * 1.7320508;    // variance of the sum is 4/12
+}
+
+
+/*
+ * This function returns the mean noise of a room at the given second of the week.
+*/
+double profile_mean(struct room *r, long sow) {
+    int day = sow / 86400;              // 0 = Sunday
+    int hour = sow % 86400 / 3600;
+    int min = sow % 3600 / 60;
+
+    switch(r->profile) {
+        case PROFILE_LECTURE:
+            if(day >= 1 && day <= 5 && hour >= 9 && hour < 18)
+                return min < 50 ? 58.0 : 68.0;
+            return 30.0;
+        case PROFILE_PARTY:
+            if((day == 5 || day == 6) && hour >= 21)
+                return 84.0;
+            if((day == 6 || day == 0) && hour < 2)
+                return 84.0;
+            return 45.0;
+        default:
+            if(r->episode > 0)
+                return 62.0;
+            return hour >= 8 && hour < 23 ? 38.0 : 28.0;
+    }
+}
+
+
+/*
+ * This function returns one sample of a room, like get_decibel() of the publisher (1-100 if healthy).
+*/
+int sample(struct room *r, long sow) {
+    if(r->profile == PROFILE_FAULTY && r->episode > 0)
+        return r->fault_value;
+
+    int value = (int)gaussian(r, profile_mean(r, sow), 6.0);
+    if(value < 1)
+        value = 1;
+    if(value > 100)
+        value = 100;
+    return value;
+}
+
+
+/*
+ * This function counts a PUBLISH message at the broker and keeps the busiest (virtual) minute.
+*/
+void count_message(int64_t now, long count) {
+    long m = (now - sim_start) / 60000000;
+
+    if(m != minute) {
+        minute = m;
+        minute_messages = 0;
+    }
+    messages += count;
+    minute_messages += count;
+    if(minute_messages > peak_minute_messages)
+        peak_minute_messages = minute_messages;
+}
+
+
+/*
+ * This function hands a sent packet to the consumers: the gateway aggregates it, and admin_alerts checks a
+ * reading (room topic) against the baseline of the room.
+*/
+void consume(struct room *r, time_t t, int level, float avg_decibel, int healthy) {
+    char packet[PACKET_MAX];
+    int len = packet_format(&r->writer, packet, t, level, avg_decibel, healthy, healthy ? ++r->reading_seq : ++r->alert_seq);
+    struct anomaly_event event;
+
+    if(rollup_add_reading(&gateway, healthy ? r->topic : "admin/alerts", packet, len) == 0)
+        gateway_readings++;
+    if(healthy) {
+        int kind = anomaly_update(&anomalies, r->topic, r->writer.timestamp, avg_decibel, &event);
+        if(kind >= 0)
+            anomaly_events[kind]++;
+    }
+}
+
+
+/*
+ * This function is the event of the end of a gateway window: the rollups of the window are counted like the
+ * messages the gateway would publish.
+*/
+void on_window(void *ctx) {
+    struct aggregate *closed = rollup_close_window(&gateway);
+    int64_t now = vclock_now_usec();
+
+    gateway_windows++;
+    for(struct aggregate *agg = closed; agg != NULL; agg = agg->next)
+        rollup_messages++;
+    rollup_free_list(closed);
+
+    if(now + gateway_window_usec <= sim_end)
+        sched_at(sched, now + gateway_window_usec, on_window, ctx);
+}
+
+
+/*
+ * This function is the event of one reading of a room: it takes the samples of the last window, runs them
+ * through the publisher logic and the alert paths, and schedules the next reading.
+*/
+void on_reading(void *ctx) {
+    struct room *r = ctx;
+    struct profile_stats *st = &stats[r->profile];
+    int64_t now = vclock_now_usec();
+    long sow = (start_sow + (now - sim_start) / 1000000) % 604800;
+    float avg_decibel = 0.0;
+
+    // bursts of the library rooms and faults of the faulty rooms start at a reading
+    if(r->episode > 0) {
+        r->episode--;
+    }
+    else if(r->profile == PROFILE_LIBRARY && uniform(r) < 0.002) {
+        r->episode = 6;
+    }
+    else if(r->profile == PROFILE_FAULTY && uniform(r) < (double)window_usec / 86400e6) {
+        r->episode = 1800000000 / window_usec;
+        r->fault_value = next_random(r) & 1 ? 130 : -20;
+        r->fault_start = now;
+        faults++;
+    }
+
+    for(int i=0; i<NOISE_WINDOW_SAMPLES; i++)
+        avg_decibel += sample(r, (sow + 604800 - (NOISE_WINDOW_SAMPLES - i) * sample_usec / 1000000) % 604800);
+    avg_decibel = avg_decibel / NOISE_WINDOW_SAMPLES;
+
+    int level = cal_alert_level(avg_decibel);
+    int healthy = get_health_status(avg_decibel);
+    time_t t = now / 1000000;
+
+    st->readings++;
+    st->levels[level + 1]++;
+    if(level == 3 && r->last_level != 3)
+        st->level3_episodes++;
+    r->last_level = level;
+
+    // the original behaviour: reading + 'admin/logs/pub' copy, and the 'admin/logs/sub' echo of nth_313_sub
+    messages_always += healthy ? 3 : 2;
+
+    if(report_check(&policy, &r->report, level, avg_decibel, t) != REPORT_SUPPRESSED) {
+        st->sent++;
+        count_message(now, healthy ? 3 : 2);
+        if(consumers)
+            consume(r, t, level, avg_decibel, healthy);
+        if(!healthy) {
+            health_alerts++;
+            if(r->fault_start != 0) {
+                int64_t delay = now - r->fault_start;
+                detect_sum += delay;
+                if(delay > detect_max)
+                    detect_max = delay;
+                faults_reported++;
+                r->fault_start = 0;
+            }
+        }
+    }
+
+    if(now + window_usec <= sim_end)
+        sched_at(sched, now + window_usec, on_reading, r);
+}
+
+
+long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-r rooms] [-d days] [-t YYMMDDHHMMSS] [-s seed] [-c]\n", name);
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *start = config_str("NOISE_SIM_START", "260105000000");
+    double days = 7.0;
+    uint64_t seed = 313;
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:d:t:s:c")) != -1) {
+        switch(opt) {
+            case 'r': nrooms = atoi(optarg); break;
+            case 'd': days = atof(optarg); break;
+            case 't': start = optarg; break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'c': consumers = 0; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    sim_start = vclock_parse_usec(start);
+    sample_usec = config_long("NOISE_SAMPLE_USEC", sample_usec);
+    if(nrooms <= 0 || days <= 0 || sim_start < 0 || sample_usec <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    window_usec = NOISE_WINDOW_SAMPLES * sample_usec;
+    sim_end = sim_start + (int64_t)(days * 86400e6);
+
+    time_t t = sim_start / 1000000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    start_sow = tm.tm_wday * 86400L + tm.tm_hour * 3600L + tm.tm_min * 60L + tm.tm_sec;
+
+    report_policy_from_config(&policy);
+    vclock_use_virtual(sim_start);
+    gateway_window_usec = config_long("NOISE_GATEWAY_WINDOW_SEC", 60) * 1000000;
+    struct anomaly_options opts;
+    anomaly_options_from_config(&opts);
+    rooms = calloc(nrooms, sizeof(struct room));
+    sched = sched_create();
+    if(gateway_window_usec <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(rooms == NULL || sched == NULL || anomaly_table_init(&anomalies, &opts) != 0 ||
+       sched_at(sched, sim_start + gateway_window_usec, on_window, NULL) != 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return 1;
+    }
+
+    // the rooms do not read at the same time: the first reading is somewhere in the first window
+    static const enum profile mix[20] = {
+        PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_PARTY,
+        PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_FAULTY,
+        PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_PARTY,
+        PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_LIBRARY, PROFILE_LECTURE, PROFILE_PARTY
+    };
+    for(int i=0; i<nrooms; i++) {
+        struct room *r = &rooms[i];
+        r->rng = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+        r->profile = mix[i % 20];
+        r->last_level = 0;
+        report_state_init(&r->report);
+        char location[8], number[8];
+        snprintf(location, sizeof(location), "B%d", i / 100);
+        snprintf(number, sizeof(number), "%d", i % 100000);
+        packet_writer_init(&r->writer, "handong", location, number);
+        snprintf(r->topic, sizeof(r->topic), "handong/%s/%s", location, number);
+        stats[r->profile].rooms++;
+        if(sched_at(sched, sim_start + window_usec + next_random(r) % window_usec, on_reading, r) != 0) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            return 1;
+        }
+    }
+
+    long wall = now_ns();
+    long events = sched_run(sched, sim_end);
+    wall = now_ns() - wall;
+
+    double simulated = (sim_end - sim_start) / 1e6;
+    printf("simulated: %d rooms, %.1f days from %s, sample every %.3f s, report mode %s\n",
+           nrooms, days, start, sample_usec / 1e6, policy.mode == REPORT_EXCEPTION ? "exception" : "always");
+    printf("events: %ld in %.3f s wall time (%.0f events/s, speedup %.0fx)\n\n",
+           events, wall / 1e9, events / (wall / 1e9), simulated / (wall / 1e9));
+
+    printf("profile   rooms    readings        sent  unhealthy      normal     level 1     level 2     level 3  level 3 episodes\n");
+    for(int p=0; p<PROFILES; p++) {
+        struct profile_stats *st = &stats[p];
+        printf("%-8s %6ld %11ld %11ld %10ld %11ld %11ld %11ld %11ld %17ld\n", profile_names[p], st->rooms, st->readings, st->sent,
+               st->levels[0], st->levels[1], st->levels[2], st->levels[3], st->levels[4], st->level3_episodes);
+    }
+
+    printf("\nbroker messages: %ld (original behaviour %ld, %.1f%% fewer)\n",
+           messages, messages_always, messages_always ? 100.0 * (messages_always - messages) / messages_always : 0.0);
+    printf("busiest minute: %ld messages (%.1f msgs/s), average %.1f msgs/s\n",
+           peak_minute_messages, peak_minute_messages / 60.0, messages / simulated);
+    printf("health alerts: %ld, sensor faults: %ld, reported: %ld", health_alerts, faults, faults_reported);
+    if(faults_reported > 0)
+        printf(" (detection delay avg %.1f s, max %.1f s)", detect_sum / 1e6 / faults_reported, detect_max / 1e6);
+    printf("\n");
+    if(consumers) {
+        printf("gateway: %ld windows of %.0f s, %ld rollup messages for %ld readings (%.0fx fewer)\n", gateway_windows,
+               gateway_window_usec / 1e6, rollup_messages, gateway_readings,
+               rollup_messages ? (double)gateway_readings / rollup_messages : 0.0);
+        printf("noise anomalies (admin_alerts): %ld louder, %ld quieter than usual, %ld back to normal",
+               anomaly_events[ANOMALY_LOUD], anomaly_events[ANOMALY_QUIET], anomaly_events[ANOMALY_CLEAR]);
+        if(anomalies.rejected)
+            printf(", %lu readings of rooms with too long a name", anomalies.rejected);
+        printf("\n");
+    }
+
+    rollup_free(&gateway);
+    anomaly_table_free(&anomalies);
+    sched_destroy(sched);
+    free(rooms);
+    return 0;
+}
@@ -12,7 +12,16 @@
  * 		66 ~  80 dB		- warning level 2
  * 		81 ~ 100 dB		- warning level 3
  * 
- * Also, all data transmission logs are published to the 'admin/logs/sub' topic.
+ * Also, all data transmission logs are published to the 'admin/logs/sub/<subscriber>' topic, so that admin_logs
+ * tracks the logs of every subscriber of a room apart. The subscriber is NOISE_SUB_ID (at most 16 characters,
+ * no '/', '+' or '#'), by default the host name and the process id.
+ * With NOISE_LANES=1 they are not sent over the connection that receives the readings (see common/transport.h).
+ * A compact packet (without the room, see common/packet.h) is logged to 'admin/logs/sub/<subscriber>/<room topic>'.
+ * They are sent even with NOISE_LOG_ECHO=0, which only stops the logs of the publishers: the log capture plugin
+ * of the broker sees what the publishers send, not what a subscriber receives.
+ *
+ * The sequence numbers of the readings are tracked per room (common/seq_track.h): lost, duplicated and
+ * reordered readings are counted, and 'kill -USR1 <pid>' prints the counts.
 */
 
 #include <mosquitto.h>
@@ -20,13 +29,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+
+#include "config.h"
+#include "packet.h"
+#include "ready.h"
+#include "seq_track.h"
+#include "tls.h"
+#include "transport.h"
+#include "worker_pool.h"
 
-#define MQTT_HOST 	"127.0.0.1" 
-#define MQTT_PORT	1883
 #define MAX_TOKEN	7
+#define LOG_TOPIC_LEN	96
+#define SUB_ID_LEN	17
+
+char sub_topic[30] = "handong/NTH/313";		//location topic	- subscribe
+char log_topic[40] = "admin/logs/sub";		//log topic			- publish, with the subscriber appended
 
-char *const sub_topic = "handong/NTH/313";	//location topic	- subscribe
-char *const log_topic = "admin/logs/sub";	//log topic			- publish
+struct worker_pool *pool = NULL;			//message handlers (NOISE_WORKERS > 0)
+struct transport *transport = NULL;			//MQTT, or shared memory for co-located components (NOISE_SHM)
+struct seq_table seqs;						//delivery of the readings per room (SIGUSR1 prints it)
 
 /*
  * This function reconnects to a new broker when the previous broker is disconnected.
@@ -37,7 +59,7 @@ void reconnect(struct mosquitto *mosq) {
         printf("Try to reconnect to broker...\n");
 
         // reconnect to a new broker
-        int rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+        int rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 
         // if connection failed, wait for a second and reconnect to a broker
         if (rc != MOSQ_ERR_SUCCESS) {
@@ -68,7 +90,7 @@ void on_connect(struct mosquitto *mosq, void *obj, int reason_code)
 	}
 
 	//if unable to subscribe, disconnect from the broker
-	sub_rc = mosquitto_subscribe(mosq, NULL, sub_topic, 1);
+	sub_rc = transport_subscribe(transport, sub_topic, 1);
 	if(sub_rc != MOSQ_ERR_SUCCESS){
 		fprintf(stderr, "Error subscribing: %s\n", mosquitto_strerror(sub_rc));
 		reconnect(mosq);
@@ -106,35 +128,42 @@ void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, con
 /*
  * This function publishes a log message and receives a noise-alert message
  * 
- * It publishes a log message to the "admin/logs/sub" topic.
+ * It publishes a log message to the "admin/logs/sub/<subscriber>" topic.
  * 
  * After receiving a message from a publisher, it separates each piece of information by using delimeter (,).
+ * Nothing is allocated per message (the worker pool reuses its message buffers).
  * It puts each piece into tokens array in order.
+ * It records the sequence number of the reading (gaps, duplicates and reorders of the room).
  * It converts decibel and level into integer type.
  * It checks whether the level and the decibel value match (just in case)
  * It prints the level and the decibel value.
+ *
+ * It runs on the network thread, or on a worker thread of the pool when NOISE_WORKERS > 0.
 */
-void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+void handle_message(void *obj, char *topic, char *payload, int payloadlen)
 {
-
-	//publish a log message to the "admin/logs/sub" topic
+	//publish a log message to the "admin/logs/sub/<subscriber>" topic (with the room of a compact packet appended)
+	char room_log_topic[LOG_TOPIC_LEN];
+	const char *log_to = log_topic;
 	int log_rc;
-	log_rc = mosquitto_publish(mosq, NULL, log_topic, strlen((char *)msg->payload), (char *)msg->payload, 1, false);
-        if(log_rc != MOSQ_ERR_SUCCESS){
-            fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(log_rc));
-        }
 
-	//get each piece of information
-	char *tokens[MAX_TOKEN];
-	int index = 0;
+	if(packet_is_compact(payload, payloadlen)){
+		snprintf(room_log_topic, sizeof(room_log_topic), "%s/%s", log_topic, topic);
+		log_to = room_log_topic;
+	}
+	log_rc = transport_publish(transport, log_to, payloadlen, payload, 1, false);
+	if(log_rc != MOSQ_ERR_SUCCESS){
+		fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(log_rc));
+	}
 
-	//each piece extracted with the delimeter
-	char *token = strtok((char *)msg->payload, ",");
-	while (token != NULL & index < MAX_TOKEN){
-		tokens[index] = token;
-		index++;
-		token = strtok(NULL, ",");
+	//get each piece of information, extracted with the delimeter (in place, see common/packet.h)
+	char *tokens[PACKET_FIELDS];
+	char room[PACKET_ROOM_LEN];
+	int index = packet_parse(topic, payload, payloadlen, tokens, room);
+	if(index < MAX_TOKEN){
+		return;
 	}
+	seq_table_observe(&seqs, "readings", tokens, index);
 
 	//conversion to integer type for the warning level and decibel
 	int level = atoi(tokens[4]);
@@ -152,6 +181,31 @@ void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_messag
 	}
 }
 
+/*
+ * This function takes a message from the broker or from the shared-memory ring.
+ * Without a worker pool the message is handled right here, on the network (or ring reader) thread.
+ * With a worker pool it is queued by room, so the network thread can go back to reading (and acknowledging) messages.
+*/
+void dispatch_message(void *obj, char *topic, char *payload, int payloadlen)
+{
+	if(pool != NULL){
+		int keylen;
+		const char *key = packet_room(topic, payload, payloadlen, &keylen);
+		wp_submit(pool, key, keylen, topic, payload, payloadlen);
+	} else {
+		handle_message(obj, topic, payload, payloadlen);
+	}
+}
+
+/*
+ * Callback called when the client receives a message.
+*/
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	ready_first_message();
+	dispatch_message(mosq, msg->topic, msg->payload, msg->payloadlen);
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -161,6 +215,32 @@ int main(int argc, char *argv[])
 
 	struct mosquitto *mosq;
 	int rc;
+	char institution[10] = "handong", location[10] = "NTH", room[10] = "313";
+	char host[9] = "sub", default_id[SUB_ID_LEN];
+
+	/* The location to listen to can be overridden with NOISE_ROOM */
+	if(config_room(institution, location, room, sizeof(room)) == 1) {
+		snprintf(sub_topic, sizeof(sub_topic), "%s/%s/%s", institution, location, room);
+	}
+
+	/* The logs carry the subscriber, so two subscribers of a room are not taken for duplicates */
+	if(gethostname(host, sizeof(host)) != 0 || host[0] == '\0' || strpbrk(host, "/+#") != NULL){
+		strcpy(host, "sub");
+	}
+	host[sizeof(host) - 1] = '\0';
+	snprintf(default_id, sizeof(default_id), "%s-%d", host, (int)getpid() % 10000000);
+	const char *id = config_str("NOISE_SUB_ID", default_id);
+	if(id[0] == '\0' || strlen(id) >= SUB_ID_LEN || strpbrk(id, "/+#") != NULL){
+		fprintf(stderr, "Error: NOISE_SUB_ID must be 1 to %d characters without '/', '+' or '#'\n", SUB_ID_LEN - 1);
+		return 1;
+	}
+	snprintf(log_topic, sizeof(log_topic), "admin/logs/sub/%s", id);
+
+	/* Sequence tracking: only the report thread takes SIGUSR1, so this comes before the other threads start */
+	seq_table_init(&seqs, "nth_313_sub");
+	if(seq_table_report_on_signal(&seqs, SIGUSR1) != 0){
+		fprintf(stderr, "Error: Cannot start the sequence report.\n");
+	}
 
 	/* Required before calling other mosquitto functions */
 	mosquitto_lib_init();
@@ -182,11 +262,33 @@ int main(int argc, char *argv[])
 	mosquitto_subscribe_callback_set(mosq, on_subscribe);
 	mosquitto_message_callback_set(mosq, on_message);
 
+	/* Hand messages to a pool of worker threads if NOISE_WORKERS is set */
+	if(config_long("NOISE_WORKERS", 0) > 0){
+		pool = wp_create_configured(handle_message, mosq);
+		if(pool == NULL){
+			mosquitto_destroy(mosq);
+			return 1;
+		}
+	}
+
+	/* Topics routed to shared memory (NOISE_SHM_TOPICS) are published and received without the broker */
+	transport = transport_create(mosq, dispatch_message, mosq);
+	if(transport == NULL){
+		mosquitto_destroy(mosq);
+		return 1;
+	}
+
+	/* TLS to the broker if NOISE_TLS is set (common/tls.h) */
+	if(tls_configure(mosq) != MOSQ_ERR_SUCCESS){
+		mosquitto_destroy(mosq);
+		return 1;
+	}
+
 	/* Connect to test.mosquitto.org on port 1883, with a keepalive of 60 seconds.
 	 * This call makes the socket connection only, it does not complete the MQTT
 	 * CONNECT/CONNACK flow, you should use mosquitto_loop_start() or
 	 * mosquitto_loop_forever() for processing net traffic. */
-	rc = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 60);
+	rc = mosquitto_connect(mosq, config_mqtt_host(), config_mqtt_port(), 60);
 	if(rc != MOSQ_ERR_SUCCESS){
 		mosquitto_destroy(mosq);
 		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
@@ -201,6 +303,8 @@ int main(int argc, char *argv[])
 	 */
 	mosquitto_loop_forever(mosq, -1, 1);
 
+	transport_destroy(transport);
+	wp_destroy(pool);
 	mosquitto_lib_cleanup();
 	return 0;
 }
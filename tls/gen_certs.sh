@@ -0,0 +1,72 @@
+#!/bin/bash
+#
+# Generates test certificates for TLS between the components and the broker (make certs).
+#
+#   usage: tls/gen_certs.sh [out_dir] [tls_port]     (default certs 8883)
+#
+# Writes to out_dir:
+#   ca.crt, ca.key              test CA (ECDSA P-256, 10 years)
+#   server.crt, server.key      broker certificate for localhost / 127.0.0.1 / this host name
+#   client.crt, client.key      client certificate, for brokers with require_certificate true
+#   mosquitto.conf              plaintext listener 1883 and TLS listener tls_port with these files
+#
+# ECDSA keys make the handshake cheaper than RSA for both sides. The certificates are for testing only;
+# use the CA of your organization in production.
+
+set -eu
+
+OUT=${1:-certs}
+TLS_PORT=${2:-8883}
+DAYS=3650
+HOST=$(hostname)
+
+command -v openssl >/dev/null || { echo "gen_certs: openssl not found" >&2; exit 1; }
+mkdir -p "$OUT"
+cd "$OUT"
+
+key() {
+    openssl genpkey -algorithm EC -pkeyopt ec_paramgen_curve:P-256 -out "$1" 2>/dev/null
+    chmod 600 "$1"
+}
+
+# sign 'name'.crt with the CA: sign name subject extensions
+sign() {
+    openssl req -new -key "$1.key" -subj "$2" -out "$1.csr"
+    printf "%s\n" "$3" > "$1.ext"
+    openssl x509 -req -in "$1.csr" -CA ca.crt -CAkey ca.key -CAcreateserial -days "$DAYS" -sha256 \
+        -extfile "$1.ext" -out "$1.crt" 2>/dev/null
+    rm -f "$1.csr" "$1.ext"
+}
+
+key ca.key
+openssl req -x509 -new -key ca.key -sha256 -days "$DAYS" -subj "/CN=Noise Warning Test CA" \
+    -addext "basicConstraints=critical,CA:TRUE" -addext "keyUsage=critical,keyCertSign,cRLSign" -out ca.crt
+
+key server.key
+sign server "/CN=localhost" "subjectAltName=DNS:localhost,DNS:$HOST,IP:127.0.0.1
+extendedKeyUsage=serverAuth"
+
+key client.key
+sign client "/CN=noise-client" "extendedKeyUsage=clientAuth"
+
+rm -f ca.srl
+
+DIR=$(pwd)
+cat > mosquitto.conf <<CONF
+# generated by tls/gen_certs.sh
+per_listener_settings false
+allow_anonymous true
+
+listener 1883
+
+listener $TLS_PORT
+cafile $DIR/ca.crt
+certfile $DIR/server.crt
+keyfile $DIR/server.key
+tls_version tlsv1.2
+ciphers ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-CHACHA20-POLY1305
+ciphers_tls1.3 TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256
+# require_certificate true    # clients then need NOISE_TLS_CERT=$DIR/client.crt NOISE_TLS_KEY=$DIR/client.key
+CONF
+
+echo "gen_certs: certificates and mosquitto.conf written to $DIR"